@@ -0,0 +1,379 @@
+#include <string.h>
+
+#include "array.h"
+#include "memory.h"
+
+#define NOT_NUMERIC "Bulk operations need an int or double array."
+
+// One SSE register: four ints or two doubles, which baseline x86-64
+// always has. Int arithmetic goes through the unsigned vector so it wraps
+// instead of overflowing. Wider vectors would be split into halves and
+// spilled between iterations unless the build targets AVX.
+typedef int32_t IntVector __attribute__((vector_size(16)));
+typedef uint32_t WrapVector __attribute__((vector_size(16)));
+typedef double DoubleVector __attribute__((vector_size(16)));
+typedef int64_t MaskVector __attribute__((vector_size(16)));
+
+#define INT_LANES ((int)(sizeof(IntVector) / sizeof(int32_t)))
+#define DOUBLE_LANES ((int)(sizeof(DoubleVector) / sizeof(double)))
+
+// Elements are only 4 or 8 byte aligned, so vectors go through memcpy,
+// which compiles to unaligned loads and stores.
+#define LOAD(vector, pointer) memcpy(&(vector), (pointer), sizeof(vector))
+#define STORE(pointer, vector) memcpy((pointer), &(vector), sizeof(vector))
+
+size_t arrayElementSize(ArrayKind kind) {
+  switch (kind) {
+  case ARRAY_INT:
+    return sizeof(int);
+  case ARRAY_DOUBLE:
+    return sizeof(double);
+  default:
+    return sizeof(Value);
+  }
+}
+
+Value arrayGet(ObjArray *array, int index) {
+  switch (array->kind) {
+  case ARRAY_INT:
+    return INT_VAL(array->as.ints[index]);
+  case ARRAY_DOUBLE:
+    return DOUBLE_VAL(array->as.doubles[index]);
+  default:
+    return array->as.values[index];
+  }
+}
+
+static void retype(ObjArray *array, ArrayKind kind) {
+  size_t oldSize = (size_t)array->capacity * arrayElementSize(array->kind);
+  void *elements =
+      reallocate(MEM_ARRAY, NULL, 0, array->capacity * arrayElementSize(kind));
+  if (kind == ARRAY_VALUE) {
+    Value *values = elements;
+    for (int i = 0; i < array->count; i++)
+      values[i] = arrayGet(array, i);
+  }
+  reallocate(MEM_ARRAY, array->as.ints, oldSize, 0);
+  array->as.ints = elements;
+  array->kind = kind;
+}
+
+// Makes room in the array's storage for a value of this type.
+static void admit(ObjArray *array, Value value) {
+  switch (array->kind) {
+  case ARRAY_INT:
+    if (IS_INT(value))
+      return;
+    break;
+  case ARRAY_DOUBLE:
+    if (IS_DOUBLE(value))
+      return;
+    break;
+  case ARRAY_VALUE:
+    return;
+  }
+  retype(array, array->count == 0 && IS_DOUBLE(value) ? ARRAY_DOUBLE
+                                                      : ARRAY_VALUE);
+}
+
+void arraySet(ObjArray *array, int index, Value value) {
+  admit(array, value);
+  switch (array->kind) {
+  case ARRAY_INT:
+    array->as.ints[index] = AS_INT(value);
+    break;
+  case ARRAY_DOUBLE:
+    array->as.doubles[index] = AS_DOUBLE(value);
+    break;
+  case ARRAY_VALUE:
+    array->as.values[index] = materialize(value);
+    break;
+  }
+}
+
+void arrayAppend(ObjArray *array, Value value) {
+  admit(array, value);
+  if (array->count == array->capacity) {
+    int oldCapacity = array->capacity;
+    size_t size = arrayElementSize(array->kind);
+    array->capacity = INCREASE_CAPACITY(oldCapacity);
+    array->as.ints = reallocate(MEM_ARRAY, array->as.ints, oldCapacity * size,
+                                array->capacity * size);
+  }
+  array->count++;
+  arraySet(array, array->count - 1, value);
+}
+
+static int sumInts(const int *ints, int count) {
+  WrapVector total = {0};
+  int i = 0;
+  for (; i + INT_LANES <= count; i += INT_LANES) {
+    WrapVector lanes;
+    LOAD(lanes, ints + i);
+    total += lanes;
+  }
+  uint32_t sum = 0;
+  for (int lane = 0; lane < INT_LANES; lane++)
+    sum += total[lane];
+  for (; i < count; i++)
+    sum += (uint32_t)ints[i];
+  return (int)sum;
+}
+
+static double sumDoubles(const double *doubles, int count) {
+  DoubleVector total = {0};
+  int i = 0;
+  for (; i + DOUBLE_LANES <= count; i += DOUBLE_LANES) {
+    DoubleVector lanes;
+    LOAD(lanes, doubles + i);
+    total += lanes;
+  }
+  double sum = 0;
+  for (int lane = 0; lane < DOUBLE_LANES; lane++)
+    sum += total[lane];
+  for (; i < count; i++)
+    sum += doubles[i];
+  return sum;
+}
+
+const char *arraySum(ObjArray *array, Value *result) {
+  switch (array->kind) {
+  case ARRAY_INT:
+    *result = INT_VAL(sumInts(array->as.ints, array->count));
+    return NULL;
+  case ARRAY_DOUBLE:
+    *result = DOUBLE_VAL(sumDoubles(array->as.doubles, array->count));
+    return NULL;
+  default:
+    return NOT_NUMERIC;
+  }
+}
+
+// Keeps a running minimum (or maximum) per lane by blending each vector
+// into it under a compare mask, then reduces the lanes and the tail.
+static int extremeInt(const int *ints, int count, bool max) {
+  int i = 0;
+  int best = ints[0];
+  if (count >= INT_LANES) {
+    IntVector lanes;
+    LOAD(lanes, ints);
+    for (i = INT_LANES; i + INT_LANES <= count; i += INT_LANES) {
+      IntVector next;
+      LOAD(next, ints + i);
+      IntVector take = max ? next > lanes : next < lanes;
+      lanes = (next & take) | (lanes & ~take);
+    }
+    best = lanes[0];
+    for (int lane = 1; lane < INT_LANES; lane++) {
+      if (max ? lanes[lane] > best : lanes[lane] < best)
+        best = lanes[lane];
+    }
+  }
+  for (; i < count; i++) {
+    if (max ? ints[i] > best : ints[i] < best)
+      best = ints[i];
+  }
+  return best;
+}
+
+static double extremeDouble(const double *doubles, int count, bool max) {
+  int i = 0;
+  double best = doubles[0];
+  if (count >= DOUBLE_LANES) {
+    DoubleVector lanes;
+    LOAD(lanes, doubles);
+    for (i = DOUBLE_LANES; i + DOUBLE_LANES <= count; i += DOUBLE_LANES) {
+      DoubleVector next;
+      LOAD(next, doubles + i);
+      MaskVector take = max ? next > lanes : next < lanes;
+      lanes = (DoubleVector)(((MaskVector)next & take) |
+                             ((MaskVector)lanes & ~take));
+    }
+    best = lanes[0];
+    for (int lane = 1; lane < DOUBLE_LANES; lane++) {
+      if (max ? lanes[lane] > best : lanes[lane] < best)
+        best = lanes[lane];
+    }
+  }
+  for (; i < count; i++) {
+    if (max ? doubles[i] > best : doubles[i] < best)
+      best = doubles[i];
+  }
+  return best;
+}
+
+static const char *extreme(ObjArray *array, bool max, Value *result) {
+  if (array->kind == ARRAY_VALUE)
+    return NOT_NUMERIC;
+  if (array->count == 0)
+    return "Can't take the min or max of an empty array.";
+  if (array->kind == ARRAY_INT) {
+    *result = INT_VAL(extremeInt(array->as.ints, array->count, max));
+  } else {
+    *result = DOUBLE_VAL(extremeDouble(array->as.doubles, array->count, max));
+  }
+  return NULL;
+}
+
+const char *arrayMin(ObjArray *array, Value *result) {
+  return extreme(array, false, result);
+}
+
+const char *arrayMax(ObjArray *array, Value *result) {
+  return extreme(array, true, result);
+}
+
+const char *arrayDot(ObjArray *a, ObjArray *b, Value *result) {
+  if (a->kind == ARRAY_VALUE || b->kind == ARRAY_VALUE)
+    return NOT_NUMERIC;
+  if (a->kind != b->kind || a->count != b->count)
+    return "Arrays must have the same length and element type.";
+
+  int count = a->count;
+  int i = 0;
+  if (a->kind == ARRAY_INT) {
+    WrapVector total = {0};
+    for (; i + INT_LANES <= count; i += INT_LANES) {
+      WrapVector x, y;
+      LOAD(x, a->as.ints + i);
+      LOAD(y, b->as.ints + i);
+      total += x * y;
+    }
+    uint32_t sum = 0;
+    for (int lane = 0; lane < INT_LANES; lane++)
+      sum += total[lane];
+    for (; i < count; i++)
+      sum += (uint32_t)a->as.ints[i] * (uint32_t)b->as.ints[i];
+    *result = INT_VAL((int)sum);
+  } else {
+    DoubleVector total = {0};
+    for (; i + DOUBLE_LANES <= count; i += DOUBLE_LANES) {
+      DoubleVector x, y;
+      LOAD(x, a->as.doubles + i);
+      LOAD(y, b->as.doubles + i);
+      total += x * y;
+    }
+    double sum = 0;
+    for (int lane = 0; lane < DOUBLE_LANES; lane++)
+      sum += total[lane];
+    for (; i < count; i++)
+      sum += a->as.doubles[i] * b->as.doubles[i];
+    *result = DOUBLE_VAL(sum);
+  }
+  return NULL;
+}
+
+const char *arrayScale(ObjArray *array, Value factor, Value *result) {
+  if (array->kind == ARRAY_VALUE)
+    return NOT_NUMERIC;
+  if (array->kind == ARRAY_INT ? !IS_INT(factor) : !IS_DOUBLE(factor))
+    return "Scale factor must be the same type as the elements.";
+
+  int count = array->count;
+  ObjArray *scaled = newArray(0);
+  if (array->kind == ARRAY_DOUBLE)
+    retype(scaled, ARRAY_DOUBLE);
+  size_t size = arrayElementSize(array->kind);
+  scaled->as.ints = reallocate(MEM_ARRAY, scaled->as.ints, 0, count * size);
+  scaled->capacity = count;
+  scaled->count = count;
+
+  int i = 0;
+  if (array->kind == ARRAY_INT) {
+    uint32_t k = (uint32_t)AS_INT(factor);
+    for (; i + INT_LANES <= count; i += INT_LANES) {
+      WrapVector lanes;
+      LOAD(lanes, array->as.ints + i);
+      lanes *= k;
+      STORE(scaled->as.ints + i, lanes);
+    }
+    for (; i < count; i++)
+      scaled->as.ints[i] = (int)((uint32_t)array->as.ints[i] * k);
+  } else {
+    double k = AS_DOUBLE(factor);
+    for (; i + DOUBLE_LANES <= count; i += DOUBLE_LANES) {
+      DoubleVector lanes;
+      LOAD(lanes, array->as.doubles + i);
+      lanes *= k;
+      STORE(scaled->as.doubles + i, lanes);
+    }
+    for (; i < count; i++)
+      scaled->as.doubles[i] = array->as.doubles[i] * k;
+  }
+  *result = OBJ_VAL(scaled);
+  return NULL;
+}
+
+// Keys whose unsigned order is the elements' order: flip the sign bit of
+// ints, and of non-negative doubles; negative doubles flip every bit.
+static uint64_t doubleKey(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits >> 63 ? ~bits : bits | (1ull << 63);
+}
+
+static double keyDouble(uint64_t key) {
+  uint64_t bits = key >> 63 ? key & ~(1ull << 63) : ~key;
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// LSD radix sort a byte at a time. One pass counts every byte position;
+// positions where all keys share a byte are skipped.
+static void radixSort(uint64_t *keys, int count, int bytes) {
+  uint64_t *scratch = ALLOCATE_AS(MEM_ARRAY, uint64_t, count);
+  static int counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < count; i++) {
+    for (int byte = 0; byte < bytes; byte++)
+      counts[byte][(keys[i] >> (byte * 8)) & 0xff]++;
+  }
+
+  uint64_t *from = keys;
+  uint64_t *to = scratch;
+  for (int byte = 0; byte < bytes; byte++) {
+    int *digits = counts[byte];
+    if (digits[(from[0] >> (byte * 8)) & 0xff] == count)
+      continue;
+    int offset = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      int digitCount = digits[digit];
+      digits[digit] = offset;
+      offset += digitCount;
+    }
+    for (int i = 0; i < count; i++)
+      to[digits[(from[i] >> (byte * 8)) & 0xff]++] = from[i];
+    uint64_t *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys)
+    memcpy(keys, from, count * sizeof(uint64_t));
+  FREE_ARRAY_AS(MEM_ARRAY, uint64_t, scratch, count);
+}
+
+const char *arraySort(ObjArray *array) {
+  if (array->kind == ARRAY_VALUE)
+    return NOT_NUMERIC;
+  int count = array->count;
+  if (count < 2)
+    return NULL;
+
+  uint64_t *keys = ALLOCATE_AS(MEM_ARRAY, uint64_t, count);
+  if (array->kind == ARRAY_INT) {
+    for (int i = 0; i < count; i++)
+      keys[i] = (uint32_t)array->as.ints[i] ^ 0x80000000u;
+    radixSort(keys, count, 4);
+    for (int i = 0; i < count; i++)
+      array->as.ints[i] = (int)(uint32_t)(keys[i] ^ 0x80000000u);
+  } else {
+    for (int i = 0; i < count; i++)
+      keys[i] = doubleKey(array->as.doubles[i]);
+    radixSort(keys, count, 8);
+    for (int i = 0; i < count; i++)
+      array->as.doubles[i] = keyDouble(keys[i]);
+  }
+  FREE_ARRAY_AS(MEM_ARRAY, uint64_t, keys, count);
+  return NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef rotlang_array_h
+#define rotlang_array_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+size_t arrayElementSize(ArrayKind kind);
+
+// `index` must be in bounds.
+Value arrayGet(ObjArray *array, int index);
+// Stores `value` materialized, like globals, fields and map entries, so a
+// string view of -n/-p input can't outlive its buffer in an array. Every
+// store into an array goes through here.
+void arraySet(ObjArray *array, int index, Value value);
+// Doubles the capacity whenever it runs out, so appending is amortized
+// constant time.
+void arrayAppend(ObjArray *array, Value value);
+
+// Bulk operations over int and double arrays, which run on the unboxed
+// storage several elements per instruction. Each returns NULL on success and
+// otherwise the message of the runtime error to raise. Double sums and dot
+// products add in a different order than a loop in the script would, so the
+// last bits can differ.
+const char *arraySum(ObjArray *array, Value *result);
+const char *arrayMin(ObjArray *array, Value *result);
+const char *arrayMax(ObjArray *array, Value *result);
+const char *arrayDot(ObjArray *a, ObjArray *b, Value *result);
+// A new array of each element times `factor`, which must be of the same
+// type as the elements.
+const char *arrayScale(ObjArray *array, Value factor, Value *result);
+// Sorts in place, ascending. -0.0 sorts before 0.0, and NaNs end up at the
+// ends according to their sign.
+const char *arraySort(ObjArray *array);
+
+#endif
@@ -0,0 +1,1072 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "debug.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "table.h"
+#include "verifier.h"
+
+// Every stack slot, and every global the chunk defines, holds one block of
+// lanes sharing a single type. Bools are ints that are 0 or 1, so
+// comparisons and their negations stay in integer vectors. All lanes of a
+// slot are valid values, including those past the last row of a short final
+// block, which repeat that row: kernels always run over whole blocks, and
+// that fixed trip count lets the compiler vectorize them with no scalar tail
+// and nothing to mask.
+typedef enum {
+  LANES_NIL,
+  LANES_BOOL,
+  LANES_INT,
+  LANES_DOUBLE,
+  LANES_STRING,
+  // A pure native about to be called, the same in every lane.
+  LANES_NATIVE,
+} LaneType;
+
+typedef struct {
+  LaneType type;
+  union {
+    int ints[BATCH_BLOCK];
+    double doubles[BATCH_BLOCK];
+    Value strings[BATCH_BLOCK];
+    ObjNative *native;
+  } as;
+} Lanes;
+
+// One int per lane, 1 or 0, so masking a kernel is a select the compiler
+// vectorizes.
+typedef int LaneMask[BATCH_BLOCK];
+
+// Lanes waiting at a jump target for dispatch to reach it, with the stack
+// they had when they jumped. Several jumps can park lanes at one target;
+// their stacks are merged lane by lane.
+typedef struct {
+  LaneMask lanes;
+  int count; // 0 if no lanes are parked here.
+  int depth;
+  Lanes **stack;
+} ParkedLanes;
+
+typedef struct {
+  Lanes *lanes;
+  bool defined; // In the current block.
+} BatchGlobal;
+
+typedef struct {
+  Chunk *chunk;
+  const ColumnBinding *inputs;
+  int inputCount;
+  // Maps each global the batch owns to its slot: the inputs first, then
+  // the globals the chunk defines.
+  Table slots;
+  BatchGlobal *globals;
+  int globalCount;
+
+  // stack[depth] is always free: binary kernels write their result there
+  // and swap it in for their left operand.
+  Lanes **stack;
+  int stackSize;
+  int depth;
+  Lanes *pool;
+  int poolSize;
+
+  // The rows of the current block.
+  int base;
+  int count;
+
+  // The lanes running the current instruction and how many there are.
+  // Forward jumps park the lanes that take them at the target, so both
+  // sides of a branch run as masked passes over the block, one after the
+  // other, and only when some lane takes them. Lanes not running hold
+  // leftover values of the slot's type, which kernels compute on and then
+  // ignore.
+  LaneMask active;
+  int activeCount;
+  // Indexed by code offset: the ParkedLanes of the jump target there, or -1.
+  int *targetOf;
+  ParkedLanes *parked;
+  int parkedCount;
+} Batch;
+
+#define EACH_LANE(body)                                                        \
+  do {                                                                         \
+    for (int i = 0; i < BATCH_BLOCK; i++)                                      \
+      body;                                                                    \
+  } while (false)
+
+static InterpretResult batchError(Batch *batch, int offset,
+                                  const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
+  fprintf(stderr, "[line %d] in script, rows %d to %d\n",
+          getLine(batch->chunk, offset), batch->base,
+          batch->base + batch->count - 1);
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+static bool broadcast(Lanes *out, Value value) {
+  switch (value.type) {
+  case VAL_NIL:
+    out->type = LANES_NIL;
+    return true;
+  case VAL_BOOL:
+    out->type = LANES_BOOL;
+    EACH_LANE(out->as.ints[i] = AS_BOOL(value));
+    return true;
+  case VAL_INT:
+    out->type = LANES_INT;
+    EACH_LANE(out->as.ints[i] = AS_INT(value));
+    return true;
+  case VAL_DOUBLE:
+    out->type = LANES_DOUBLE;
+    EACH_LANE(out->as.doubles[i] = AS_DOUBLE(value));
+    return true;
+  default:
+    if (IS_NATIVE(value) && isPureNative(AS_NATIVE(value))) {
+      out->type = LANES_NATIVE;
+      out->as.native = AS_NATIVE(value);
+      return true;
+    }
+    if (!IS_ANY_STRING(value))
+      return false;
+    out->type = LANES_STRING;
+    EACH_LANE(out->as.strings[i] = value);
+    return true;
+  }
+}
+
+// Copies the block's rows of `column` and repeats the last one to the end.
+static void loadColumn(Lanes *out, const Column *column, int base,
+                       int count) {
+  switch (column->type) {
+  case COLUMN_BOOL:
+    out->type = LANES_BOOL;
+    for (int i = 0; i < count; i++)
+      out->as.ints[i] = column->as.bools[base + i];
+    for (int i = count; i < BATCH_BLOCK; i++)
+      out->as.ints[i] = out->as.ints[count - 1];
+    break;
+  case COLUMN_INT:
+    out->type = LANES_INT;
+    memcpy(out->as.ints, column->as.ints + base, count * sizeof(int));
+    for (int i = count; i < BATCH_BLOCK; i++)
+      out->as.ints[i] = out->as.ints[count - 1];
+    break;
+  case COLUMN_DOUBLE:
+    out->type = LANES_DOUBLE;
+    memcpy(out->as.doubles, column->as.doubles + base,
+           count * sizeof(double));
+    for (int i = count; i < BATCH_BLOCK; i++)
+      out->as.doubles[i] = out->as.doubles[count - 1];
+    break;
+  case COLUMN_STRING:
+    out->type = LANES_STRING;
+    memcpy(out->as.strings, column->as.strings + base, count * sizeof(Value));
+    for (int i = count; i < BATCH_BLOCK; i++)
+      out->as.strings[i] = out->as.strings[count - 1];
+    break;
+  }
+}
+
+static void intKernel(uint8_t op, int *restrict out, const int *restrict a,
+                      const int *restrict b) {
+  switch (op) {
+  case OP_ADD:
+    EACH_LANE(out[i] = a[i] + b[i]);
+    break;
+  case OP_SUBTRACT:
+    EACH_LANE(out[i] = a[i] - b[i]);
+    break;
+  case OP_MULTIPLY:
+    EACH_LANE(out[i] = a[i] * b[i]);
+    break;
+  case OP_DIVIDE:
+    EACH_LANE(out[i] = a[i] / b[i]);
+    break;
+  case OP_LESS:
+    EACH_LANE(out[i] = a[i] < b[i]);
+    break;
+  case OP_GREATER:
+    EACH_LANE(out[i] = a[i] > b[i]);
+    break;
+  case OP_EQUAL:
+    EACH_LANE(out[i] = a[i] == b[i]);
+    break;
+  }
+}
+
+static void doubleKernel(uint8_t op, double *restrict out,
+                         const double *restrict a, const double *restrict b) {
+  switch (op) {
+  case OP_ADD:
+    EACH_LANE(out[i] = a[i] + b[i]);
+    break;
+  case OP_SUBTRACT:
+    EACH_LANE(out[i] = a[i] - b[i]);
+    break;
+  case OP_MULTIPLY:
+    EACH_LANE(out[i] = a[i] * b[i]);
+    break;
+  case OP_DIVIDE:
+    EACH_LANE(out[i] = a[i] / b[i]);
+    break;
+  }
+}
+
+static void doubleCompareKernel(uint8_t op, int *restrict out,
+                                const double *restrict a,
+                                const double *restrict b) {
+  switch (op) {
+  case OP_LESS:
+    EACH_LANE(out[i] = a[i] < b[i]);
+    break;
+  case OP_GREATER:
+    EACH_LANE(out[i] = a[i] > b[i]);
+    break;
+  case OP_EQUAL:
+    EACH_LANE(out[i] = a[i] == b[i]);
+    break;
+  }
+}
+
+// Values of different types are never equal, so mismatched lanes compare
+// false without looking at them.
+static void equalKernel(Lanes *out, Lanes *a, Lanes *b) {
+  if (a->type != b->type) {
+    EACH_LANE(out->as.ints[i] = 0);
+    return;
+  }
+  switch (a->type) {
+  case LANES_NIL:
+    EACH_LANE(out->as.ints[i] = 1);
+    break;
+  case LANES_BOOL:
+  case LANES_INT:
+    intKernel(OP_EQUAL, out->as.ints, a->as.ints, b->as.ints);
+    break;
+  case LANES_DOUBLE:
+    doubleCompareKernel(OP_EQUAL, out->as.ints, a->as.doubles, b->as.doubles);
+    break;
+  case LANES_STRING:
+    EACH_LANE(out->as.ints[i] =
+                  valuesEqual(a->as.strings[i], b->as.strings[i]));
+    break;
+  case LANES_NATIVE: {
+    int same = a->as.native == b->as.native;
+    EACH_LANE(out->as.ints[i] = same);
+    break;
+  }
+  }
+}
+
+// The same checks, in the same order and with the same messages, as run().
+static const char *numericError(uint8_t op, LaneType a, LaneType b) {
+  if (b == LANES_INT)
+    return a == LANES_INT ? NULL : "Operands must be numbers.";
+  if (b == LANES_DOUBLE)
+    return a == LANES_DOUBLE ? NULL : "Operands type mismatch";
+  return op == OP_LESS || op == OP_GREATER ? "Operands must be numbers."
+                                           : "Operands type mistmatch";
+}
+
+// `op` is one of the generic binary operators; `negate` applies the OP_NOT
+// a fused OP_NOT_* carries.
+static InterpretResult binary(Batch *batch, uint8_t op, bool negate,
+                              int offset) {
+  Lanes *a = batch->stack[batch->depth - 2];
+  Lanes *b = batch->stack[batch->depth - 1];
+  Lanes *out = batch->stack[batch->depth];
+
+  if (op == OP_EQUAL) {
+    equalKernel(out, a, b);
+    out->type = LANES_BOOL;
+  } else if (op == OP_ADD && a->type == LANES_STRING &&
+             b->type == LANES_STRING) {
+    // Lanes that aren't running get the left operand rather than a string
+    // nobody reads.
+    EACH_LANE(out->as.strings[i] =
+                  batch->active[i] ? concatenateStrings(a->as.strings[i],
+                                                        b->as.strings[i])
+                                   : a->as.strings[i]);
+    out->type = LANES_STRING;
+    if (heapLimitExceeded())
+      return batchError(batch, offset, "Heap limit of %zu bytes exceeded.",
+                        memoryStats.limit);
+  } else {
+    const char *error = numericError(op, a->type, b->type);
+    if (error != NULL)
+      return batchError(batch, offset, "%s", error);
+    bool compare = op == OP_LESS || op == OP_GREATER;
+    if (b->type == LANES_INT && op == OP_DIVIDE &&
+        batch->activeCount < BATCH_BLOCK) {
+      // A lane that isn't running may hold a zero a branch steered around.
+      LaneMask divisors;
+      EACH_LANE(divisors[i] = batch->active[i] ? b->as.ints[i] : 1);
+      intKernel(op, out->as.ints, a->as.ints, divisors);
+    } else if (b->type == LANES_INT) {
+      intKernel(op, out->as.ints, a->as.ints, b->as.ints);
+    } else if (compare) {
+      doubleCompareKernel(op, out->as.ints, a->as.doubles, b->as.doubles);
+    } else {
+      doubleKernel(op, out->as.doubles, a->as.doubles, b->as.doubles);
+    }
+    out->type = compare ? LANES_BOOL : b->type;
+  }
+  if (negate)
+    EACH_LANE(out->as.ints[i] ^= 1);
+
+  batch->stack[batch->depth] = a;
+  batch->stack[batch->depth - 2] = out;
+  batch->depth--;
+  return INTERPRET_OK;
+}
+
+static Value laneValue(Lanes *lanes, int lane) {
+  switch (lanes->type) {
+  case LANES_NIL:
+    return NIL_VAL;
+  case LANES_BOOL:
+    return BOOL_VAL(lanes->as.ints[lane]);
+  case LANES_INT:
+    return INT_VAL(lanes->as.ints[lane]);
+  case LANES_DOUBLE:
+    return DOUBLE_VAL(lanes->as.doubles[lane]);
+  case LANES_NATIVE:
+    return OBJ_VAL(lanes->as.native);
+  default:
+    return lanes->as.strings[lane];
+  }
+}
+
+// OP_CONCAT_N and OP_INTERPOLATE: joins the top `count` slots row by row.
+static InterpretResult concatenation(Batch *batch, bool convert, int count,
+                                     int offset) {
+  Lanes **operands = &batch->stack[batch->depth - count];
+  Lanes *out = batch->stack[batch->depth];
+  Value values[UINT8_MAX];
+  for (int i = 0; i < BATCH_BLOCK; i++) {
+    if (!batch->active[i]) {
+      out->as.strings[i] = makeString("", 0);
+      continue;
+    }
+    for (int j = 0; j < count; j++)
+      values[j] = laneValue(operands[j], i);
+    const char *error =
+        concatenateValues(values, count, convert, &out->as.strings[i]);
+    if (error != NULL)
+      return batchError(batch, offset, "%s", error);
+  }
+  out->type = LANES_STRING;
+  if (heapLimitExceeded())
+    return batchError(batch, offset, "Heap limit of %zu bytes exceeded.",
+                      memoryStats.limit);
+
+  batch->stack[batch->depth] = operands[0];
+  operands[0] = out;
+  batch->depth -= count - 1;
+  return INTERPRET_OK;
+}
+
+static void notKernel(Lanes *lanes) {
+  if (lanes->type == LANES_BOOL) {
+    EACH_LANE(lanes->as.ints[i] ^= 1);
+  } else {
+    // Only nil and false are falsey.
+    int falsey = lanes->type == LANES_NIL;
+    EACH_LANE(lanes->as.ints[i] = falsey);
+  }
+  lanes->type = LANES_BOOL;
+}
+
+static bool negateKernel(Lanes *lanes) {
+  if (lanes->type == LANES_INT) {
+    EACH_LANE(lanes->as.ints[i] = -lanes->as.ints[i]);
+  } else if (lanes->type == LANES_DOUBLE) {
+    EACH_LANE(lanes->as.doubles[i] = -lanes->as.doubles[i]);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Copies the lanes of `from` that `mask` selects into `into`. Lanes of a slot
+// share one type, so the two must already agree on it.
+static bool mergeLanes(Lanes *into, Lanes *from, const int *mask) {
+  if (into->type != from->type)
+    return false;
+  switch (into->type) {
+  case LANES_NIL:
+    break;
+  case LANES_BOOL:
+  case LANES_INT:
+    EACH_LANE(into->as.ints[i] = mask[i] ? from->as.ints[i] : into->as.ints[i]);
+    break;
+  case LANES_DOUBLE:
+    EACH_LANE(into->as.doubles[i] =
+                  mask[i] ? from->as.doubles[i] : into->as.doubles[i]);
+    break;
+  case LANES_STRING:
+    EACH_LANE(into->as.strings[i] =
+                  mask[i] ? from->as.strings[i] : into->as.strings[i]);
+    break;
+  case LANES_NATIVE:
+    return into->as.native == from->as.native;
+  }
+  return true;
+}
+
+// Sends the running lanes in `taken` to the jump target `parked` with the
+// stack they have now, and stops running them.
+static InterpretResult park(Batch *batch, ParkedLanes *parked,
+                            const int *taken, int offset) {
+  int count = 0;
+  EACH_LANE(count += taken[i]);
+  if (count == 0)
+    return INTERPRET_OK;
+
+  if (parked->count == 0 && count == batch->activeCount) {
+    // Every running lane jumps: hand the whole stack over.
+    for (int i = 0; i < batch->depth; i++) {
+      Lanes *lanes = batch->stack[i];
+      batch->stack[i] = parked->stack[i];
+      parked->stack[i] = lanes;
+    }
+  } else if (parked->count == 0) {
+    for (int i = 0; i < batch->depth; i++)
+      *parked->stack[i] = *batch->stack[i];
+  } else {
+    for (int i = 0; i < batch->depth; i++) {
+      if (!mergeLanes(parked->stack[i], batch->stack[i], taken))
+        return batchError(batch, offset,
+                          "Rows of a batch give a value different types.");
+    }
+  }
+  EACH_LANE(parked->lanes[i] = parked->count == 0
+                                   ? taken[i]
+                                   : parked->lanes[i] | taken[i]);
+  parked->count += count;
+  parked->depth = batch->depth;
+
+  EACH_LANE(batch->active[i] &= !taken[i]);
+  batch->activeCount -= count;
+  return INTERPRET_OK;
+}
+
+// Lets the lanes parked at the instruction dispatch has reached run again.
+static InterpretResult arrive(Batch *batch, ParkedLanes *parked, int offset) {
+  if (batch->activeCount == 0) {
+    for (int i = 0; i < parked->depth; i++) {
+      Lanes *lanes = batch->stack[i];
+      batch->stack[i] = parked->stack[i];
+      parked->stack[i] = lanes;
+    }
+    batch->depth = parked->depth;
+    memcpy(batch->active, parked->lanes, sizeof(LaneMask));
+  } else {
+    for (int i = 0; i < batch->depth; i++) {
+      if (!mergeLanes(batch->stack[i], parked->stack[i], parked->lanes))
+        return batchError(batch, offset,
+                          "Rows of a batch give a value different types.");
+    }
+    EACH_LANE(batch->active[i] |= parked->lanes[i]);
+  }
+  batch->activeCount += parked->count;
+  parked->count = 0;
+  return INTERPRET_OK;
+}
+
+// Runs a pure native over the running lanes. sqrt and abs of doubles get
+// kernels of their own; everything else is called once per lane, and the
+// first lane's result decides the type of the rest.
+static InterpretResult callNative(Batch *batch, int argCount, int offset) {
+  Lanes **args = &batch->stack[batch->depth - argCount];
+  Lanes *callee = args[-1];
+  if (callee->type != LANES_NATIVE)
+    return batchError(batch, offset, "Can only call functions and classes.");
+  ObjNative *native = callee->as.native;
+  if (native->arity >= 0 && argCount != native->arity)
+    return batchError(batch, offset, "Expected %d arguments but got %d.",
+                      native->arity, argCount);
+
+  Lanes *out = batch->stack[batch->depth];
+  if (argCount == 1 && args[0]->type == LANES_DOUBLE &&
+      (strcmp(native->name, "sqrt") == 0 || strcmp(native->name, "abs") == 0)) {
+    bool root = native->name[0] == 's';
+    double *restrict result = out->as.doubles;
+    const double *restrict x = args[0]->as.doubles;
+    for (int i = 0; i < BATCH_BLOCK; i++)
+      result[i] = root ? sqrt(x[i]) : fabs(x[i]);
+    out->type = LANES_DOUBLE;
+  } else {
+    Value values[UINT8_MAX + 1];
+    values[0] = OBJ_VAL(native);
+    int first = -1;
+    for (int i = 0; i < BATCH_BLOCK; i++) {
+      if (!batch->active[i])
+        continue;
+      for (int j = 0; j < argCount; j++)
+        values[j + 1] = laneValue(args[j], i);
+      Value value = native->function(argCount, values + 1);
+      if (vm.nativeError != NULL) {
+        const char *message = vm.nativeError;
+        vm.nativeError = NULL;
+        return batchError(batch, offset, "%s", message);
+      }
+      if (first < 0) {
+        if (!broadcast(out, value) || out->type == LANES_NATIVE)
+          return batchError(batch, offset, "%s() gives a value a batch "
+                            "can't hold.", native->name);
+        first = i;
+      }
+      bool same;
+      switch (out->type) {
+      case LANES_NIL:
+        same = IS_NIL(value);
+        break;
+      case LANES_BOOL:
+        same = IS_BOOL(value);
+        if (same)
+          out->as.ints[i] = AS_BOOL(value);
+        break;
+      case LANES_INT:
+        same = IS_INT(value);
+        if (same)
+          out->as.ints[i] = AS_INT(value);
+        break;
+      case LANES_DOUBLE:
+        same = IS_DOUBLE(value);
+        if (same)
+          out->as.doubles[i] = AS_DOUBLE(value);
+        break;
+      default:
+        same = IS_ANY_STRING(value);
+        if (same)
+          out->as.strings[i] = value;
+        break;
+      }
+      if (!same)
+        return batchError(batch, offset,
+                          "Rows of a batch give %s() different types.",
+                          native->name);
+    }
+    if (heapLimitExceeded())
+      return batchError(batch, offset, "Heap limit of %zu bytes exceeded.",
+                        memoryStats.limit);
+  }
+
+  batch->stack[batch->depth] = args[-1];
+  args[-1] = out;
+  batch->depth -= argCount;
+  return INTERPRET_OK;
+}
+
+static int slotOf(Batch *batch, Value name) {
+  Value slot;
+  return tableGet(&batch->slots, name, &slot) ? AS_INT(slot) : -1;
+}
+
+static BatchGlobal *globalOf(Batch *batch, Value name) {
+  return &batch->globals[slotOf(batch, name) - batch->inputCount];
+}
+
+static InterpretResult getGlobal(Batch *batch, Value name, int offset) {
+  Lanes *out = batch->stack[batch->depth];
+  int slot = slotOf(batch, name);
+  Value value;
+  if (slot >= 0 && slot < batch->inputCount) {
+    loadColumn(out, &batch->inputs[slot].column, batch->base, batch->count);
+  } else if (slot >= 0 && batch->globals[slot - batch->inputCount].defined) {
+    *out = *batch->globals[slot - batch->inputCount].lanes;
+  } else if (!tableGet(&vm.globals, name, &value)) {
+    return batchError(batch, offset, "Undefined variable '%.*s'.",
+                      STRING_LENGTH(name), STRING_CHARS(name));
+  } else if (!broadcast(out, value)) {
+    if (IS_NATIVE(value) || IS_FUNCTION(value) || IS_CLASS(value))
+      return batchError(batch, offset,
+                        "Only pure natives can be called in a batch, not "
+                        "'%.*s'.",
+                        STRING_LENGTH(name), STRING_CHARS(name));
+    return batchError(batch, offset, "Global '%.*s' can't be batched.",
+                      STRING_LENGTH(name), STRING_CHARS(name));
+  }
+  batch->depth++;
+  return INTERPRET_OK;
+}
+
+// Only globals the chunk defines itself can be assigned: inputs and the
+// globals in vm.globals are the same for every row of the batch.
+static InterpretResult setGlobal(Batch *batch, Value name, int offset) {
+  int slot = slotOf(batch, name);
+  Value value;
+  if (slot >= batch->inputCount &&
+      batch->globals[slot - batch->inputCount].defined) {
+    Lanes *global = batch->globals[slot - batch->inputCount].lanes;
+    Lanes *value = batch->stack[batch->depth - 1];
+    if (batch->activeCount == BATCH_BLOCK)
+      *global = *value;
+    else if (!mergeLanes(global, value, batch->active))
+      return batchError(batch, offset,
+                        "Rows of a batch give '%.*s' different types.",
+                        STRING_LENGTH(name), STRING_CHARS(name));
+    return INTERPRET_OK;
+  }
+  if (slot < 0 && !tableGet(&vm.globals, name, &value))
+    return batchError(batch, offset, "Undefined variable '%.*s'.",
+                      STRING_LENGTH(name), STRING_CHARS(name));
+  return batchError(batch, offset,
+                    "Global '%.*s' can't be assigned in a batch.",
+                    STRING_LENGTH(name), STRING_CHARS(name));
+}
+
+// Runs the chunk once over the current block, dispatching each instruction
+// once for all of its rows.
+static InterpretResult runBlock(Batch *batch) {
+  Chunk *chunk = batch->chunk;
+  Value *constants = chunk->constants.values;
+  batch->depth = 0;
+  for (int i = 0; i < batch->globalCount; i++)
+    batch->globals[i].defined = false;
+  EACH_LANE(batch->active[i] = 1);
+  batch->activeCount = BATCH_BLOCK;
+  for (int i = 0; i < batch->parkedCount; i++)
+    batch->parked[i].count = 0;
+
+#define PUSH_CONSTANT(index)                                                   \
+  do {                                                                         \
+    Value value = constants[(index)];                                          \
+    if (!broadcast(batch->stack[batch->depth], value))                         \
+      return batchError(batch, offset, "Constant can't be batched.");          \
+    batch->depth++;                                                            \
+  } while (false)
+#define PARK_AT_TARGET(taken)                                                  \
+  park(batch, &batch->parked[batch->targetOf[jumpTarget(chunk, offset)]],      \
+       (taken), offset)
+#define COMPARE_JUMP(op, negate)                                               \
+  do {                                                                         \
+    result = binary(batch, (op), (negate), offset);                            \
+    if (result != INTERPRET_OK)                                                \
+      return result;                                                           \
+    Lanes *condition = batch->stack[--batch->depth];                           \
+    LaneMask taken;                                                            \
+    EACH_LANE(taken[i] = batch->active[i] & condition->as.ints[i]);            \
+    result = PARK_AT_TARGET(taken);                                            \
+  } while (false)
+
+  for (int offset = 0;;) {
+    uint8_t op = chunk->code[offset];
+    InterpretResult result = INTERPRET_OK;
+    if (batch->targetOf[offset] >= 0 &&
+        batch->parked[batch->targetOf[offset]].count > 0) {
+      result = arrive(batch, &batch->parked[batch->targetOf[offset]], offset);
+      if (result != INTERPRET_OK)
+        return result;
+    }
+    if (batch->activeCount == 0) {
+      // Every lane is parked further on.
+      offset += instructionLength(op);
+      continue;
+    }
+    switch (genericOpcode(op)) {
+    case OP_CONSTANT:
+      PUSH_CONSTANT(chunk->code[offset + 1]);
+      break;
+    case OP_NIL:
+      batch->stack[batch->depth++]->type = LANES_NIL;
+      break;
+    case OP_TRUE:
+    case OP_FALSE:
+      broadcast(batch->stack[batch->depth++], BOOL_VAL(op == OP_TRUE));
+      break;
+    case OP_POP:
+      batch->depth--;
+      break;
+    case OP_POPN:
+      batch->depth -= chunk->code[offset + 1];
+      break;
+    case OP_DUP:
+      *batch->stack[batch->depth] = *batch->stack[batch->depth - 1];
+      batch->depth++;
+      break;
+    case OP_GET_LOCAL:
+      *batch->stack[batch->depth] = *batch->stack[chunk->code[offset + 1]];
+      batch->depth++;
+      break;
+    case OP_SET_LOCAL:
+      *batch->stack[chunk->code[offset + 1]] = *batch->stack[batch->depth - 1];
+      break;
+    case OP_GET_GLOBAL:
+      result = getGlobal(batch, constants[chunk->code[offset + 1]], offset);
+      break;
+    case OP_SET_GLOBAL:
+      result = setGlobal(batch, constants[chunk->code[offset + 1]], offset);
+      break;
+    case OP_DEFINE_GLOBAL: {
+      BatchGlobal *global =
+          globalOf(batch, constants[chunk->code[offset + 1]]);
+      Lanes *value = batch->stack[--batch->depth];
+      batch->stack[batch->depth] = global->lanes;
+      global->lanes = value;
+      global->defined = true;
+      break;
+    }
+    case OP_DEFINE_GLOBAL_CONSTANT: {
+      BatchGlobal *global =
+          globalOf(batch, constants[chunk->code[offset + 1]]);
+      if (!broadcast(global->lanes, constants[chunk->code[offset + 2]]))
+        return batchError(batch, offset, "Constant can't be batched.");
+      global->defined = true;
+      break;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      result = binary(batch, genericOpcode(op), false, offset);
+      break;
+    case OP_NOT_EQUAL:
+      result = binary(batch, OP_EQUAL, true, offset);
+      break;
+    case OP_NOT_LESS:
+      result = binary(batch, OP_LESS, true, offset);
+      break;
+    case OP_NOT_GREATER:
+      result = binary(batch, OP_GREATER, true, offset);
+      break;
+    case OP_CONSTANT_ADD:
+    case OP_CONSTANT_SUBTRACT:
+    case OP_CONSTANT_MULTIPLY:
+    case OP_CONSTANT_DIVIDE:
+    case OP_CONSTANT_LESS:
+    case OP_CONSTANT_GREATER:
+      PUSH_CONSTANT(chunk->code[offset + 1]);
+      result = binary(batch, (uint8_t)fusedConstantOperation(op), false,
+                      offset);
+      break;
+    case OP_CONCAT_N:
+    case OP_INTERPOLATE:
+      result = concatenation(batch, op == OP_INTERPOLATE,
+                             chunk->code[offset + 1], offset);
+      break;
+    case OP_NOT:
+      notKernel(batch->stack[batch->depth - 1]);
+      break;
+    case OP_NEGATE:
+      if (!negateKernel(batch->stack[batch->depth - 1]))
+        return batchError(batch, offset, "Operand must be a number.");
+      break;
+    case OP_JUMP: {
+      LaneMask taken;
+      memcpy(taken, batch->active, sizeof(LaneMask));
+      result = PARK_AT_TARGET(taken);
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      Lanes *condition = batch->stack[--batch->depth];
+      LaneMask taken;
+      if (condition->type == LANES_BOOL)
+        EACH_LANE(taken[i] = batch->active[i] & !condition->as.ints[i]);
+      else if (condition->type == LANES_NIL)
+        memcpy(taken, batch->active, sizeof(LaneMask));
+      else
+        EACH_LANE(taken[i] = 0);
+      result = PARK_AT_TARGET(taken);
+      break;
+    }
+    case OP_JUMP_IF_EQUAL:
+      COMPARE_JUMP(OP_EQUAL, false);
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+      COMPARE_JUMP(OP_EQUAL, true);
+      break;
+    case OP_JUMP_IF_LESS:
+      COMPARE_JUMP(OP_LESS, false);
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      COMPARE_JUMP(OP_LESS, true);
+      break;
+    case OP_JUMP_IF_GREATER:
+      COMPARE_JUMP(OP_GREATER, false);
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      COMPARE_JUMP(OP_GREATER, true);
+      break;
+    case OP_CALL:
+      result = callNative(batch, chunk->code[offset + 1], offset);
+      break;
+    case OP_RETURN:
+      return INTERPRET_OK;
+    default:
+      // Everything else was rejected before the first block.
+      return batchError(batch, offset, "Can't batch %s.", opcodeName(op));
+    }
+    if (result != INTERPRET_OK)
+      return result;
+    offset += instructionLength(op);
+  }
+
+#undef PUSH_CONSTANT
+#undef PARK_AT_TARGET
+#undef COMPARE_JUMP
+}
+
+static bool columnType(LaneType type, ColumnType *column) {
+  switch (type) {
+  case LANES_BOOL:
+    *column = COLUMN_BOOL;
+    return true;
+  case LANES_INT:
+    *column = COLUMN_INT;
+    return true;
+  case LANES_DOUBLE:
+    *column = COLUMN_DOUBLE;
+    return true;
+  case LANES_STRING:
+    *column = COLUMN_STRING;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void allocateColumn(Column *column, ColumnType type, int rows) {
+  column->type = type;
+  switch (type) {
+  case COLUMN_BOOL:
+    column->as.bools = ALLOCATE(bool, rows);
+    break;
+  case COLUMN_INT:
+    column->as.ints = ALLOCATE(int, rows);
+    break;
+  case COLUMN_DOUBLE:
+    column->as.doubles = ALLOCATE(double, rows);
+    break;
+  case COLUMN_STRING:
+    column->as.strings = ALLOCATE(Value, rows);
+    break;
+  }
+}
+
+void freeColumn(Column *column, int rows) {
+  switch (column->type) {
+  case COLUMN_BOOL:
+    FREE_ARRAY(bool, column->as.bools, rows);
+    break;
+  case COLUMN_INT:
+    FREE_ARRAY(int, column->as.ints, rows);
+    break;
+  case COLUMN_DOUBLE:
+    FREE_ARRAY(double, column->as.doubles, rows);
+    break;
+  case COLUMN_STRING:
+    FREE_ARRAY(Value, column->as.strings, rows);
+    break;
+  }
+  column->as.ints = NULL;
+}
+
+// The first block decides the result column's type; straight-line code
+// gives every later block the same one.
+static InterpretResult storeOutput(Batch *batch, Value output, int rows,
+                                   Column *result) {
+  BatchGlobal *global = globalOf(batch, output);
+  Lanes *lanes = global->lanes;
+  ColumnType type;
+  if (!global->defined || !columnType(lanes->type, &type)) {
+    return batchError(
+        batch, batch->chunk->count - 1,
+        "Batch output '%.*s' must be a bool, int, double or string.",
+        STRING_LENGTH(output), STRING_CHARS(output));
+  }
+  if (batch->base == 0)
+    allocateColumn(result, type, rows);
+
+  int base = batch->base;
+  int count = batch->count;
+  switch (type) {
+  case COLUMN_BOOL:
+    for (int i = 0; i < count; i++)
+      result->as.bools[base + i] = lanes->as.ints[i];
+    break;
+  case COLUMN_INT:
+    memcpy(result->as.ints + base, lanes->as.ints, count * sizeof(int));
+    break;
+  case COLUMN_DOUBLE:
+    memcpy(result->as.doubles + base, lanes->as.doubles,
+           count * sizeof(double));
+    break;
+  case COLUMN_STRING:
+    memcpy(result->as.strings + base, lanes->as.strings,
+           count * sizeof(Value));
+    break;
+  }
+  return INTERPRET_OK;
+}
+
+// What a chunk containing `op` can't do in a batch, or NULL.
+static const char *unbatchable(uint8_t op) {
+  switch (op) {
+  case OP_PRINT:
+    return "print";
+  case OP_ARRAY:
+  case OP_ARRAY_APPEND:
+  case OP_GET_INDEX:
+  case OP_SET_INDEX:
+    return "use arrays";
+  case OP_MAP:
+  case OP_MAP_INSERT:
+  case OP_MAP_MERGE:
+  case OP_IN:
+  case OP_DELETE:
+    return "use maps";
+  case OP_SIZE:
+    return "take sizes";
+  case OP_TAIL_CALL:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    return "call functions";
+  case OP_CLASS:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+    return "use classes";
+  case OP_LOOP:
+    return "loop";
+  default:
+    return NULL;
+  }
+}
+
+// Gives every global the chunk defines a slot, and rejects what a batch
+// can't run.
+static bool prepare(Batch *batch, Value output) {
+  Chunk *chunk = batch->chunk;
+  batch->targetOf = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++)
+    batch->targetOf[i] = -1;
+  for (int i = 0; i < batch->inputCount; i++) {
+    const char *name = batch->inputs[i].name;
+    tableSet(&batch->slots, makeString(name, (int)strlen(name)),
+             INT_VAL(i));
+  }
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t op = chunk->code[offset];
+    const char *reason = unbatchable(op);
+    if (reason != NULL) {
+      fprintf(stderr, "Batch chunks can't %s.\n[line %d] in script\n", reason,
+              getLine(chunk, offset));
+      return false;
+    }
+    if (jumpTarget(chunk, offset) >= 0 &&
+        batch->targetOf[jumpTarget(chunk, offset)] < 0)
+      batch->targetOf[jumpTarget(chunk, offset)] = batch->parkedCount++;
+    if (op == OP_DEFINE_GLOBAL || op == OP_DEFINE_GLOBAL_CONSTANT) {
+      Value name = chunk->constants.values[chunk->code[offset + 1]];
+      int slot = slotOf(batch, name);
+      if (slot >= 0 && slot < batch->inputCount) {
+        fprintf(stderr, "Batch chunk redefines input '%.*s'.\n",
+                STRING_LENGTH(name), STRING_CHARS(name));
+        return false;
+      }
+      if (slot < 0) {
+        tableSet(&batch->slots, name,
+                 INT_VAL(batch->inputCount + batch->globalCount));
+        batch->globalCount++;
+      }
+    }
+    offset += instructionLength(op);
+  }
+
+  int slot = slotOf(batch, output);
+  if (slot < batch->inputCount) {
+    fprintf(stderr, "Batch output '%.*s' is not a global the chunk defines.\n",
+            STRING_LENGTH(output), STRING_CHARS(output));
+    return false;
+  }
+
+  // Each global holds its own lanes; the stack gets one more than its
+  // deepest point for binary kernels to write to, and each jump target a
+  // stack for the lanes parked there.
+  batch->stackSize = chunk->maxStackDepth + 1;
+  batch->poolSize = batch->stackSize * (1 + batch->parkedCount) +
+                    batch->globalCount;
+  batch->pool = ALLOCATE(Lanes, batch->poolSize);
+  batch->stack = ALLOCATE(Lanes *, batch->stackSize * (1 + batch->parkedCount));
+  batch->globals = ALLOCATE(BatchGlobal, batch->globalCount);
+  batch->parked = ALLOCATE(ParkedLanes, batch->parkedCount);
+  for (int i = 0; i < batch->stackSize * (1 + batch->parkedCount); i++)
+    batch->stack[i] = &batch->pool[i];
+  for (int i = 0; i < batch->parkedCount; i++)
+    batch->parked[i].stack = batch->stack + batch->stackSize * (i + 1);
+  Lanes *globals = &batch->pool[batch->stackSize * (1 + batch->parkedCount)];
+  for (int i = 0; i < batch->globalCount; i++)
+    batch->globals[i].lanes = &globals[i];
+  return true;
+}
+
+InterpretResult evaluateBatch(Chunk *chunk, const ColumnBinding *inputs,
+                              int inputCount, int rows, const char *output,
+                              Column *result) {
+  if (!chunk->verified && !verifyChunk(chunk))
+    return INTERPRET_COMPILE_ERROR;
+
+  Batch batch;
+  batch.chunk = chunk;
+  batch.inputs = inputs;
+  batch.inputCount = inputCount;
+  initTable(&batch.slots);
+  batch.globals = NULL;
+  batch.globalCount = 0;
+  batch.stack = NULL;
+  batch.stackSize = 0;
+  batch.pool = NULL;
+  batch.poolSize = 0;
+  batch.targetOf = NULL;
+  batch.parked = NULL;
+  batch.parkedCount = 0;
+
+  result->type = COLUMN_INT;
+  result->as.ints = NULL;
+
+  Value outputName = makeString(output, (int)strlen(output));
+  InterpretResult status = INTERPRET_COMPILE_ERROR;
+  if (prepare(&batch, outputName)) {
+    status = INTERPRET_OK;
+    for (batch.base = 0; batch.base < rows && status == INTERPRET_OK;
+         batch.base += BATCH_BLOCK) {
+      batch.count = rows - batch.base < BATCH_BLOCK ? rows - batch.base
+                                                    : BATCH_BLOCK;
+      status = runBlock(&batch);
+      if (status == INTERPRET_OK)
+        status = storeOutput(&batch, outputName, rows, result);
+    }
+    if (status != INTERPRET_OK && result->as.ints != NULL)
+      freeColumn(result, rows);
+  }
+
+  // prepare() counts globals and jump targets before it can reject the
+  // chunk, and only allocates for them once it has accepted it.
+  if (batch.pool != NULL) {
+    FREE_ARRAY(Lanes, batch.pool, batch.poolSize);
+    FREE_ARRAY(Lanes *, batch.stack,
+               batch.stackSize * (1 + batch.parkedCount));
+    FREE_ARRAY(BatchGlobal, batch.globals, batch.globalCount);
+    FREE_ARRAY(ParkedLanes, batch.parked, batch.parkedCount);
+  }
+  FREE_ARRAY(int, batch.targetOf, chunk->count);
+  freeTable(&batch.slots);
+  return status;
+}
@@ -0,0 +1,55 @@
+#ifndef rotlang_batch_h
+#define rotlang_batch_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// Rows are evaluated this many at a time: each instruction is dispatched
+// once per block and runs over all of its rows in a tight loop.
+#define BATCH_BLOCK 256
+
+typedef enum {
+  COLUMN_BOOL,
+  COLUMN_INT,
+  COLUMN_DOUBLE,
+  COLUMN_STRING,
+} ColumnType;
+
+// One value per row. String columns hold string Values (short, interned or
+// views); the others are unboxed.
+typedef struct {
+  ColumnType type;
+  union {
+    bool *bools;
+    int *ints;
+    double *doubles;
+    Value *strings;
+  } as;
+} Column;
+
+typedef struct {
+  const char *name;
+  Column column;
+} ColumnBinding;
+
+// Runs `chunk` over `rows` rows at once, as if once per row with each
+// input's global holding that row's value, and fills `result` with the
+// value the global `output` ends up with in each row. The globals the chunk
+// defines are private to the batch; any other global it reads comes from
+// vm.globals. An instruction that fails on any row fails the whole batch.
+// Branches run each side over the rows that take it, so `and`, `or` and
+// `if` work, and so do calls to pure natives like abs() and str(); chunks
+// that print, loop, call anything else or use arrays, maps or classes are
+// rejected. Only the globals the chunk defines can be assigned, and each
+// must keep one type across the rows of a block. On
+// success the caller owns `result` and releases it with freeColumn(); with
+// no rows it's an empty int column.
+InterpretResult evaluateBatch(Chunk *chunk, const ColumnBinding *inputs,
+                              int inputCount, int rows, const char *output,
+                              Column *result);
+
+void freeColumn(Column *column, int rows);
+
+#endif
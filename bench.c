@@ -0,0 +1,791 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "bench.h"
+#include "compiler.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "vm.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define SCAN_SOURCE_MB 64
+#define SCAN_ROUNDS 5
+
+// Each statement is a full binary tree of this depth, so it uses
+// 2^VM_EXPRESSION_DEPTH constants; keep the total under the 256 constant
+// limit.
+#define VM_STATEMENTS 30
+#define VM_EXPRESSION_DEPTH 3
+#define VM_ROUNDS 100000
+#define VM_LOOP_ITERATIONS 1000000
+#define VM_LOOP_ROUNDS 5
+
+#define BATCH_ROWS (1 << 20)
+
+#define CALLS_ROUNDS 5
+
+#define PROPERTY_ITERATIONS 1000000
+#define PROPERTY_ROUNDS 5
+
+#define CONCAT_LINES 200000
+#define CONCAT_ROUNDS 5
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Retired instructions, loads and stores, read from the kernel's generic
+// hardware events (the ones `perf stat -e L1-dcache-loads,...` uses). Where
+// they can't be opened, such as in VMs and containers without PMU access,
+// the benchmark still reports times and simply omits the counts.
+typedef enum {
+  COUNT_INSTRUCTIONS,
+  COUNT_LOADS,
+  COUNT_STORES,
+  COUNT_KINDS,
+} CountKind;
+
+typedef struct {
+  int fds[COUNT_KINDS];
+  bool available;
+} Counters;
+
+typedef struct {
+  double seconds;
+  uint64_t counts[COUNT_KINDS];
+} Measurement;
+
+#if defined(__linux__)
+static int openCounter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t l1dAccess(uint64_t op) {
+  return PERF_COUNT_HW_CACHE_L1D | op << 8 |
+         (uint64_t)PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16;
+}
+#endif
+
+static void openCounters(Counters *counters) {
+  counters->available = false;
+#if defined(__linux__)
+  counters->fds[COUNT_INSTRUCTIONS] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters->fds[COUNT_LOADS] =
+      openCounter(PERF_TYPE_HW_CACHE, l1dAccess(PERF_COUNT_HW_CACHE_OP_READ));
+  counters->fds[COUNT_STORES] =
+      openCounter(PERF_TYPE_HW_CACHE, l1dAccess(PERF_COUNT_HW_CACHE_OP_WRITE));
+  counters->available = true;
+  for (int i = 0; i < COUNT_KINDS; i++) {
+    if (counters->fds[i] < 0)
+      counters->available = false;
+  }
+#endif
+}
+
+static void closeCounters(Counters *counters) {
+#if defined(__linux__)
+  for (int i = 0; i < COUNT_KINDS; i++) {
+    if (counters->fds[i] >= 0)
+      close(counters->fds[i]);
+  }
+#endif
+  counters->available = false;
+}
+
+static void startCounters(Counters *counters) {
+#if defined(__linux__)
+  if (!counters->available)
+    return;
+  for (int i = 0; i < COUNT_KINDS; i++) {
+    ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static void stopCounters(Counters *counters, Measurement *measurement) {
+  memset(measurement->counts, 0, sizeof(measurement->counts));
+#if defined(__linux__)
+  if (!counters->available)
+    return;
+  for (int i = 0; i < COUNT_KINDS; i++) {
+    ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t value;
+    if (read(counters->fds[i], &value, sizeof(value)) == sizeof(value))
+      measurement->counts[i] = value;
+  }
+#endif
+}
+
+// A representative mix of declarations, comments, strings and operators,
+// repeated until the generated source reaches the requested size.
+static const char *scanSnippet =
+    "// running totals for the current batch\n"
+    "sumn totalBytesProcessed = 1024 * 64 + previousBatchSize;\n"
+    "sumn ratio = 3.14159 / (count - 1);\n"
+    "pluh \"processed \" + totalBytesProcessed + \" bytes in batch\";\n"
+    "  if (ratio >= 0.5 and !done) { crashout nil; }\n"
+    "typeshi Record { fn describe() { pluh ts.name; } }\n";
+
+static char *generateSource(size_t size) {
+  size_t snippetLength = strlen(scanSnippet);
+  char *source = malloc(size + 1);
+  if (source == NULL) {
+    fprintf(stderr, "Not enough memory to generate benchmark source.\n");
+    exit(74);
+  }
+  size_t length = 0;
+  while (length + snippetLength <= size) {
+    memcpy(source + length, scanSnippet, snippetLength);
+    length += snippetLength;
+  }
+  source[length] = '\0';
+  return source;
+}
+
+static void benchScanner() {
+  size_t size = (size_t)SCAN_SOURCE_MB * 1024 * 1024;
+  char *source = generateSource(size);
+  size_t length = strlen(source);
+
+  double best = 0;
+  long tokens = 0;
+  for (int round = 0; round < SCAN_ROUNDS; round++) {
+    double start = now();
+    initScanner(source);
+    tokens = 0;
+    for (;;) {
+      Token token = scanToken();
+      tokens++;
+      if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR)
+        break;
+    }
+    double elapsed = now() - start;
+    double throughput = length / (1024.0 * 1024.0) / elapsed;
+    if (throughput > best)
+      best = throughput;
+  }
+
+  printf("scan: %zu bytes, %ld tokens, best of %d: %.1f MB/s\n", length,
+         tokens, SCAN_ROUNDS, best);
+  free(source);
+}
+
+static uint32_t randomState = 2463534242u;
+
+static int nextRandom(int bound) {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return (int)(randomState % (uint32_t)bound);
+}
+
+// Appends a random arithmetic expression. Ints stay clear of '/' so nothing
+// divides by zero.
+static int appendExpression(char *buffer, int length, int depth,
+                            bool isDouble) {
+  if (depth == 0) {
+    int digit = 1 + nextRandom(9);
+    if (isDouble)
+      return length + sprintf(buffer + length, "%d.5", digit);
+    return length + sprintf(buffer + length, "%d", digit);
+  }
+
+  const char *ops = isDouble ? "+-*/" : "+-*";
+  char op = ops[nextRandom((int)strlen(ops))];
+  buffer[length++] = '(';
+  length = appendExpression(buffer, length, depth - 1, isDouble);
+  length += sprintf(buffer + length, " %c ", op);
+  length = appendExpression(buffer, length, depth - 1, isDouble);
+  buffer[length++] = ')';
+  return length;
+}
+
+static int stackInstructionCount(Chunk *chunk) {
+  int count = 0;
+  for (int offset = 0; offset < chunk->count; count++) {
+    offset += instructionLength(chunk->code[offset]);
+  }
+  return count;
+}
+
+static void timeRounds(Chunk *chunk, RegChunk *regChunk, JitCode *jit,
+                       Counters *counters, Measurement *measurement) {
+  startCounters(counters);
+  double start = now();
+  for (int round = 0; round < VM_ROUNDS; round++) {
+    if (jit != NULL) {
+      jitRun(jit, chunk);
+    } else if (regChunk != NULL) {
+      interpretRegChunk(regChunk);
+    } else {
+      interpretChunk(chunk);
+    }
+  }
+  measurement->seconds = now() - start;
+  stopCounters(counters, measurement);
+}
+
+static void printCounts(Counters *counters, Measurement *measurement) {
+  if (!counters->available)
+    return;
+  printf("            %8.1f instructions, %7.1f loads, %7.1f stores per run\n",
+         (double)measurement->counts[COUNT_INSTRUCTIONS] / VM_ROUNDS,
+         (double)measurement->counts[COUNT_LOADS] / VM_ROUNDS,
+         (double)measurement->counts[COUNT_STORES] / VM_ROUNDS);
+}
+
+// A loop over locals with a branch in its body, leaving its answer in the
+// global `result`.
+static const char *loopSource =
+    "sumn result = 0;\n"
+    "{\n"
+    "  sumn i = 0;\n"
+    "  sumn total = 0;\n"
+    "  while (i < %d) {\n"
+    "    if (i / 3 * 3 == i) total = total + i; else total = total - 1;\n"
+    "    i = i + 1;\n"
+    "  }\n"
+    "  result = total;\n"
+    "}\n";
+
+static long long loopResult() {
+  long long total = 0;
+  for (int i = 0; i < VM_LOOP_ITERATIONS; i++)
+    total += i % 3 == 0 ? i : -1;
+  return total;
+}
+
+static void benchLoop() {
+  char source[512];
+  snprintf(source, sizeof(source), loopSource, VM_LOOP_ITERATIONS);
+
+  initVM();
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(source, &chunk)) {
+    fprintf(stderr, "Benchmark source failed to compile.\n");
+    exit(70);
+  }
+  RegChunk regChunk;
+  initRegChunk(&regChunk);
+  if (!translateChunk(&chunk, &regChunk)) {
+    fprintf(stderr, "Benchmark loop has no register form.\n");
+    exit(70);
+  }
+
+  Value name = makeString("result", 6);
+  double seconds[2];
+  bool correct = true;
+  for (int engine = 0; engine < 2; engine++) {
+    double start = now();
+    for (int round = 0; round < VM_LOOP_ROUNDS; round++) {
+      if (engine == 0)
+        interpretChunk(&chunk);
+      else
+        interpretRegChunk(&regChunk);
+    }
+    seconds[engine] = now() - start;
+    Value result;
+    correct = correct && tableGet(&vm.globals, name, &result) &&
+              IS_INT(result) && AS_INT(result) == (int)loopResult();
+  }
+
+  long long iterations = (long long)VM_LOOP_ITERATIONS * VM_LOOP_ROUNDS;
+  printf("loop: %d iterations over locals, %d runs%s\n", VM_LOOP_ITERATIONS,
+         VM_LOOP_ROUNDS, correct ? "" : " (WRONG RESULT)");
+  printf("  stack:    %5d instructions, %8.2f ns/iteration\n",
+         stackInstructionCount(&chunk), seconds[0] * 1e9 / iterations);
+  printf("  register: %5d instructions, %8.2f ns/iteration (%.2fx)\n",
+         regChunk.count, seconds[1] * 1e9 / iterations,
+         seconds[0] / seconds[1]);
+
+  freeRegChunk(&regChunk);
+  freeChunk(&chunk);
+  freeVM();
+}
+
+static void benchVM() {
+  char *source = malloc(VM_STATEMENTS * 256);
+  int length = 0;
+  for (int i = 0; i < VM_STATEMENTS; i++) {
+    length = appendExpression(source, length, VM_EXPRESSION_DEPTH, i % 2);
+    length += sprintf(source + length, ";\n");
+  }
+
+  initVM();
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(source, &chunk)) {
+    fprintf(stderr, "Benchmark source failed to compile.\n");
+    exit(70);
+  }
+  RegChunk regChunk;
+  initRegChunk(&regChunk);
+  translateChunk(&chunk, &regChunk);
+
+  JitCode jit;
+  bool hasJit = jitCompile(&chunk, &jit);
+
+  Counters counters;
+  openCounters(&counters);
+  Measurement stack, registers;
+  vm.engine = ENGINE_STACK;
+  timeRounds(&chunk, NULL, NULL, &counters, &stack);
+  timeRounds(&chunk, &regChunk, NULL, &counters, &registers);
+
+  int runs = VM_ROUNDS;
+  printf("vm: %d arithmetic statements, %d runs\n", VM_STATEMENTS, runs);
+  printf("  stack:    %5d instructions, %8.1f ns/run\n",
+         stackInstructionCount(&chunk), stack.seconds * 1e9 / runs);
+  printCounts(&counters, &stack);
+  printf("  register: %5d instructions, %8.1f ns/run (%d registers)\n",
+         regChunk.count, registers.seconds * 1e9 / runs,
+         regChunk.registerCount);
+  printCounts(&counters, &registers);
+  if (hasJit) {
+    Measurement native;
+    timeRounds(&chunk, NULL, &jit, &counters, &native);
+    printf("  jit:      %5zu bytes,        %8.1f ns/run\n", jit.size,
+           native.seconds * 1e9 / runs);
+    printCounts(&counters, &native);
+    jitFree(&jit);
+  }
+  if (!counters.available)
+    printf("  (hardware counters unavailable: no loads/stores reported)\n");
+  closeCounters(&counters);
+
+  freeRegChunk(&regChunk);
+  freeChunk(&chunk);
+  freeVM();
+  free(source);
+  benchLoop();
+}
+
+// A scoring rule of the kind batch mode is for, over three columns, with
+// branches that split each block and natives called per row.
+static const char *batchSource =
+    "sumn gross = price * 1.08 - discount;\n"
+    "sumn bulk = qty > 10 and abs(price - 500.0) < 200.0 or discount > 4.5;\n"
+    "sumn score = gross * 2.0 + 0.5;\n"
+    "if (bulk) score = sqrt(abs(score)) + floor(gross);\n";
+
+static void benchBatch() {
+  initVM();
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(batchSource, &chunk)) {
+    fprintf(stderr, "Benchmark source failed to compile.\n");
+    exit(70);
+  }
+
+  double *prices = malloc(BATCH_ROWS * sizeof(double));
+  double *discounts = malloc(BATCH_ROWS * sizeof(double));
+  int *quantities = malloc(BATCH_ROWS * sizeof(int));
+  for (int i = 0; i < BATCH_ROWS; i++) {
+    prices[i] = nextRandom(100000) / 100.0;
+    discounts[i] = nextRandom(500) / 100.0;
+    quantities[i] = nextRandom(20);
+  }
+
+  // One interpretChunk() per row, the only way to do this without batches.
+  Value price = makeString("price", 5);
+  Value discount = makeString("discount", 8);
+  Value qty = makeString("qty", 3);
+  Value score = makeString("score", 5);
+  double *scores = malloc(BATCH_ROWS * sizeof(double));
+  double start = now();
+  for (int i = 0; i < BATCH_ROWS; i++) {
+    tableSet(&vm.globals, price, DOUBLE_VAL(prices[i]));
+    tableSet(&vm.globals, discount, DOUBLE_VAL(discounts[i]));
+    tableSet(&vm.globals, qty, INT_VAL(quantities[i]));
+    interpretChunk(&chunk);
+    Value value;
+    tableGet(&vm.globals, score, &value);
+    scores[i] = AS_DOUBLE(value);
+  }
+  double perRow = now() - start;
+
+  ColumnBinding inputs[] = {
+      {"price", {COLUMN_DOUBLE, {.doubles = prices}}},
+      {"discount", {COLUMN_DOUBLE, {.doubles = discounts}}},
+      {"qty", {COLUMN_INT, {.ints = quantities}}},
+  };
+  Column result;
+  start = now();
+  InterpretResult status =
+      evaluateBatch(&chunk, inputs, 3, BATCH_ROWS, "score", &result);
+  double batched = now() - start;
+  if (status != INTERPRET_OK) {
+    fprintf(stderr, "Batch evaluation failed.\n");
+    exit(70);
+  }
+  int mismatches = 0;
+  for (int i = 0; i < BATCH_ROWS; i++) {
+    if (result.as.doubles[i] != scores[i])
+      mismatches++;
+  }
+
+  printf("batch: %d rows, %d per block\n", BATCH_ROWS, BATCH_BLOCK);
+  printf("  per row: %8.1f ns/row\n", perRow * 1e9 / BATCH_ROWS);
+  printf("  batched: %8.1f ns/row (%.1fx), %d mismatched rows\n",
+         batched * 1e9 / BATCH_ROWS, perRow / batched, mismatches);
+
+  freeColumn(&result, BATCH_ROWS);
+  free(scores);
+  free(prices);
+  free(discounts);
+  free(quantities);
+  freeChunk(&chunk);
+  freeVM();
+}
+
+// Call-heavy scripts, each leaving its answer in the global `result`, and
+// the same functions in C, counting the calls the script makes.
+typedef struct {
+  const char *name;
+  const char *source;
+  long long (*reference)(long long *calls);
+} CallBenchmark;
+
+static long long fib(int n, long long *calls) {
+  ++*calls;
+  return n < 2 ? n : fib(n - 1, calls) + fib(n - 2, calls);
+}
+
+static long long ackermann(int m, int n, long long *calls) {
+  ++*calls;
+  if (m == 0)
+    return n + 1;
+  if (n == 0)
+    return ackermann(m - 1, 1, calls);
+  return ackermann(m - 1, ackermann(m, n - 1, calls), calls);
+}
+
+static long long fibReference(long long *calls) { return fib(25, calls); }
+
+static long long ackermannReference(long long *calls) {
+  return ackermann(3, 5, calls);
+}
+
+static long long countdownReference(long long *calls) {
+  *calls = 1000001;
+  return 0;
+}
+
+static const CallBenchmark callBenchmarks[] = {
+    {"fib(25)",
+     "fn fib(n) {\n"
+     "  if (n < 2) crashout n;\n"
+     "  crashout fib(n - 1) + fib(n - 2);\n"
+     "}\n"
+     "sumn result = fib(25);\n",
+     fibReference},
+    {"ackermann(3, 5)",
+     "fn ack(m, n) {\n"
+     "  if (m == 0) crashout n + 1;\n"
+     "  if (n == 0) crashout ack(m - 1, 1);\n"
+     "  crashout ack(m - 1, ack(m, n - 1));\n"
+     "}\n"
+     "sumn result = ack(3, 5);\n",
+     ackermannReference},
+    // Every call is a tail call, so this runs in a single frame.
+    {"countdown(1000000)",
+     "fn countdown(n) {\n"
+     "  if (n == 0) crashout 0;\n"
+     "  crashout countdown(n - 1);\n"
+     "}\n"
+     "sumn result = countdown(1000000);\n",
+     countdownReference},
+};
+
+// Times function calls and returns on the stack VM, and checks that they
+// allocate nothing: a call's frame and arguments live in preallocated
+// arrays.
+static void benchCalls() {
+  initVM();
+  vm.engine = ENGINE_STACK;
+  Value resultName = makeString("result", 6);
+  printf("calls: best of %d runs\n", CALLS_ROUNDS);
+
+  int count = sizeof(callBenchmarks) / sizeof(callBenchmarks[0]);
+  for (int i = 0; i < count; i++) {
+    const CallBenchmark *benchmark = &callBenchmarks[i];
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(benchmark->source, &chunk)) {
+      fprintf(stderr, "Benchmark source failed to compile.\n");
+      exit(70);
+    }
+    long long calls = 0;
+    long long expected = benchmark->reference(&calls);
+
+    double best = 0;
+    uint64_t allocations = 0;
+    for (int round = 0; round < CALLS_ROUNDS; round++) {
+      uint64_t before = memoryStats.total.allocations;
+      double start = now();
+      if (interpretChunk(&chunk) != INTERPRET_OK) {
+        fprintf(stderr, "Benchmark %s failed.\n", benchmark->name);
+        exit(70);
+      }
+      double seconds = now() - start;
+      // The first run also defines the globals.
+      if (round > 0)
+        allocations += memoryStats.total.allocations - before;
+      if (round == 0 || seconds < best)
+        best = seconds;
+    }
+
+    Value result;
+    tableGet(&vm.globals, resultName, &result);
+    printf("  %-20s %10lld calls, %6.1f ns/call, %llu allocations%s\n",
+           benchmark->name, calls, best * 1e9 / (double)calls,
+           (unsigned long long)allocations,
+           IS_INT(result) && AS_INT(result) == expected ? ""
+                                                        : " (wrong result)");
+    freeChunk(&chunk);
+  }
+  freeVM();
+}
+
+// Loops of PROPERTY_ITERATIONS iterations over instances made up front,
+// each leaving its answer in the global `result`. The polymorphic one sends
+// a single call site instances of four classes, as many shapes as its cache
+// holds.
+typedef struct {
+  const char *name;
+  const char *source;
+  int accesses; // Property reads, writes and method calls per iteration.
+  int expected;
+} PropertyBenchmark;
+
+static const PropertyBenchmark propertyBenchmarks[] = {
+    {"fields",
+     "typeshi P { init() { ts.x = 0; ts.y = 1; } }\n"
+     "fn run(p) {\n"
+     "  sumn i = 0;\n"
+     "  while (i < 1000000) { p.x = p.x + p.y; i = i + 1; }\n"
+     "  crashout p.x;\n"
+     "}\n"
+     "sumn result = run(P());\n",
+     3, 1000000},
+    {"methods",
+     "typeshi C {\n"
+     "  init() { ts.n = 0; }\n"
+     "  add(k) { ts.n = ts.n + k; }\n"
+     "}\n"
+     "fn run(c) {\n"
+     "  sumn i = 0;\n"
+     "  while (i < 1000000) { c.add(1); i = i + 1; }\n"
+     "  crashout c.n;\n"
+     "}\n"
+     "sumn result = run(C());\n",
+     3, 1000000},
+    {"polymorphic methods",
+     "typeshi A { init() { ts.v = 1; } get() { crashout ts.v; } }\n"
+     "typeshi B < A { init() { ts.w = 0; ts.v = 1; } }\n"
+     "typeshi C < A { init() { ts.w = 0; ts.x = 0; ts.v = 1; } }\n"
+     "typeshi D < A { init() { ts.u = 0; ts.v = 1; } }\n"
+     "fn run(all) {\n"
+     "  sumn i = 0;\n"
+     "  sumn s = 0;\n"
+     "  while (i < 1000000) { s = s + all[i - i / 4 * 4].get(); i = i + 1; }\n"
+     "  crashout s;\n"
+     "}\n"
+     "sumn result = run([A(), B(), C(), D()]);\n",
+     2, 1000000},
+};
+
+// Times property access and method calls on the stack VM. Allocations are
+// per run and come from making the classes and instances: reading a field,
+// adding one an instance's shape already has room for and calling a method
+// allocate nothing.
+static void benchProperties() {
+  initVM();
+  vm.engine = ENGINE_STACK;
+  Value resultName = makeString("result", 6);
+  printf("props: %d iterations, best of %d runs\n", PROPERTY_ITERATIONS,
+         PROPERTY_ROUNDS);
+
+  int count = sizeof(propertyBenchmarks) / sizeof(propertyBenchmarks[0]);
+  for (int i = 0; i < count; i++) {
+    const PropertyBenchmark *benchmark = &propertyBenchmarks[i];
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(benchmark->source, &chunk)) {
+      fprintf(stderr, "Benchmark source failed to compile.\n");
+      exit(70);
+    }
+
+    double best = 0;
+    uint64_t allocations = 0;
+    for (int round = 0; round < PROPERTY_ROUNDS; round++) {
+      uint64_t before = memoryStats.total.allocations;
+      double start = now();
+      if (interpretChunk(&chunk) != INTERPRET_OK) {
+        fprintf(stderr, "Benchmark %s failed.\n", benchmark->name);
+        exit(70);
+      }
+      double seconds = now() - start;
+      // The first run also compiles the methods.
+      if (round > 0)
+        allocations = memoryStats.total.allocations - before;
+      if (round == 0 || seconds < best)
+        best = seconds;
+    }
+
+    Value result;
+    tableGet(&vm.globals, resultName, &result);
+    long long accesses = (long long)benchmark->accesses * PROPERTY_ITERATIONS;
+    printf("  %-20s %10lld accesses, %5.1f ns/access, "
+           "%llu allocations/run%s\n",
+           benchmark->name, accesses, best * 1e9 / (double)accesses,
+           (unsigned long long)allocations,
+           IS_INT(result) && AS_INT(result) == benchmark->expected
+               ? ""
+               : " (wrong result)");
+    freeChunk(&chunk);
+  }
+  freeVM();
+}
+
+// The same log line built three ways, CONCAT_LINES times. Parentheses keep
+// the first one a chain of pairwise OP_ADDs, each building, hashing and
+// interning a string.
+static const struct {
+  const char *name;
+  const char *source;
+} concatBenchmarks[] = {
+    {"pairwise +",
+     "fn run(user, path) {\n"
+     "  sumn i = 0;\n"
+     "  sumn line = \"\";\n"
+     "  while (i < 200000) {\n"
+     "    line = ((((\"user=\" + user) + \" path=\") + path) +\n"
+     "            \" status=\") + str(i);\n"
+     "    i = i + 1;\n"
+     "  }\n"
+     "  crashout line;\n"
+     "}\n"
+     "sumn result = run(\"somebody\", \"/index.html\");\n"},
+    {"chained +",
+     "fn run(user, path) {\n"
+     "  sumn i = 0;\n"
+     "  sumn line = \"\";\n"
+     "  while (i < 200000) {\n"
+     "    line = \"user=\" + user + \" path=\" + path + \" status=\" +\n"
+     "           str(i);\n"
+     "    i = i + 1;\n"
+     "  }\n"
+     "  crashout line;\n"
+     "}\n"
+     "sumn result = run(\"somebody\", \"/index.html\");\n"},
+    {"interpolation",
+     "fn run(user, path) {\n"
+     "  sumn i = 0;\n"
+     "  sumn line = \"\";\n"
+     "  while (i < 200000) {\n"
+     "    line = \"user=${user} path=${path} status=${i}\";\n"
+     "    i = i + 1;\n"
+     "  }\n"
+     "  crashout line;\n"
+     "}\n"
+     "sumn result = run(\"somebody\", \"/index.html\");\n"},
+};
+
+// Times building strings piece by piece on the stack VM, counting the
+// allocations each way makes per line once every line has been interned.
+static void benchConcat() {
+  initVM();
+  vm.engine = ENGINE_STACK;
+  Value resultName = makeString("result", 6);
+  const char *expected = "user=somebody path=/index.html status=199999";
+  printf("concat: %d lines, best of %d runs\n", CONCAT_LINES, CONCAT_ROUNDS);
+
+  int count = sizeof(concatBenchmarks) / sizeof(concatBenchmarks[0]);
+  for (int i = 0; i < count; i++) {
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(concatBenchmarks[i].source, &chunk)) {
+      fprintf(stderr, "Benchmark source failed to compile.\n");
+      exit(70);
+    }
+
+    double best = 0;
+    uint64_t allocations = 0;
+    for (int round = 0; round < CONCAT_ROUNDS; round++) {
+      uint64_t before = memoryStats.total.allocations;
+      double start = now();
+      if (interpretChunk(&chunk) != INTERPRET_OK) {
+        fprintf(stderr, "Benchmark %s failed.\n", concatBenchmarks[i].name);
+        exit(70);
+      }
+      double seconds = now() - start;
+      allocations = memoryStats.total.allocations - before;
+      if (round == 0 || seconds < best)
+        best = seconds;
+    }
+
+    Value result;
+    tableGet(&vm.globals, resultName, &result);
+    bool right = IS_ANY_STRING(result) &&
+                 STRING_LENGTH(result) == (int)strlen(expected) &&
+                 memcmp(STRING_CHARS(result), expected, strlen(expected)) == 0;
+    printf("  %-20s %6.1f ns/line, %4.1f allocations/line%s\n",
+           concatBenchmarks[i].name, best * 1e9 / CONCAT_LINES,
+           (double)allocations / CONCAT_LINES, right ? "" : " (wrong result)");
+    freeChunk(&chunk);
+  }
+  freeVM();
+}
+
+bool runBenchmark(const char *name) {
+  if (strcmp(name, "scan") == 0) {
+    benchScanner();
+    return true;
+  }
+  if (strcmp(name, "vm") == 0) {
+    benchVM();
+    return true;
+  }
+  if (strcmp(name, "batch") == 0) {
+    benchBatch();
+    return true;
+  }
+  if (strcmp(name, "calls") == 0) {
+    benchCalls();
+    return true;
+  }
+  if (strcmp(name, "props") == 0) {
+    benchProperties();
+    return true;
+  }
+  if (strcmp(name, "concat") == 0) {
+    benchConcat();
+    return true;
+  }
+  return false;
+}
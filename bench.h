@@ -0,0 +1,10 @@
+#ifndef rotlang_bench_h
+#define rotlang_bench_h
+
+#include "common.h"
+
+// Runs the named in-process benchmark and prints its results to stdout.
+// Returns false if no benchmark has that name.
+bool runBenchmark(const char *name);
+
+#endif
@@ -12,6 +12,15 @@ void initChunk(Chunk *chunk)
     chunk->linesCount = 0;
     chunk->linesCapacity = 0;
     initValueArray(&chunk->constants);
+    chunk->loops = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->arity = -1;
+    chunk->maxStackDepth = 0;
+    chunk->verified = false;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line)
@@ -20,30 +29,324 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = INCREASE_CAPACITY(oldCapacity);
-        chunk->code = INCREASE_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = INCREASE_ARRAY(Line, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = INCREASE_ARRAY_AS(MEM_CHUNK, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
     chunk->count++;
-    // chunk->lines[chunk->count] = line;
-    if (chunk->linesCount == 0 || (chunk->lines[chunk->linesCount - 1].lineNumber == line))
+    chunk->verified = false;
+
+    // Lines are run-length encoded: extend the last run or start a new one.
+    if (chunk->linesCount > 0 && chunk->lines[chunk->linesCount - 1].lineNumber == line)
     {
-        if (chunk->linesCount + 1 > chunk->linesCapacity)
-        {
-            int oldCapacity = chunk->linesCapacity;
-            chunk->linesCapacity = INCREASE_CAPACITY(oldCapacity);
-            chunk->lines = INCREASE_ARRAY(Line, chunk->lines, oldCapacity, chunk->linesCapacity);
-            Line newLine;
-            newLine.lineNumber = line;
-            newLine.runLength = 1;
-            chunk->lines[chunk->linesCount++] = newLine;
-        }
+        chunk->lines[chunk->linesCount - 1].runLength++;
+        return;
     }
-    else
+
+    if (chunk->linesCount + 1 > chunk->linesCapacity)
     {
-        chunk->lines[chunk->linesCount - 1].runLength++;
+        int oldCapacity = chunk->linesCapacity;
+        chunk->linesCapacity = INCREASE_CAPACITY(oldCapacity);
+        chunk->lines = INCREASE_ARRAY_AS(MEM_CHUNK, Line, chunk->lines, oldCapacity, chunk->linesCapacity);
+    }
+    Line newLine;
+    newLine.lineNumber = line;
+    newLine.runLength = 1;
+    chunk->lines[chunk->linesCount++] = newLine;
+}
+
+int getLine(Chunk *chunk, int offset)
+{
+    for (int i = 0; i < chunk->linesCount; i++)
+    {
+        offset -= chunk->lines[i].runLength;
+        if (offset < 0)
+            return chunk->lines[i].lineNumber;
+    }
+    return -1;
+}
+
+int instructionLength(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_POPN:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_ARRAY:
+    case OP_MAP:
+    case OP_CONCAT_N:
+    case OP_INTERPOLATE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_CONSTANT_ADD:
+    case OP_CONSTANT_SUBTRACT:
+    case OP_CONSTANT_MULTIPLY:
+    case OP_CONSTANT_DIVIDE:
+    case OP_CONSTANT_LESS:
+    case OP_CONSTANT_GREATER:
+        return 2;
+    case OP_DEFINE_GLOBAL_CONSTANT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS_II:
+    case OP_JUMP_IF_NOT_LESS_II:
+    case OP_JUMP_IF_GREATER_II:
+    case OP_JUMP_IF_NOT_GREATER_II:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_SUPER_INVOKE:
+        return 3;
+    case OP_LOOP:
+    case OP_INVOKE:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+int jumpTarget(Chunk *chunk, int offset)
+{
+    uint8_t op = chunk->code[offset];
+    // Forward jumps count from the end of the instruction; OP_LOOP jumps
+    // back by its second and third operand bytes.
+    if (op == OP_LOOP)
+        return offset + 4 -
+               ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    if (op != OP_JUMP && op != OP_JUMP_IF_FALSE &&
+        (op < OP_JUMP_IF_EQUAL || op > OP_JUMP_IF_NOT_GREATER_II))
+        return -1;
+    return offset + 3 + ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+int stackEffect(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_ARRAY:
+    case OP_MAP:
+    case OP_CLASS:
+    case OP_CONCAT_N:
+    case OP_INTERPOLATE:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_ARRAY_APPEND:
+    case OP_GET_INDEX:
+    case OP_MAP_MERGE:
+    case OP_IN:
+    case OP_DELETE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_NOT_EQUAL:
+    case OP_NOT_LESS:
+    case OP_NOT_GREATER:
+    case OP_ADD_II:
+    case OP_SUBTRACT_II:
+    case OP_MULTIPLY_II:
+    case OP_DIVIDE_II:
+    case OP_LESS_II:
+    case OP_GREATER_II:
+    case OP_ADD_DD:
+    case OP_SUBTRACT_DD:
+    case OP_MULTIPLY_DD:
+    case OP_DIVIDE_DD:
+    case OP_LESS_DD:
+    case OP_GREATER_DD:
+    case OP_CONCAT_SS:
+    case OP_JUMP_IF_FALSE:
+    case OP_TAIL_CALL:
+    case OP_RETURN:
+    case OP_METHOD:
+    case OP_SET_PROPERTY:
+        return -1;
+    case OP_SET_INDEX:
+    case OP_MAP_INSERT:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS_II:
+    case OP_JUMP_IF_NOT_LESS_II:
+    case OP_JUMP_IF_GREATER_II:
+    case OP_JUMP_IF_NOT_GREATER_II:
+    case OP_INHERIT:
+        return -2;
+    default:
+        return 0;
+    }
+}
+
+int maxStackDepth(Chunk *chunk)
+{
+    int depth = chunk->arity >= 0 ? chunk->arity + 1 : 0;
+    int max = depth;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = chunk->code[offset];
+        // Superinstructions carrying a constant push it for a moment first.
+        if ((fusedConstantOperation(op) >= 0 ||
+             op == OP_DEFINE_GLOBAL_CONSTANT) &&
+            depth + 1 > max)
+            max = depth + 1;
+        depth += stackEffect(op);
+        if (argumentCountOperand(op) > 0)
+            depth -= chunk->code[offset + argumentCountOperand(op)];
+        if (op == OP_POPN || op == OP_CONCAT_N || op == OP_INTERPOLATE)
+            depth -= chunk->code[offset + 1];
+        if (depth > max)
+            max = depth;
+        offset += instructionLength(op);
     }
+    return max;
+}
+
+int argumentCountOperand(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return 1;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+int fusedConstantOperation(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT_ADD:
+        return OP_ADD;
+    case OP_CONSTANT_SUBTRACT:
+        return OP_SUBTRACT;
+    case OP_CONSTANT_MULTIPLY:
+        return OP_MULTIPLY;
+    case OP_CONSTANT_DIVIDE:
+        return OP_DIVIDE;
+    case OP_CONSTANT_LESS:
+        return OP_LESS;
+    case OP_CONSTANT_GREATER:
+        return OP_GREATER;
+    default:
+        return -1;
+    }
+}
+
+uint8_t typedOpcode(uint8_t op, StaticType left, StaticType right)
+{
+    if (op == OP_NEGATE)
+    {
+        if (left == TYPE_INT)
+            return OP_NEGATE_I;
+        if (left == TYPE_DOUBLE)
+            return OP_NEGATE_D;
+        return op;
+    }
+    if (op == OP_ADD && left == TYPE_STRING && right == TYPE_STRING)
+        return OP_CONCAT_SS;
+    // Branches only have int forms, in the same order as the generic ones.
+    if (op >= OP_JUMP_IF_LESS && op <= OP_JUMP_IF_NOT_GREATER)
+        return left == TYPE_INT && right == TYPE_INT
+                   ? op - OP_JUMP_IF_LESS + OP_JUMP_IF_LESS_II
+                   : op;
+    if (left != right || (left != TYPE_INT && left != TYPE_DOUBLE))
+        return op;
+
+    // The _II and _DD blocks list the same operations in the same order.
+    int base = left == TYPE_INT ? OP_ADD_II : OP_ADD_DD;
+    switch (op)
+    {
+    case OP_ADD:
+        return base;
+    case OP_SUBTRACT:
+        return base + 1;
+    case OP_MULTIPLY:
+        return base + 2;
+    case OP_DIVIDE:
+        return base + 3;
+    case OP_LESS:
+        return base + 4;
+    case OP_GREATER:
+        return base + 5;
+    default:
+        return op;
+    }
+}
+
+uint8_t genericOpcode(uint8_t op)
+{
+    static const uint8_t generic[] = {OP_ADD, OP_SUBTRACT, OP_MULTIPLY,
+                                      OP_DIVIDE, OP_LESS, OP_GREATER};
+    if (op >= OP_ADD_II && op <= OP_GREATER_II)
+        return generic[op - OP_ADD_II];
+    if (op >= OP_ADD_DD && op <= OP_GREATER_DD)
+        return generic[op - OP_ADD_DD];
+    if (op >= OP_JUMP_IF_LESS_II && op <= OP_JUMP_IF_NOT_GREATER_II)
+        return op - OP_JUMP_IF_LESS_II + OP_JUMP_IF_LESS;
+    switch (op)
+    {
+    case OP_NEGATE_I:
+    case OP_NEGATE_D:
+        return OP_NEGATE;
+    case OP_CONCAT_SS:
+        return OP_ADD;
+    default:
+        return op;
+    }
+}
+
+StaticType constantType(Value value)
+{
+    switch (value.type)
+    {
+    case VAL_NIL:
+        return TYPE_NIL;
+    case VAL_BOOL:
+        return TYPE_BOOL;
+    case VAL_INT:
+        return TYPE_INT;
+    case VAL_DOUBLE:
+        return TYPE_DOUBLE;
+    case VAL_OBJ:
+        return IS_STRING(value) ? TYPE_STRING : TYPE_UNKNOWN;
+    case VAL_SHORT_STRING:
+    case VAL_STRING_VIEW:
+        return TYPE_STRING;
+    }
+    return TYPE_UNKNOWN;
 }
 
 int addConstant(Chunk *chunk, Value value)
@@ -52,10 +355,63 @@ int addConstant(Chunk *chunk, Value value)
     return chunk->constants.count - 1;
 }
 
+int addLoop(Chunk *chunk, int header)
+{
+    if (chunk->loopCount + 1 > chunk->loopCapacity)
+    {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = INCREASE_CAPACITY(oldCapacity);
+        chunk->loops = INCREASE_ARRAY_AS(MEM_CHUNK, LoopCounter, chunk->loops, oldCapacity, chunk->loopCapacity);
+    }
+    chunk->loops[chunk->loopCount].header = header;
+    chunk->loops[chunk->loopCount].iterations = 0;
+    return chunk->loopCount++;
+}
+
+int addCache(Chunk *chunk, int offset)
+{
+    if (chunk->cacheCount + 1 > chunk->cacheCapacity)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = INCREASE_CAPACITY(oldCapacity);
+        chunk->caches = INCREASE_ARRAY_AS(MEM_CHUNK, PropertyCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    chunk->caches[chunk->cacheCount].offset = offset;
+    chunk->caches[chunk->cacheCount].count = 0;
+    for (int i = 0; i < PROPERTY_CACHE_ENTRIES; i++)
+        chunk->caches[chunk->cacheCount].entries[i].shape = NULL;
+    return chunk->cacheCount++;
+}
+
+void truncateChunk(Chunk *chunk, int count, int constantCount)
+{
+    int kept = 0;
+    for (int i = 0; i < chunk->linesCount && kept < count; i++)
+    {
+        if (kept + chunk->lines[i].runLength >= count)
+        {
+            chunk->lines[i].runLength = count - kept;
+            chunk->linesCount = i + 1;
+        }
+        kept += chunk->lines[i].runLength;
+    }
+    if (count == 0)
+        chunk->linesCount = 0;
+    chunk->count = count;
+    chunk->constants.count = constantCount;
+    while (chunk->loopCount > 0 && chunk->loops[chunk->loopCount - 1].header >= count)
+        chunk->loopCount--;
+    while (chunk->cacheCount > 0 && chunk->caches[chunk->cacheCount - 1].offset >= count)
+        chunk->cacheCount--;
+    chunk->verified = false;
+}
+
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY_AS(MEM_CHUNK, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY_AS(MEM_CHUNK, Line, chunk->lines, chunk->linesCapacity);
+    FREE_ARRAY_AS(MEM_CHUNK, LoopCounter, chunk->loops, chunk->loopCapacity);
+    FREE_ARRAY_AS(MEM_CHUNK, PropertyCache, chunk->caches, chunk->cacheCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
-}
\ No newline at end of file
+}
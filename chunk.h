@@ -10,7 +10,29 @@ typedef enum {
   OP_TRUE,
   OP_FALSE,
   OP_POP,
+  OP_POPN,
+  OP_DUP,
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
   OP_DEFINE_GLOBAL,
+  OP_GET_GLOBAL,
+  OP_SET_GLOBAL,
+  OP_ARRAY,
+  OP_ARRAY_APPEND,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  OP_MAP,
+  OP_MAP_INSERT,
+  OP_MAP_MERGE,
+  OP_IN,
+  OP_DELETE,
+  OP_SIZE,
+  OP_CALL,
+  // `crashout f(...)`: calls f in place of the function returning.
+  OP_TAIL_CALL,
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_LOOP,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -18,17 +40,119 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  // `a + b + c ...` with a string among the first two operands: joins as
+  // many values as its operand says into one string. OP_INTERPOLATE does
+  // the same for the pieces of an interpolated string literal, formatting
+  // numbers, bools and nil the way str() does.
+  OP_CONCAT_N,
+  OP_INTERPOLATE,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
   OP_RETURN,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  // The property instructions take the index of their PropertyCache in the
+  // chunk as their last operand.
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  // `receiver.name(...)`: calls a method without binding it first.
+  OP_INVOKE,
+  OP_GET_SUPER,
+  OP_SUPER_INVOKE,
+  // Superinstructions: fused forms of the most frequent opcode pairs seen
+  // by --profile-ops. Each behaves exactly like the pair it replaces.
+  OP_CONSTANT_ADD,           // OP_CONSTANT k, OP_ADD
+  OP_CONSTANT_SUBTRACT,      // OP_CONSTANT k, OP_SUBTRACT
+  OP_CONSTANT_MULTIPLY,      // OP_CONSTANT k, OP_MULTIPLY
+  OP_CONSTANT_DIVIDE,        // OP_CONSTANT k, OP_DIVIDE
+  OP_CONSTANT_LESS,          // OP_CONSTANT k, OP_LESS
+  OP_CONSTANT_GREATER,       // OP_CONSTANT k, OP_GREATER
+  OP_DEFINE_GLOBAL_CONSTANT, // OP_CONSTANT k, OP_DEFINE_GLOBAL name
+  OP_NOT_EQUAL,              // OP_EQUAL, OP_NOT
+  OP_NOT_LESS,               // OP_LESS, OP_NOT
+  OP_NOT_GREATER,            // OP_GREATER, OP_NOT
+  // Typed forms, emitted only where the compiler has proven the operand
+  // types. They skip the VM's type checks entirely.
+  OP_ADD_II,
+  OP_SUBTRACT_II,
+  OP_MULTIPLY_II,
+  OP_DIVIDE_II,
+  OP_LESS_II,
+  OP_GREATER_II,
+  OP_ADD_DD,
+  OP_SUBTRACT_DD,
+  OP_MULTIPLY_DD,
+  OP_DIVIDE_DD,
+  OP_LESS_DD,
+  OP_GREATER_DD,
+  OP_NEGATE_I,
+  OP_NEGATE_D,
+  OP_CONCAT_SS,
+  // Compare-and-branch: each pops two operands and jumps if the comparison
+  // in its name holds. `if (a < b)` skips its then branch with
+  // OP_JUMP_IF_NOT_LESS instead of OP_LESS, OP_JUMP_IF_FALSE, so no bool is
+  // ever pushed. The _II forms are for operands proven to be ints.
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_GREATER,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_LESS_II,
+  OP_JUMP_IF_NOT_LESS_II,
+  OP_JUMP_IF_GREATER_II,
+  OP_JUMP_IF_NOT_GREATER_II,
 } OpCode;
 
+// What the compiler can prove about a value before running the code.
+typedef enum {
+  TYPE_UNKNOWN,
+  TYPE_NIL,
+  TYPE_BOOL,
+  TYPE_INT,
+  TYPE_DOUBLE,
+  TYPE_STRING,
+  TYPE_ARRAY,
+  TYPE_MAP,
+} StaticType;
+
 typedef struct {
   int lineNumber;
   int runLength;
 } Line;
 
+// Counts the times a loop's back edge is taken: how hot the loop is, for
+// --profile-ops to report and for a tiering engine to pick what to compile.
+typedef struct {
+  int header; // Offset of the loop's first instruction.
+  uint64_t iterations;
+} LoopCounter;
+
+// Inline caches: where a property instruction found its property on the
+// shapes it has seen, so that the next instance of one of those shapes needs
+// one compare and an indexed load. A site that has seen more shapes than
+// there are entries keeps the first ones and looks the rest up.
+#define PROPERTY_CACHE_ENTRIES 4
+
+typedef struct {
+  Shape *shape;
+  // The index of the field holding the property, or -1 for a method of the
+  // shape's class.
+  int field;
+  // OP_SET_PROPERTY on an instance without the field: the shape it moves
+  // to once the field is added at index `field`. NULL otherwise.
+  Shape *transition;
+  Value method;
+} CacheEntry;
+
+typedef struct {
+  int offset; // Offset of the instruction using the cache.
+  int count;
+  CacheEntry entries[PROPERTY_CACHE_ENTRIES];
+} PropertyCache;
+
 typedef struct {
   int count;
   int capacity;
@@ -39,10 +163,66 @@ typedef struct {
   int linesCapacity;
 
   ValueArray constants;
+  // Indexed by OP_LOOP's first operand.
+  LoopCounter *loops;
+  int loopCount;
+  int loopCapacity;
+  // Indexed by the last operand of the property instructions.
+  PropertyCache *caches;
+  int cacheCount;
+  int cacheCapacity;
+  // The number of arguments a function's chunk finds in the slots after
+  // slot 0, which holds the function or a method's receiver, or -1 for a
+  // top-level chunk, which starts on an empty stack.
+  int arity;
+  // The most values run() can have on the stack at once while executing
+  // this chunk, slot 0 and arguments included, computed by the compiler so
+  // the VM can reserve it up front.
+  int maxStackDepth;
+  // Set once verifyChunk() has accepted the code; any write clears it.
+  bool verified;
 } Chunk;
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+// Adds a back-edge counter for the loop starting at `header` and returns its
+// index.
+int addLoop(Chunk *chunk, int header);
+// Adds an empty inline cache for the instruction at `offset` and returns its
+// index.
+int addCache(Chunk *chunk, int offset);
+// Drops the code from `count` on, the constants from `constantCount` on and
+// the loops and caches of the dropped code.
+void truncateChunk(Chunk *chunk, int count, int constantCount);
+int getLine(Chunk *chunk, int offset);
+// Size in bytes of an instruction, opcode included.
+int instructionLength(uint8_t op);
+// Where the jump, branch or loop instruction at `offset` goes, or -1 if the
+// instruction doesn't jump.
+int jumpTarget(Chunk *chunk, int offset);
+// Net number of values an instruction pushes (negative if it pops). The
+// call instructions also pop as many arguments as their argument count
+// operand says, and OP_POPN and the concatenations as many values; this
+// doesn't count them.
+// OP_RETURN pops the value a function returns; the one ending a top-level
+// chunk has none, but nothing runs after it.
+int stackEffect(uint8_t op);
+// Walks the finished chunk tracking how many values each instruction leaves
+// on the stack. Control flow is structured: every jump lands where the
+// stack is as deep as at the jump, so one pass in order sees every depth.
+int maxStackDepth(Chunk *chunk);
+// Where the argument count of a call instruction is, counting from the
+// opcode, or 0 if `op` isn't a call.
+int argumentCountOperand(uint8_t op);
+// The binary opcode a fused OP_CONSTANT_* instruction applies, or -1.
+int fusedConstantOperation(uint8_t op);
+// The typed form of a generic binary or unary opcode for operands of the
+// given types (pass TYPE_UNKNOWN as `right` for unary ones), or `op`
+// itself when there is none.
+uint8_t typedOpcode(uint8_t op, StaticType left, StaticType right);
+// The generic opcode a typed one specializes, or `op` itself.
+uint8_t genericOpcode(uint8_t op);
+StaticType constantType(Value value);
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 
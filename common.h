@@ -5,8 +5,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
+#define UINT8_COUNT (UINT8_MAX + 1)
 
-#define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_CODE
+
+// #define DEBUG_TRACE_EXECUTION
 
 #endif
\ No newline at end of file
@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -23,15 +26,15 @@ typedef enum {
   PREC_OR,         // or
   PREC_AND,        // and
   PREC_EQUALITY,   // == !=
-  PREC_COMPARISON, // < > <= >=
+  PREC_COMPARISON, // < > <= >= in
   PREC_TERM,       // + -
   PREC_FACTOR,     // * /
-  PREC_UNARY,      // ! -
-  PREC_CALL,       // . ()
+  PREC_UNARY,      // ! - #
+  PREC_CALL,       // . () []
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -39,8 +42,41 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
+typedef struct {
+  Token name;
+  // Depth of the block declaring it, or -1 while its initializer is being
+  // compiled.
+  int depth;
+  // What the local holds at this point in the code. Each assignment
+  // replaces it; where paths meet it's kept only if they all agree.
+  StaticType type;
+} Local;
+
+// Locals sit in stack slots in the order they're declared, so each one's
+// slot is its index in `locals`. A function's slot 0 holds the function
+// itself, or the receiver `ts` names in a method, and its parameters come
+// next.
+typedef struct Compiler {
+  struct Compiler *enclosing;
+  // The function being compiled, or NULL for the top-level chunk.
+  ObjFunction *function;
+  Chunk *chunk;
+  Local locals[UINT8_COUNT];
+  int localCount;
+  int scopeDepth;
+} Compiler;
+
+// The static types of every local at some point in the code, kept to merge
+// with those of another path to the same place.
+typedef struct {
+  StaticType types[UINT8_COUNT];
+} LocalTypes;
+
 Parser parser;
-Chunk *compilingChunk;
+Compiler *current = NULL;
+int optimizationLevel = 0;
+
+void setOptimizationLevel(int level) { optimizationLevel = level; }
 
 static void errorAt(Token *token, const char *message) {
   if (parser.panicMode)
@@ -60,7 +96,7 @@ static void errorAt(Token *token, const char *message) {
   parser.hadError = true;
 }
 
-static Chunk *currentChunk() { return compilingChunk; }
+static Chunk *currentChunk() { return current->chunk; }
 
 static void errorAtCurrent(const char *message) {
   errorAt(&parser.current, message);
@@ -107,7 +143,26 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
-static void emitReturn() { emitByte(OP_RETURN); }
+// Falling off the end of a function returns nil, and of an initializer the
+// instance.
+static void emitReturn() {
+  if (current->function != NULL &&
+      current->function->kind == FUNCTION_INITIALIZER)
+    emitBytes(OP_GET_LOCAL, 0);
+  else if (current->function != NULL)
+    emitByte(OP_NIL);
+  emitByte(OP_RETURN);
+}
+
+// Adds an inline cache for the property instruction at `offset`.
+static uint8_t makeCache(int offset) {
+  int cache = addCache(currentChunk(), offset);
+  if (cache > UINT8_MAX) {
+    error("Too many property accesses in one chunk.");
+    return 0;
+  }
+  return (uint8_t)cache;
+}
 
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
@@ -119,101 +174,607 @@ static uint8_t makeConstant(Value value) {
   return (uint8_t)constant;
 }
 
+// Offset of the last OP_CONSTANT emitted, so that an instruction consuming
+// the constant right away can be fused with it into a superinstruction.
+static int lastConstant = -1;
+
 static void emitConstant(Value value) {
   emitBytes(OP_CONSTANT, makeConstant(value));
+  lastConstant = currentChunk()->count - 2;
+}
+
+static bool endsWithConstant() {
+  return lastConstant >= 0 && lastConstant == currentChunk()->count - 2;
+}
+
+// Static type of the expression compiled last. Every prefix and infix rule
+// sets it, so binary() and unary() know their operands' types when they
+// emit the operator. TYPE_UNKNOWN whenever the value isn't proven.
+static StaticType expressionType = TYPE_UNKNOWN;
+
+// Emits a binary operation and returns its offset. If its right operand was
+// a lone constant, the OP_CONSTANT is rewritten in place into the fused
+// form: saving a dispatch beats skipping the type checks. Otherwise proven
+// operand types get the typed opcode.
+static int emitBinaryOp(uint8_t op, uint8_t fused, StaticType left,
+                        StaticType right) {
+  if (endsWithConstant()) {
+    int offset = lastConstant;
+    currentChunk()->code[offset] = fused;
+    lastConstant = -1;
+    return offset;
+  }
+  emitByte(typedOpcode(op, left, right));
+  return currentChunk()->count - 1;
+}
+
+// The last comparison compiled, so that a conditional jump right after it
+// can take its place as one compare-and-branch instruction. `end` is -1
+// once anything else was emitted in between.
+static struct {
+  int start;
+  int end;
+  uint8_t op; // The generic comparison.
+  StaticType left;
+  StaticType right;
+} lastComparison = {-1, -1, OP_EQUAL, TYPE_UNKNOWN, TYPE_UNKNOWN};
+
+static void compared(uint8_t op, int start, StaticType left,
+                     StaticType right) {
+  lastComparison.start = start;
+  lastComparison.end = currentChunk()->count;
+  lastComparison.op = op;
+  lastComparison.left = left;
+  lastComparison.right = right;
+}
+
+// The branch taken when comparison `op` doesn't hold.
+static uint8_t branchUnless(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return OP_JUMP_IF_NOT_EQUAL;
+  case OP_NOT_EQUAL:
+    return OP_JUMP_IF_EQUAL;
+  case OP_LESS:
+    return OP_JUMP_IF_NOT_LESS;
+  case OP_NOT_LESS:
+    return OP_JUMP_IF_LESS;
+  case OP_GREATER:
+    return OP_JUMP_IF_NOT_GREATER;
+  default:
+    return OP_JUMP_IF_GREATER;
+  }
+}
+
+// Emits a forward jump and returns the offset of its operand, which
+// patchJump() fills in once the target is known.
+static int emitJump(uint8_t instruction) {
+  emitByte(instruction);
+  emitByte(0xff);
+  emitByte(0xff);
+  return currentChunk()->count - 2;
+}
+
+// Emits the jump taken when the condition just compiled is falsey. If the
+// condition was a comparison, the two become a single branch on the
+// comparison's operands.
+static int emitJumpIfFalse() {
+  Chunk *chunk = currentChunk();
+  if (lastComparison.end != chunk->count)
+    return emitJump(OP_JUMP_IF_FALSE);
+
+  uint8_t branch = typedOpcode(branchUnless(lastComparison.op),
+                               lastComparison.left, lastComparison.right);
+  lastComparison.end = -1;
+  if (lastComparison.start == chunk->count - 2) {
+    // A comparison fused with its constant operand: push the constant and
+    // branch on that instead.
+    chunk->code[lastComparison.start] = OP_CONSTANT;
+    return emitJump(branch);
+  }
+  chunk->code[chunk->count - 1] = branch;
+  emitByte(0xff);
+  emitByte(0xff);
+  return chunk->count - 2;
+}
+
+// Offset of the last OP_GET_INDEX emitted, so `yeet` can turn the
+// subscript it just compiled into a deletion.
+static int lastIndex = -1;
+
+// Offset of the last OP_CALL emitted, so that `crashout` can turn a call
+// it returns the result of into a tail call.
+static int lastCall = -1;
+
+// Points the jump whose operand is at `offset` to the next instruction. Code
+// there is reached from two places now, so nothing compiled before it may
+// be fused with what comes after.
+static void patchJump(int offset) {
+  int jump = currentChunk()->count - offset - 2;
+  if (jump > UINT16_MAX)
+    error("Too much code to jump over.");
+  currentChunk()->code[offset] = (jump >> 8) & 0xff;
+  currentChunk()->code[offset + 1] = jump & 0xff;
+  lastConstant = -1;
+  lastIndex = -1;
+  lastCall = -1;
+  lastComparison.end = -1;
+}
+
+// Jumps back to `loopStart`, counting the iteration in a counter of its own.
+static void emitLoop(int loopStart) {
+  int loop = addLoop(currentChunk(), loopStart);
+  if (loop > UINT8_MAX)
+    error("Too many loops in one chunk.");
+  emitBytes(OP_LOOP, (uint8_t)loop);
+
+  int offset = currentChunk()->count - loopStart + 2;
+  if (offset > UINT16_MAX)
+    error("Loop body too large.");
+  emitByte((offset >> 8) & 0xff);
+  emitByte(offset & 0xff);
+}
+
+static void saveLocalTypes(LocalTypes *saved) {
+  for (int i = 0; i < current->localCount; i++)
+    saved->types[i] = current->locals[i].type;
+}
+
+static void restoreLocalTypes(LocalTypes *saved) {
+  for (int i = 0; i < current->localCount; i++)
+    current->locals[i].type = saved->types[i];
+}
+
+// Where another path with the locals typed as in `other` joins this one.
+static void mergeLocalTypes(LocalTypes *other) {
+  for (int i = 0; i < current->localCount; i++) {
+    if (current->locals[i].type != other->types[i])
+      current->locals[i].type = TYPE_UNKNOWN;
+  }
+}
+
+static void initCompiler(Compiler *compiler, ObjFunction *function,
+                         Chunk *chunk) {
+  compiler->enclosing = current;
+  compiler->function = function;
+  compiler->chunk = chunk;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  if (function != NULL) {
+    Local *local = &compiler->locals[compiler->localCount++];
+    local->name.start = function->kind == FUNCTION_PLAIN ? "" : "ts";
+    local->name.length = function->kind == FUNCTION_PLAIN ? 0 : 2;
+    local->depth = 0;
+    local->type = TYPE_UNKNOWN;
+  }
+  current = compiler;
+  lastConstant = -1;
+  lastIndex = -1;
+  lastCall = -1;
+  lastComparison.end = -1;
 }
 
 static void endCompiler() {
   emitReturn();
-#ifdef DEBUG_PRINT_CODE if (!parser.hadError) {
-  disassembleChunk(currentChunk(), "code");
+  if (optimizationLevel >= 2 && !parser.hadError)
+    optimizeChunk(currentChunk());
+  currentChunk()->maxStackDepth = maxStackDepth(currentChunk());
+#ifdef DEBUG_PRINT_CODE
+  if (!parser.hadError) {
+    char name[64] = "code";
+    if (current->function != NULL) {
+      Value function = current->function->name;
+      snprintf(name, sizeof(name), "%.*s", STRING_LENGTH(function),
+               STRING_CHARS(function));
+    }
+    disassembleChunk(currentChunk(), name);
+  }
+#endif
+  current = current->enclosing;
+  // Nothing the enclosing chunk emitted before can fuse with what follows.
+  if (current != NULL) {
+    lastConstant = -1;
+    lastIndex = -1;
+    lastCall = -1;
+    lastComparison.end = -1;
+  }
 }
-#endif }
 
 static void expression();
 static void statement();
 static void declaration();
 static ParseRule *getRule(TokenType type);
+static uint8_t identifierConstant(Token *name);
 static void parsePrecedence(Precedence precedence);
 
-static void binary() {
+// The type a typed opcode produces; generic arithmetic stays unknown.
+static StaticType resultType(uint8_t op) {
+  if (op >= OP_ADD_II && op <= OP_DIVIDE_II)
+    return TYPE_INT;
+  if (op >= OP_ADD_DD && op <= OP_DIVIDE_DD)
+    return TYPE_DOUBLE;
+  if (op == OP_CONCAT_SS)
+    return TYPE_STRING;
+  return TYPE_UNKNOWN;
+}
+
+// The rest of `a + b + c ...` once a or b is known to be a string: every
+// step of the chain then adds strings or fails, so the operands are all
+// pushed and joined by one OP_CONCAT_N instead of making a string per `+`.
+static void concatenation() {
+  int count = 2;
+  while (match(TOKEN_PLUS)) {
+    if (count == UINT8_MAX) {
+      emitBytes(OP_CONCAT_N, (uint8_t)count);
+      count = 1;
+    }
+    parsePrecedence((Precedence)(PREC_TERM + 1));
+    count++;
+  }
+  emitBytes(OP_CONCAT_N, (uint8_t)count);
+  expressionType = TYPE_STRING;
+}
+
+static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+  StaticType left = expressionType;
   parsePrecedence((Precedence)(rule->precedence + 1));
+  StaticType right = expressionType;
 
+  // Comparisons yield a bool whenever they don't fail at run time.
+  expressionType = TYPE_BOOL;
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    emitByte(OP_NOT_EQUAL);
+    compared(OP_NOT_EQUAL, currentChunk()->count - 1, left, right);
     break;
   case TOKEN_EQUAL_EQUAL:
     emitByte(OP_EQUAL);
+    compared(OP_EQUAL, currentChunk()->count - 1, left, right);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    compared(OP_GREATER,
+             emitBinaryOp(OP_GREATER, OP_CONSTANT_GREATER, left, right), left,
+             right);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    emitByte(OP_NOT_LESS);
+    compared(OP_NOT_LESS, currentChunk()->count - 1, left, right);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    compared(OP_LESS, emitBinaryOp(OP_LESS, OP_CONSTANT_LESS, left, right),
+             left, right);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    emitByte(OP_NOT_GREATER);
+    compared(OP_NOT_GREATER, currentChunk()->count - 1, left, right);
     break;
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    if ((left == TYPE_STRING || right == TYPE_STRING) && check(TOKEN_PLUS)) {
+      concatenation();
+      break;
+    }
+    emitBinaryOp(OP_ADD, OP_CONSTANT_ADD, left, right);
+    expressionType = resultType(typedOpcode(OP_ADD, left, right));
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    emitBinaryOp(OP_SUBTRACT, OP_CONSTANT_SUBTRACT, left, right);
+    expressionType = resultType(typedOpcode(OP_SUBTRACT, left, right));
     break;
   case TOKEN_STAR:
-    emitByte(OP_MULTIPLY);
+    emitBinaryOp(OP_MULTIPLY, OP_CONSTANT_MULTIPLY, left, right);
+    expressionType = resultType(typedOpcode(OP_MULTIPLY, left, right));
     break;
   case TOKEN_SLASH:
-    emitByte(OP_DIVIDE);
+    emitBinaryOp(OP_DIVIDE, OP_CONSTANT_DIVIDE, left, right);
+    expressionType = resultType(typedOpcode(OP_DIVIDE, left, right));
+    break;
+  case TOKEN_IN:
+    emitByte(OP_IN);
     break;
   default:
     return; // Unreachable.
   }
 }
 
-static void literal() {
+// `a and b`: a falsey `a` is the result, and `b` isn't evaluated.
+static void and_(bool canAssign) {
+  StaticType left = expressionType;
+  LocalTypes skipped;
+  saveLocalTypes(&skipped);
+  emitByte(OP_DUP);
+  int endJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_AND);
+  patchJump(endJump);
+  mergeLocalTypes(&skipped);
+  if (expressionType != left)
+    expressionType = TYPE_UNKNOWN;
+}
+
+// `a or b`: a truthy `a` is the result, and `b` isn't evaluated.
+static void or_(bool canAssign) {
+  StaticType left = expressionType;
+  LocalTypes skipped;
+  saveLocalTypes(&skipped);
+  emitByte(OP_DUP);
+  int elseJump = emitJump(OP_JUMP_IF_FALSE);
+  int endJump = emitJump(OP_JUMP);
+  patchJump(elseJump);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_OR);
+  patchJump(endJump);
+  mergeLocalTypes(&skipped);
+  if (expressionType != left)
+    expressionType = TYPE_UNKNOWN;
+}
+
+static void literal(bool canAssign) {
   switch (parser.previous.type) {
   case TOKEN_FALSE:
     emitByte(OP_FALSE);
+    expressionType = TYPE_BOOL;
     break;
   case TOKEN_NIL:
     emitByte(OP_NIL);
+    expressionType = TYPE_NIL;
     break;
   case TOKEN_TRUE:
     emitByte(OP_TRUE);
+    expressionType = TYPE_BOOL;
     break;
   default:
     return; // Unreachable.
   }
 }
 
-static void grouping() {
+static void grouping(bool canAssign) {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void doubleNumber() {
+static void doubleNumber(bool canAssign) {
   double value = strtod(parser.previous.start, NULL);
   emitConstant(DOUBLE_VAL(value));
+  expressionType = TYPE_DOUBLE;
 }
 
-static void intNumber() {
+static void intNumber(bool canAssign) {
   double value = strtol(parser.previous.start, NULL, 10);
   emitConstant(INT_VAL(value));
+  expressionType = TYPE_INT;
+}
+
+static void string(bool canAssign) {
+  emitConstant(
+      makeString(parser.previous.start + 1, parser.previous.length - 2));
+  expressionType = TYPE_STRING;
+}
+
+// `"text ${expression} text"`: the scanner hands over the text before each
+// `${` as an interpolation token and the text after the last `}` as a
+// string. The non-empty pieces and the expressions are joined by one
+// OP_INTERPOLATE.
+static void interpolation(bool canAssign) {
+  int count = 0;
+  do {
+    // The piece runs from after the opening '"' or '}' to before the "${".
+    if (parser.previous.length > 3) {
+      emitConstant(
+          makeString(parser.previous.start + 1, parser.previous.length - 3));
+      count++;
+    }
+    expression();
+    count++;
+    if (count >= UINT8_MAX - 1) {
+      emitBytes(OP_INTERPOLATE, (uint8_t)count);
+      count = 1;
+    }
+  } while (match(TOKEN_INTERPOLATION));
+  consume(TOKEN_STRING, "Expect '}' after interpolated expression.");
+  if (parser.previous.length > 2) {
+    emitConstant(
+        makeString(parser.previous.start + 1, parser.previous.length - 2));
+    count++;
+  }
+  emitBytes(OP_INTERPOLATE, (uint8_t)count);
+  expressionType = TYPE_STRING;
+}
+
+static bool identifiersEqual(Token *a, Token *b) {
+  return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+// The slot of the innermost local called `name`, or -1 for a global.
+static int resolveLocal(Compiler *compiler, Token *name) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1)
+        error("Can't read local variable in its own initializer.");
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void namedVariable(Token name, bool canAssign) {
+  int slot = resolveLocal(current, &name);
+  if (canAssign && match(TOKEN_EQUAL)) {
+    // The assignment's value is the expression's, type included.
+    expression();
+    if (slot >= 0) {
+      emitBytes(OP_SET_LOCAL, (uint8_t)slot);
+      current->locals[slot].type = expressionType;
+    } else {
+      emitBytes(OP_SET_GLOBAL, identifierConstant(&name));
+    }
+  } else if (slot >= 0) {
+    emitBytes(OP_GET_LOCAL, (uint8_t)slot);
+    expressionType = current->locals[slot].type;
+  } else {
+    emitBytes(OP_GET_GLOBAL, identifierConstant(&name));
+    expressionType = TYPE_UNKNOWN;
+  }
+}
+
+static void variable(bool canAssign) {
+  namedVariable(parser.previous, canAssign);
+}
+
+// `[a, b, ...]`. The operand of OP_ARRAY is only a capacity hint, so
+// longer literals still work, they just grow while being filled.
+static void arrayLiteral(bool canAssign) {
+  emitBytes(OP_ARRAY, 0);
+  int hint = currentChunk()->count - 1;
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression();
+      emitByte(OP_ARRAY_APPEND);
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+  currentChunk()->code[hint] =
+      (uint8_t)(count < UINT8_MAX ? count : UINT8_MAX);
+  expressionType = TYPE_ARRAY;
+}
+
+// `{k: v, ...m}`: OP_MAP's operand presizes the map for the literal's
+// own entries, and each spread grows it once for the entries it adds.
+static void mapLiteral(bool canAssign) {
+  emitBytes(OP_MAP, 0);
+  int hint = currentChunk()->count - 1;
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      if (match(TOKEN_DOT_DOT_DOT)) {
+        expression();
+        emitByte(OP_MAP_MERGE);
+        continue;
+      }
+      expression();
+      consume(TOKEN_COLON, "Expect ':' after map key.");
+      expression();
+      emitByte(OP_MAP_INSERT);
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  currentChunk()->code[hint] =
+      (uint8_t)(count < UINT8_MAX ? count : UINT8_MAX);
+  expressionType = TYPE_MAP;
+}
+
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
+    lastIndex = currentChunk()->count - 1;
+    expressionType = TYPE_UNKNOWN;
+  }
+}
+
+static uint8_t argumentList() {
+  uint8_t argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      expression();
+      if (argCount == UINT8_MAX)
+        error("Can't have more than 255 arguments.");
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(bool canAssign) {
+  uint8_t argCount = argumentList();
+  emitBytes(OP_CALL, argCount);
+  lastCall = currentChunk()->count - 2;
+  expressionType = TYPE_UNKNOWN;
+}
+
+// `a.b`, `a.b = c` and `a.b(...)`, which calls the method without binding
+// it to `a` first.
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    // The assignment's value is the expression's, type included.
+    expression();
+    int offset = currentChunk()->count;
+    emitBytes(OP_SET_PROPERTY, name);
+    emitByte(makeCache(offset));
+    return;
+  }
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    int offset = currentChunk()->count;
+    emitBytes(OP_INVOKE, name);
+    emitBytes(argCount, makeCache(offset));
+  } else {
+    int offset = currentChunk()->count;
+    emitBytes(OP_GET_PROPERTY, name);
+    emitByte(makeCache(offset));
+  }
+  expressionType = TYPE_UNKNOWN;
+}
+
+static bool inMethod() {
+  return current->function != NULL &&
+         current->function->kind != FUNCTION_PLAIN;
+}
+
+static void this_(bool canAssign) {
+  if (!inMethod()) {
+    error("Can't use 'ts' outside of a method.");
+    return;
+  }
+  variable(false);
+}
+
+// `super.name` and `super.name(...)` look the method up in the superclass
+// of the method's class, and bind or call it with `ts` as the receiver.
+static void super_(bool canAssign) {
+  if (!inMethod())
+    error("Can't use 'super' outside of a method.");
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  emitBytes(OP_GET_LOCAL, 0);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    emitBytes(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+  } else {
+    emitBytes(OP_GET_SUPER, name);
+  }
+  expressionType = TYPE_UNKNOWN;
 }
 
-static void string() {
-  emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+// `yeet m[k]` removes the entry and yields whether there was one.
+static void deletion(bool canAssign) {
+  parsePrecedence(PREC_CALL);
+  if (lastIndex != currentChunk()->count - 1) {
+    error("Expect a subscript after 'yeet'.");
+    return;
+  }
+  currentChunk()->code[lastIndex] = OP_DELETE;
+  lastIndex = -1;
+  expressionType = TYPE_BOOL;
 }
 
-static void unary() {
+static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
 
   // Compile the operand.
@@ -223,22 +784,35 @@ static void unary() {
   switch (operatorType) {
   case TOKEN_BANG:
     emitByte(OP_NOT);
+    expressionType = TYPE_BOOL;
     break;
-  case TOKEN_MINUS:
-    emitByte(OP_NEGATE);
+  case TOKEN_HASH:
+    emitByte(OP_SIZE);
+    expressionType = TYPE_INT;
+    break;
+  case TOKEN_MINUS: {
+    uint8_t op = typedOpcode(OP_NEGATE, expressionType, TYPE_UNKNOWN);
+    emitByte(op);
+    if (op == OP_NEGATE)
+      expressionType = TYPE_UNKNOWN;
     break;
+  }
   default:
     return; // Unreachable.
   }
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {arrayLiteral, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+    [TOKEN_HASH] = {unary, NULL, PREC_NONE},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -252,23 +826,27 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT_DOT_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
+    [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
     [TOKEN_INT] = {intNumber, NULL, PREC_NONE},
     [TOKEN_DOUBLE] = {doubleNumber, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DELETE] = {deletion, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IN] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -284,25 +862,77 @@ static void parsePrecedence(Precedence precedence) {
     return;
   }
 
-  prefixRule();
+  // Only a rule parsed at assignment precedence may consume an `=`, so
+  // `a + b[0] = c` doesn't parse as `a + (b[0] = c)`.
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(canAssign);
 
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule();
+    infixRule(canAssign);
   }
+
+  if (canAssign && match(TOKEN_EQUAL))
+    error("Invalid assignment target.");
 }
 
 static uint8_t identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  return makeConstant(makeString(name->start, name->length));
 }
 
+static void addLocal(Token name) {
+  if (current->localCount == UINT8_COUNT) {
+    error("Too many local variables.");
+    return;
+  }
+  Local *local = &current->locals[current->localCount++];
+  local->name = name;
+  local->depth = -1;
+  local->type = TYPE_UNKNOWN;
+}
+
+static void declareVariable() {
+  if (current->scopeDepth == 0)
+    return;
+
+  Token *name = &parser.previous;
+  for (int i = current->localCount - 1; i >= 0; i--) {
+    Local *local = &current->locals[i];
+    if (local->depth != -1 && local->depth < current->scopeDepth)
+      break;
+    if (identifiersEqual(name, &local->name))
+      error("Already a variable with this name in this scope.");
+  }
+  addLocal(*name);
+}
+
+// Returns the name's constant for a global; locals need none.
 static uint8_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
+  declareVariable();
+  if (current->scopeDepth > 0)
+    return 0;
   return identifierConstant(&parser.previous);
 }
 
 static void defineVariable(uint8_t global) {
+  // A local's value is already in its slot: the initializer left it there.
+  if (current->scopeDepth > 0) {
+    Local *local = &current->locals[current->localCount - 1];
+    local->depth = current->scopeDepth;
+    local->type = expressionType;
+    return;
+  }
+  if (endsWithConstant()) {
+    Chunk *chunk = currentChunk();
+    uint8_t value = chunk->code[lastConstant + 1];
+    chunk->code[lastConstant] = OP_DEFINE_GLOBAL_CONSTANT;
+    chunk->code[lastConstant + 1] = global;
+    emitByte(value);
+    lastConstant = -1;
+    return;
+  }
   emitBytes(OP_DEFINE_GLOBAL, global);
 }
 
@@ -317,6 +947,7 @@ static void varDeclaration() {
     expression();
   } else {
     emitByte(OP_NIL);
+    expressionType = TYPE_NIL;
   }
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
@@ -329,6 +960,240 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
+static void beginScope() { current->scopeDepth++; }
+
+// Drops the block's locals, all of them with one instruction.
+static void endScope() {
+  current->scopeDepth--;
+  int count = 0;
+  while (current->localCount > 0 &&
+         current->locals[current->localCount - 1].depth >
+             current->scopeDepth) {
+    current->localCount--;
+    count++;
+  }
+  for (; count > 1; count -= UINT8_MAX)
+    emitBytes(OP_POPN, (uint8_t)(count < UINT8_MAX ? count : UINT8_MAX));
+  if (count == 1)
+    emitByte(OP_POP);
+}
+
+static void block() {
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    declaration();
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void ifStatement() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int thenJump = emitJumpIfFalse();
+  LocalTypes skipped;
+  saveLocalTypes(&skipped);
+  statement();
+
+  if (match(TOKEN_ELSE)) {
+    int elseJump = emitJump(OP_JUMP);
+    LocalTypes taken;
+    saveLocalTypes(&taken);
+    restoreLocalTypes(&skipped);
+    patchJump(thenJump);
+    statement();
+    patchJump(elseJump);
+    mergeLocalTypes(&taken);
+  } else {
+    patchJump(thenJump);
+    mergeLocalTypes(&skipped);
+  }
+}
+
+// Types the locals at the loop's head may have, given those they have at
+// the end of its body. Returns whether any was widened.
+static bool widenLoopTypes(LocalTypes *head) {
+  bool widened = false;
+  for (int i = 0; i < current->localCount; i++) {
+    if (head->types[i] != current->locals[i].type &&
+        head->types[i] != TYPE_UNKNOWN) {
+      head->types[i] = TYPE_UNKNOWN;
+      widened = true;
+    }
+  }
+  return widened;
+}
+
+static void whileStatement() {
+  // The loop is compiled for the types its locals have on entry. If the
+  // body changes one, later iterations start with another type, so the
+  // loop is compiled again without assuming it.
+  Chunk *chunk = currentChunk();
+  Scanner scanner = saveScanner();
+  Parser start = parser;
+  int codeCount = chunk->count;
+  int constantCount = chunk->constants.count;
+  LocalTypes head;
+  saveLocalTypes(&head);
+
+  for (;;) {
+    int loopStart = chunk->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int exitJump = emitJumpIfFalse();
+    LocalTypes exit;
+    saveLocalTypes(&exit);
+    statement();
+    emitLoop(loopStart);
+
+    if (parser.hadError || !widenLoopTypes(&head)) {
+      patchJump(exitJump);
+      restoreLocalTypes(&exit);
+      return;
+    }
+    truncateChunk(chunk, codeCount, constantCount);
+    restoreScanner(scanner);
+    parser = start;
+    restoreLocalTypes(&head);
+    lastConstant = -1;
+    lastIndex = -1;
+    lastCall = -1;
+    lastComparison.end = -1;
+  }
+}
+
+// Compiles the parameters and body of `function`, scanned from its source,
+// into its chunk.
+static void functionBody(ObjFunction *function) {
+  Compiler compiler;
+  initCompiler(&compiler, function, &function->chunk);
+  expressionType = TYPE_UNKNOWN;
+  beginScope();
+
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  int arity = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      if (arity == UINT8_MAX)
+        errorAtCurrent("Can't have more than 255 parameters.");
+      arity++;
+      uint8_t constant = parseVariable("Expect parameter name.");
+      expressionType = TYPE_UNKNOWN;
+      defineVariable(constant);
+    } while (match(TOKEN_COMMA));
+  }
+  function->chunk.arity = arity;
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block();
+  // The body's locals go with the frame: no need to pop them.
+  endCompiler();
+}
+
+// Skips the parameters and body of the function just named, matching
+// braces and nothing else, and emits the function as a constant with their
+// text as its source. Most functions in a large script never run, so the
+// body is only compiled by its first call.
+static void function(FunctionKind kind) {
+  ObjFunction *function = newFunction(
+      makeString(parser.previous.start, parser.previous.length), kind);
+  Token start = parser.current;
+
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  while (!check(TOKEN_RIGHT_PAREN) && !check(TOKEN_EOF))
+    advance();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  for (int depth = 1; depth > 0; advance()) {
+    if (check(TOKEN_EOF)) {
+      errorAtCurrent("Expect '}' after block.");
+      break;
+    }
+    if (check(TOKEN_LEFT_BRACE))
+      depth++;
+    else if (check(TOKEN_RIGHT_BRACE))
+      depth--;
+  }
+
+  int length =
+      (int)(parser.previous.start + parser.previous.length - start.start);
+  function->source = ALLOCATE_AS(MEM_CHUNK, char, length + 1);
+  memcpy(function->source, start.start, length);
+  function->source[length] = '\0';
+  function->sourceLength = length;
+  function->line = start.line;
+
+  emitConstant(OBJ_VAL(function));
+  expressionType = TYPE_UNKNOWN;
+}
+
+static void funDeclaration() {
+  uint8_t global = parseVariable("Expect function name.");
+  function(FUNCTION_PLAIN);
+  defineVariable(global);
+}
+
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(&parser.previous);
+  FunctionKind kind = FUNCTION_METHOD;
+  if (parser.previous.length == 4 &&
+      memcmp(parser.previous.start, "init", 4) == 0)
+    kind = FUNCTION_INITIALIZER;
+  function(kind);
+  emitBytes(OP_METHOD, constant);
+}
+
+// `typeshi Name < Superclass { method(...) { ... } ... }`. The class stays
+// on the stack while its methods are attached.
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitBytes(OP_CLASS, nameConstant);
+  expressionType = TYPE_UNKNOWN;
+  defineVariable(nameConstant);
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    if (identifiersEqual(&className, &parser.previous))
+      error("A class can't inherit from itself.");
+    variable(false);
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    method();
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+}
+
+static void returnStatement() {
+  if (current->function == NULL)
+    error("Can't return from top-level code.");
+
+  if (match(TOKEN_SEMICOLON)) {
+    emitReturn();
+    return;
+  }
+  if (current->function != NULL &&
+      current->function->kind == FUNCTION_INITIALIZER)
+    error("Can't return a value from an initializer.");
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+  // Returning what a call returns: the callee can take over this frame.
+  if (lastCall >= 0 && lastCall == currentChunk()->count - 2) {
+    currentChunk()->code[lastCall] = OP_TAIL_CALL;
+    lastCall = -1;
+    return;
+  }
+  emitByte(OP_RETURN);
+}
+
 static void printStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after value.");
@@ -360,7 +1225,11 @@ static void synchronize() {
 }
 
 static void declaration() {
-  if (match(TOKEN_VAR)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
+    funDeclaration();
+  } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else {
     statement();
@@ -371,8 +1240,18 @@ static void declaration() {
 
 static void statement() {
   if (match(TOKEN_PRINT)) {
-
     printStatement();
+  } else if (match(TOKEN_IF)) {
+    ifStatement();
+  } else if (match(TOKEN_RETURN)) {
+    returnStatement();
+  } else if (match(TOKEN_WHILE)) {
+    whileStatement();
+  } else if (match(TOKEN_LEFT_BRACE)) {
+    // At the start of a statement a brace opens a block, never a map.
+    beginScope();
+    block();
+    endScope();
   } else {
     expressionStatement();
   }
@@ -380,7 +1259,10 @@ static void statement() {
 
 bool compile(const char *source, Chunk *chunk) {
   initScanner(source);
-  compilingChunk = chunk;
+  Compiler compiler;
+  current = NULL;
+  initCompiler(&compiler, NULL, chunk);
+  expressionType = TYPE_UNKNOWN;
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -392,4 +1274,26 @@ bool compile(const char *source, Chunk *chunk) {
   }
   endCompiler();
   return !parser.hadError;
+}
+
+bool compileFunction(ObjFunction *function) {
+  restoreScanner((Scanner){.start = function->source,
+                           .current = function->source,
+                           .line = function->line,
+                           .interpolationDepth = 0});
+  current = NULL;
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  advance();
+  functionBody(function);
+  if (parser.hadError) {
+    // Left to fail the same way on the next call.
+    freeChunk(&function->chunk);
+    return false;
+  }
+  FREE_ARRAY_AS(MEM_CHUNK, char, function->source,
+                function->sourceLength + 1);
+  function->source = NULL;
+  return true;
 }
\ No newline at end of file
@@ -4,5 +4,11 @@
 #include "vm.h"
 
 bool compile(const char *source, Chunk *chunk);
+// Compiles the body of a function compile() only skimmed, which it does on
+// the function's first call. On a syntax error the function keeps its
+// source and is left uncompiled.
+bool compileFunction(ObjFunction *function);
+// 0 compiles straight to bytecode; 2 and up also runs the IR optimizer.
+void setOptimizationLevel(int level);
 
 #endif
\ No newline at end of file
@@ -11,6 +11,99 @@ void disassembleChunk(Chunk *chunk, const char *name) {
   }
 }
 
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_POPN] = "OP_POPN",
+    [OP_DUP] = "OP_DUP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_ARRAY] = "OP_ARRAY",
+    [OP_ARRAY_APPEND] = "OP_ARRAY_APPEND",
+    [OP_GET_INDEX] = "OP_GET_INDEX",
+    [OP_SET_INDEX] = "OP_SET_INDEX",
+    [OP_MAP] = "OP_MAP",
+    [OP_MAP_INSERT] = "OP_MAP_INSERT",
+    [OP_MAP_MERGE] = "OP_MAP_MERGE",
+    [OP_IN] = "OP_IN",
+    [OP_DELETE] = "OP_DELETE",
+    [OP_SIZE] = "OP_SIZE",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_CONCAT_N] = "OP_CONCAT_N",
+    [OP_INTERPOLATE] = "OP_INTERPOLATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CONSTANT_ADD] = "OP_CONSTANT_ADD",
+    [OP_CONSTANT_SUBTRACT] = "OP_CONSTANT_SUBTRACT",
+    [OP_CONSTANT_MULTIPLY] = "OP_CONSTANT_MULTIPLY",
+    [OP_CONSTANT_DIVIDE] = "OP_CONSTANT_DIVIDE",
+    [OP_CONSTANT_LESS] = "OP_CONSTANT_LESS",
+    [OP_CONSTANT_GREATER] = "OP_CONSTANT_GREATER",
+    [OP_DEFINE_GLOBAL_CONSTANT] = "OP_DEFINE_GLOBAL_CONSTANT",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_NOT_LESS] = "OP_NOT_LESS",
+    [OP_NOT_GREATER] = "OP_NOT_GREATER",
+    [OP_ADD_II] = "OP_ADD_II",
+    [OP_SUBTRACT_II] = "OP_SUBTRACT_II",
+    [OP_MULTIPLY_II] = "OP_MULTIPLY_II",
+    [OP_DIVIDE_II] = "OP_DIVIDE_II",
+    [OP_LESS_II] = "OP_LESS_II",
+    [OP_GREATER_II] = "OP_GREATER_II",
+    [OP_ADD_DD] = "OP_ADD_DD",
+    [OP_SUBTRACT_DD] = "OP_SUBTRACT_DD",
+    [OP_MULTIPLY_DD] = "OP_MULTIPLY_DD",
+    [OP_DIVIDE_DD] = "OP_DIVIDE_DD",
+    [OP_LESS_DD] = "OP_LESS_DD",
+    [OP_GREATER_DD] = "OP_GREATER_DD",
+    [OP_NEGATE_I] = "OP_NEGATE_I",
+    [OP_NEGATE_D] = "OP_NEGATE_D",
+    [OP_CONCAT_SS] = "OP_CONCAT_SS",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_LESS_II] = "OP_JUMP_IF_LESS_II",
+    [OP_JUMP_IF_NOT_LESS_II] = "OP_JUMP_IF_NOT_LESS_II",
+    [OP_JUMP_IF_GREATER_II] = "OP_JUMP_IF_GREATER_II",
+    [OP_JUMP_IF_NOT_GREATER_II] = "OP_JUMP_IF_NOT_GREATER_II",
+};
+
+const char *opcodeName(uint8_t op) {
+  if (op >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+      opcodeNames[op] == NULL)
+    return "OP_UNKNOWN";
+  return opcodeNames[op];
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -24,14 +117,63 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t operand = chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, operand);
+  return offset + 2;
+}
+
+static int jumpInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d -> %d\n", name, offset, jumpTarget(chunk, offset));
+  return offset + 3;
+}
+
+static int loopInstruction(Chunk *chunk, int offset) {
+  uint8_t loop = chunk->code[offset + 1];
+  printf("%-16s %4d -> %d (%llu iterations)\n", "OP_LOOP", offset,
+         jumpTarget(chunk, offset),
+         (unsigned long long)chunk->loops[loop].iterations);
+  return offset + 4;
+}
+
+// Name constant, then an argument count for the invokes and a cache index
+// with how many shapes the cache holds for the instructions that have one.
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t op = chunk->code[offset];
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  int length = instructionLength(op);
+  if (op == OP_INVOKE || op == OP_SUPER_INVOKE)
+    printf(" (%d args)", chunk->code[offset + 2]);
+  if (op != OP_SUPER_INVOKE) {
+    PropertyCache *cache = &chunk->caches[chunk->code[offset + length - 1]];
+    printf(" (%d shapes cached)", cache->count);
+  }
+  printf("\n");
+  return offset + length;
+}
+
+static int defineConstantInstruction(Chunk *chunk, int offset) {
+  uint8_t name = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d '", "OP_DEFINE_GLOBAL_CONSTANT", name);
+  printValue(chunk->constants.values[name]);
+  printf("' %4d '", constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
-  if (offset > 0 &&
-      chunk->lines[offset].lineNumber == chunk->lines[offset - 1].lineNumber) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset].lineNumber);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -52,8 +194,72 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_FALSE", offset);
   case OP_POP:
     return simpleInstruction("OP_POP", offset);
+  case OP_POPN:
+    return byteInstruction("OP_POPN", chunk, offset);
+  case OP_DUP:
+    return simpleInstruction("OP_DUP", offset);
+  case OP_GET_LOCAL:
+    return byteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL:
+    return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
     return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL:
+    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL:
+    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_ARRAY:
+    return byteInstruction("OP_ARRAY", chunk, offset);
+  case OP_ARRAY_APPEND:
+    return simpleInstruction("OP_ARRAY_APPEND", offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_GET_INDEX", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_SET_INDEX", offset);
+  case OP_MAP:
+    return byteInstruction("OP_MAP", chunk, offset);
+  case OP_MAP_INSERT:
+    return simpleInstruction("OP_MAP_INSERT", offset);
+  case OP_MAP_MERGE:
+    return simpleInstruction("OP_MAP_MERGE", offset);
+  case OP_IN:
+    return simpleInstruction("OP_IN", offset);
+  case OP_DELETE:
+    return simpleInstruction("OP_DELETE", offset);
+  case OP_SIZE:
+    return simpleInstruction("OP_SIZE", offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_CLASS:
+    return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_INHERIT:
+    return simpleInstruction("OP_INHERIT", offset);
+  case OP_METHOD:
+    return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_GET_SUPER:
+    return constantInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    return propertyInstruction(opcodeName(instruction), chunk, offset);
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_GREATER:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_LESS_II:
+  case OP_JUMP_IF_NOT_LESS_II:
+  case OP_JUMP_IF_GREATER_II:
+  case OP_JUMP_IF_NOT_GREATER_II:
+    return jumpInstruction(opcodeName(instruction), chunk, offset);
+  case OP_LOOP:
+    return loopInstruction(chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -68,8 +274,40 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_MULTIPLY", offset);
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", offset);
+  case OP_CONCAT_N:
+    return byteInstruction("OP_CONCAT_N", chunk, offset);
+  case OP_INTERPOLATE:
+    return byteInstruction("OP_INTERPOLATE", chunk, offset);
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset);
+  case OP_CONSTANT_ADD:
+  case OP_CONSTANT_SUBTRACT:
+  case OP_CONSTANT_MULTIPLY:
+  case OP_CONSTANT_DIVIDE:
+  case OP_CONSTANT_LESS:
+  case OP_CONSTANT_GREATER:
+    return constantInstruction(opcodeName(instruction), chunk, offset);
+  case OP_DEFINE_GLOBAL_CONSTANT:
+    return defineConstantInstruction(chunk, offset);
+  case OP_NOT_EQUAL:
+  case OP_NOT_LESS:
+  case OP_NOT_GREATER:
+  case OP_ADD_II:
+  case OP_SUBTRACT_II:
+  case OP_MULTIPLY_II:
+  case OP_DIVIDE_II:
+  case OP_LESS_II:
+  case OP_GREATER_II:
+  case OP_ADD_DD:
+  case OP_SUBTRACT_DD:
+  case OP_MULTIPLY_DD:
+  case OP_DIVIDE_DD:
+  case OP_LESS_DD:
+  case OP_GREATER_DD:
+  case OP_NEGATE_I:
+  case OP_NEGATE_D:
+  case OP_CONCAT_SS:
+    return simpleInstruction(opcodeName(instruction), offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
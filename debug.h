@@ -5,5 +5,7 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+// The opcode's enum name, e.g. "OP_ADD".
+const char *opcodeName(uint8_t op);
 
 #endif
\ No newline at end of file
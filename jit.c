@@ -0,0 +1,843 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "array.h"
+
+// Generated code keeps the VM stack top in rbx, the constant table in r12 and
+// the frame's first local slot in r13, and writes rbx back through rbp
+// (&vm.stackTop) whenever it leaves native code: on return and around helper
+// calls. A Value is 16 bytes, its type tag in the first 4 and its payload at
+// offset 8, so the top of the stack is the tag at [rbx-16] and the payload at
+// [rbx-8]. A call can move the stack, so after every helper r13 is reloaded
+// through r14 (&frame->slots).
+//
+// Every bytecode offset gets a native label, and jumps and loops go straight
+// to them. An instruction without a template, or one whose type guard fails,
+// is handed to the stack VM with stepInstruction(), and the code carries on
+// at the label of whatever instruction the VM stopped at.
+
+typedef struct {
+  int patch;  // Where the rel32 of the jump to the stub lives.
+  int offset; // Bytecode offset of the instruction the stub hands the VM.
+  bool drop;  // Pop the constant a fused OP_CONSTANT_* pushed first.
+} BailSite;
+
+// A jump to the label of a bytecode offset, patched once every instruction
+// has its label.
+typedef struct {
+  int patch;
+  int target;
+} JumpSite;
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+
+  // Native offset of the code for each bytecode offset an instruction
+  // starts at.
+  int *labels;
+  int labelCount;
+
+  JumpSite *jumps;
+  int jumpCount;
+  int jumpCapacity;
+
+  BailSite *bails;
+  int bailCount;
+  int bailCapacity;
+  // Set while emitting the operation half of an OP_CONSTANT_* instruction,
+  // whose constant is already on the native stack but not in the bytecode
+  // the interpreter would resume at.
+  bool pushedConstant;
+
+  // The shared exits at the start of the code: `epilogue` writes the stack
+  // top back and returns eax, `failure` returns JIT_FAILED without touching
+  // the stack an error has just reset.
+  int epilogue;
+  int failure;
+} Assembler;
+
+static void emit(Assembler *as, const uint8_t *bytes, int length) {
+  while (as->count + length > as->capacity) {
+    int oldCapacity = as->capacity;
+    as->capacity = INCREASE_CAPACITY(oldCapacity);
+    as->code = INCREASE_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  memcpy(as->code + as->count, bytes, length);
+  as->count += length;
+}
+
+#define EMIT(...)                                                              \
+  do {                                                                         \
+    const uint8_t bytes[] = {__VA_ARGS__};                                     \
+    emit(as, bytes, sizeof(bytes));                                            \
+  } while (false)
+
+static void emit32(Assembler *as, uint32_t value) {
+  emit(as, (const uint8_t *)&value, 4);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emit(as, (const uint8_t *)&value, 8);
+}
+
+static void patch32(Assembler *as, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(as->code + at, &rel, 4);
+}
+
+#define JMP 0xe9
+#define JNE 0x85
+#define JE 0x84
+#define JS 0x88
+#define JB 0x82
+#define JAE 0x83
+#define JBE 0x86
+#define JA 0x87
+#define JL 0x8c
+#define JGE 0x8d
+#define JLE 0x8e
+#define JG 0x8f
+
+// Emits a jump (E9) or a conditional jump (0F 8x) and returns where its
+// rel32 goes.
+static int jump(Assembler *as, uint8_t condition) {
+  if (condition == JMP) {
+    EMIT(JMP);
+  } else {
+    EMIT(0x0f, condition);
+  }
+  int at = as->count;
+  emit32(as, 0);
+  return at;
+}
+
+// A jump to code already emitted.
+static void jumpBack(Assembler *as, uint8_t condition, int target) {
+  patch32(as, jump(as, condition), target);
+}
+
+// A jump to the label of bytecode offset `target`.
+static void jumpToOffset(Assembler *as, uint8_t condition, int target) {
+  if (as->jumpCount + 1 > as->jumpCapacity) {
+    int oldCapacity = as->jumpCapacity;
+    as->jumpCapacity = INCREASE_CAPACITY(oldCapacity);
+    as->jumps =
+        INCREASE_ARRAY(JumpSite, as->jumps, oldCapacity, as->jumpCapacity);
+  }
+  as->jumps[as->jumpCount].patch = jump(as, condition);
+  as->jumps[as->jumpCount].target = target;
+  as->jumpCount++;
+}
+
+// Emits a conditional jump to the bail stub for `offset`.
+static void bailIf(Assembler *as, uint8_t condition, int offset) {
+  if (as->bailCount + 1 > as->bailCapacity) {
+    int oldCapacity = as->bailCapacity;
+    as->bailCapacity = INCREASE_CAPACITY(oldCapacity);
+    as->bails =
+        INCREASE_ARRAY(BailSite, as->bails, oldCapacity, as->bailCapacity);
+  }
+  as->bails[as->bailCount].patch = jump(as, condition);
+  as->bails[as->bailCount].offset = offset;
+  as->bails[as->bailCount].drop = as->pushedConstant;
+  as->bailCount++;
+}
+
+// mov eax, result; jmp epilogue
+static void exitWith(Assembler *as, int result) {
+  EMIT(0xb8);
+  emit32(as, (uint32_t)result);
+  jumpBack(as, JMP, as->epilogue);
+}
+
+// cmp dword [rbx+disp], type
+static void checkType(Assembler *as, int8_t disp, ValueType type) {
+  EMIT(0x83, 0x7b, (uint8_t)disp, (uint8_t)type);
+}
+
+static void pushConstantAt(Assembler *as, int index) {
+  // movdqu xmm0, [r12+disp32]; movdqu [rbx], xmm0; add rbx, 16
+  EMIT(0xf3, 0x41, 0x0f, 0x6f, 0x84, 0x24);
+  emit32(as, (uint32_t)(index * sizeof(Value)));
+  EMIT(0xf3, 0x0f, 0x7f, 0x03, 0x48, 0x83, 0xc3, 0x10);
+}
+
+static void pushImmediate(Assembler *as, ValueType type, int32_t payload) {
+  // mov dword [rbx], type; mov qword [rbx+8], payload; add rbx, 16
+  EMIT(0xc7, 0x03);
+  emit32(as, (uint32_t)type);
+  EMIT(0x48, 0xc7, 0x43, 0x08);
+  emit32(as, (uint32_t)payload);
+  EMIT(0x48, 0x83, 0xc3, 0x10);
+}
+
+static void dropOne(Assembler *as) { EMIT(0x48, 0x83, 0xeb, 0x10); }
+
+// lea rdi, [r12+disp32]: the address of a constant as the first argument.
+static void constantArgument(Assembler *as, int index) {
+  EMIT(0x49, 0x8d, 0xbc, 0x24);
+  emit32(as, (uint32_t)(index * sizeof(Value)));
+}
+
+// mov edi, value or mov esi, value: the first or second argument.
+static void intArgument(Assembler *as, int position, int value) {
+  EMIT(position == 0 ? 0xbf : 0xbe);
+  emit32(as, (uint32_t)value);
+}
+
+// Calls a C helper with vm.stackTop in sync, then reloads the stack top and
+// the frame's slots, which a call can have moved.
+static void callHelper(Assembler *as, void *helper) {
+  EMIT(0x48, 0x89, 0x5d, 0x00); // mov [rbp], rbx
+  EMIT(0x48, 0xb8);             // mov rax, helper
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(0xff, 0xd0);             // call rax
+  EMIT(0x48, 0x8b, 0x5d, 0x00); // mov rbx, [rbp]
+  EMIT(0x4d, 0x8b, 0x2e);       // mov r13, [r14]
+}
+
+// Hands the instruction at `offset` to the stack VM, leaving the offset it
+// stopped at in eax, and fails out if it raised an error.
+static void step(Assembler *as, int offset) {
+  intArgument(as, 0, offset);
+  callHelper(as, (void *)stepInstruction);
+  EMIT(0x85, 0xc0); // test eax, eax
+  jumpBack(as, JS, as->failure);
+}
+
+static void helperEqual() {
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void helperNot() { push(BOOL_VAL(isFalsey(pop()))); }
+
+static void helperPrint() {
+  printValue(pop());
+  printf("\n");
+}
+
+// The helpers below return false, without touching the stack, for anything
+// but the common case, and the instruction goes to the stack VM, which raises
+// the error if there is one. The allocating ones also refuse once the heap is
+// over its limit, so that the VM raises that error.
+static bool helperDefineGlobal(Value *name) {
+  if (heapLimitExceeded())
+    return false;
+  tableSet(&vm.globals, *name, materialize(vm.stackTop[-1]));
+  pop();
+  return true;
+}
+
+static bool helperGetGlobal(Value *name) {
+  Value value;
+  if (!tableGet(&vm.globals, *name, &value))
+    return false;
+  push(value);
+  return true;
+}
+
+static bool helperSetGlobal(Value *name) {
+  if (heapLimitExceeded())
+    return false;
+  if (tableSet(&vm.globals, *name, materialize(vm.stackTop[-1]))) {
+    tableDelete(&vm.globals, *name);
+    return false;
+  }
+  return true;
+}
+
+static bool helperGetIndex() {
+  Value target = vm.stackTop[-2];
+  Value index = vm.stackTop[-1];
+  Value value;
+  if (IS_MAP(target)) {
+    if (!tableGet(&AS_MAP(target)->table, index, &value))
+      return false;
+  } else if (IS_ARRAY(target) && IS_INT(index) && AS_INT(index) >= 0 &&
+             AS_INT(index) < AS_ARRAY(target)->count) {
+    value = arrayGet(AS_ARRAY(target), AS_INT(index));
+  } else {
+    return false;
+  }
+  vm.stackTop[-2] = value;
+  vm.stackTop--;
+  return true;
+}
+
+static bool helperConcatenate() {
+  Value b = vm.stackTop[-1];
+  Value a = vm.stackTop[-2];
+  if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b) || heapLimitExceeded())
+    return false;
+
+  pop();
+  pop();
+  push(concatenateStrings(a, b));
+  return true;
+}
+
+// Computes an int operation on the two top slots into the lower one, which
+// the caller then drops down to.
+static void intOperation(Assembler *as, uint8_t op) {
+  EMIT(0x8b, 0x43, 0xe8); // mov eax, [rbx-24]
+  switch (op) {
+  case OP_ADD:
+    EMIT(0x03, 0x43, 0xf8); // add eax, [rbx-8]
+    break;
+  case OP_SUBTRACT:
+    EMIT(0x2b, 0x43, 0xf8); // sub eax, [rbx-8]
+    break;
+  case OP_MULTIPLY:
+    EMIT(0x0f, 0xaf, 0x43, 0xf8); // imul eax, [rbx-8]
+    break;
+  case OP_DIVIDE:
+    EMIT(0x99, 0xf7, 0x7b, 0xf8); // cdq; idiv dword [rbx-8]
+    break;
+  case OP_LESS:
+  case OP_GREATER:
+    EMIT(0x3b, 0x43, 0xf8);                          // cmp eax, [rbx-8]
+    EMIT(0x0f, op == OP_LESS ? 0x9c : 0x9f, 0xc0);   // setl/setg al
+    EMIT(0x0f, 0xb6, 0xc0);                          // movzx eax, al
+    EMIT(0xc7, 0x43, 0xe0);                          // mov [rbx-32], BOOL
+    emit32(as, VAL_BOOL);
+    EMIT(0x48, 0x89, 0x43, 0xe8); // mov [rbx-24], rax
+    break;
+  }
+  if (op != OP_LESS && op != OP_GREATER)
+    EMIT(0x89, 0x43, 0xe8); // mov [rbx-24], eax
+}
+
+// Compares the two top doubles, b > a for LESS and a > b for GREATER, so
+// that `above` is false when they are unordered.
+static void compareDoubles(Assembler *as, uint8_t op) {
+  EMIT(0xf2, 0x0f, 0x10, 0x43, op == OP_LESS ? 0xf8 : 0xe8);
+  EMIT(0x66, 0x0f, 0x2e, 0x43, op == OP_LESS ? 0xe8 : 0xf8);
+}
+
+static void doubleOperation(Assembler *as, uint8_t op) {
+  switch (op) {
+  case OP_LESS:
+  case OP_GREATER:
+    compareDoubles(as, op);
+    EMIT(0x0f, 0x97, 0xc0); // seta al
+    EMIT(0x0f, 0xb6, 0xc0); // movzx eax, al
+    EMIT(0xc7, 0x43, 0xe0); // mov [rbx-32], BOOL
+    emit32(as, VAL_BOOL);
+    EMIT(0x48, 0x89, 0x43, 0xe8); // mov [rbx-24], rax
+    break;
+  default: {
+    uint8_t sse = op == OP_ADD        ? 0x58
+                  : op == OP_SUBTRACT ? 0x5c
+                  : op == OP_MULTIPLY ? 0x59
+                                      : 0x5e;
+    EMIT(0xf2, 0x0f, 0x10, 0x43, 0xe8); // movsd xmm0, [rbx-24]
+    EMIT(0xf2, 0x0f, sse, 0x43, 0xf8);  // op xmm0, [rbx-8]
+    EMIT(0xf2, 0x0f, 0x11, 0x43, 0xe8); // movsd [rbx-24], xmm0
+    break;
+  }
+  }
+}
+
+// Arithmetic and comparisons check the right operand's tag, then require the
+// left one to match; any other combination goes to the stack VM, which
+// raises the same error it always would.
+static void binaryTemplate(Assembler *as, uint8_t op, int offset) {
+  EMIT(0x8b, 0x43, 0xf0);    // mov eax, [rbx-16]
+  EMIT(0x83, 0xf8, VAL_INT); // cmp eax, VAL_INT
+  int notInt = jump(as, JNE);
+
+  checkType(as, -32, VAL_INT);
+  bailIf(as, JNE, offset);
+  intOperation(as, op);
+  int intDone = jump(as, JMP);
+
+  patch32(as, notInt, as->count);
+  EMIT(0x83, 0xf8, VAL_DOUBLE); // cmp eax, VAL_DOUBLE
+  bailIf(as, JNE, offset);
+  checkType(as, -32, VAL_DOUBLE);
+  bailIf(as, JNE, offset);
+  doubleOperation(as, op);
+
+  patch32(as, intDone, as->count);
+  dropOne(as);
+}
+
+static void addTemplate(Assembler *as, int offset) {
+  // Strings are the rare case; numbers fall through to the inline paths.
+  // Both string tags sort after every numeric one.
+  EMIT(0x83, 0x7b, 0xf0, VAL_OBJ); // cmp dword [rbx-16], VAL_OBJ
+  int numeric = jump(as, JB);
+  callHelper(as, (void *)helperConcatenate);
+  EMIT(0x84, 0xc0); // test al, al
+  bailIf(as, JE, offset);
+  int done = jump(as, JMP);
+
+  patch32(as, numeric, as->count);
+  binaryTemplate(as, OP_ADD, offset);
+  patch32(as, done, as->count);
+}
+
+// Pops the two int operands and jumps to `target` on `condition`. lea moves
+// the stack top without touching the flags of the compare.
+static void intCompareJump(Assembler *as, uint8_t condition, int target) {
+  EMIT(0x8b, 0x43, 0xe8);       // mov eax, [rbx-24]
+  EMIT(0x3b, 0x43, 0xf8);       // cmp eax, [rbx-8]
+  EMIT(0x48, 0x8d, 0x5b, 0xe0); // lea rbx, [rbx-32]
+  jumpToOffset(as, condition, target);
+}
+
+// OP_JUMP_IF_LESS and the like, guarded like binaryTemplate().
+static void compareJumpTemplate(Assembler *as, uint8_t op, int offset,
+                                int target) {
+  bool less = op == OP_JUMP_IF_LESS || op == OP_JUMP_IF_NOT_LESS;
+  bool when = op == OP_JUMP_IF_LESS || op == OP_JUMP_IF_GREATER;
+  EMIT(0x8b, 0x43, 0xf0);    // mov eax, [rbx-16]
+  EMIT(0x83, 0xf8, VAL_INT); // cmp eax, VAL_INT
+  int notInt = jump(as, JNE);
+
+  checkType(as, -32, VAL_INT);
+  bailIf(as, JNE, offset);
+  intCompareJump(as, less ? (when ? JL : JGE) : (when ? JG : JLE), target);
+  int done = jump(as, JMP);
+
+  patch32(as, notInt, as->count);
+  EMIT(0x83, 0xf8, VAL_DOUBLE); // cmp eax, VAL_DOUBLE
+  bailIf(as, JNE, offset);
+  checkType(as, -32, VAL_DOUBLE);
+  bailIf(as, JNE, offset);
+  compareDoubles(as, less ? OP_LESS : OP_GREATER);
+  EMIT(0x48, 0x8d, 0x5b, 0xe0); // lea rbx, [rbx-32]
+  jumpToOffset(as, when ? JA : JBE, target);
+
+  patch32(as, done, as->count);
+}
+
+// Ints compare inline; anything else through valuesEqual().
+static void equalJumpTemplate(Assembler *as, bool when, int target) {
+  checkType(as, -16, VAL_INT);
+  int notInts = jump(as, JNE);
+  checkType(as, -32, VAL_INT);
+  int notInt = jump(as, JNE);
+  intCompareJump(as, when ? JE : JNE, target);
+  int done = jump(as, JMP);
+
+  patch32(as, notInts, as->count);
+  patch32(as, notInt, as->count);
+  callHelper(as, (void *)helperEqual);
+  dropOne(as);
+  EMIT(0x80, 0x7b, 0x08, 0x00); // cmp byte [rbx+8], 0
+  jumpToOffset(as, when ? JNE : JE, target);
+
+  patch32(as, done, as->count);
+}
+
+static void jumpIfFalseTemplate(Assembler *as, int target) {
+  EMIT(0x8b, 0x43, 0xf0);    // mov eax, [rbx-16]
+  dropOne(as);
+  EMIT(0x83, 0xf8, VAL_NIL); // cmp eax, VAL_NIL
+  jumpToOffset(as, JE, target);
+  EMIT(0x83, 0xf8, VAL_BOOL); // cmp eax, VAL_BOOL
+  int truthy = jump(as, JNE);
+  EMIT(0x80, 0x7b, 0x08, 0x00); // cmp byte [rbx+8], 0
+  jumpToOffset(as, JE, target);
+  patch32(as, truthy, as->count);
+}
+
+// Int arrays index inline; maps and the other arrays go through a helper.
+static void getIndexTemplate(Assembler *as, int offset) {
+  checkType(as, -16, VAL_INT);
+  int notInt = jump(as, JNE);
+  checkType(as, -32, VAL_OBJ);
+  int notObject = jump(as, JNE);
+  EMIT(0x48, 0x8b, 0x43, 0xe8); // mov rax, [rbx-24]
+  // cmp dword [rax+type], OBJ_ARRAY; cmp dword [rax+kind], ARRAY_INT
+  EMIT(0x83, 0x78, (uint8_t)offsetof(Obj, type), OBJ_ARRAY);
+  int notArray = jump(as, JNE);
+  EMIT(0x83, 0x78, (uint8_t)offsetof(ObjArray, kind), ARRAY_INT);
+  int notInts = jump(as, JNE);
+  EMIT(0x8b, 0x4b, 0xf8); // mov ecx, [rbx-8]
+  // cmp ecx, [rax+count]: unsigned, so negative indexes are out too.
+  EMIT(0x3b, 0x48, (uint8_t)offsetof(ObjArray, count));
+  int outOfBounds = jump(as, JAE);
+  // mov rax, [rax+as]; mov eax, [rax+rcx*4]
+  EMIT(0x48, 0x8b, 0x40, (uint8_t)offsetof(ObjArray, as));
+  EMIT(0x8b, 0x04, 0x88);
+  EMIT(0xc7, 0x43, 0xe0); // mov dword [rbx-32], VAL_INT
+  emit32(as, VAL_INT);
+  EMIT(0x89, 0x43, 0xe8); // mov [rbx-24], eax
+  dropOne(as);
+  int done = jump(as, JMP);
+
+  patch32(as, notInt, as->count);
+  patch32(as, notObject, as->count);
+  patch32(as, notArray, as->count);
+  patch32(as, notInts, as->count);
+  patch32(as, outOfBounds, as->count);
+  callHelper(as, (void *)helperGetIndex);
+  EMIT(0x84, 0xc0); // test al, al
+  bailIf(as, JE, offset);
+  patch32(as, done, as->count);
+}
+
+// Calls run functions with native code natively, each in its own frame;
+// anything else is called by the stack VM. A tail call leaves native code
+// so that whoever runs the frame picks up the function now in it.
+static void callTemplate(Assembler *as, bool tail, int argCount, int offset) {
+  intArgument(as, 0, argCount);
+  intArgument(as, 1, offset);
+  callHelper(as, tail ? (void *)tailCallFromNative : (void *)callFromNative);
+  EMIT(0x84, 0xc0); // test al, al
+  jumpBack(as, JE, as->failure);
+  if (tail)
+    exitWith(as, JIT_TAIL_CALL);
+}
+
+static void emitExits(Assembler *as) {
+  as->epilogue = as->count;
+  EMIT(0x48, 0x89, 0x5d, 0x00); // mov [rbp], rbx
+  int leave = as->count;
+  EMIT(0x41, 0x5e); // pop r14
+  EMIT(0x41, 0x5d); // pop r13
+  EMIT(0x41, 0x5c); // pop r12
+  EMIT(0x5b);       // pop rbx
+  EMIT(0x5d);       // pop rbp
+  EMIT(0xc3);       // ret
+
+  as->failure = as->count;
+  EMIT(0xb8); // mov eax, JIT_FAILED
+  emit32(as, (uint32_t)JIT_FAILED);
+  jumpBack(as, JMP, leave);
+}
+
+static bool assemble(Assembler *as, Chunk *chunk) {
+  EMIT(0x55);             // push rbp
+  EMIT(0x53);             // push rbx
+  EMIT(0x41, 0x54);       // push r12
+  EMIT(0x41, 0x55);       // push r13
+  EMIT(0x41, 0x56);       // push r14
+  EMIT(0x48, 0x89, 0xfd); // mov rbp, rdi
+  EMIT(0x48, 0x8b, 0x1f); // mov rbx, [rdi]
+  EMIT(0x49, 0x89, 0xf4); // mov r12, rsi
+  EMIT(0x49, 0x89, 0xd6); // mov r14, rdx
+  EMIT(0x4c, 0x8b, 0x2a); // mov r13, [rdx]
+
+  uint8_t op = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(op)) {
+    op = chunk->code[offset];
+    as->labels[offset] = as->count;
+    switch (op) {
+    case OP_CONSTANT:
+      pushConstantAt(as, chunk->code[offset + 1]);
+      break;
+    case OP_NIL:
+      pushImmediate(as, VAL_NIL, 0);
+      break;
+    case OP_TRUE:
+      pushImmediate(as, VAL_BOOL, 1);
+      break;
+    case OP_FALSE:
+      pushImmediate(as, VAL_BOOL, 0);
+      break;
+    case OP_POP:
+      dropOne(as);
+      break;
+    case OP_POPN:
+      EMIT(0x48, 0x81, 0xeb); // sub rbx, count * 16
+      emit32(as, (uint32_t)(chunk->code[offset + 1] * sizeof(Value)));
+      break;
+    case OP_GET_LOCAL:
+      // movdqu xmm0, [r13+disp32]; movdqu [rbx], xmm0; add rbx, 16
+      EMIT(0xf3, 0x41, 0x0f, 0x6f, 0x85);
+      emit32(as, (uint32_t)(chunk->code[offset + 1] * sizeof(Value)));
+      EMIT(0xf3, 0x0f, 0x7f, 0x03, 0x48, 0x83, 0xc3, 0x10);
+      break;
+    case OP_SET_LOCAL:
+      // movdqu xmm0, [rbx-16]; movdqu [r13+disp32], xmm0
+      EMIT(0xf3, 0x0f, 0x6f, 0x43, 0xf0, 0xf3, 0x41, 0x0f, 0x7f, 0x85);
+      emit32(as, (uint32_t)(chunk->code[offset + 1] * sizeof(Value)));
+      break;
+    case OP_DUP:
+      // movdqu xmm0, [rbx-16]; movdqu [rbx], xmm0; add rbx, 16
+      EMIT(0xf3, 0x0f, 0x6f, 0x43, 0xf0, 0xf3, 0x0f, 0x7f, 0x03);
+      EMIT(0x48, 0x83, 0xc3, 0x10);
+      break;
+    case OP_DEFINE_GLOBAL:
+      constantArgument(as, chunk->code[offset + 1]);
+      callHelper(as, (void *)helperDefineGlobal);
+      EMIT(0x84, 0xc0); // test al, al
+      bailIf(as, JE, offset);
+      break;
+    case OP_GET_GLOBAL:
+      constantArgument(as, chunk->code[offset + 1]);
+      callHelper(as, (void *)helperGetGlobal);
+      EMIT(0x84, 0xc0); // test al, al
+      bailIf(as, JE, offset);
+      break;
+    case OP_SET_GLOBAL:
+      constantArgument(as, chunk->code[offset + 1]);
+      callHelper(as, (void *)helperSetGlobal);
+      EMIT(0x84, 0xc0); // test al, al
+      bailIf(as, JE, offset);
+      break;
+    case OP_GET_INDEX:
+      getIndexTemplate(as, offset);
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      callTemplate(as, op == OP_TAIL_CALL, chunk->code[offset + 1], offset);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      jumpToOffset(as, JMP, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      jumpIfFalseTemplate(as, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+      equalJumpTemplate(as, op == OP_JUMP_IF_EQUAL, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+      compareJumpTemplate(as, op, offset, jumpTarget(chunk, offset));
+      break;
+    // Typed compare-and-branch: no guards.
+    case OP_JUMP_IF_LESS_II:
+      intCompareJump(as, JL, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_LESS_II:
+      intCompareJump(as, JGE, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_GREATER_II:
+      intCompareJump(as, JG, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_GREATER_II:
+      intCompareJump(as, JLE, jumpTarget(chunk, offset));
+      break;
+    case OP_EQUAL:
+      callHelper(as, (void *)helperEqual);
+      break;
+    case OP_ADD:
+      addTemplate(as, offset);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      binaryTemplate(as, op, offset);
+      break;
+    case OP_NOT:
+      callHelper(as, (void *)helperNot);
+      break;
+    case OP_NEGATE: {
+      checkType(as, -16, VAL_DOUBLE);
+      int notDouble = jump(as, JNE);
+      EMIT(0x48, 0x0f, 0xba, 0x7b, 0xf8, 0x3f); // btc qword [rbx-8], 63
+      int done = jump(as, JMP);
+      patch32(as, notDouble, as->count);
+      checkType(as, -16, VAL_INT);
+      bailIf(as, JNE, offset);
+      EMIT(0xf7, 0x5b, 0xf8); // neg dword [rbx-8]
+      patch32(as, done, as->count);
+      break;
+    }
+    // Typed opcodes: the compiler proved the operand types, so no guards.
+    case OP_ADD_II:
+    case OP_SUBTRACT_II:
+    case OP_MULTIPLY_II:
+    case OP_DIVIDE_II:
+    case OP_LESS_II:
+    case OP_GREATER_II:
+      intOperation(as, genericOpcode(op));
+      dropOne(as);
+      break;
+    case OP_ADD_DD:
+    case OP_SUBTRACT_DD:
+    case OP_MULTIPLY_DD:
+    case OP_DIVIDE_DD:
+    case OP_LESS_DD:
+    case OP_GREATER_DD:
+      doubleOperation(as, genericOpcode(op));
+      dropOne(as);
+      break;
+    case OP_NEGATE_I:
+      EMIT(0xf7, 0x5b, 0xf8); // neg dword [rbx-8]
+      break;
+    case OP_NEGATE_D:
+      EMIT(0x48, 0x0f, 0xba, 0x7b, 0xf8, 0x3f); // btc qword [rbx-8], 63
+      break;
+    case OP_CONCAT_SS:
+      callHelper(as, (void *)helperConcatenate);
+      EMIT(0x84, 0xc0); // test al, al
+      bailIf(as, JE, offset);
+      break;
+    case OP_PRINT:
+      callHelper(as, (void *)helperPrint);
+      break;
+    case OP_CONSTANT_ADD:
+    case OP_CONSTANT_SUBTRACT:
+    case OP_CONSTANT_MULTIPLY:
+    case OP_CONSTANT_DIVIDE:
+    case OP_CONSTANT_LESS:
+    case OP_CONSTANT_GREATER: {
+      uint8_t binary = (uint8_t)fusedConstantOperation(op);
+      pushConstantAt(as, chunk->code[offset + 1]);
+      as->pushedConstant = true;
+      if (binary == OP_ADD) {
+        addTemplate(as, offset);
+      } else {
+        binaryTemplate(as, binary, offset);
+      }
+      as->pushedConstant = false;
+      break;
+    }
+    case OP_DEFINE_GLOBAL_CONSTANT:
+      pushConstantAt(as, chunk->code[offset + 2]);
+      as->pushedConstant = true;
+      constantArgument(as, chunk->code[offset + 1]);
+      callHelper(as, (void *)helperDefineGlobal);
+      EMIT(0x84, 0xc0); // test al, al
+      bailIf(as, JE, offset);
+      as->pushedConstant = false;
+      break;
+    case OP_NOT_EQUAL:
+      callHelper(as, (void *)helperEqual);
+      EMIT(0x48, 0x83, 0x73, 0xf8, 0x01); // xor qword [rbx-8], 1
+      break;
+    case OP_NOT_LESS:
+    case OP_NOT_GREATER:
+      binaryTemplate(as, op == OP_NOT_LESS ? OP_LESS : OP_GREATER, offset);
+      EMIT(0x48, 0x83, 0x73, 0xf8, 0x01); // xor qword [rbx-8], 1
+      break;
+    case OP_RETURN:
+      exitWith(as, JIT_FINISHED);
+      break;
+    default:
+      // No template: the stack VM runs this one instruction.
+      step(as, offset);
+      break;
+    }
+  }
+  // A verified chunk ends with OP_RETURN, so nothing falls off the end.
+  return op == OP_RETURN;
+}
+
+static void finish(Assembler *as, Chunk *chunk) {
+  for (int i = 0; i < as->jumpCount; i++)
+    patch32(as, as->jumps[i].patch, as->labels[as->jumps[i].target]);
+
+  // Bail stubs, sharing one per bytecode offset. The stack VM runs the
+  // instruction, and the code carries on after it, or at its target if it
+  // branched there.
+  int stubOffset = -1;
+  int stub = 0;
+  for (int i = 0; i < as->bailCount; i++) {
+    int offset = as->bails[i].offset;
+    if (offset != stubOffset) {
+      stubOffset = offset;
+      stub = as->count;
+      if (as->bails[i].drop)
+        dropOne(as);
+      step(as, offset);
+      int target = jumpTarget(chunk, offset);
+      if (target >= 0) {
+        EMIT(0x3d); // cmp eax, target
+        emit32(as, (uint32_t)target);
+        jumpBack(as, JE, as->labels[target]);
+      }
+      jumpBack(as, JMP,
+               as->labels[offset + instructionLength(chunk->code[offset])]);
+    }
+    patch32(as, as->bails[i].patch, stub);
+  }
+}
+
+static void freeAssembler(Assembler *as) {
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  FREE_ARRAY(int, as->labels, as->labelCount);
+  FREE_ARRAY(JumpSite, as->jumps, as->jumpCapacity);
+  FREE_ARRAY(BailSite, as->bails, as->bailCapacity);
+}
+
+bool jitCompile(Chunk *chunk, JitCode *code) {
+  Assembler as = {0};
+  as.labelCount = chunk->count;
+  as.labels = ALLOCATE(int, as.labelCount);
+  emitExits(&as);
+  int entry = as.count;
+  if (!assemble(&as, chunk)) {
+    freeAssembler(&as);
+    return false;
+  }
+  finish(&as, chunk);
+
+  // Written while writable, then flipped to executable: never both at once.
+  size_t size = (size_t)as.count;
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    freeAssembler(&as);
+    return false;
+  }
+  memcpy(memory, as.code, size);
+  freeAssembler(&as);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  code->memory = memory;
+  code->size = size;
+  code->entry = (JitEntry)((uint8_t *)memory + entry);
+  return true;
+}
+
+int jitRun(JitCode *code, Chunk *chunk) {
+  return code->entry(&vm.stackTop, chunk->constants.values,
+                     &vm.frames[vm.frameCount - 1].slots);
+}
+
+void jitFree(JitCode *code) {
+  if (code->memory != NULL)
+    munmap(code->memory, code->size);
+  code->memory = NULL;
+  code->size = 0;
+  code->entry = NULL;
+}
+
+#else
+
+bool jitCompile(Chunk *chunk, JitCode *code) {
+  (void)chunk;
+  code->memory = NULL;
+  code->size = 0;
+  code->entry = NULL;
+  return false;
+}
+
+int jitRun(JitCode *code, Chunk *chunk) {
+  (void)code;
+  (void)chunk;
+  return JIT_FAILED;
+}
+
+void jitFree(JitCode *code) { (void)code; }
+
+#endif
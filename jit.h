@@ -0,0 +1,32 @@
+#ifndef rotlang_jit_h
+#define rotlang_jit_h
+
+#include "chunk.h"
+#include "common.h"
+
+// Native code for one chunk, run in the innermost frame from the chunk's
+// start. Instructions without a template, and those whose type guards fail,
+// are run one at a time by the stack VM, after which the native code carries
+// on. It returns JIT_FINISHED at OP_RETURN, with the chunk's result, if any,
+// on top of the stack; JIT_FAILED once the VM has raised an error; or
+// JIT_TAIL_CALL once a tail call has put another function in the frame, or
+// has already returned from it.
+#define JIT_FINISHED -1
+#define JIT_FAILED -2
+#define JIT_TAIL_CALL -3
+
+typedef int (*JitEntry)(Value **stackTop, Value *constants, Value **slots);
+
+typedef struct {
+  void *memory;
+  size_t size;
+  JitEntry entry;
+} JitCode;
+
+// Only x86-64 Linux has templates; elsewhere this always returns false and
+// leaves `code` with no entry.
+bool jitCompile(Chunk *chunk, JitCode *code);
+int jitRun(JitCode *code, Chunk *chunk);
+void jitFree(JitCode *code);
+
+#endif
@@ -1,6 +1,12 @@
+#include "bench.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "prefork.h"
+#include "snapshot.h"
+#include "stream.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,29 +53,263 @@ static char *readFile(const char *path) {
   return buffer;
 }
 
-static void runFile(const char *path) {
+// Runs every script in the corpus on the stack VM, recording opcode n-grams
+// and loop iterations, and prints the report to stderr. A script that fails
+// at runtime still contributes the instructions it executed.
+static void profileFiles(const char *paths[], int count) {
+  OpProfile profile;
+  initOpProfile(&profile);
+  vm.engine = ENGINE_STACK;
+  vm.profile = &profile;
+
+  for (int i = 0; i < count; i++) {
+    char *source = readFile(paths[i]);
+    profile.script = paths[i];
+    if (interpret(source) == INTERPRET_COMPILE_ERROR) {
+      fprintf(stderr, "Skipping \"%s\": compile error.\n", paths[i]);
+    }
+    free(source);
+  }
+
+  fflush(stdout);
+  printOpProfile(&profile, stderr);
+  vm.profile = NULL;
+  freeOpProfile(&profile);
+}
+
+// Runs the script the way a host time-slicing many scripts would, in slices
+// of `budget` instructions or, when `nanoseconds` isn't 0, of that much time.
+static InterpretResult interpretSliced(const char *source, int64_t budget,
+                                       int64_t nanoseconds) {
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(source, &chunk)) {
+    freeChunk(&chunk);
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  InterpretResult result = loadChunk(&chunk);
+  if (result == INTERPRET_OK) {
+    do {
+      result = nanoseconds > 0 ? runForTime(budget, nanoseconds)
+                               : runFor(budget);
+    } while (result == INTERPRET_YIELD);
+  }
+  freeChunk(&chunk);
+  return result;
+}
+
+// Returns the process exit code rather than an InterpretResult: errors can
+// come from the setup script, the entry script or the server itself.
+static int runPreforkFiles(const char *setupPath, const char *entryPath,
+                           int workers, const char *socketPath) {
+  char *setup = readFile(setupPath);
+  char *entry = readFile(entryPath);
+  int status = runPrefork(setup, entry, workers, socketPath);
+  free(setup);
+  free(entry);
+  return status;
+}
+
+static int runStreamFile(const char *path, const char *beginPath,
+                         const char *endPath, bool printLines) {
   char *source = readFile(path);
-  InterpretResult result = interpret(source);
+  char *begin = beginPath != NULL ? readFile(beginPath) : NULL;
+  char *end = endPath != NULL ? readFile(endPath) : NULL;
+  int status = runStream(source, begin, end, printLines);
   free(source);
+  free(begin);
+  free(end);
+  return status;
+}
 
-  if (result == INTERPRET_COMPILE_ERROR)
-    exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+static InterpretResult runFile(const char *path, int64_t slice,
+                               int64_t sliceNanos) {
+  char *source = readFile(path);
+  InterpretResult result = INTERPRET_OK;
+  if (slice == 0 && sliceNanos == 0)
+    result = interpret(source);
+  else
+    result = interpretSliced(source, slice > 0 ? slice : INT64_MAX,
+                             sliceNanos);
+  free(source);
+  return result;
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns false for
+// anything else, including zero.
+static bool parseSize(const char *text, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || value == 0)
+    return false;
+
+  switch (*end) {
+  case 'G':
+    value *= 1024;
+    // Fall through.
+  case 'M':
+    value *= 1024;
+    // Fall through.
+  case 'K':
+    value *= 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0')
+    return false;
+  *size = (size_t)value;
+  return true;
 }
 
 int main(int argc, const char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--bench") == 0) {
+    if (!runBenchmark(argv[2])) {
+      fprintf(stderr, "Unknown benchmark \"%s\".\n", argv[2]);
+      exit(64);
+    }
+    return 0;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "--profile-ops") == 0) {
+    initVM();
+    profileFiles(argv + 2, argc - 2);
+    freeVM();
+    return 0;
+  }
+
+  const char *path = NULL;
+  const char *entryPath = NULL;
+  const char *socketPath = NULL;
+  const char *snapshotPath = NULL;
+  const char *restorePath = NULL;
+  size_t workers = 0;
+  int optimizationLevel = 0;
+  Engine engine = ENGINE_STACK;
+  bool memStats = false;
+  size_t slice = 0;
+  size_t sliceMicros = 0;
+  // -n runs the script once per line of stdin; -p also prints each line.
+  bool stream = false;
+  bool printLines = false;
+  const char *beginPath = NULL;
+  const char *endPath = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-O0") == 0) {
+      optimizationLevel = 0;
+    } else if (strcmp(argv[i], "-O2") == 0) {
+      optimizationLevel = 2;
+    } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-p") == 0) {
+      stream = true;
+      printLines = argv[i][1] == 'p';
+    } else if (strcmp(argv[i], "--begin") == 0 && i + 1 < argc) {
+      beginPath = argv[++i];
+    } else if (strcmp(argv[i], "--end") == 0 && i + 1 < argc) {
+      endPath = argv[++i];
+    } else if (strcmp(argv[i], "--regvm") == 0) {
+      engine = ENGINE_REGISTER;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      engine = ENGINE_JIT;
+    } else if (strcmp(argv[i], "--mem-stats") == 0) {
+      memStats = true;
+    } else if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc &&
+               parseSize(argv[i + 1], &memoryStats.limit)) {
+      i++;
+    } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc &&
+               parseSize(argv[i + 1], &slice)) {
+      i++;
+    } else if (strcmp(argv[i], "--slice-us") == 0 && i + 1 < argc &&
+               parseSize(argv[i + 1], &sliceMicros)) {
+      i++;
+    } else if (strcmp(argv[i], "--prefork") == 0 && i + 1 < argc &&
+               parseSize(argv[i + 1], &workers)) {
+      i++;
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshotPath = argv[++i];
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restorePath = argv[++i];
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else if (workers > 0 && entryPath == NULL && argv[i][0] != '-') {
+      entryPath = argv[i];
+    } else {
+      fputs("Usage: clox [-O0|-O2] [--regvm|--jit] [--mem-stats]\n"
+            "            [--heap-limit bytes[K|M|G]] [--slice instructions]\n"
+            "            [--slice-us microseconds]\n"
+            "            [--snapshot image] [--restore image] [path]\n"
+            "       clox [-O0|-O2] -n|-p [--begin path] [--end path] path\n"
+            "            < input\n"
+            "       clox --prefork workers [--socket path] setup entry\n"
+            "       clox --bench scan|vm|batch|calls|props|concat\n"
+            "       clox --profile-ops path...\n",
+            stderr);
+      exit(64);
+    }
+  }
+
+  if (workers > 0 && entryPath == NULL) {
+    fprintf(stderr, "--prefork needs a setup and an entry script.\n");
+    exit(64);
+  }
+
+  if (stream && path == NULL) {
+    fprintf(stderr, "-n and -p need a script to run on each line.\n");
+    exit(64);
+  }
+  if (!stream && (beginPath != NULL || endPath != NULL)) {
+    fprintf(stderr, "--begin and --end only apply to -n and -p.\n");
+    exit(64);
+  }
+  if (snapshotPath != NULL && path == NULL) {
+    fprintf(stderr, "--snapshot needs a script to run first.\n");
+    exit(64);
+  }
+
   initVM();
+  vm.engine = engine;
+  if (restorePath != NULL && !restoreSnapshot(restorePath)) {
+    freeVM();
+    exit(74);
+  }
 
-  if (argc == 1) {
+  if (stream || workers > 0) {
+    setOptimizationLevel(optimizationLevel);
+    // -n and -p run each line on the stack VM whatever the engine.
+    int status = stream ? runStreamFile(path, beginPath, endPath, printLines)
+                        : runPreforkFiles(path, entryPath, (int)workers,
+                                          socketPath);
+    if (memStats)
+      printMemoryStats(stderr);
+    freeVM();
+    releaseSnapshot();
+    return status;
+  }
+
+  InterpretResult result = INTERPRET_OK;
+  if (path == NULL) {
+    // The REPL always takes the single-pass path; it's compile-latency bound.
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    setOptimizationLevel(optimizationLevel);
+    result = runFile(path, (int64_t)slice, (int64_t)sliceMicros * 1000);
+    if (snapshotPath != NULL && result == INTERPRET_OK &&
+        !writeSnapshot(snapshotPath))
+      result = INTERPRET_RUNTIME_ERROR;
   }
 
+  // Before freeVM(), so live bytes are what the script left behind.
+  if (memStats) {
+    fflush(stdout);
+    printMemoryStats(stderr);
+  }
   freeVM();
+  releaseSnapshot();
+
+  if (result == INTERPRET_COMPILE_ERROR)
+    exit(65);
+  if (result == INTERPRET_RUNTIME_ERROR)
+    exit(70);
   return 0;
 }
\ No newline at end of file
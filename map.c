@@ -0,0 +1,21 @@
+#include "map.h"
+#include "table.h"
+
+bool mapSet(ObjMap *map, Value key, Value value) {
+  if (IS_NIL(key))
+    return false;
+  if (tableSet(&map->table, materialize(key), materialize(value)))
+    map->size++;
+  return true;
+}
+
+bool mapDelete(ObjMap *map, Value key) {
+  if (!tableDelete(&map->table, key))
+    return false;
+  map->size--;
+  return true;
+}
+
+void mapMerge(ObjMap *to, ObjMap *from) {
+  to->size += tableAddAll(&from->table, &to->table);
+}
@@ -0,0 +1,20 @@
+#ifndef rotlang_map_h
+#define rotlang_map_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Lookups go straight to tableGet() on map->table; these keep map->size
+// in step with the table.
+
+// Stores copies of string views, so the map never points into a buffer it
+// doesn't own. Returns false, storing nothing, if `key` is nil.
+bool mapSet(ObjMap *map, Value key, Value value);
+// Returns whether `key` was there.
+bool mapDelete(ObjMap *map, Value key);
+// Copies every entry of `from` into `to`, overwriting keys `to` already
+// has. `to` is grown once up front rather than rehashing as it fills.
+void mapMerge(ObjMap *to, ObjMap *from);
+
+#endif
@@ -1,28 +1,86 @@
 #include <stdlib.h>
 
+#include "array.h"
 #include "memory.h"
 #include "vm.h"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+MemoryStats memoryStats;
+
+static void account(MemoryUsage *usage, size_t oldSize, size_t newSize) {
+  usage->live = usage->live - oldSize + newSize;
+  if (usage->live > usage->peak)
+    usage->peak = usage->live;
+  if (oldSize == 0 && newSize > 0)
+    usage->allocations++;
+}
+
+void *reallocate(MemoryCategory category, void *pointer, size_t oldSize,
+                 size_t newSize) {
+  account(&memoryStats.total, oldSize, newSize);
+  account(&memoryStats.categories[category], oldSize, newSize);
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
   }
 
   void *result = realloc(pointer, newSize);
-  if (result == NULL)
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory allocating %zu bytes.\n", newSize);
     exit(1);
+  }
   return result;
 }
 
 static void freeObject(Obj *object) {
   switch (object->type) {
   case OBJ_STRING: {
+    // The characters live inline after the header, so it's one allocation.
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    reallocate(MEM_STRING, object, sizeof(ObjString) + string->length + 1, 0);
+    break;
+  }
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *)object;
+    reallocate(MEM_ARRAY, array->as.values,
+               (size_t)array->capacity * arrayElementSize(array->kind), 0);
+    reallocate(MEM_ARRAY, object, sizeof(ObjArray), 0);
+    break;
+  }
+  case OBJ_MAP:
+    freeTable(&((ObjMap *)object)->table);
+    reallocate(MEM_TABLE, object, sizeof(ObjMap), 0);
+    break;
+  case OBJ_NATIVE:
+    reallocate(MEM_OTHER, object, sizeof(ObjNative), 0);
+    break;
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    freeChunk(&function->chunk);
+    jitFree(&function->native);
+    if (function->source != NULL)
+      FREE_ARRAY_AS(MEM_CHUNK, char, function->source,
+                    function->sourceLength + 1);
+    reallocate(MEM_CHUNK, object, sizeof(ObjFunction), 0);
+    break;
+  }
+  case OBJ_CLASS:
+    freeTable(&((ObjClass *)object)->methods);
+    reallocate(MEM_TABLE, object, sizeof(ObjClass), 0);
+    break;
+  case OBJ_SHAPE:
+    freeTable(&((Shape *)object)->transitions);
+    reallocate(MEM_TABLE, object, sizeof(Shape), 0);
+    break;
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    FREE_ARRAY_AS(MEM_INSTANCE, Value, instance->fields, instance->capacity);
+    reallocate(MEM_INSTANCE, object, sizeof(ObjInstance), 0);
     break;
   }
+  case OBJ_BOUND_METHOD:
+    reallocate(MEM_INSTANCE, object, sizeof(ObjBoundMethod), 0);
+    break;
   }
 }
 
@@ -33,4 +91,45 @@ void freeObjects() {
     freeObject(object);
     object = next;
   }
-}
\ No newline at end of file
+}
+static const char *categoryNames[MEM_CATEGORY_COUNT] = {
+    [MEM_OTHER] = "other",         [MEM_CHUNK] = "chunk",
+    [MEM_CONSTANTS] = "constants", [MEM_TABLE] = "tables",
+    [MEM_STRING] = "strings",      [MEM_STACK] = "stack",
+    [MEM_ARRAY] = "arrays",        [MEM_INSTANCE] = "instances",
+};
+
+static const char *objectTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_ARRAY] = "array",
+    [OBJ_MAP] = "map",
+    [OBJ_NATIVE] = "native",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_CLASS] = "class",
+    [OBJ_SHAPE] = "shape",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "bound method",
+};
+
+static void printUsage(FILE *out, const char *name, MemoryUsage *usage) {
+  fprintf(out, "  %-10s %12zu %12zu %12llu\n", name, usage->live, usage->peak,
+          (unsigned long long)usage->allocations);
+}
+
+void printMemoryStats(FILE *out) {
+  fprintf(out, "memory:\n  %-10s %12s %12s %12s\n", "category", "live bytes",
+          "peak bytes", "allocations");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    printUsage(out, categoryNames[i], &memoryStats.categories[i]);
+  }
+  printUsage(out, "total", &memoryStats.total);
+
+  fprintf(out, "objects allocated:\n");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(out, "  %-10s %12llu\n", objectTypeNames[i],
+            (unsigned long long)memoryStats.objects[i]);
+  }
+
+  if (memoryStats.limit != 0)
+    fprintf(out, "heap limit: %zu bytes\n", memoryStats.limit);
+}
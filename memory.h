@@ -1,24 +1,75 @@
 #ifndef crotlang_memory_h
 #define crotlang_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count)                                                  \
-  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+// What an allocation is for. Everything the macros below allocate without
+// naming a category (compiler and JIT scratch, profiles) is MEM_OTHER.
+typedef enum {
+  MEM_OTHER,
+  MEM_CHUNK,
+  MEM_CONSTANTS,
+  MEM_TABLE,
+  MEM_STRING,
+  MEM_STACK,
+  MEM_ARRAY,
+  MEM_INSTANCE,
+  MEM_CATEGORY_COUNT,
+} MemoryCategory;
+
+typedef struct {
+  size_t live;
+  size_t peak;
+  uint64_t allocations;
+} MemoryUsage;
+
+typedef struct {
+  MemoryUsage total;
+  MemoryUsage categories[MEM_CATEGORY_COUNT];
+  uint64_t objects[OBJ_TYPE_COUNT];
+  // Live bytes above which allocating instructions raise a runtime error.
+  // Zero means no limit.
+  size_t limit;
+} MemoryStats;
+
+// Kept outside the VM so it also sees allocations made before initVM() and
+// after freeVM().
+extern MemoryStats memoryStats;
+
+#define ALLOCATE_AS(category, type, count)                                     \
+  (type *)reallocate(category, NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count) ALLOCATE_AS(MEM_OTHER, type, count)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer) reallocate(MEM_OTHER, pointer, sizeof(type), 0)
 
 #define INCREASE_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define INCREASE_ARRAY(type, pointer, oldCount, newCount)                      \
-  (type *)reallocate(pointer, sizeof(type) * (oldCount),                       \
+#define INCREASE_ARRAY_AS(category, type, pointer, oldCount, newCount)         \
+  (type *)reallocate(category, pointer, sizeof(type) * (oldCount),             \
                      sizeof(type) * (newCount))
+#define INCREASE_ARRAY(type, pointer, oldCount, newCount)                      \
+  INCREASE_ARRAY_AS(MEM_OTHER, type, pointer, oldCount, newCount)
 
+#define FREE_ARRAY_AS(category, type, pointer, oldCount)                       \
+  reallocate(category, pointer, sizeof(type) * (oldCount), 0)
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+  FREE_ARRAY_AS(MEM_OTHER, type, pointer, oldCount)
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// Never fails: the heap limit is enforced by the interpreters checking
+// heapLimitExceeded() after instructions that allocate, so a script that
+// runs away gets a runtime error it can be stopped with rather than a
+// failed allocation in the middle of a table resize.
+void *reallocate(MemoryCategory category, void *pointer, size_t oldSize,
+                 size_t newSize);
 void freeObjects();
 
-#endif
\ No newline at end of file
+static inline bool heapLimitExceeded() {
+  return memoryStats.limit != 0 && memoryStats.total.live > memoryStats.limit;
+}
+
+void printMemoryStats(FILE *out);
+
+#endif
@@ -0,0 +1,280 @@
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "array.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "vm.h"
+
+static bool toDouble(Value value, double *result) {
+  if (IS_INT(value)) {
+    *result = AS_INT(value);
+    return true;
+  }
+  if (IS_DOUBLE(value)) {
+    *result = AS_DOUBLE(value);
+    return true;
+  }
+  return false;
+}
+
+// Turns a bulk operation's error message into the native's failure.
+static Value bulkResult(const char *error, Value result) {
+  return error == NULL ? result : nativeError("%s", error);
+}
+
+// Seconds on a monotonic clock, for timing scripts.
+static Value clockNative(int argCount, Value *args) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return DOUBLE_VAL((double)now.tv_sec + now.tv_nsec / 1e9);
+}
+
+#define DOUBLE_NATIVE(name, function)                                          \
+  static Value name##Native(int argCount, Value *args) {                       \
+    double x;                                                                  \
+    if (!toDouble(args[0], &x))                                                \
+      return nativeError(#name "() needs a number.");                          \
+    return DOUBLE_VAL(function(x));                                            \
+  }
+
+DOUBLE_NATIVE(sqrt, sqrt)
+DOUBLE_NATIVE(floor, floor)
+DOUBLE_NATIVE(ceil, ceil)
+
+#undef DOUBLE_NATIVE
+
+static Value absNative(int argCount, Value *args) {
+  if (IS_INT(args[0]))
+    return INT_VAL((int)(AS_INT(args[0]) < 0 ? -(unsigned)AS_INT(args[0])
+                                             : (unsigned)AS_INT(args[0])));
+  if (IS_DOUBLE(args[0]))
+    return DOUBLE_VAL(fabs(AS_DOUBLE(args[0])));
+  return nativeError("abs() needs a number.");
+}
+
+static Value powNative(int argCount, Value *args) {
+  double x, y;
+  if (!toDouble(args[0], &x) || !toDouble(args[1], &y))
+    return nativeError("pow() needs numbers.");
+  return DOUBLE_VAL(pow(x, y));
+}
+
+// Copies a string argument into a NUL-terminated buffer for strtol/strtod.
+// Returns false if it's too long to be a number.
+static bool numberText(Value *string, char *buffer, size_t size) {
+  int length = STRING_LENGTH(*string);
+  if ((size_t)length >= size)
+    return false;
+  memcpy(buffer, STRING_CHARS(*string), length);
+  buffer[length] = '\0';
+  return true;
+}
+
+static Value intNative(int argCount, Value *args) {
+  if (IS_INT(args[0]))
+    return args[0];
+  if (IS_DOUBLE(args[0])) {
+    double x = AS_DOUBLE(args[0]);
+    if (!(x > INT_MIN - 1.0 && x < INT_MAX + 1.0))
+      return nativeError("int() argument out of range.");
+    return INT_VAL((int)x);
+  }
+  if (IS_ANY_STRING(args[0])) {
+    char buffer[32];
+    char *end;
+    if (numberText(&args[0], buffer, sizeof(buffer))) {
+      long value = strtol(buffer, &end, 10);
+      if (end != buffer && *end == '\0' && value >= INT_MIN &&
+          value <= INT_MAX)
+        return INT_VAL((int)value);
+    }
+    return nativeError("int() can't parse '%.*s'.", STRING_LENGTH(args[0]),
+                       STRING_CHARS(args[0]));
+  }
+  return nativeError("int() needs a number or a string.");
+}
+
+static Value doubleNative(int argCount, Value *args) {
+  double x;
+  if (toDouble(args[0], &x))
+    return DOUBLE_VAL(x);
+  if (IS_ANY_STRING(args[0])) {
+    char buffer[64];
+    char *end;
+    if (numberText(&args[0], buffer, sizeof(buffer))) {
+      x = strtod(buffer, &end);
+      if (end != buffer && *end == '\0')
+        return DOUBLE_VAL(x);
+    }
+    return nativeError("double() can't parse '%.*s'.",
+                       STRING_LENGTH(args[0]), STRING_CHARS(args[0]));
+  }
+  return nativeError("double() needs a number or a string.");
+}
+
+static Value strNative(int argCount, Value *args) {
+  if (IS_ANY_STRING(args[0]))
+    return materialize(args[0]);
+  char buffer[32];
+  int length = formatValue(args[0], buffer, sizeof(buffer));
+  if (length < 0)
+    return nativeError("str() can't convert arrays, maps or functions.");
+  return makeString(buffer, length);
+}
+
+static Value convertCase(Value *string, int (*convert)(int)) {
+  int length = STRING_LENGTH(*string);
+  const char *source = STRING_CHARS(*string);
+  char *chars = ALLOCATE(char, length);
+  for (int i = 0; i < length; i++)
+    chars[i] = (char)convert((unsigned char)source[i]);
+  Value result = makeString(chars, length);
+  FREE_ARRAY(char, chars, length);
+  return result;
+}
+
+static Value upperNative(int argCount, Value *args) {
+  if (!IS_ANY_STRING(args[0]))
+    return nativeError("upper() needs a string.");
+  return convertCase(&args[0], toupper);
+}
+
+static Value lowerNative(int argCount, Value *args) {
+  if (!IS_ANY_STRING(args[0]))
+    return nativeError("lower() needs a string.");
+  return convertCase(&args[0], tolower);
+}
+
+// substr(s, start, length)
+static Value substrNative(int argCount, Value *args) {
+  if (!IS_ANY_STRING(args[0]) || !IS_INT(args[1]) || !IS_INT(args[2]))
+    return nativeError("substr() needs a string and two ints.");
+  int start = AS_INT(args[1]);
+  int length = AS_INT(args[2]);
+  if (start < 0 || length < 0 || length > STRING_LENGTH(args[0]) - start)
+    return nativeError("substr() range out of bounds.");
+  return makeString(STRING_CHARS(args[0]) + start, length);
+}
+
+// The next line of stdin without its newline, or nil at the end of input.
+static Value readLineNative(int argCount, Value *args) {
+  static char *line = NULL;
+  static size_t capacity = 0;
+  ssize_t length = getline(&line, &capacity, stdin);
+  if (length < 0)
+    return NIL_VAL;
+  if (length > 0 && line[length - 1] == '\n')
+    length--;
+  return makeString(line, (int)length);
+}
+
+static Value sumNative(int argCount, Value *args) {
+  if (!IS_ARRAY(args[0]))
+    return nativeError("sum() needs an array.");
+  Value result = NIL_VAL;
+  return bulkResult(arraySum(AS_ARRAY(args[0]), &result), result);
+}
+
+// min(array) or min(a, b), and the same for max.
+static Value extreme(int argCount, Value *args, bool max) {
+  Value result = NIL_VAL;
+  if (argCount == 1 && IS_ARRAY(args[0])) {
+    ObjArray *array = AS_ARRAY(args[0]);
+    return bulkResult(max ? arrayMax(array, &result) : arrayMin(array, &result),
+                      result);
+  }
+  if (argCount == 2 && IS_INT(args[0]) && IS_INT(args[1])) {
+    bool first = max ? AS_INT(args[0]) >= AS_INT(args[1])
+                     : AS_INT(args[0]) <= AS_INT(args[1]);
+    return first ? args[0] : args[1];
+  }
+  if (argCount == 2 && IS_DOUBLE(args[0]) && IS_DOUBLE(args[1])) {
+    bool first = max ? AS_DOUBLE(args[0]) >= AS_DOUBLE(args[1])
+                     : AS_DOUBLE(args[0]) <= AS_DOUBLE(args[1]);
+    return first ? args[0] : args[1];
+  }
+  return nativeError("%s() needs an array or two numbers of the same type.",
+                     max ? "max" : "min");
+}
+
+static Value minNative(int argCount, Value *args) {
+  return extreme(argCount, args, false);
+}
+
+static Value maxNative(int argCount, Value *args) {
+  return extreme(argCount, args, true);
+}
+
+static Value dotNative(int argCount, Value *args) {
+  if (!IS_ARRAY(args[0]) || !IS_ARRAY(args[1]))
+    return nativeError("dot() needs two arrays.");
+  Value result = NIL_VAL;
+  return bulkResult(arrayDot(AS_ARRAY(args[0]), AS_ARRAY(args[1]), &result),
+                    result);
+}
+
+static Value scaleNative(int argCount, Value *args) {
+  if (!IS_ARRAY(args[0]))
+    return nativeError("scale() needs an array.");
+  Value result = NIL_VAL;
+  return bulkResult(arrayScale(AS_ARRAY(args[0]), args[1], &result), result);
+}
+
+// Sorts in place and returns the array.
+static Value sortNative(int argCount, Value *args) {
+  if (!IS_ARRAY(args[0]))
+    return nativeError("sort() needs an array.");
+  return bulkResult(arraySort(AS_ARRAY(args[0])), args[0]);
+}
+
+static Value pushNative(int argCount, Value *args) {
+  if (!IS_ARRAY(args[0]))
+    return nativeError("push() needs an array.");
+  arrayAppend(AS_ARRAY(args[0]), args[1]);
+  return NIL_VAL;
+}
+
+bool isPureNative(ObjNative *native) {
+  static const NativeFn pure[] = {
+      sqrtNative, floorNative, ceilNative, absNative, powNative, intNative,
+      doubleNative, strNative, upperNative, lowerNative, substrNative,
+      minNative, maxNative};
+  for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); i++) {
+    if (native->function == pure[i])
+      return true;
+  }
+  return false;
+}
+
+void defineBuiltins() {
+  defineNative("clock", clockNative, 0);
+
+  defineNative("sqrt", sqrtNative, 1);
+  defineNative("floor", floorNative, 1);
+  defineNative("ceil", ceilNative, 1);
+  defineNative("abs", absNative, 1);
+  defineNative("pow", powNative, 2);
+  defineNative("int", intNative, 1);
+  defineNative("double", doubleNative, 1);
+
+  defineNative("str", strNative, 1);
+  defineNative("upper", upperNative, 1);
+  defineNative("lower", lowerNative, 1);
+  defineNative("substr", substrNative, 3);
+  defineNative("readLine", readLineNative, 0);
+
+  defineNative("sum", sumNative, 1);
+  defineNative("min", minNative, -1);
+  defineNative("max", maxNative, -1);
+  defineNative("dot", dotNative, 2);
+  defineNative("scale", scaleNative, 2);
+  defineNative("sort", sortNative, 1);
+  defineNative("push", pushNative, 2);
+}
@@ -0,0 +1,13 @@
+#ifndef rotlang_natives_h
+#define rotlang_natives_h
+
+#include "object.h"
+
+// Defines the standard natives (timing, math, strings, input and the array
+// bulk operations) in vm.globals. initVM() calls it.
+void defineBuiltins();
+// Whether a call to the native depends only on its arguments and changes
+// nothing, so batch mode can make it once per row in any order.
+bool isPureNative(ObjNative *native);
+
+#endif
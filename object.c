@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "array.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -11,9 +12,22 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
+static const MemoryCategory objectCategories[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = MEM_STRING,
+    [OBJ_ARRAY] = MEM_ARRAY,
+    [OBJ_MAP] = MEM_TABLE,
+    [OBJ_NATIVE] = MEM_OTHER,
+    [OBJ_FUNCTION] = MEM_CHUNK,
+    [OBJ_CLASS] = MEM_TABLE,
+    [OBJ_SHAPE] = MEM_TABLE,
+    [OBJ_INSTANCE] = MEM_INSTANCE,
+    [OBJ_BOUND_METHOD] = MEM_INSTANCE,
+};
+
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = (Obj *)reallocate(objectCategories[type], NULL, 0, size);
   object->type = type;
+  memoryStats.objects[type]++;
 
   object->next = vm.objects;
   vm.objects = object;
@@ -31,7 +45,7 @@ static ObjString *allocateString(int length, uint32_t hash) {
   return string;
 }
 
-static uint32_t hashString(const char *key, int length) {
+uint32_t hashString(const char *key, int length) {
   uint32_t hash = 2166136261u;
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t)key[i];
@@ -45,13 +59,13 @@ ObjString *takeString(char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    FREE_ARRAY_AS(MEM_STRING, char, chars, length + 1);
     return interned;
   }
   ObjString *string = allocateString(length, hash);
   memcpy(string->chars, chars, length);
   string->chars[length] = '\0';
-  free(chars);
+  FREE_ARRAY_AS(MEM_STRING, char, chars, length + 1);
   return string;
 }
 
@@ -70,10 +84,274 @@ ObjString *copyString(const char *chars, int length) {
   //   return allocateString(heapChars, length);
 }
 
+Value makeString(const char *chars, int length) {
+  if (length > SHORT_STRING_MAX)
+    return OBJ_VAL(copyString(chars, length));
+
+  Value value = {.type = VAL_SHORT_STRING, .stringLength = (uint32_t)length};
+  memset(value.as.shortChars, 0, SHORT_STRING_MAX);
+  memcpy(value.as.shortChars, chars, length);
+  return value;
+}
+
+Value makeStringView(const char *chars, int length) {
+  if (length <= SHORT_STRING_MAX)
+    return makeString(chars, length);
+  Value value = {.type = VAL_STRING_VIEW, .stringLength = (uint32_t)length};
+  value.as.viewChars = chars;
+  return value;
+}
+
+Value materialize(Value value) {
+  if (!IS_STRING_VIEW(value))
+    return value;
+  return OBJ_VAL(copyString(value.as.viewChars, (int)value.stringLength));
+}
+
+Value concatenateStrings(Value a, Value b) {
+  int aLength = STRING_LENGTH(a);
+  int bLength = STRING_LENGTH(b);
+  int length = aLength + bLength;
+  if (length <= SHORT_STRING_MAX) {
+    char chars[SHORT_STRING_MAX];
+    memcpy(chars, STRING_CHARS(a), aLength);
+    memcpy(chars + aLength, STRING_CHARS(b), bLength);
+    return makeString(chars, length);
+  }
+
+  char *chars = ALLOCATE_AS(MEM_STRING, char, length + 1);
+  memcpy(chars, STRING_CHARS(a), aLength);
+  memcpy(chars + aLength, STRING_CHARS(b), bLength);
+  chars[length] = '\0';
+  return OBJ_VAL(takeString(chars, length));
+}
+
+int formatValue(Value value, char *chars, size_t size) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return snprintf(chars, size, "%s", AS_BOOL(value) ? "true" : "false");
+  case VAL_NIL:
+    return snprintf(chars, size, "nil");
+  case VAL_INT:
+    return snprintf(chars, size, "%d", AS_INT(value));
+  case VAL_DOUBLE:
+    return snprintf(chars, size, "%g", AS_DOUBLE(value));
+  default:
+    return -1;
+  }
+}
+
+// What OP_ADD reports for a string and `right` that aren't both strings.
+static const char *addError(Value right) {
+  if (IS_INT(right))
+    return "Operands must be numbers.";
+  if (IS_DOUBLE(right))
+    return "Operands type mismatch";
+  return "Operands type mistmatch";
+}
+
+const char *concatenateValues(const Value *values, int count, bool convert,
+                              Value *result) {
+  int length = 0;
+  for (int i = 0; i < count; i++) {
+    if (IS_ANY_STRING(values[i])) {
+      length += STRING_LENGTH(values[i]);
+      continue;
+    }
+    // A chain only compiles to one instruction when the first or second
+    // value is a string, so a non-string first fails adding the second.
+    if (!convert)
+      return addError(values[i == 0 ? 1 : i]);
+    int pieceLength = formatValue(values[i], NULL, 0);
+    if (pieceLength < 0)
+      return "Only strings, numbers, bools and nil can be interpolated.";
+    length += pieceLength;
+  }
+
+  // Long results are built straight in the string object, so the pieces
+  // are copied once; a short one, or one already interned, is copied again.
+  char shortChars[SHORT_STRING_MAX + 1];
+  char *chars = shortChars;
+  ObjString *string = NULL;
+  if (length > SHORT_STRING_MAX) {
+    string = (ObjString *)allocateObject(sizeof(ObjString) + length + 1,
+                                         OBJ_STRING);
+    chars = string->chars;
+  }
+  char *end = chars;
+  for (int i = 0; i < count; i++) {
+    if (IS_ANY_STRING(values[i])) {
+      memcpy(end, STRING_CHARS(values[i]), STRING_LENGTH(values[i]));
+      end += STRING_LENGTH(values[i]);
+    } else {
+      // Leaves a '\0' after the piece, which the next one overwrites.
+      end += formatValue(values[i], end, (size_t)(chars + length + 1 - end));
+    }
+  }
+  if (string == NULL) {
+    *result = makeString(chars, length);
+    return NULL;
+  }
+
+  chars[length] = '\0';
+  uint32_t hash = hashString(chars, length);
+  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  if (interned != NULL) {
+    // Nothing has been allocated since, so the new string is still the head
+    // of the object list.
+    vm.objects = string->obj.next;
+    reallocate(MEM_STRING, string, sizeof(ObjString) + length + 1, 0);
+    *result = OBJ_VAL(interned);
+    return NULL;
+  }
+  string->length = length;
+  string->hash = hash;
+  tableSet(&vm.strings, OBJ_VAL(string), NIL_VAL);
+  *result = OBJ_VAL(string);
+  return NULL;
+}
+
+ObjArray *newArray(int capacity) {
+  ObjArray *array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+  array->kind = ARRAY_INT;
+  array->count = 0;
+  array->capacity = capacity;
+  array->as.ints = ALLOCATE_AS(MEM_ARRAY, int, capacity);
+  return array;
+}
+
+ObjMap *newMap(int capacity) {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  initTable(&map->table);
+  tableReserve(&map->table, capacity);
+  map->size = 0;
+  return map;
+}
+
+ObjNative *newNative(NativeFn function, const char *name, int arity) {
+  ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+  native->function = function;
+  native->name = name;
+  native->arity = arity;
+  return native;
+}
+
+ObjFunction *newFunction(Value name, FunctionKind kind) {
+  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+  initChunk(&function->chunk);
+  function->name = name;
+  function->kind = kind;
+  function->superclass = NULL;
+  function->source = NULL;
+  function->sourceLength = 0;
+  function->line = 0;
+  function->native.memory = NULL;
+  function->native.size = 0;
+  function->native.entry = NULL;
+  return function;
+}
+
+Shape *newShape(ObjClass *klass, Shape *parent, Value name) {
+  Shape *shape = ALLOCATE_OBJ(Shape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+ObjClass *newClass(Value name) {
+  ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->superclass = NULL;
+  klass->initializer = NIL_VAL;
+  klass->fieldCapacity = 0;
+  klass->shape = newShape(klass, NULL, NIL_VAL);
+  return klass;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->shape = klass->shape;
+  instance->capacity = klass->fieldCapacity;
+  instance->fields = instance->capacity == 0
+                         ? NULL
+                         : ALLOCATE_AS(MEM_INSTANCE, Value, instance->capacity);
+  return instance;
+}
+
+ObjBoundMethod *newBoundMethod(Value receiver, ObjFunction *method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+static void printArray(ObjArray *array) {
+  printf("[");
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0)
+      printf(", ");
+    printValue(arrayGet(array, i));
+  }
+  printf("]");
+}
+
+static void printMap(ObjMap *map) {
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    Entry *entry = &map->table.entries[i];
+    if (IS_NIL(entry->key))
+      continue;
+    if (!first)
+      printf(", ");
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+}
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
     break;
+  case OBJ_ARRAY:
+    printArray(AS_ARRAY(value));
+    break;
+  case OBJ_MAP:
+    printMap(AS_MAP(value));
+    break;
+  case OBJ_NATIVE:
+    printf("<native %s>", AS_NATIVE(value)->name);
+    break;
+  case OBJ_FUNCTION: {
+    Value name = AS_FUNCTION(value)->name;
+    printf("<fn %.*s>", STRING_LENGTH(name), STRING_CHARS(name));
+    break;
+  }
+  case OBJ_CLASS: {
+    Value name = AS_CLASS(value)->name;
+    printf("<class %.*s>", STRING_LENGTH(name), STRING_CHARS(name));
+    break;
+  }
+  case OBJ_SHAPE:
+    printf("<shape>");
+    break;
+  case OBJ_INSTANCE: {
+    Value name = AS_INSTANCE(value)->shape->klass->name;
+    printf("<%.*s instance>", STRING_LENGTH(name), STRING_CHARS(name));
+    break;
+  }
+  case OBJ_BOUND_METHOD: {
+    Value name = AS_BOUND_METHOD(value)->method->name;
+    printf("<fn %.*s>", STRING_LENGTH(name), STRING_CHARS(name));
+    break;
+  }
   }
 }
\ No newline at end of file
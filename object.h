@@ -1,19 +1,59 @@
 #ifndef crotLang_object_h
 #define crotLang_object_h
 
+#include "chunk.h"
 #include "common.h"
+#include "jit.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+
+// Any string representation. STRING_CHARS of a short string points into
+// the Value, so it needs an lvalue that outlives the pointer, and only heap
+// strings are NUL-terminated.
+#define IS_ANY_STRING(value)                                                   \
+  ((value).type >= VAL_SHORT_STRING || IS_STRING(value))
+#define STRING_CHARS(value)                                                    \
+  (IS_SHORT_STRING(value)   ? (value).as.shortChars                            \
+   : IS_STRING_VIEW(value) ? (value).as.viewChars                             \
+                           : AS_CSTRING(value))
+#define STRING_LENGTH(value)                                                   \
+  ((value).type >= VAL_SHORT_STRING ? (int)(value).stringLength                \
+                                    : AS_STRING(value)->length)
 
 typedef enum {
   OBJ_STRING,
+  OBJ_ARRAY,
+  OBJ_MAP,
+  OBJ_NATIVE,
+  OBJ_FUNCTION,
+  OBJ_CLASS,
+  OBJ_SHAPE,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_BOUND_METHOD + 1)
+
 struct Obj {
   ObjType type;
   struct Obj *next;
@@ -26,9 +66,164 @@ struct ObjString {
   char chars[];
 };
 
+typedef enum {
+  ARRAY_INT,
+  ARRAY_DOUBLE,
+  ARRAY_VALUE,
+} ArrayKind;
+
+// Elements are stored unboxed for as long as every one of them is an int,
+// or every one a double. Storing anything else converts the array to boxed
+// Values for good. A new array holds ints until its first element says
+// otherwise.
+typedef struct {
+  Obj obj;
+  ArrayKind kind;
+  int count;
+  int capacity;
+  union {
+    int *ints;
+    double *doubles;
+    Value *values;
+  } as;
+} ObjArray;
+
+// Keys are any value but nil, which marks the table's empty entries. Other
+// objects are keys by identity.
+typedef struct {
+  Obj obj;
+  Table table;
+  // Live entries: table.count also counts tombstones.
+  int size;
+} ObjMap;
+
+// `args` points at the arguments where they sit on the VM stack, valid only
+// for the duration of the call. A native fails the call by returning
+// nativeError(...).
+typedef Value (*NativeFn)(int argCount, Value *args);
+
+typedef struct {
+  Obj obj;
+  NativeFn function;
+  const char *name;
+  // -1 for any number of arguments.
+  int arity;
+} ObjNative;
+
+typedef struct ObjClass ObjClass;
+
+typedef enum {
+  FUNCTION_PLAIN,
+  FUNCTION_METHOD,
+  // A class's `init` method, which returns the instance.
+  FUNCTION_INITIALIZER,
+} FunctionKind;
+
+// A function declared with `fn`, or a method. Its chunk's arity is the
+// number of arguments it takes, which it finds in the local slots after
+// the first. Slot 0 holds the function itself, or a method's receiver.
+typedef struct {
+  Obj obj;
+  Chunk chunk;
+  Value name;
+  FunctionKind kind;
+  // The class a method's `super` looks methods up in, set as its class is
+  // created; NULL for anything else.
+  ObjClass *superclass;
+  // The text of the parameters and body, from '(' to '}', until the first
+  // call compiles it into `chunk`; NULL from then on. `line` is the line the
+  // text starts on.
+  char *source;
+  int sourceLength;
+  int line;
+  // Under --jit, the chunk's native code, compiled along with the chunk.
+  JitCode native;
+} ObjFunction;
+
+// A hidden class: which fields an instance has and at which index each one
+// is stored. Instances of a class that get the same fields in the same
+// order share a shape, so an instruction that has seen a shape before knows
+// where a field is without looking it up. Shapes form a tree per class,
+// rooted at the class's shape with no fields.
+struct Shape {
+  Obj obj;
+  ObjClass *klass;
+  Shape *parent;
+  // The field this shape adds to its parent's, stored at fieldCount - 1.
+  Value name;
+  int fieldCount;
+  // Field name to the child shape adding that field.
+  Table transitions;
+};
+
+struct ObjClass {
+  Obj obj;
+  Value name;
+  // Inherited methods are copied in when the class is created.
+  Table methods;
+  ObjClass *superclass;
+  // The `init` method, or nil.
+  Value initializer;
+  // The shape of a new instance.
+  Shape *shape;
+  // The most fields any instance has had. New instances start with room
+  // for as many, so they fill in without growing.
+  int fieldCapacity;
+};
+
+// Fields live in a flat array in the order of the instance's shape.
+typedef struct {
+  Obj obj;
+  Shape *shape;
+  Value *fields;
+  int capacity;
+} ObjInstance;
+
+// A method read as a property, remembering the instance it was read from.
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjFunction *method;
+} ObjBoundMethod;
+
 ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
+// Returns an inline short string when `length` allows, otherwise an
+// interned ObjString.
+Value makeString(const char *chars, int length);
+// Borrows `chars` without copying unless the string fits inline.
+Value makeStringView(const char *chars, int length);
+// Turns a view into a string that doesn't depend on its buffer.
+Value materialize(Value value);
+Value concatenateStrings(Value a, Value b);
+// Joins `count` values into one string in `result`, sizing it once and
+// copying each piece into it once; only the joined string is interned. With
+// `convert`, ints, doubles, bools and nil are formatted as str() would;
+// without it, every value must be a string. Returns NULL on success and
+// otherwise the message of the runtime error to raise, which for
+// non-strings is the one OP_ADD raises at the first step that fails.
+const char *concatenateValues(const Value *values, int count, bool convert,
+                              Value *result);
+// Writes the text str() gives an int, double, bool or nil to `chars` the
+// way snprintf() does, and returns its length, or -1 for any other value.
+int formatValue(Value value, char *chars, size_t size);
+uint32_t hashString(const char *key, int length);
+// An empty int array with room for `capacity` elements.
+ObjArray *newArray(int capacity);
+// An empty map that takes `capacity` entries before it first rehashes.
+ObjMap *newMap(int capacity);
+ObjNative *newNative(NativeFn function, const char *name, int arity);
+// A function with an empty chunk and no source, for the compiler to fill in.
+ObjFunction *newFunction(Value name, FunctionKind kind);
+// A class with no methods, no superclass and a root shape of its own.
+ObjClass *newClass(Value name);
+// A child shape of `parent` adding the field `name`. Use shapeTransition()
+// to find or make one, so that instances share their shapes.
+Shape *newShape(ObjClass *klass, Shape *parent, Value name);
+// An instance with no fields yet.
+ObjInstance *newInstance(ObjClass *klass);
+ObjBoundMethod *newBoundMethod(Value receiver, ObjFunction *method);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
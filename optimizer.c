@@ -0,0 +1,1282 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "table.h"
+#include "verifier.h"
+
+// Every node is one SSA value: the result of a single bytecode instruction
+// whose operands are other nodes. Nodes live in one growable array (the
+// arena) and refer to each other by index, so the whole IR is released with
+// a single free once the chunk has been re-emitted.
+
+typedef struct {
+  uint8_t op;
+  int left;
+  int right;
+  // The literal of an OP_CONSTANT, the name an OP_GET_GLOBAL reads or the
+  // slot an OP_GET_LOCAL reads, as an int.
+  Value constant;
+  int line;
+  StaticType type;
+  // Set when evaluating the node (or anything it depends on) can raise a
+  // runtime error. Such nodes are never dropped or reordered.
+  bool mayFail;
+  // Set when the node reads a global or a stack slot, directly or through
+  // an operand, so a store can change what emitting it again computes.
+  bool readsState;
+  int depth;
+  // A stack slot already holding the node's value in the code emitted so
+  // far, or NO_SLOT. Emitting the node then just reads that slot.
+  int slot;
+} IrNode;
+
+typedef struct {
+  IrNode *nodes;
+  int count;
+  int capacity;
+
+  // Open-addressed set of pure node indices, used to hash-cons identical
+  // computations into a single node.
+  int *cse;
+  int cseCapacity;
+  int cseCount;
+} Ir;
+
+#define NO_NODE -1
+#define NO_SLOT -1
+#define LIFT_STACK_MAX 256
+
+static void initIr(Ir *ir) {
+  ir->nodes = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+  ir->cse = NULL;
+  ir->cseCapacity = 0;
+  ir->cseCount = 0;
+}
+
+static void freeIr(Ir *ir) {
+  FREE_ARRAY(IrNode, ir->nodes, ir->capacity);
+  FREE_ARRAY(int, ir->cse, ir->cseCapacity);
+  initIr(ir);
+}
+
+// Forgets every node hash-consed so far, so that nothing created from here
+// on is merged with a node computed under different values.
+static void resetCse(Ir *ir) {
+  for (int i = 0; i < ir->cseCapacity; i++)
+    ir->cse[i] = NO_NODE;
+  ir->cseCount = 0;
+}
+
+// Constants are compared bit for bit so that 0.0 and -0.0 stay distinct.
+static bool sameConstant(Value a, Value b) {
+  if (a.type != b.type)
+    return false;
+  switch (a.type) {
+  case VAL_DOUBLE: {
+    double x = AS_DOUBLE(a);
+    double y = AS_DOUBLE(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  default:
+    return valuesEqual(a, b);
+  }
+}
+
+static uint32_t hashNode(IrNode *node) {
+  uint32_t hash = 2166136261u;
+  hash = (hash ^ node->op) * 16777619;
+  hash = (hash ^ (uint32_t)node->left) * 16777619;
+  hash = (hash ^ (uint32_t)node->right) * 16777619;
+  if (node->op == OP_CONSTANT || node->op == OP_GET_GLOBAL)
+    hash = (hash ^ getHashValue(node->constant)) * 16777619;
+  return hash;
+}
+
+static bool sameNode(IrNode *a, IrNode *b) {
+  if (a->op != b->op || a->left != b->left || a->right != b->right)
+    return false;
+  return (a->op != OP_CONSTANT && a->op != OP_GET_GLOBAL) ||
+         sameConstant(a->constant, b->constant);
+}
+
+static int appendNode(Ir *ir, IrNode *node) {
+  if (ir->count + 1 > ir->capacity) {
+    int oldCapacity = ir->capacity;
+    ir->capacity = INCREASE_CAPACITY(oldCapacity);
+    ir->nodes = INCREASE_ARRAY(IrNode, ir->nodes, oldCapacity, ir->capacity);
+  }
+  ir->nodes[ir->count] = *node;
+  return ir->count++;
+}
+
+static void growCse(Ir *ir) {
+  int oldCapacity = ir->cseCapacity;
+  int *old = ir->cse;
+  ir->cseCapacity = INCREASE_CAPACITY(oldCapacity);
+  ir->cse = ALLOCATE(int, ir->cseCapacity);
+  for (int i = 0; i < ir->cseCapacity; i++)
+    ir->cse[i] = NO_NODE;
+
+  for (int i = 0; i < oldCapacity; i++) {
+    if (old[i] == NO_NODE)
+      continue;
+    uint32_t index = hashNode(&ir->nodes[old[i]]) & (ir->cseCapacity - 1);
+    while (ir->cse[index] != NO_NODE)
+      index = (index + 1) & (ir->cseCapacity - 1);
+    ir->cse[index] = old[i];
+  }
+  FREE_ARRAY(int, old, oldCapacity);
+}
+
+// Returns an existing node computing the same thing, or adds a new one.
+static int internNode(Ir *ir, IrNode *node) {
+  if (ir->cseCount + 1 > ir->cseCapacity / 2)
+    growCse(ir);
+
+  uint32_t index = hashNode(node) & (ir->cseCapacity - 1);
+  for (;;) {
+    int existing = ir->cse[index];
+    if (existing == NO_NODE)
+      break;
+    if (sameNode(&ir->nodes[existing], node))
+      return existing;
+    index = (index + 1) & (ir->cseCapacity - 1);
+  }
+
+  int id = appendNode(ir, node);
+  ir->cse[index] = id;
+  ir->cseCount++;
+  return id;
+}
+
+static int constantNode(Ir *ir, Value value, int line) {
+  IrNode node;
+  node.op = OP_CONSTANT;
+  node.left = NO_NODE;
+  node.right = NO_NODE;
+  node.constant = value;
+  node.line = line;
+  node.type = constantType(value);
+  node.mayFail = false;
+  node.readsState = false;
+  node.depth = 1;
+  node.slot = NO_SLOT;
+  return internNode(ir, &node);
+}
+
+// What a global holds, read before anything in the block stored to it. The
+// read fails if the global isn't defined.
+static int globalNode(Ir *ir, Value name, int line) {
+  IrNode node;
+  node.op = OP_GET_GLOBAL;
+  node.left = NO_NODE;
+  node.right = NO_NODE;
+  node.constant = name;
+  node.line = line;
+  node.type = TYPE_UNKNOWN;
+  node.mayFail = true;
+  node.readsState = true;
+  node.depth = 1;
+  node.slot = NO_SLOT;
+  return internNode(ir, &node);
+}
+
+// The value of a global the block has just stored to, or of a stack slot
+// as an instruction the IR doesn't model left it. Each is a value of its
+// own, so these nodes are never hash-consed.
+static int readNode(Ir *ir, uint8_t op, Value operand, int line) {
+  IrNode node;
+  node.op = op;
+  node.left = NO_NODE;
+  node.right = NO_NODE;
+  node.constant = operand;
+  node.line = line;
+  node.type = TYPE_UNKNOWN;
+  node.mayFail = false;
+  node.readsState = true;
+  node.depth = 1;
+  node.slot = NO_SLOT;
+  return appendNode(ir, &node);
+}
+
+// Cleared when the verifier rejected the chunk emitted with refined types:
+// it only follows types through the stack slots, so a refined value read
+// back from a global is unproven to it.
+static bool refineTypes;
+
+// A typed opcode is only emitted where the compiler proved its operands'
+// types, which then hold for the nodes wherever else they are used.
+static void refineType(Ir *ir, int id, StaticType type) {
+  if (refineTypes && ir->nodes[id].type == TYPE_UNKNOWN)
+    ir->nodes[id].type = type;
+}
+
+static bool isConstant(Ir *ir, int id) {
+  return ir->nodes[id].op == OP_CONSTANT;
+}
+
+// Evaluates a binary instruction on two constants exactly as run() would.
+// Returns false for anything that would raise a runtime error or is
+// undefined in C, leaving it to the VM.
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result) {
+  if (op == OP_EQUAL) {
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  }
+
+  if (op == OP_ADD && IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+    *result = concatenateStrings(a, b);
+    return true;
+  }
+
+  if (IS_INT(a) && IS_INT(b)) {
+    // Unsigned arithmetic gives the same two's complement wraparound the
+    // VM gets in practice, without relying on signed overflow.
+    unsigned x = (unsigned)AS_INT(a);
+    unsigned y = (unsigned)AS_INT(b);
+    switch (op) {
+    case OP_GREATER:
+      *result = BOOL_VAL(AS_INT(a) > AS_INT(b));
+      return true;
+    case OP_LESS:
+      *result = BOOL_VAL(AS_INT(a) < AS_INT(b));
+      return true;
+    case OP_ADD:
+      *result = INT_VAL((int)(x + y));
+      return true;
+    case OP_SUBTRACT:
+      *result = INT_VAL((int)(x - y));
+      return true;
+    case OP_MULTIPLY:
+      *result = INT_VAL((int)(x * y));
+      return true;
+    case OP_DIVIDE:
+      if (AS_INT(b) == 0 || (AS_INT(a) == INT_MIN && AS_INT(b) == -1))
+        return false;
+      *result = INT_VAL(AS_INT(a) / AS_INT(b));
+      return true;
+    }
+    return false;
+  }
+
+  if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+    double x = AS_DOUBLE(a);
+    double y = AS_DOUBLE(b);
+    switch (op) {
+    case OP_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case OP_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case OP_ADD:
+      *result = DOUBLE_VAL(x + y);
+      return true;
+    case OP_SUBTRACT:
+      *result = DOUBLE_VAL(x - y);
+      return true;
+    case OP_MULTIPLY:
+      *result = DOUBLE_VAL(x * y);
+      return true;
+    case OP_DIVIDE:
+      *result = DOUBLE_VAL(x / y);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool foldUnary(uint8_t op, Value a, Value *result) {
+  switch (op) {
+  case OP_NOT:
+    *result = BOOL_VAL(isFalsey(a));
+    return true;
+  case OP_NEGATE:
+    if (IS_INT(a)) {
+      *result = INT_VAL((int)(0u - (unsigned)AS_INT(a)));
+      return true;
+    }
+    if (!IS_DOUBLE(a))
+      return false;
+    *result = DOUBLE_VAL(-AS_DOUBLE(a));
+    return true;
+  }
+  return false;
+}
+
+static bool sameNumericType(StaticType a, StaticType b) {
+  return a == b && (a == TYPE_INT || a == TYPE_DOUBLE);
+}
+
+static int unaryNode(Ir *ir, uint8_t op, int operand, int line) {
+  Value folded;
+  if (isConstant(ir, operand) &&
+      foldUnary(op, ir->nodes[operand].constant, &folded)) {
+    return constantNode(ir, folded, line);
+  }
+
+  IrNode *a = &ir->nodes[operand];
+  IrNode node;
+  node.op = op;
+  node.left = operand;
+  node.right = NO_NODE;
+  node.constant = NIL_VAL;
+  node.line = line;
+  node.depth = a->depth;
+  if (op == OP_NOT) {
+    node.type = TYPE_BOOL;
+    node.mayFail = a->mayFail;
+  } else {
+    node.type = a->type == TYPE_INT || a->type == TYPE_DOUBLE ? a->type
+                                                              : TYPE_UNKNOWN;
+    node.mayFail = a->mayFail || node.type == TYPE_UNKNOWN;
+  }
+  node.readsState = a->readsState;
+  node.slot = NO_SLOT;
+  return internNode(ir, &node);
+}
+
+static int binaryNode(Ir *ir, uint8_t op, int left, int right, int line) {
+  Value folded;
+  if (isConstant(ir, left) && isConstant(ir, right) &&
+      foldBinary(op, ir->nodes[left].constant, ir->nodes[right].constant,
+                 &folded)) {
+    return constantNode(ir, folded, line);
+  }
+
+  IrNode *a = &ir->nodes[left];
+  IrNode *b = &ir->nodes[right];
+  IrNode node;
+  node.op = op;
+  node.left = left;
+  node.right = right;
+  node.constant = NIL_VAL;
+  node.line = line;
+
+  bool numeric = sameNumericType(a->type, b->type);
+  switch (op) {
+  case OP_EQUAL:
+    node.type = TYPE_BOOL;
+    break;
+  case OP_GREATER:
+  case OP_LESS:
+    node.type = numeric ? TYPE_BOOL : TYPE_UNKNOWN;
+    break;
+  case OP_ADD:
+    if (a->type == TYPE_STRING && b->type == TYPE_STRING) {
+      node.type = TYPE_STRING;
+      break;
+    }
+    // Fall through.
+  default:
+    node.type = numeric ? a->type : TYPE_UNKNOWN;
+    // Integer division by zero traps.
+    if (op == OP_DIVIDE && node.type == TYPE_INT)
+      node.type = TYPE_UNKNOWN;
+    break;
+  }
+  node.mayFail = a->mayFail || b->mayFail ||
+                 (op != OP_EQUAL && node.type == TYPE_UNKNOWN);
+  node.readsState = a->readsState || b->readsState;
+  node.slot = NO_SLOT;
+
+  // Stack slots needed to evaluate the node, assuming operands are emitted
+  // deeper-first when that's allowed (see emitNode).
+  if (left == right) {
+    node.depth = a->depth + 1;
+  } else if (a->depth == b->depth) {
+    node.depth = a->depth + 1;
+  } else {
+    node.depth = a->depth > b->depth ? a->depth : b->depth;
+  }
+  return internNode(ir, &node);
+}
+
+// Set when folding leaves the re-emitted chunk more constants than an
+// operand byte can index; the original chunk is kept instead.
+static bool tooManyConstants;
+
+static uint8_t emitConstantIndex(Chunk *out, Value value) {
+  for (int i = 0; i < out->constants.count; i++) {
+    if (sameConstant(out->constants.values[i], value))
+      return (uint8_t)i;
+  }
+  if (out->constants.count > UINT8_MAX) {
+    tooManyConstants = true;
+    return 0;
+  }
+  return (uint8_t)addConstant(out, value);
+}
+
+// Offset of the last instruction emitted. Superinstructions are formed by
+// rewriting it in place when the next instruction is its fusion partner.
+static int lastInstruction;
+
+static uint8_t fuseInstruction(uint8_t previous, uint8_t op) {
+  if (previous == OP_CONSTANT) {
+    switch (op) {
+    case OP_ADD:
+      return OP_CONSTANT_ADD;
+    case OP_SUBTRACT:
+      return OP_CONSTANT_SUBTRACT;
+    case OP_MULTIPLY:
+      return OP_CONSTANT_MULTIPLY;
+    case OP_DIVIDE:
+      return OP_CONSTANT_DIVIDE;
+    case OP_LESS:
+      return OP_CONSTANT_LESS;
+    case OP_GREATER:
+      return OP_CONSTANT_GREATER;
+    }
+  } else if (op == OP_NOT) {
+    switch (previous) {
+    case OP_EQUAL:
+      return OP_NOT_EQUAL;
+    case OP_LESS:
+      return OP_NOT_LESS;
+    case OP_GREATER:
+      return OP_NOT_GREATER;
+    }
+  }
+  return previous;
+}
+
+static void emitOp(Chunk *out, uint8_t op, int line) {
+  if (lastInstruction >= 0) {
+    uint8_t previous = out->code[lastInstruction];
+    // As in the compiler, fusing with a constant wins over a typed opcode.
+    uint8_t fused = fuseInstruction(
+        previous, previous == OP_CONSTANT ? genericOpcode(op) : op);
+    if (fused != previous) {
+      out->code[lastInstruction] = fused;
+      return;
+    }
+  }
+  lastInstruction = out->count;
+  writeChunk(out, op, line);
+}
+
+static void emitValue(Chunk *out, Value value, int line) {
+  if (IS_NIL(value)) {
+    emitOp(out, OP_NIL, line);
+  } else if (IS_BOOL(value)) {
+    emitOp(out, AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+  } else {
+    emitOp(out, OP_CONSTANT, line);
+    writeChunk(out, emitConstantIndex(out, value), line);
+  }
+}
+
+// Operand order can only be swapped when the result doesn't depend on it and
+// neither side can raise an error, since that would change which error wins.
+static bool canSwapOperands(Ir *ir, IrNode *node) {
+  IrNode *a = &ir->nodes[node->left];
+  IrNode *b = &ir->nodes[node->right];
+  if (a->mayFail || b->mayFail)
+    return false;
+  switch (node->op) {
+  case OP_EQUAL:
+    return true;
+  case OP_ADD:
+  case OP_MULTIPLY:
+    return sameNumericType(a->type, b->type);
+  default:
+    return false;
+  }
+}
+
+// Nodes shared with an earlier statement (id below `shared`) take the line of
+// the statement being emitted, so runtime errors point at the right line.
+static void emitNode(Ir *ir, Chunk *out, int id, int shared, int line) {
+  IrNode *node = &ir->nodes[id];
+  if (id >= shared)
+    line = node->line;
+  if (node->op == OP_CONSTANT) {
+    emitValue(out, node->constant, line);
+    return;
+  }
+  if (node->slot != NO_SLOT || node->op == OP_GET_LOCAL) {
+    emitOp(out, OP_GET_LOCAL, line);
+    writeChunk(out,
+               (uint8_t)(node->slot != NO_SLOT ? node->slot
+                                               : AS_INT(node->constant)),
+               line);
+    return;
+  }
+  if (node->op == OP_GET_GLOBAL) {
+    emitOp(out, OP_GET_GLOBAL, line);
+    writeChunk(out, emitConstantIndex(out, node->constant), line);
+    return;
+  }
+
+  if (node->right == NO_NODE) {
+    emitNode(ir, out, node->left, shared, line);
+  } else if (node->left == node->right) {
+    // A common subexpression used twice in a row is computed once.
+    emitNode(ir, out, node->left, shared, line);
+    emitOp(out, OP_DUP, line);
+  } else if (canSwapOperands(ir, node) &&
+             ir->nodes[node->right].depth > ir->nodes[node->left].depth) {
+    // Evaluate the deeper operand first to keep the stack shallow.
+    emitNode(ir, out, node->right, shared, line);
+    emitNode(ir, out, node->left, shared, line);
+  } else {
+    emitNode(ir, out, node->left, shared, line);
+    emitNode(ir, out, node->right, shared, line);
+  }
+  StaticType right =
+      node->right == NO_NODE ? TYPE_UNKNOWN : ir->nodes[node->right].type;
+  emitOp(out, typedOpcode(node->op, ir->nodes[node->left].type, right), line);
+}
+
+
+// A jump emitted before the offset of its target in the new chunk is known.
+typedef struct {
+  int operand; // Offset of the jump's 16-bit operand in the new chunk.
+  int target;  // Offset of the target in the original chunk.
+} Patch;
+
+// Lifting and emitting are a single pass over the chunk, one basic block
+// after another. Within a block the stack holds nodes rather than values:
+// an expression is only emitted once an instruction with an effect needs
+// it, by which point constants have been folded through it and repeated
+// subexpressions merged. Whatever is still on the stack when a block ends
+// is emitted then, so every block starts with its stack on the VM stack.
+typedef struct {
+  Ir ir;
+  Chunk *chunk;
+  Chunk *out;
+
+  // The node each stack slot holds. The first `physical` slots are on the
+  // VM stack in the code emitted so far; the ones above it are expressions
+  // nothing has emitted yet.
+  int stack[LIFT_STACK_MAX];
+  int depth;
+  int physical;
+
+  // Globals the block has stored to, and the node each one now holds.
+  Value *globalNames;
+  int *globalValues;
+  int globalCount;
+  int globalCapacity;
+
+  // Indexed by offsets in the original chunk: whether a jump goes there,
+  // the stack depth it lands with (-1 until one is seen) and the offset
+  // the instruction there moved to.
+  bool *isTarget;
+  int *targetDepth;
+  int *newOffset;
+
+  Patch *patches;
+  int patchCount;
+  int patchCapacity;
+
+  int line;
+  // Nodes below this index were created before the last emitted statement.
+  int shared;
+} Lifter;
+
+static void initLifter(Lifter *lifter, Chunk *chunk, Chunk *out) {
+  initIr(&lifter->ir);
+  lifter->chunk = chunk;
+  lifter->out = out;
+  lifter->depth = 0;
+  lifter->physical = 0;
+  lifter->globalNames = NULL;
+  lifter->globalValues = NULL;
+  lifter->globalCount = 0;
+  lifter->globalCapacity = 0;
+  lifter->isTarget = ALLOCATE(bool, chunk->count);
+  lifter->targetDepth = ALLOCATE(int, chunk->count);
+  lifter->newOffset = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    lifter->isTarget[i] = false;
+    lifter->targetDepth[i] = -1;
+    lifter->newOffset[i] = -1;
+  }
+  lifter->patches = NULL;
+  lifter->patchCount = 0;
+  lifter->patchCapacity = 0;
+  lifter->line = 0;
+  lifter->shared = 0;
+}
+
+static void freeLifter(Lifter *lifter) {
+  freeIr(&lifter->ir);
+  FREE_ARRAY(Value, lifter->globalNames, lifter->globalCapacity);
+  FREE_ARRAY(int, lifter->globalValues, lifter->globalCapacity);
+  FREE_ARRAY(bool, lifter->isTarget, lifter->chunk->count);
+  FREE_ARRAY(int, lifter->targetDepth, lifter->chunk->count);
+  FREE_ARRAY(int, lifter->newOffset, lifter->chunk->count);
+  FREE_ARRAY(Patch, lifter->patches, lifter->patchCapacity);
+}
+
+static int findGlobal(Lifter *lifter, Value name) {
+  for (int i = 0; i < lifter->globalCount; i++) {
+    if (valuesEqual(lifter->globalNames[i], name))
+      return i;
+  }
+  return -1;
+}
+
+// After a store, reading the global gives the stored node back, unless
+// emitting that again could compute something else by then.
+static void storeGlobal(Lifter *lifter, Value name, int value) {
+  Ir *ir = &lifter->ir;
+  if (ir->nodes[value].readsState)
+    value = readNode(ir, OP_GET_GLOBAL, name, lifter->line);
+
+  int index = findGlobal(lifter, name);
+  if (index < 0) {
+    if (lifter->globalCount + 1 > lifter->globalCapacity) {
+      int oldCapacity = lifter->globalCapacity;
+      lifter->globalCapacity = INCREASE_CAPACITY(oldCapacity);
+      lifter->globalNames = INCREASE_ARRAY(Value, lifter->globalNames,
+                                           oldCapacity, lifter->globalCapacity);
+      lifter->globalValues = INCREASE_ARRAY(
+          int, lifter->globalValues, oldCapacity, lifter->globalCapacity);
+    }
+    index = lifter->globalCount++;
+    lifter->globalNames[index] = name;
+  }
+  lifter->globalValues[index] = value;
+}
+
+// Records that `node` is on the VM stack in `slot`.
+static void placeNode(Lifter *lifter, int slot, int node) {
+  lifter->stack[slot] = node;
+  IrNode *placed = &lifter->ir.nodes[node];
+  if (placed->op != OP_CONSTANT && placed->slot == NO_SLOT)
+    placed->slot = slot;
+}
+
+// The value in `slot` is about to be popped or overwritten. If its node was
+// being read from there, it's read from another slot below `limit` holding
+// it, if any.
+static void releaseSlot(Lifter *lifter, int slot, int limit) {
+  IrNode *node = &lifter->ir.nodes[lifter->stack[slot]];
+  if (node->slot != slot)
+    return;
+  node->slot = NO_SLOT;
+  for (int i = 0; i < limit; i++) {
+    if (i != slot && lifter->stack[i] == lifter->stack[slot]) {
+      node->slot = i;
+      return;
+    }
+  }
+}
+
+// Emits the stack slots from `physical` up to `through`, in order.
+static void emitSlots(Lifter *lifter, int through) {
+  for (; lifter->physical < through; lifter->physical++) {
+    int slot = lifter->physical;
+    emitNode(&lifter->ir, lifter->out, lifter->stack[slot], lifter->shared,
+             lifter->line);
+    placeNode(lifter, slot, lifter->stack[slot]);
+  }
+}
+
+// Before an effect, emits every unemitted slot below `below` that could
+// raise an error, so errors keep their order, and for a store also every
+// one whose value the store could change.
+static void settle(Lifter *lifter, int below, bool store) {
+  int through = lifter->physical;
+  for (int slot = lifter->physical; slot < below; slot++) {
+    IrNode *node = &lifter->ir.nodes[lifter->stack[slot]];
+    if ((node->mayFail && node->slot == NO_SLOT) ||
+        (store && node->readsState))
+      through = slot + 1;
+  }
+  emitSlots(lifter, through);
+}
+
+// Pops the top of the stack into the emitted code: emits its node unless it
+// is already on the VM stack.
+static void emitTop(Lifter *lifter) {
+  int slot = --lifter->depth;
+  if (slot < lifter->physical) {
+    releaseSlot(lifter, slot, slot);
+    lifter->physical = slot;
+  } else {
+    emitNode(&lifter->ir, lifter->out, lifter->stack[slot], lifter->shared,
+             lifter->line);
+  }
+}
+
+static void addPatch(Lifter *lifter, int target) {
+  if (lifter->patchCount + 1 > lifter->patchCapacity) {
+    int oldCapacity = lifter->patchCapacity;
+    lifter->patchCapacity = INCREASE_CAPACITY(oldCapacity);
+    lifter->patches = INCREASE_ARRAY(Patch, lifter->patches, oldCapacity,
+                                     lifter->patchCapacity);
+  }
+  Patch *patch = &lifter->patches[lifter->patchCount++];
+  patch->operand = lifter->out->count;
+  patch->target = target;
+  writeChunk(lifter->out, 0xff, lifter->line);
+  writeChunk(lifter->out, 0xff, lifter->line);
+}
+
+// Every path into a jump target must arrive with the same stack depth.
+static bool reachTarget(Lifter *lifter, int target) {
+  if (lifter->targetDepth[target] < 0)
+    lifter->targetDepth[target] = lifter->depth;
+  return lifter->targetDepth[target] == lifter->depth;
+}
+
+static void emitJump(Lifter *lifter, uint8_t op, int target) {
+  emitOp(lifter->out, op, lifter->line);
+  addPatch(lifter, target);
+  lifter->shared = lifter->ir.count;
+}
+
+static uint8_t compareJump(uint8_t compare, bool when) {
+  switch (compare) {
+  case OP_EQUAL:
+    return when ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+  case OP_LESS:
+    return when ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+  default:
+    return when ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+  }
+}
+
+static bool isComparison(IrNode *node) {
+  return node->slot == NO_SLOT &&
+         (node->op == OP_EQUAL || node->op == OP_LESS ||
+          node->op == OP_GREATER);
+}
+
+// Emits a branch to `target` taken when `left compare right` is `when`,
+// or nothing if it can be decided now and is never taken.
+static void emitCompareJump(Lifter *lifter, uint8_t compare, bool when,
+                            int left, int right, int target) {
+  Ir *ir = &lifter->ir;
+  Value folded;
+  if (isConstant(ir, left) && isConstant(ir, right) &&
+      foldBinary(compare, ir->nodes[left].constant, ir->nodes[right].constant,
+                 &folded)) {
+    if (AS_BOOL(folded) == when)
+      emitJump(lifter, OP_JUMP, target);
+    return;
+  }
+
+  emitNode(ir, lifter->out, left, lifter->shared, lifter->line);
+  emitNode(ir, lifter->out, right, lifter->shared, lifter->line);
+  emitJump(lifter,
+           typedOpcode(compareJump(compare, when), ir->nodes[left].type,
+                       ir->nodes[right].type),
+           target);
+}
+
+// OP_JUMP_IF_FALSE on a node: a comparison branches on its operands
+// directly, and a constant condition either always jumps or never does.
+static void emitConditionalJump(Lifter *lifter, int condition, int target) {
+  Ir *ir = &lifter->ir;
+  IrNode *node = &ir->nodes[condition];
+  if (node->op == OP_CONSTANT) {
+    if (isFalsey(node->constant))
+      emitJump(lifter, OP_JUMP, target);
+  } else if (isComparison(node)) {
+    emitCompareJump(lifter, node->op, false, node->left, node->right, target);
+  } else if (node->op == OP_NOT && node->slot == NO_SLOT &&
+             isComparison(&ir->nodes[node->left])) {
+    IrNode *compare = &ir->nodes[node->left];
+    emitCompareJump(lifter, compare->op, true, compare->left, compare->right,
+                    target);
+  } else {
+    if (node->slot != NO_SLOT && node->slot == lifter->physical - 1)
+      emitOp(lifter->out, OP_DUP, lifter->line);
+    else
+      emitNode(ir, lifter->out, condition, lifter->shared, lifter->line);
+    emitJump(lifter, OP_JUMP_IF_FALSE, target);
+  }
+}
+
+// Emits an instruction the IR doesn't model as it is, once everything below
+// it is on the VM stack. What it leaves on top is a value of its own, and as
+// it may run arbitrary code, nothing known about globals survives it.
+static bool emitUnmodeled(Lifter *lifter, int offset) {
+  Chunk *chunk = lifter->chunk;
+  Chunk *out = lifter->out;
+  uint8_t op = chunk->code[offset];
+  emitSlots(lifter, lifter->depth);
+
+  int after = lifter->depth + stackEffect(op);
+  if (argumentCountOperand(op) > 0)
+    after -= chunk->code[offset + argumentCountOperand(op)];
+  if (op == OP_CONCAT_N || op == OP_INTERPOLATE)
+    after -= chunk->code[offset + 1];
+  if (after < 0 || after > LIFT_STACK_MAX)
+    return false;
+
+  int fused = fusedConstantOperation(op);
+  if (fused >= 0) {
+    // Refused with the constant by emitOp.
+    emitValue(out, chunk->constants.values[chunk->code[offset + 1]],
+              lifter->line);
+    emitOp(out, (uint8_t)fused, lifter->line);
+  } else {
+    emitOp(out, op, lifter->line);
+    for (int i = 1; i < instructionLength(op); i++)
+      writeChunk(out, chunk->code[offset + i], lifter->line);
+  }
+
+  int changed = after <= lifter->depth ? after - 1 : lifter->depth;
+  for (int slot = lifter->depth - 1; slot >= changed && slot >= 0; slot--)
+    releaseSlot(lifter, slot, changed);
+  lifter->depth = after;
+  lifter->physical = after;
+  resetCse(&lifter->ir);
+  lifter->globalCount = 0;
+  if (changed >= 0 && changed < after) {
+    placeNode(lifter, changed,
+              readNode(&lifter->ir, OP_GET_LOCAL, INT_VAL(changed),
+                       lifter->line));
+  }
+  lifter->shared = lifter->ir.count;
+  return true;
+}
+
+// Starts a basic block: the stack is all on the VM stack, and nothing known
+// about its slots or the globals carries over from the code before.
+static void startBlock(Lifter *lifter) {
+  Ir *ir = &lifter->ir;
+  for (int slot = 0; slot < lifter->physical; slot++)
+    ir->nodes[lifter->stack[slot]].slot = NO_SLOT;
+  resetCse(ir);
+  lifter->globalCount = 0;
+  for (int slot = 0; slot < lifter->depth; slot++) {
+    placeNode(lifter, slot,
+              readNode(ir, OP_GET_LOCAL, INT_VAL(slot), lifter->line));
+  }
+  lifter->physical = lifter->depth;
+  lastInstruction = -1;
+}
+
+static void findTargets(Lifter *lifter) {
+  Chunk *chunk = lifter->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0 && target < chunk->count)
+      lifter->isTarget[target] = true;
+  }
+}
+
+// Symbolically executes the chunk, turning stack slots into node indices.
+// Folding and CSE happen as each node is created, so constants propagate
+// through every expression in a single pass.
+static bool lift(Lifter *lifter) {
+  Ir *ir = &lifter->ir;
+  Chunk *chunk = lifter->chunk;
+  Chunk *out = lifter->out;
+  findTargets(lifter);
+  lifter->depth = chunk->arity >= 0 ? chunk->arity + 1 : 0;
+  startBlock(lifter);
+  bool fallsThrough = true;
+
+#define POP_NODE() (lifter->stack[--lifter->depth])
+#define PUSH_NODE(id)                                                          \
+  do {                                                                         \
+    if (lifter->depth == LIFT_STACK_MAX)                                       \
+      return false;                                                            \
+    lifter->stack[lifter->depth++] = (id);                                     \
+  } while (false)
+#define NEED(count)                                                            \
+  do {                                                                         \
+    if (lifter->depth < (count))                                               \
+      return false;                                                            \
+  } while (false)
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t code = chunk->code[offset];
+    // Typed opcodes lift to their generic form; node types carry the same
+    // information and emitNode specializes again.
+    uint8_t op = genericOpcode(code);
+    StaticType proven = code >= OP_ADD_II && code <= OP_GREATER_II
+                            ? TYPE_INT
+                        : code >= OP_ADD_DD && code <= OP_GREATER_DD
+                            ? TYPE_DOUBLE
+                        : code == OP_NEGATE_I ? TYPE_INT
+                        : code == OP_NEGATE_D ? TYPE_DOUBLE
+                        : code == OP_CONCAT_SS ? TYPE_STRING
+                        : code >= OP_JUMP_IF_LESS_II ? TYPE_INT
+                                                     : TYPE_UNKNOWN;
+    int target = jumpTarget(chunk, offset);
+    lifter->line = getLine(chunk, offset);
+
+    if (lifter->isTarget[offset] || !fallsThrough) {
+      if (fallsThrough) {
+        emitSlots(lifter, lifter->depth);
+        if (!reachTarget(lifter, offset))
+          return false;
+      } else if (lifter->targetDepth[offset] >= 0) {
+        lifter->depth = lifter->targetDepth[offset];
+      }
+      startBlock(lifter);
+      lifter->newOffset[offset] = out->count;
+      fallsThrough = true;
+    }
+
+    switch (op) {
+    case OP_CONSTANT:
+      PUSH_NODE(constantNode(
+          ir, chunk->constants.values[chunk->code[offset + 1]], lifter->line));
+      break;
+    case OP_NIL:
+      PUSH_NODE(constantNode(ir, NIL_VAL, lifter->line));
+      break;
+    case OP_TRUE:
+      PUSH_NODE(constantNode(ir, BOOL_VAL(true), lifter->line));
+      break;
+    case OP_FALSE:
+      PUSH_NODE(constantNode(ir, BOOL_VAL(false), lifter->line));
+      break;
+    case OP_DUP: {
+      NEED(1);
+      int top = lifter->stack[lifter->depth - 1];
+      PUSH_NODE(top);
+      break;
+    }
+    case OP_GET_LOCAL: {
+      int slot = chunk->code[offset + 1];
+      if (slot >= lifter->depth)
+        return false;
+      PUSH_NODE(lifter->stack[slot]);
+      break;
+    }
+    case OP_SET_LOCAL: {
+      int slot = chunk->code[offset + 1];
+      if (slot >= lifter->depth - 1)
+        return false;
+      int value = lifter->stack[lifter->depth - 1];
+      if (slot >= lifter->physical) {
+        // The slot hasn't been emitted yet, so nothing reads it at runtime.
+        lifter->stack[slot] = value;
+        break;
+      }
+      bool pending = lifter->depth - 1 >= lifter->physical;
+      settle(lifter, lifter->depth - 1, true);
+      if (pending)
+        emitNode(ir, out, value, lifter->shared, lifter->line);
+      emitOp(out, OP_SET_LOCAL, lifter->line);
+      writeChunk(out, (uint8_t)slot, lifter->line);
+      if (pending)
+        emitOp(out, OP_POP, lifter->line);
+      releaseSlot(lifter, slot, lifter->physical);
+      placeNode(lifter, slot, value);
+      lifter->shared = ir->count;
+      break;
+    }
+    case OP_GET_GLOBAL: {
+      Value name = chunk->constants.values[chunk->code[offset + 1]];
+      int index = findGlobal(lifter, name);
+      PUSH_NODE(index >= 0 ? lifter->globalValues[index]
+                           : globalNode(ir, name, lifter->line));
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      NEED(1);
+      Value name = chunk->constants.values[chunk->code[offset + 1]];
+      int value = lifter->stack[lifter->depth - 1];
+      bool pending = lifter->depth - 1 >= lifter->physical;
+      settle(lifter, lifter->depth - 1, true);
+      if (pending)
+        emitNode(ir, out, value, lifter->shared, lifter->line);
+      emitOp(out, OP_SET_GLOBAL, lifter->line);
+      writeChunk(out, emitConstantIndex(out, name), lifter->line);
+      storeGlobal(lifter, name, value);
+      if (pending) {
+        // The assignment's value is read back from the global instead.
+        emitOp(out, OP_POP, lifter->line);
+        lifter->stack[lifter->depth - 1] =
+            lifter->globalValues[findGlobal(lifter, name)];
+      }
+      lifter->shared = ir->count;
+      break;
+    }
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_CONSTANT: {
+      Value name = chunk->constants.values[chunk->code[offset + 1]];
+      if (op == OP_DEFINE_GLOBAL_CONSTANT) {
+        PUSH_NODE(constantNode(
+            ir, chunk->constants.values[chunk->code[offset + 2]],
+            lifter->line));
+      }
+      NEED(1);
+      int value = lifter->stack[lifter->depth - 1];
+      settle(lifter, lifter->depth - 1, true);
+      emitTop(lifter);
+      if (lastInstruction >= 0 && out->code[lastInstruction] == OP_CONSTANT) {
+        // OP_CONSTANT k becomes OP_DEFINE_GLOBAL_CONSTANT name k.
+        uint8_t constant = out->code[lastInstruction + 1];
+        out->code[lastInstruction] = OP_DEFINE_GLOBAL_CONSTANT;
+        out->code[lastInstruction + 1] = emitConstantIndex(out, name);
+        writeChunk(out, constant, lifter->line);
+      } else {
+        emitOp(out, OP_DEFINE_GLOBAL, lifter->line);
+        writeChunk(out, emitConstantIndex(out, name), lifter->line);
+      }
+      storeGlobal(lifter, name, value);
+      lifter->shared = ir->count;
+      break;
+    }
+    case OP_NOT:
+    case OP_NEGATE: {
+      NEED(1);
+      if (lifter->physical == lifter->depth) {
+        if (!emitUnmodeled(lifter, offset))
+          return false;
+        break;
+      }
+      int operand = POP_NODE();
+      if (proven != TYPE_UNKNOWN)
+        refineType(ir, operand, proven);
+      PUSH_NODE(unaryNode(ir, op, operand, lifter->line));
+      break;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT_EQUAL:
+    case OP_NOT_LESS:
+    case OP_NOT_GREATER: {
+      NEED(2);
+      if (lifter->physical > lifter->depth - 2) {
+        if (!emitUnmodeled(lifter, offset))
+          return false;
+        break;
+      }
+      int right = POP_NODE();
+      int left = POP_NODE();
+      if (proven != TYPE_UNKNOWN) {
+        refineType(ir, left, proven);
+        refineType(ir, right, proven);
+      }
+      if (op == OP_NOT_EQUAL || op == OP_NOT_LESS || op == OP_NOT_GREATER) {
+        uint8_t compare = op == OP_NOT_EQUAL  ? OP_EQUAL
+                          : op == OP_NOT_LESS ? OP_LESS
+                                              : OP_GREATER;
+        int result = binaryNode(ir, compare, left, right, lifter->line);
+        PUSH_NODE(unaryNode(ir, OP_NOT, result, lifter->line));
+      } else {
+        PUSH_NODE(binaryNode(ir, op, left, right, lifter->line));
+      }
+      break;
+    }
+    case OP_CONSTANT_ADD:
+    case OP_CONSTANT_SUBTRACT:
+    case OP_CONSTANT_MULTIPLY:
+    case OP_CONSTANT_DIVIDE:
+    case OP_CONSTANT_LESS:
+    case OP_CONSTANT_GREATER: {
+      NEED(1);
+      if (lifter->physical == lifter->depth) {
+        if (!emitUnmodeled(lifter, offset))
+          return false;
+        break;
+      }
+      int left = POP_NODE();
+      int right = constantNode(
+          ir, chunk->constants.values[chunk->code[offset + 1]], lifter->line);
+      PUSH_NODE(binaryNode(ir, fusedConstantOperation(op), left, right,
+                           lifter->line));
+      break;
+    }
+    case OP_POP:
+    case OP_POPN: {
+      int count = op == OP_POP ? 1 : chunk->code[offset + 1];
+      NEED(count);
+      int base = lifter->depth - count;
+      for (int slot = lifter->physical > base ? lifter->physical : base;
+           slot < lifter->depth; slot++) {
+        IrNode *node = &ir->nodes[lifter->stack[slot]];
+        // A value that can fail is still computed, and everything below it
+        // that hasn't been first.
+        if (node->mayFail && node->slot == NO_SLOT)
+          emitSlots(lifter, lifter->depth);
+      }
+      int emitted = lifter->physical > base ? lifter->physical - base : 0;
+      for (int slot = lifter->physical - 1; slot >= base; slot--)
+        releaseSlot(lifter, slot, base);
+      if (emitted == 1) {
+        emitOp(out, OP_POP, lifter->line);
+      } else if (emitted > 1) {
+        emitOp(out, OP_POPN, lifter->line);
+        writeChunk(out, (uint8_t)emitted, lifter->line);
+      }
+      lifter->depth = base;
+      if (lifter->physical > base)
+        lifter->physical = base;
+      lifter->shared = ir->count;
+      break;
+    }
+    case OP_PRINT:
+      NEED(1);
+      settle(lifter, lifter->depth - 1, false);
+      emitTop(lifter);
+      emitOp(out, OP_PRINT, lifter->line);
+      lifter->shared = ir->count;
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      emitSlots(lifter, lifter->depth);
+      if (target < 0 || !reachTarget(lifter, target))
+        return false;
+      if (op == OP_LOOP) {
+        emitOp(out, OP_LOOP, lifter->line);
+        writeChunk(out, chunk->code[offset + 1], lifter->line);
+        addPatch(lifter, target);
+      } else {
+        emitJump(lifter, OP_JUMP, target);
+      }
+      fallsThrough = false;
+      break;
+    case OP_JUMP_IF_FALSE: {
+      NEED(1);
+      if (lifter->physical == lifter->depth) {
+        emitTop(lifter);
+        emitJump(lifter, OP_JUMP_IF_FALSE, target);
+      } else {
+        int condition = POP_NODE();
+        emitSlots(lifter, lifter->depth);
+        emitConditionalJump(lifter, condition, target);
+      }
+      if (!reachTarget(lifter, target))
+        return false;
+      break;
+    }
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER: {
+      NEED(2);
+      if (lifter->physical > lifter->depth - 2) {
+        emitSlots(lifter, lifter->depth);
+        emitTop(lifter);
+        emitTop(lifter);
+        emitJump(lifter, code, target);
+      } else {
+        int right = POP_NODE();
+        int left = POP_NODE();
+        if (proven != TYPE_UNKNOWN) {
+          refineType(ir, left, proven);
+          refineType(ir, right, proven);
+        }
+        emitSlots(lifter, lifter->depth);
+        bool when = op == OP_JUMP_IF_EQUAL || op == OP_JUMP_IF_LESS ||
+                    op == OP_JUMP_IF_GREATER;
+        uint8_t compare = op <= OP_JUMP_IF_NOT_EQUAL  ? OP_EQUAL
+                          : op <= OP_JUMP_IF_NOT_LESS ? OP_LESS
+                                                      : OP_GREATER;
+        emitCompareJump(lifter, compare, when, left, right, target);
+      }
+      if (!reachTarget(lifter, target))
+        return false;
+      break;
+    }
+    case OP_RETURN:
+      // The code after a return is laid out for the stack it leaves, so
+      // maxStackDepth() needs every slot below the value emitted.
+      if (chunk->arity < 0) {
+        // The top-level chunk's return has no value.
+        emitSlots(lifter, lifter->depth);
+      } else {
+        NEED(1);
+        emitSlots(lifter, lifter->depth - 1);
+        emitTop(lifter);
+      }
+      emitOp(out, OP_RETURN, lifter->line);
+      lifter->shared = ir->count;
+      fallsThrough = false;
+      break;
+    case OP_ARRAY:
+    case OP_ARRAY_APPEND:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+    case OP_MAP:
+    case OP_MAP_INSERT:
+    case OP_MAP_MERGE:
+    case OP_IN:
+    case OP_DELETE:
+    case OP_SIZE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CONCAT_N:
+    case OP_INTERPOLATE:
+      if (!emitUnmodeled(lifter, offset))
+        return false;
+      break;
+    default:
+      return false;
+    }
+    offset += instructionLength(code);
+  }
+
+#undef POP_NODE
+#undef PUSH_NODE
+#undef NEED
+
+  for (int i = 0; i < lifter->patchCount; i++) {
+    Patch *patch = &lifter->patches[i];
+    int target = patch->target < chunk->count
+                     ? lifter->newOffset[patch->target]
+                     : -1;
+    if (target < 0)
+      return false;
+    // Forward jumps count from the end of the operand, OP_LOOP back from it.
+    int distance = target > patch->operand ? target - (patch->operand + 2)
+                                           : patch->operand + 2 - target;
+    if (distance > UINT16_MAX)
+      return false;
+    out->code[patch->operand] = (distance >> 8) & 0xff;
+    out->code[patch->operand + 1] = distance & 0xff;
+  }
+  for (int i = 0; i < chunk->loopCount; i++)
+    addLoop(out, lifter->newOffset[chunk->loops[i].header]);
+  return !fallsThrough;
+}
+
+static bool optimizeInto(Chunk *chunk, Chunk *out) {
+  initChunk(out);
+  out->arity = chunk->arity;
+  Lifter lifter;
+  initLifter(&lifter, chunk, out);
+  lastInstruction = -1;
+  tooManyConstants = false;
+  bool lifted = lift(&lifter);
+  freeLifter(&lifter);
+  if (lifted && !tooManyConstants) {
+    out->maxStackDepth = maxStackDepth(out);
+    if (checkChunk(out))
+      return true;
+  }
+  freeChunk(out);
+  return false;
+}
+
+bool optimizeChunk(Chunk *chunk) {
+  Chunk out;
+  refineTypes = true;
+  if (!optimizeInto(chunk, &out)) {
+    refineTypes = false;
+    if (!optimizeInto(chunk, &out))
+      return false;
+  }
+  freeChunk(chunk);
+  *chunk = out;
+  return true;
+}
@@ -0,0 +1,15 @@
+#ifndef rotlang_optimizer_h
+#define rotlang_optimizer_h
+
+#include "chunk.h"
+
+// Lifts each basic block of the chunk into an SSA-style IR, folding and
+// propagating constants, forwarding stores to locals and globals to later
+// reads and eliminating common subexpressions, and re-emits the chunk in
+// place, computing values only where they are used. Returns false and leaves
+// the chunk untouched if it contains an instruction the lifter doesn't know,
+// if a jump no longer fits, if the optimized chunk would need more than 256
+// constants or if the verifier rejects it.
+bool optimizeChunk(Chunk *chunk);
+
+#endif
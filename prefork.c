@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "object.h"
+#include "prefork.h"
+#include "vm.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// One request, including its newline. Longer lines of stdin are skipped and
+// longer socket requests are cut off.
+#define REQUEST_MAX 65536
+
+#if defined(__linux__)
+
+static char requestBuffer[REQUEST_MAX];
+
+// Running a request writes to a few things the parent set up, and each
+// worker gets its own copy of the pages they're on: the globals table slot
+// for `request`, each chunk's loop counters and inline caches (arrays of
+// their own, so the code beside them stays shared), and the chunk of any
+// function first called in a worker, since bodies are compiled on first
+// call. Constants and strings are only read, and there are no reference
+// counts or mark bits in object headers. New strings go on new pages.
+static void serveRequest(Chunk *entry, const char *text, int length) {
+  if (length > 0 && text[length - 1] == '\n')
+    length--;
+  tableSet(&vm.globals, makeString("request", 7), makeString(text, length));
+  interpretChunk(entry);
+  fflush(stdout);
+}
+
+// Requests arrive as packets on a SOCK_SEQPACKET pair, which keeps message
+// boundaries even with every worker reading the same socket.
+static void serveStdin(Chunk *entry, int channel) {
+  for (;;) {
+    ssize_t length = recv(channel, requestBuffer, REQUEST_MAX, 0);
+    if (length < 0 && errno == EINTR)
+      continue;
+    if (length <= 0)
+      return;
+    serveRequest(entry, requestBuffer, (int)length);
+  }
+}
+
+// Reads up to the first newline or the end of the connection.
+static int readRequest(int connection) {
+  int length = 0;
+  while (length < REQUEST_MAX) {
+    ssize_t count =
+        read(connection, requestBuffer + length, REQUEST_MAX - length);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      break;
+    char *newline = memchr(requestBuffer + length, '\n', count);
+    length += (int)count;
+    if (newline != NULL)
+      return (int)(newline - requestBuffer) + 1;
+  }
+  return length;
+}
+
+static void serveSocket(Chunk *entry, int listener) {
+  for (;;) {
+    int connection = accept(listener, NULL, NULL);
+    if (connection < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      return;
+    }
+
+    int length = readRequest(connection);
+    int savedStdout = dup(STDOUT_FILENO);
+    dup2(connection, STDOUT_FILENO);
+    serveRequest(entry, requestBuffer, length);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    close(connection);
+  }
+}
+
+static int listenAt(const char *path) {
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perror(path);
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+// Hands each line of stdin to whichever worker is free, then closes the
+// channel so the workers see end of input.
+static void dispatchStdin(int channel) {
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, stdin)) >= 0) {
+    if (length > REQUEST_MAX) {
+      fprintf(stderr, "Skipping a request longer than %d bytes.\n",
+              REQUEST_MAX);
+      continue;
+    }
+    if (send(channel, line, (size_t)length, 0) < 0) {
+      perror("send");
+      break;
+    }
+  }
+  free(line);
+  close(channel);
+}
+
+static int serve(Chunk *entry, int workers, const char *socketPath) {
+  int channel[2];
+  int listener = -1;
+  if (socketPath != NULL) {
+    listener = listenAt(socketPath);
+    if (listener < 0)
+      return 74;
+    // A client hanging up early must not kill the worker writing to it.
+    signal(SIGPIPE, SIG_IGN);
+  } else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) < 0) {
+    perror("socketpair");
+    return 74;
+  }
+
+  // Anything the setup printed must not be flushed once per worker.
+  fflush(stdout);
+  for (int i = 0; i < workers; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (pid == 0) {
+      if (socketPath != NULL) {
+        serveSocket(entry, listener);
+      } else {
+        close(channel[0]);
+        serveStdin(entry, channel[1]);
+      }
+      exit(0);
+    }
+  }
+
+  if (socketPath == NULL) {
+    close(channel[1]);
+    dispatchStdin(channel[0]);
+  }
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+  return 0;
+}
+
+#else
+
+static int serve(Chunk *entry, int workers, const char *socketPath) {
+  fprintf(stderr, "--prefork needs fork() and Unix sockets.\n");
+  return 64;
+}
+
+#endif
+
+// Everything that writes to long-lived state happens here, before the fork:
+// running the setup, verifying the entry chunk, sizing the stack, and giving
+// `request` its slot in the globals table.
+static int prepare(Chunk *setup, Chunk *entry, const char *setupSource,
+                   const char *entrySource) {
+  if (!compile(setupSource, setup) || !compile(entrySource, entry))
+    return 65;
+  if (interpretChunk(setup) != INTERPRET_OK)
+    return 70;
+  if (loadChunk(entry) != INTERPRET_OK)
+    return 65;
+  tableSet(&vm.globals, makeString("request", 7), NIL_VAL);
+  return 0;
+}
+
+int runPrefork(const char *setupSource, const char *entrySource, int workers,
+               const char *socketPath) {
+  Chunk setup;
+  Chunk entry;
+  initChunk(&setup);
+  initChunk(&entry);
+
+  int status = prepare(&setup, &entry, setupSource, entrySource);
+  if (status == 0)
+    status = serve(&entry, workers, socketPath);
+
+  freeChunk(&setup);
+  freeChunk(&entry);
+  return status;
+}
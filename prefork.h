@@ -0,0 +1,15 @@
+#ifndef rotlang_prefork_h
+#define rotlang_prefork_h
+
+#include "common.h"
+
+// Compiles `setupSource` and `entrySource`, runs the setup once, then forks
+// `workers` processes that run the entry chunk once per request with the
+// request text in the global `request`. Requests are lines of stdin, or,
+// when `socketPath` is set, connections to a Unix socket there, whose output
+// goes back over the connection. Everything compiled and interned before the
+// fork is shared copy-on-write. Returns the process exit code.
+int runPrefork(const char *setupSource, const char *entrySource, int workers,
+               const char *socketPath);
+
+#endif
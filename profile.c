@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+
+#define REPORT_OPCODES 10
+#define REPORT_NGRAMS 15
+#define REPORT_LOOPS 10
+
+#define PAIR_COUNT (PROFILE_OPCODES * PROFILE_OPCODES)
+#define TRIPLE_COUNT (PAIR_COUNT * PROFILE_OPCODES)
+
+typedef struct {
+  int index;
+  uint64_t count;
+} Ngram;
+
+void initOpProfile(OpProfile *profile) {
+  profile->dispatches = 0;
+  memset(profile->opcodes, 0, sizeof(profile->opcodes));
+  profile->pairs = ALLOCATE(uint64_t, PAIR_COUNT);
+  memset(profile->pairs, 0, sizeof(uint64_t) * PAIR_COUNT);
+  profile->triples = ALLOCATE(uint64_t, TRIPLE_COUNT);
+  memset(profile->triples, 0, sizeof(uint64_t) * TRIPLE_COUNT);
+  profile->script = "script";
+  profile->loops = NULL;
+  profile->loopCount = 0;
+  profile->loopCapacity = 0;
+  resetProfileWindow(profile);
+}
+
+void freeOpProfile(OpProfile *profile) {
+  FREE_ARRAY(uint64_t, profile->pairs, PAIR_COUNT);
+  FREE_ARRAY(uint64_t, profile->triples, TRIPLE_COUNT);
+  FREE_ARRAY(HotLoop, profile->loops, profile->loopCapacity);
+  profile->pairs = NULL;
+  profile->triples = NULL;
+  profile->loops = NULL;
+  profile->loopCount = 0;
+  profile->loopCapacity = 0;
+}
+
+void resetProfileWindow(OpProfile *profile) {
+  profile->window[0] = PROFILE_NONE;
+  profile->window[1] = PROFILE_NONE;
+}
+
+void profileLoops(OpProfile *profile, Chunk *chunk) {
+  for (int i = 0; i < chunk->loopCount; i++) {
+    if (chunk->loops[i].iterations == 0)
+      continue;
+    if (profile->loopCount == profile->loopCapacity) {
+      int oldCapacity = profile->loopCapacity;
+      profile->loopCapacity = INCREASE_CAPACITY(oldCapacity);
+      profile->loops = INCREASE_ARRAY(HotLoop, profile->loops, oldCapacity,
+                                      profile->loopCapacity);
+    }
+    HotLoop *loop = &profile->loops[profile->loopCount++];
+    loop->script = profile->script;
+    loop->line = getLine(chunk, chunk->loops[i].header);
+    loop->iterations = chunk->loops[i].iterations;
+  }
+}
+
+static int compareNgrams(const void *a, const void *b) {
+  uint64_t left = ((const Ngram *)a)->count;
+  uint64_t right = ((const Ngram *)b)->count;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static double share(uint64_t count, uint64_t total) {
+  return total == 0 ? 0.0 : 100.0 * (double)count / (double)total;
+}
+
+// Ranks the n-grams of one length and prints the most frequent ones. An
+// n-gram's index is its opcodes as base-PROFILE_OPCODES digits, oldest first.
+static void printNgrams(OpProfile *profile, uint64_t *counts, int total,
+                        int length, FILE *out) {
+  Ngram *ranked = ALLOCATE(Ngram, total);
+  int count = 0;
+  for (int index = 0; index < total; index++) {
+    if (counts[index] == 0)
+      continue;
+    // Windows that reach back past the start of a stream aren't n-grams.
+    bool complete = true;
+    for (int rest = index, i = 0; i < length; i++, rest /= PROFILE_OPCODES) {
+      if (rest % PROFILE_OPCODES == PROFILE_NONE)
+        complete = false;
+    }
+    if (!complete)
+      continue;
+    ranked[count].index = index;
+    ranked[count].count = counts[index];
+    count++;
+  }
+  qsort(ranked, count, sizeof(Ngram), compareNgrams);
+
+  fprintf(out, "\n%s by frequency:\n", length == 2 ? "Pairs" : "Triples");
+  for (int i = 0; i < count && i < REPORT_NGRAMS; i++) {
+    // Fusing an n-gram saves n - 1 dispatches each time it occurs.
+    uint64_t saved = ranked[i].count * (uint64_t)(length - 1);
+    fprintf(out, "  %12llu  saves %5.1f%%  ",
+            (unsigned long long)ranked[i].count,
+            share(saved, profile->dispatches));
+
+    int scale = length == 2 ? PROFILE_OPCODES : PAIR_COUNT;
+    for (int rest = ranked[i].index; scale > 0; scale /= PROFILE_OPCODES) {
+      fprintf(out, scale == 1 ? "%s\n" : "%s -> ", opcodeName(rest / scale));
+      rest %= scale;
+    }
+  }
+  FREE_ARRAY(Ngram, ranked, total);
+}
+
+static int compareLoops(const void *a, const void *b) {
+  uint64_t left = ((const HotLoop *)a)->iterations;
+  uint64_t right = ((const HotLoop *)b)->iterations;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void printLoops(OpProfile *profile, FILE *out) {
+  if (profile->loopCount == 0)
+    return;
+  qsort(profile->loops, profile->loopCount, sizeof(HotLoop), compareLoops);
+  fprintf(out, "\nLoops by iterations:\n");
+  for (int i = 0; i < profile->loopCount && i < REPORT_LOOPS; i++) {
+    HotLoop *loop = &profile->loops[i];
+    fprintf(out, "  %12llu  %s:%d\n", (unsigned long long)loop->iterations,
+            loop->script, loop->line);
+  }
+}
+
+void printOpProfile(OpProfile *profile, FILE *out) {
+  fprintf(out, "%llu dispatches\n", (unsigned long long)profile->dispatches);
+
+  int ops[PROFILE_OPCODES];
+  int opCount = 0;
+  for (int op = 0; op < PROFILE_OPCODES; op++) {
+    if (profile->opcodes[op] > 0)
+      ops[opCount++] = op;
+  }
+  // Selection order is fine here: there are only a few dozen opcodes.
+  fprintf(out, "\nOpcodes by frequency:\n");
+  for (int i = 0; i < opCount && i < REPORT_OPCODES; i++) {
+    int best = i;
+    for (int j = i + 1; j < opCount; j++) {
+      if (profile->opcodes[ops[j]] > profile->opcodes[ops[best]])
+        best = j;
+    }
+    int op = ops[best];
+    ops[best] = ops[i];
+    ops[i] = op;
+    fprintf(out, "  %12llu  %5.1f%%  %s\n",
+            (unsigned long long)profile->opcodes[op],
+            share(profile->opcodes[op], profile->dispatches), opcodeName(op));
+  }
+
+  printNgrams(profile, profile->pairs, PAIR_COUNT, 2, out);
+  printNgrams(profile, profile->triples, TRIPLE_COUNT, 3, out);
+  printLoops(profile, out);
+}
@@ -0,0 +1,63 @@
+#ifndef rotlang_profile_h
+#define rotlang_profile_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+// Opcode n-gram counts gathered by the stack VM while --profile-ops is on.
+// Counts live in dense arrays indexed by opcode so that recording one
+// dispatch is a handful of increments with no calls: anything opaque in the
+// dispatch loop would make run() reload its registers on every instruction.
+#define PROFILE_OPCODES 128
+// A pseudo-opcode filling the window at the start of an instruction stream,
+// so n-grams never span two streams. Real opcodes must stay below it.
+#define PROFILE_NONE (PROFILE_OPCODES - 1)
+
+// How often the loop starting at `line` of `script` went around.
+typedef struct {
+  const char *script;
+  int line;
+  uint64_t iterations;
+} HotLoop;
+
+typedef struct {
+  uint64_t dispatches;
+  uint64_t opcodes[PROFILE_OPCODES];
+  // The two previous opcodes in the current instruction stream.
+  int window[2];
+  uint64_t *pairs;   // [PROFILE_OPCODES][PROFILE_OPCODES]
+  uint64_t *triples; // [PROFILE_OPCODES][PROFILE_OPCODES][PROFILE_OPCODES]
+  // The script now running, which labels the loops profileLoops() records.
+  const char *script;
+  HotLoop *loops;
+  int loopCount;
+  int loopCapacity;
+} OpProfile;
+
+void initOpProfile(OpProfile *profile);
+void freeOpProfile(OpProfile *profile);
+// Starts a new instruction stream.
+void resetProfileWindow(OpProfile *profile);
+// Records the loop counters of a chunk that has finished running.
+void profileLoops(OpProfile *profile, Chunk *chunk);
+// Prints the opcode mix and the most frequent pairs and triples, with the
+// share of dispatches fusing each one would remove, then the loops that went
+// around the most.
+void printOpProfile(OpProfile *profile, FILE *out);
+
+static inline void profileOpcode(OpProfile *profile, uint8_t op) {
+  int first = profile->window[0];
+  int second = profile->window[1];
+  int third = op & (PROFILE_OPCODES - 1);
+  profile->dispatches++;
+  profile->opcodes[third]++;
+  profile->pairs[second * PROFILE_OPCODES + third]++;
+  profile->triples[(first * PROFILE_OPCODES + second) * PROFILE_OPCODES +
+                   third]++;
+  profile->window[0] = second;
+  profile->window[1] = third;
+}
+
+#endif
@@ -0,0 +1,514 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "regcode.h"
+
+void initRegChunk(RegChunk *chunk) {
+  chunk->count = 0;
+  chunk->capacity = 0;
+  chunk->code = NULL;
+  chunk->lines = NULL;
+  chunk->registerCount = 0;
+  initValueArray(&chunk->constants);
+}
+
+void freeRegChunk(RegChunk *chunk) {
+  FREE_ARRAY_AS(MEM_CHUNK, uint32_t, chunk->code, chunk->capacity);
+  FREE_ARRAY_AS(MEM_CHUNK, int, chunk->lines, chunk->capacity);
+  freeValueArray(&chunk->constants);
+  initRegChunk(chunk);
+}
+
+static void writeInstruction(RegChunk *chunk, uint8_t op, uint8_t a,
+                             uint8_t b, uint8_t c, int line) {
+  if (chunk->count + 1 > chunk->capacity) {
+    int oldCapacity = chunk->capacity;
+    chunk->capacity = INCREASE_CAPACITY(oldCapacity);
+    chunk->code = INCREASE_ARRAY_AS(MEM_CHUNK, uint32_t, chunk->code,
+                                    oldCapacity, chunk->capacity);
+    chunk->lines = INCREASE_ARRAY_AS(MEM_CHUNK, int, chunk->lines, oldCapacity,
+                                     chunk->capacity);
+  }
+  chunk->code[chunk->count] =
+      (uint32_t)op | (uint32_t)a << 8 | (uint32_t)b << 16 | (uint32_t)c << 24;
+  chunk->lines[chunk->count] = line;
+  chunk->count++;
+}
+
+// A slot on the translator's symbolic stack: either the register holding the
+// value or the constant it would have been loaded from. A slot's register is
+// usually its own, but reading a local leaves the local's register there
+// until something assigns the local.
+typedef struct {
+  bool isConstant;
+  uint8_t index;
+} Operand;
+
+// Where control flow joins, every slot must be in its own register, since
+// the paths meeting there may have left different operands in them.
+typedef struct {
+  bool *isTarget;   // Indexed by stack code offset.
+  int *start;       // The register instruction each offset starts at.
+  int *depth;       // The stack depth jumps to each offset arrive with.
+  int *jumps;       // The REG_JUMPs to patch, each still holding an offset.
+  int jumpCount;
+} Labels;
+
+// nil, true and false have no constant in the stack chunk; give them one.
+static bool literalConstant(RegChunk *out, Value value, uint8_t *index) {
+  for (int i = 0; i < out->constants.count; i++) {
+    Value existing = out->constants.values[i];
+    if (existing.type == value.type && valuesEqual(existing, value)) {
+      *index = (uint8_t)i;
+      return true;
+    }
+  }
+  if (out->constants.count > UINT8_MAX)
+    return false;
+  writeValueArray(&out->constants, value);
+  *index = (uint8_t)(out->constants.count - 1);
+  return true;
+}
+
+static uint8_t binaryOp(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return REG_EQUAL;
+  case OP_GREATER:
+    return REG_GREATER;
+  case OP_LESS:
+    return REG_LESS;
+  case OP_ADD:
+    return REG_ADD;
+  case OP_SUBTRACT:
+    return REG_SUBTRACT;
+  case OP_MULTIPLY:
+    return REG_MULTIPLY;
+  default:
+    return REG_DIVIDE;
+  }
+}
+
+static uint8_t rkFlags(Operand b, Operand c) {
+  return (b.isConstant ? REG_KB : 0) | (c.isConstant ? REG_KC : 0);
+}
+
+// Moves each slot from `from` up that isn't in its own register into it.
+static void flushSlots(RegChunk *out, Operand *stack, int from, int depth,
+                       int line) {
+  for (int i = from; i < depth; i++) {
+    if (stack[i].isConstant || stack[i].index != i) {
+      writeInstruction(out, REG_MOVE | (stack[i].isConstant ? REG_KB : 0),
+                       (uint8_t)i, stack[i].index, 0, line);
+      stack[i].isConstant = false;
+      stack[i].index = (uint8_t)i;
+    }
+  }
+}
+
+// Ends a block with a jump to the stack code at `target`, patched to its
+// register instruction once everything is translated.
+static void writeJump(RegChunk *out, Labels *labels, int target, int depth,
+                      int line) {
+  labels->depth[target] = depth;
+  labels->jumps[labels->jumpCount++] = out->count;
+  writeInstruction(out, REG_JUMP, 0, (uint8_t)target, (uint8_t)(target >> 8),
+                   line);
+}
+
+static bool translateCode(Chunk *chunk, RegChunk *out, Labels *labels) {
+  Operand stack[UINT8_MAX + 1];
+  int depth = 0;
+  // Whether the instruction before can fall through to the next one.
+  bool fallsThrough = true;
+  // The instruction that computed the value the one before pushed, or -1.
+  int result = -1;
+
+  for (int i = 0; i < chunk->constants.count; i++)
+    writeValueArray(&out->constants, chunk->constants.values[i]);
+
+#define POP_OPERAND() (stack[--depth])
+#define NEED(n)                                                                \
+  do {                                                                         \
+    if (depth < (n))                                                           \
+      return false;                                                            \
+  } while (false)
+#define PUSH_OPERAND(constant, slot)                                           \
+  do {                                                                         \
+    if (depth > UINT8_MAX)                                                     \
+      return false;                                                            \
+    stack[depth].isConstant = (constant);                                      \
+    stack[depth].index = (uint8_t)(slot);                                      \
+    depth++;                                                                   \
+    if (depth > out->registerCount)                                            \
+      out->registerCount = depth;                                              \
+  } while (false)
+  // Pushes what the instruction just written left in the next register.
+#define PUSH_RESULT()                                                          \
+  do {                                                                         \
+    PUSH_OPERAND(false, depth);                                                \
+    result = out->count - 1;                                                   \
+  } while (false)
+
+  for (int offset = 0; offset < chunk->count;) {
+    // Register instructions check their own operand types.
+    uint8_t op = genericOpcode(chunk->code[offset]);
+    int line = getLine(chunk, offset);
+    uint8_t index;
+    int pushed = result;
+    result = -1;
+
+    if (labels->isTarget[offset]) {
+      pushed = -1;
+      if (fallsThrough) {
+        flushSlots(out, stack, 0, depth, line);
+      } else {
+        depth = labels->depth[offset];
+        for (int i = 0; i < depth; i++) {
+          stack[i].isConstant = false;
+          stack[i].index = (uint8_t)i;
+        }
+      }
+    }
+    labels->start[offset] = out->count;
+    fallsThrough = op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+
+    switch (op) {
+    case OP_CONSTANT:
+      PUSH_OPERAND(true, chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE: {
+      Value value = op == OP_NIL    ? NIL_VAL
+                    : op == OP_TRUE ? BOOL_VAL(true)
+                                    : BOOL_VAL(false);
+      if (!literalConstant(out, value, &index))
+        return false;
+      PUSH_OPERAND(true, index);
+      offset++;
+      break;
+    }
+    case OP_DUP: {
+      NEED(1);
+      Operand top = stack[depth - 1];
+      PUSH_OPERAND(top.isConstant, top.index);
+      offset++;
+      break;
+    }
+    case OP_POP:
+      // Operands are already in their registers; nothing to discard.
+      NEED(1);
+      depth--;
+      offset++;
+      break;
+    case OP_POPN:
+      NEED(chunk->code[offset + 1]);
+      depth -= chunk->code[offset + 1];
+      offset += 2;
+      break;
+    case OP_GET_LOCAL: {
+      uint8_t slot = chunk->code[offset + 1];
+      NEED(slot + 1);
+      Operand local = stack[slot];
+      PUSH_OPERAND(local.isConstant, local.index);
+      offset += 2;
+      break;
+    }
+    case OP_SET_LOCAL: {
+      uint8_t slot = chunk->code[offset + 1];
+      NEED(slot + 2);
+      // Reads of the local still on the stack keep the old value.
+      bool read = false;
+      for (int i = slot + 1; i < depth; i++) {
+        if (!stack[i].isConstant && stack[i].index == slot) {
+          writeInstruction(out, REG_MOVE, (uint8_t)i, slot, 0, line);
+          stack[i].index = (uint8_t)i;
+          read = true;
+        }
+      }
+      Operand value = stack[depth - 1];
+      if (pushed >= 0 && !read) {
+        // `x = x + 1` adds straight into x's register.
+        out->code[pushed] =
+            (out->code[pushed] & ~0xff00u) | (uint32_t)slot << 8;
+        stack[depth - 1].index = slot;
+      } else {
+        writeInstruction(out, REG_MOVE | (value.isConstant ? REG_KB : 0), slot,
+                         value.index, 0, line);
+      }
+      stack[slot].isConstant = false;
+      stack[slot].index = slot;
+      offset += 2;
+      break;
+    }
+    case OP_NOT:
+    case OP_NEGATE: {
+      NEED(1);
+      Operand b = POP_OPERAND();
+      uint8_t regOp = op == OP_NOT ? REG_NOT : REG_NEGATE;
+      writeInstruction(out, regOp | (b.isConstant ? REG_KB : 0),
+                       (uint8_t)depth, b.index, 0, line);
+      PUSH_RESULT();
+      offset++;
+      break;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      NEED(2);
+      Operand c = POP_OPERAND();
+      Operand b = POP_OPERAND();
+      writeInstruction(out, binaryOp(op) | rkFlags(b, c), (uint8_t)depth,
+                       b.index, c.index, line);
+      PUSH_RESULT();
+      offset++;
+      break;
+    }
+    case OP_CONSTANT_ADD:
+    case OP_CONSTANT_SUBTRACT:
+    case OP_CONSTANT_MULTIPLY:
+    case OP_CONSTANT_DIVIDE:
+    case OP_CONSTANT_LESS:
+    case OP_CONSTANT_GREATER: {
+      NEED(1);
+      Operand b = POP_OPERAND();
+      uint8_t regOp = binaryOp(fusedConstantOperation(op));
+      writeInstruction(out, regOp | (b.isConstant ? REG_KB : 0) | REG_KC,
+                       (uint8_t)depth, b.index, chunk->code[offset + 1], line);
+      PUSH_RESULT();
+      offset += 2;
+      break;
+    }
+    case OP_NOT_EQUAL:
+    case OP_NOT_LESS:
+    case OP_NOT_GREATER: {
+      NEED(2);
+      Operand c = POP_OPERAND();
+      Operand b = POP_OPERAND();
+      uint8_t regOp = op == OP_NOT_EQUAL  ? REG_EQUAL
+                      : op == OP_NOT_LESS ? REG_LESS
+                                          : REG_GREATER;
+      writeInstruction(out, regOp | rkFlags(b, c), (uint8_t)depth, b.index,
+                       c.index, line);
+      writeInstruction(out, REG_NOT, (uint8_t)depth, (uint8_t)depth, 0, line);
+      PUSH_RESULT();
+      offset++;
+      break;
+    }
+    case OP_PRINT: {
+      NEED(1);
+      Operand b = POP_OPERAND();
+      writeInstruction(out, REG_PRINT | (b.isConstant ? REG_KB : 0), 0,
+                       b.index, 0, line);
+      offset++;
+      break;
+    }
+    case OP_DEFINE_GLOBAL: {
+      NEED(1);
+      Operand b = POP_OPERAND();
+      writeInstruction(out, REG_DEFINE_GLOBAL | (b.isConstant ? REG_KB : 0),
+                       chunk->code[offset + 1], b.index, 0, line);
+      offset += 2;
+      break;
+    }
+    case OP_GET_GLOBAL:
+      writeInstruction(out, REG_GET_GLOBAL | REG_KB, (uint8_t)depth,
+                       chunk->code[offset + 1], 0, line);
+      PUSH_RESULT();
+      offset += 2;
+      break;
+    case OP_SET_GLOBAL: {
+      NEED(1);
+      Operand b = stack[depth - 1];
+      writeInstruction(out, REG_SET_GLOBAL | (b.isConstant ? REG_KB : 0),
+                       chunk->code[offset + 1], b.index, 0, line);
+      offset += 2;
+      break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+      flushSlots(out, stack, 0, depth, line);
+      writeJump(out, labels, jumpTarget(chunk, offset), depth, line);
+      offset += instructionLength(op);
+      break;
+    case OP_JUMP_IF_FALSE: {
+      NEED(1);
+      Operand b = POP_OPERAND();
+      flushSlots(out, stack, 0, depth, line);
+      writeInstruction(out, REG_IF_FALSE | (b.isConstant ? REG_KB : 0), 0,
+                       b.index, 0, line);
+      writeJump(out, labels, jumpTarget(chunk, offset), depth, line);
+      offset += 3;
+      break;
+    }
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER: {
+      NEED(2);
+      Operand c = POP_OPERAND();
+      Operand b = POP_OPERAND();
+      flushSlots(out, stack, 0, depth, line);
+      uint8_t regOp = op <= OP_JUMP_IF_NOT_EQUAL ? REG_IF_EQUAL
+                      : op <= OP_JUMP_IF_NOT_LESS ? REG_IF_LESS
+                                                  : REG_IF_GREATER;
+      // The negated forms follow their positive ones.
+      bool when = (op - OP_JUMP_IF_EQUAL) % 2 == 0;
+      writeInstruction(out, regOp | rkFlags(b, c), when, b.index, c.index,
+                       line);
+      writeJump(out, labels, jumpTarget(chunk, offset), depth, line);
+      offset += 3;
+      break;
+    }
+    case OP_DEFINE_GLOBAL_CONSTANT:
+      writeInstruction(out, REG_DEFINE_GLOBAL | REG_KB, chunk->code[offset + 1],
+                       chunk->code[offset + 2], 0, line);
+      offset += 3;
+      break;
+    case OP_RETURN:
+      writeInstruction(out, REG_RETURN, 0, 0, 0, line);
+      offset++;
+      break;
+    default:
+      return false;
+    }
+  }
+
+#undef POP_OPERAND
+#undef NEED
+#undef PUSH_OPERAND
+#undef PUSH_RESULT
+
+  for (int i = 0; i < labels->jumpCount; i++) {
+    uint32_t *jump = &out->code[labels->jumps[i]];
+    int target = labels->start[REG_BX(*jump)];
+    if (target > UINT16_MAX)
+      return false;
+    *jump = REG_JUMP | (uint32_t)target << 16;
+  }
+  return true;
+}
+
+bool translateChunk(Chunk *chunk, RegChunk *out) {
+  Labels labels;
+  labels.isTarget = ALLOCATE(bool, chunk->count);
+  labels.start = ALLOCATE(int, chunk->count);
+  labels.depth = ALLOCATE(int, chunk->count);
+  // Every jump instruction is at least three bytes long.
+  labels.jumps = ALLOCATE(int, chunk->count / 3 + 1);
+  labels.jumpCount = 0;
+  for (int offset = 0; offset < chunk->count; offset++)
+    labels.isTarget[offset] = false;
+
+  bool translated = chunk->count <= UINT16_MAX;
+  for (int offset = 0; translated && offset < chunk->count;) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0)
+      labels.isTarget[target] = true;
+    offset += instructionLength(chunk->code[offset]);
+  }
+  translated = translated && translateCode(chunk, out, &labels);
+
+  FREE_ARRAY(bool, labels.isTarget, chunk->count);
+  FREE_ARRAY(int, labels.start, chunk->count);
+  FREE_ARRAY(int, labels.depth, chunk->count);
+  FREE_ARRAY(int, labels.jumps, chunk->count / 3 + 1);
+  return translated;
+}
+
+static const char *regOpNames[] = {
+    [REG_EQUAL] = "REG_EQUAL",
+    [REG_GREATER] = "REG_GREATER",
+    [REG_LESS] = "REG_LESS",
+    [REG_ADD] = "REG_ADD",
+    [REG_SUBTRACT] = "REG_SUBTRACT",
+    [REG_MULTIPLY] = "REG_MULTIPLY",
+    [REG_DIVIDE] = "REG_DIVIDE",
+    [REG_NOT] = "REG_NOT",
+    [REG_NEGATE] = "REG_NEGATE",
+    [REG_PRINT] = "REG_PRINT",
+    [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL",
+    [REG_GET_GLOBAL] = "REG_GET_GLOBAL",
+    [REG_SET_GLOBAL] = "REG_SET_GLOBAL",
+    [REG_MOVE] = "REG_MOVE",
+    [REG_JUMP] = "REG_JUMP",
+    [REG_IF_FALSE] = "REG_IF_FALSE",
+    [REG_IF_EQUAL] = "REG_IF_EQUAL",
+    [REG_IF_LESS] = "REG_IF_LESS",
+    [REG_IF_GREATER] = "REG_IF_GREATER",
+    [REG_RETURN] = "REG_RETURN",
+};
+
+static void printOperand(RegChunk *chunk, bool isConstant, uint8_t index) {
+  if (isConstant) {
+    printf(" K%d'", index);
+    printValue(chunk->constants.values[index]);
+    printf("'");
+  } else {
+    printf(" R%d", index);
+  }
+}
+
+void disassembleRegChunk(RegChunk *chunk, const char *name) {
+  printf("== %s (%d registers) ==\n", name, chunk->registerCount);
+
+  for (int i = 0; i < chunk->count; i++) {
+    uint32_t instruction = chunk->code[i];
+    uint8_t op = REG_OP(instruction) & REG_OP_MASK;
+    bool kb = REG_OP(instruction) & REG_KB;
+    bool kc = REG_OP(instruction) & REG_KC;
+
+    printf("%04d ", i);
+    if (i > 0 && chunk->lines[i] == chunk->lines[i - 1]) {
+      printf("   | ");
+    } else {
+      printf("%4d ", chunk->lines[i]);
+    }
+    printf("%-17s", regOpNames[op]);
+
+    switch (op) {
+    case REG_RETURN:
+      break;
+    case REG_PRINT:
+    case REG_IF_FALSE:
+      printOperand(chunk, kb, REG_B(instruction));
+      break;
+    case REG_JUMP:
+      printf(" %04d", REG_BX(instruction));
+      break;
+    case REG_IF_EQUAL:
+    case REG_IF_LESS:
+    case REG_IF_GREATER:
+      printf(" %s", REG_A(instruction) ? "true" : "false");
+      printOperand(chunk, kb, REG_B(instruction));
+      printOperand(chunk, kc, REG_C(instruction));
+      break;
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL:
+      printOperand(chunk, true, REG_A(instruction));
+      printOperand(chunk, kb, REG_B(instruction));
+      break;
+    case REG_NOT:
+    case REG_NEGATE:
+    case REG_GET_GLOBAL:
+    case REG_MOVE:
+      printf(" R%d", REG_A(instruction));
+      printOperand(chunk, kb, REG_B(instruction));
+      break;
+    default:
+      printf(" R%d", REG_A(instruction));
+      printOperand(chunk, kb, REG_B(instruction));
+      printOperand(chunk, kc, REG_C(instruction));
+      break;
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef rotlang_regcode_h
+#define rotlang_regcode_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+// Register instructions are one 32-bit word: opcode, then operands A, B and
+// C. A is a register, except for the globals' constant names and the
+// branches' flag. B and C are "RK" operands: a register, or a constant when
+// the opcode carries the matching REG_KB / REG_KC bit. REG_JUMP instead
+// takes B and C together as Bx, the index of the instruction it goes to.
+//
+// A branch is a test followed by the REG_JUMP it takes: when the test comes
+// out as its flag says the jump is taken, and otherwise skipped, with one
+// dispatch either way.
+typedef enum {
+  REG_EQUAL,         // R(A) = RK(B) == RK(C)
+  REG_GREATER,       // R(A) = RK(B) > RK(C)
+  REG_LESS,          // R(A) = RK(B) < RK(C)
+  REG_ADD,           // R(A) = RK(B) + RK(C)
+  REG_SUBTRACT,      // R(A) = RK(B) - RK(C)
+  REG_MULTIPLY,      // R(A) = RK(B) * RK(C)
+  REG_DIVIDE,        // R(A) = RK(B) / RK(C)
+  REG_NOT,           // R(A) = !RK(B)
+  REG_NEGATE,        // R(A) = -RK(B)
+  REG_PRINT,         // print RK(B)
+  REG_DEFINE_GLOBAL, // globals[K(A)] = RK(B)
+  REG_GET_GLOBAL,    // R(A) = globals[K(B)]
+  REG_SET_GLOBAL,    // globals[K(A)] = RK(B), which must already exist
+  REG_MOVE,          // R(A) = RK(B)
+  REG_JUMP,          // go to Bx
+  REG_IF_FALSE,      // take the next jump if RK(B) is falsey
+  REG_IF_EQUAL,      // take the next jump if (RK(B) == RK(C)) == A
+  REG_IF_LESS,       // take the next jump if (RK(B) < RK(C)) == A
+  REG_IF_GREATER,    // take the next jump if (RK(B) > RK(C)) == A
+  REG_RETURN,
+} RegOpCode;
+
+#define REG_KB 0x40
+#define REG_KC 0x80
+#define REG_OP_MASK 0x3f
+
+#define REG_OP(instruction) ((instruction) & 0xff)
+#define REG_A(instruction) (((instruction) >> 8) & 0xff)
+#define REG_B(instruction) (((instruction) >> 16) & 0xff)
+#define REG_C(instruction) ((instruction) >> 24)
+#define REG_BX(instruction) ((instruction) >> 16)
+
+typedef struct {
+  int count;
+  int capacity;
+  uint32_t *code;
+  int *lines;
+  ValueArray constants;
+  int registerCount;
+} RegChunk;
+
+void initRegChunk(RegChunk *chunk);
+void freeRegChunk(RegChunk *chunk);
+
+// Translates stack bytecode into register code, mapping stack slot n to
+// register n, so locals live in the registers of their slots, and folding
+// constant pushes and local reads into operands. Returns false if the chunk
+// uses an instruction with no register form, such as a call.
+bool translateChunk(Chunk *chunk, RegChunk *out);
+
+void disassembleRegChunk(RegChunk *chunk, const char *name);
+
+#endif
@@ -4,23 +4,44 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-  int line;
-} Scanner;
-
 Scanner scanner;
 
 void initScanner(const char *source) {
   scanner.start = source;
   scanner.current = source;
   scanner.line = 1;
+  scanner.interpolationDepth = 0;
 }
 
-static bool isDigit(char c) { return c >= '0' && c <= '9'; }
-static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+Scanner saveScanner() { return scanner; }
+
+void restoreScanner(Scanner saved) { scanner = saved; }
+
+// Character classes, indexed by the raw byte. Anything >= 0x80 is left as
+// CHAR_OTHER so non-ASCII input falls through to "Unexpected character.".
+enum {
+  CHAR_OTHER = 0,
+  CHAR_ALPHA = 1 << 0,
+  CHAR_DIGIT = 1 << 1,
+  CHAR_SPACE = 1 << 2,
+  CHAR_NEWLINE = 1 << 3,
+};
+
+static const uint8_t charClass[256] = {
+    ['a' ... 'z'] = CHAR_ALPHA, ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,         ['0' ... '9'] = CHAR_DIGIT,
+    [' '] = CHAR_SPACE,         ['\r'] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,        ['\n'] = CHAR_NEWLINE,
+};
+
+static inline bool isDigit(char c) {
+  return charClass[(uint8_t)c] & CHAR_DIGIT;
+}
+static inline bool isAlpha(char c) {
+  return charClass[(uint8_t)c] & CHAR_ALPHA;
+}
+static inline bool isIdentifierChar(char c) {
+  return charClass[(uint8_t)c] & (CHAR_ALPHA | CHAR_DIGIT);
 }
 
 static bool isAtEnd() { return *scanner.current == '\0'; }
@@ -65,112 +86,212 @@ static Token errorToken(const char *message) {
   return token;
 }
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// The SIMD paths load 16 bytes at a time. The source is only guaranteed to be
+// readable up to its '\0', so a block is only loaded when it can't cross into
+// the next page; otherwise the scalar loop finishes the run.
+#define SIMD_WIDTH 16
+#define PAGE_SIZE 4096
+
+// Those loads may read past the terminating '\0' within the same page, which
+// is harmless but trips AddressSanitizer, so the block scanners opt out.
+#if defined(__SANITIZE_ADDRESS__)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#endif
+#endif
+
+static inline bool canLoadBlock(const char *p) {
+  return ((uintptr_t)p & (PAGE_SIZE - 1)) <= PAGE_SIZE - SIMD_WIDTH;
+}
+
+// Signed compares only, so "lo <= c <= hi" becomes one add and one compare:
+// shift the range down so that it starts at INT8_MIN.
+static inline __m128i inRange(__m128i chars, char low, char high) {
+  __m128i shifted = _mm_add_epi8(chars, _mm_set1_epi8((char)(-128 - low)));
+  __m128i limit = _mm_set1_epi8((char)(-128 + high - low + 1));
+  return _mm_cmplt_epi8(shifted, limit);
+}
+
+// Returns a bitmask with one bit per byte that is [A-Za-z0-9_].
+static inline unsigned identifierMask(__m128i chars) {
+  __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+  __m128i mask =
+      _mm_or_si128(inRange(lower, 'a', 'z'), inRange(chars, '0', '9'));
+  mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+  return (unsigned)_mm_movemask_epi8(mask);
+}
+
+static inline unsigned byteMask(__m128i chars, char c) {
+  return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8(c)));
+}
+#endif
+
+#ifndef NO_SANITIZE_ADDRESS
+#define NO_SANITIZE_ADDRESS
+#endif
+
+// Advances past the run of identifier characters at scanner.current.
+NO_SANITIZE_ADDRESS static void skipIdentifierRun() {
+  const char *p = scanner.current;
+#if defined(__SSE2__)
+  while (canLoadBlock(p)) {
+    unsigned stop = ~identifierMask(_mm_loadu_si128((const __m128i *)p));
+    stop &= 0xffff;
+    if (stop != 0) {
+      scanner.current = p + __builtin_ctz(stop);
+      return;
+    }
+    p += SIMD_WIDTH;
+  }
+#endif
+  while (isIdentifierChar(*p))
+    p++;
+  scanner.current = p;
+}
+
+// Advances to the next '\n' or the end of the source, whichever comes first.
+NO_SANITIZE_ADDRESS static void skipLineComment() {
+  const char *p = scanner.current;
+#if defined(__SSE2__)
+  while (canLoadBlock(p)) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)p);
+    unsigned stop = byteMask(chars, '\n') | byteMask(chars, '\0');
+    if (stop != 0) {
+      scanner.current = p + __builtin_ctz(stop);
+      return;
+    }
+    p += SIMD_WIDTH;
+  }
+#endif
+  while (*p != '\n' && *p != '\0')
+    p++;
+  scanner.current = p;
+}
+
+// Advances to the closing '"', a '$' or the end of the source, counting the
+// newlines inside the string body.
+NO_SANITIZE_ADDRESS static void skipStringBody() {
+  const char *p = scanner.current;
+#if defined(__SSE2__)
+  while (canLoadBlock(p)) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)p);
+    unsigned newlines = byteMask(chars, '\n');
+    unsigned stop = byteMask(chars, '"') | byteMask(chars, '$') |
+                    byteMask(chars, '\0');
+    if (stop != 0) {
+      int offset = __builtin_ctz(stop);
+      scanner.line += __builtin_popcount(newlines & ((1u << offset) - 1));
+      scanner.current = p + offset;
+      return;
+    }
+    scanner.line += __builtin_popcount(newlines);
+    p += SIMD_WIDTH;
+  }
+#endif
+  while (*p != '"' && *p != '$' && *p != '\0') {
+    if (*p == '\n')
+      scanner.line++;
+    p++;
+  }
+  scanner.current = p;
+}
+
+// Advances past a run of blanks (' ', '\t', '\r') starting at p. Runs of one
+// are the common case between tokens, so the block scan only kicks in once a
+// second blank shows up, e.g. for indentation.
+NO_SANITIZE_ADDRESS static const char *skipBlankRun(const char *p) {
+#if defined(__SSE2__)
+  if (charClass[(uint8_t)p[1]] == CHAR_SPACE) {
+    while (canLoadBlock(p)) {
+      __m128i chars = _mm_loadu_si128((const __m128i *)p);
+      unsigned blank = byteMask(chars, ' ') | byteMask(chars, '\t') |
+                       byteMask(chars, '\r');
+      unsigned stop = ~blank & 0xffff;
+      if (stop != 0)
+        return p + __builtin_ctz(stop);
+      p += SIMD_WIDTH;
+    }
+  }
+#endif
+  while (charClass[(uint8_t)*p] == CHAR_SPACE)
+    p++;
+  return p;
+}
+
 static void skipWhitespace() {
+  const char *p = scanner.current;
   for (;;) {
-    char c = peek();
-    switch (c) {
-    case ' ':
-    case '\r':
-    case '\t':
-      advance();
+    switch (charClass[(uint8_t)*p]) {
+    case CHAR_SPACE:
+      p = skipBlankRun(p);
       break;
-    case '\n':
+    case CHAR_NEWLINE:
       scanner.line++;
-      advance();
+      p++;
       break;
-    case '/':
-      if (peekNext() == '/') {
+    default:
+      if (p[0] == '/' && p[1] == '/') {
         // A comment goes until the end of the line.
-        while (peek() != '\n' && !isAtEnd())
-          advance();
-      } else {
-        return;
+        scanner.current = p;
+        skipLineComment();
+        p = scanner.current;
+        break;
       }
-      break;
-    default:
+      scanner.current = p;
       return;
     }
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest,
-                              TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
+typedef struct {
+  const char *name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// Perfect hash over the keyword set: no two keywords share a slot, so a
+// lookup is one hash, one length check and at most one memcmp. Regenerate the
+// multipliers if a keyword is added and two of them collide.
+#define KEYWORD_SLOTS 64
 
-  return TOKEN_IDENTIFIER;
+static inline unsigned keywordHash(const char *start, int length) {
+  return ((uint8_t)start[0] + (uint8_t)start[length - 1] * 4u +
+          (unsigned)length) &
+         (KEYWORD_SLOTS - 1);
 }
 
-static TokenType identifierType() {
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [0] = {"super", 5, TOKEN_SUPER},  [2] = {"ts", 2, TOKEN_THIS},
+    [3] = {"if", 2, TOKEN_IF},        [12] = {"true", 4, TOKEN_TRUE},
+    [13] = {"yeet", 4, TOKEN_DELETE}, [16] = {"while", 5, TOKEN_WHILE},
+    [20] = {"pluh", 4, TOKEN_PRINT},  [31] = {"typeshi", 7, TOKEN_CLASS},
+    [32] = {"fn", 2, TOKEN_FUN},      [33] = {"nil", 3, TOKEN_NIL},
+    [35] = {"in", 2, TOKEN_IN},       [47] = {"sumn", 4, TOKEN_VAR},
+    [48] = {"fr", 2, TOKEN_FOR},      [52] = {"and", 3, TOKEN_AND},
+    [57] = {"or", 2, TOKEN_OR},       [59] = {"crashout", 8, TOKEN_RETURN},
+    [61] = {"else", 4, TOKEN_ELSE},   [63] = {"false", 5, TOKEN_FALSE},
+};
 
-  switch (scanner.start[0]) {
-  case 'a':
-    return checkKeyword(1, 2, "nd", TOKEN_AND);
-  case 'e':
-    return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-  case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'a':
-        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-      case 'r':
-        return TOKEN_FOR;
-      case 'n':
-        return TOKEN_FUN;
-      }
-    }
-    break;
-  case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
-  case 'n':
-    return checkKeyword(1, 2, "il", TOKEN_NIL);
-  case 'o':
-    return checkKeyword(1, 1, "r", TOKEN_OR);
-  case 'p':
-    return checkKeyword(1, 3, "luh", TOKEN_PRINT);
-  case 'c':
-    return checkKeyword(1, 7, "rashout", TOKEN_RETURN);
-  case 's':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'u':
-        if (scanner.current - scanner.start[1] > 1) {
-          switch (scanner.start[2]) {
-          case 'p':
-            return checkKeyword(3, 2, "er", TOKEN_SUPER);
-          case 'm':
-            return checkKeyword(3, 1, "n", TOKEN_VAR);
-          }
-        }
-        break;
-      }
-    }
-  case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 's':
-        return TOKEN_THIS;
-      case 'r':
-        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-      case 'y':
-        return checkKeyword(2, 5, "peshi", TOKEN_CLASS);
-      }
-    }
-    break;
-
-    //   case 'v':
-    //     return checkKeyword(1, 2, "ar", TOKEN_VAR);
-  case 'w':
-    return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static TokenType identifierType() {
+  int length = (int)(scanner.current - scanner.start);
+  const Keyword *keyword = &keywords[keywordHash(scanner.start, length)];
+  if (keyword->length != length)
+    return TOKEN_IDENTIFIER;
+  // Keywords are at most eight bytes, a byte loop beats a call to memcmp.
+  for (int i = 0; i < length; i++) {
+    if (scanner.start[i] != keyword->name[i])
+      return TOKEN_IDENTIFIER;
   }
-  return TOKEN_IDENTIFIER;
+  return keyword->type;
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek()))
-    advance();
+  skipIdentifierRun();
   return makeToken(identifierType());
 }
 
@@ -195,19 +316,23 @@ static Token number() {
   return makeToken(TOKEN_INT);
 }
 
+// Scans string text, after the opening '"' or the `}` ending an
+// interpolated expression, up to the closing '"' or the next "${". A '$'
+// without a '{' is just text.
 static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n')
-      scanner.line++;
-    advance();
+  for (;;) {
+    skipStringBody();
+    if (isAtEnd())
+      return errorToken("Unterminated string.");
+    if (advance() == '"')
+      return makeToken(TOKEN_STRING);
+    if (match('{')) {
+      if (scanner.interpolationDepth == MAX_INTERPOLATION_DEPTH)
+        return errorToken("Interpolation nested too deeply.");
+      scanner.interpolationBraces[scanner.interpolationDepth++] = 0;
+      return makeToken(TOKEN_INTERPOLATION);
+    }
   }
-
-  if (isAtEnd())
-    return errorToken("Unterminated string.");
-
-  // The closing quote.
-  advance();
-  return makeToken(TOKEN_STRING);
 }
 
 Token scanToken() {
@@ -229,14 +354,37 @@ Token scanToken() {
   case ')':
     return makeToken(TOKEN_RIGHT_PAREN);
   case '{':
+    if (scanner.interpolationDepth > 0)
+      scanner.interpolationBraces[scanner.interpolationDepth - 1]++;
     return makeToken(TOKEN_LEFT_BRACE);
   case '}':
+    if (scanner.interpolationDepth > 0) {
+      int *braces =
+          &scanner.interpolationBraces[scanner.interpolationDepth - 1];
+      if (*braces == 0) {
+        scanner.interpolationDepth--;
+        return string();
+      }
+      (*braces)--;
+    }
     return makeToken(TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(TOKEN_RIGHT_BRACKET);
   case ';':
     return makeToken(TOKEN_SEMICOLON);
   case ',':
     return makeToken(TOKEN_COMMA);
+  case ':':
+    return makeToken(TOKEN_COLON);
+  case '#':
+    return makeToken(TOKEN_HASH);
   case '.':
+    if (peek() == '.' && peekNext() == '.') {
+      scanner.current += 2;
+      return makeToken(TOKEN_DOT_DOT_DOT);
+    }
     return makeToken(TOKEN_DOT);
   case '-':
     return makeToken(TOKEN_MINUS);
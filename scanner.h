@@ -7,14 +7,18 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON,
   TOKEN_COMMA,
   TOKEN_DOT,
+  TOKEN_HASH,
   TOKEN_MINUS,
   TOKEN_PLUS,
   TOKEN_SEMICOLON,
   TOKEN_SLASH,
   TOKEN_STAR,
-  // One or two character tokens.
+  // One, two or three character tokens.
   TOKEN_BANG,
   TOKEN_BANG_EQUAL,
   TOKEN_EQUAL,
@@ -23,19 +27,25 @@ typedef enum {
   TOKEN_GREATER_EQUAL,
   TOKEN_LESS,
   TOKEN_LESS_EQUAL,
+  TOKEN_DOT_DOT_DOT,
   // Literals.
   TOKEN_IDENTIFIER,
   TOKEN_STRING,
+  // The text of a string up to a "${", which starts an interpolated
+  // expression. The text after the `}` ending the last one is a string.
+  TOKEN_INTERPOLATION,
   TOKEN_DOUBLE,
   TOKEN_INT,
   // Keywords.
   TOKEN_AND,
   TOKEN_CLASS,
+  TOKEN_DELETE,
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
   TOKEN_FUN,
   TOKEN_IF,
+  TOKEN_IN,
   TOKEN_NIL,
   TOKEN_OR,
   TOKEN_PRINT,
@@ -57,7 +67,22 @@ typedef struct {
   int line;
 } Token;
 
+#define MAX_INTERPOLATION_DEPTH 8
+
+typedef struct {
+  const char *start;
+  const char *current;
+  int line;
+  // The braces open inside each "${" being scanned, innermost last, so the
+  // `}` that closes one goes back to scanning its string.
+  int interpolationBraces[MAX_INTERPOLATION_DEPTH];
+  int interpolationDepth;
+} Scanner;
+
 void initScanner(const char *source);
 Token scanToken();
+// The position of the scanner, to go back to and scan the same tokens again.
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
 
 #endif
\ No newline at end of file
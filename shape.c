@@ -0,0 +1,34 @@
+#include "shape.h"
+#include "memory.h"
+#include "table.h"
+
+Shape *shapeTransition(Shape *shape, Value name) {
+  Value child;
+  if (tableGet(&shape->transitions, name, &child))
+    return (Shape *)AS_OBJ(child);
+  Shape *added = newShape(shape->klass, shape, name);
+  tableSet(&shape->transitions, name, OBJ_VAL(added));
+  return added;
+}
+
+int shapeFieldIndex(Shape *shape, Value name) {
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (valuesEqual(shape->name, name))
+      return shape->fieldCount - 1;
+  }
+  return -1;
+}
+
+void instanceAddField(ObjInstance *instance, Shape *shape, Value value) {
+  if (shape->fieldCount > instance->capacity) {
+    int capacity = INCREASE_CAPACITY(instance->capacity);
+    instance->fields = INCREASE_ARRAY_AS(MEM_INSTANCE, Value, instance->fields,
+                                         instance->capacity, capacity);
+    instance->capacity = capacity;
+  }
+  instance->fields[shape->fieldCount - 1] = value;
+  instance->shape = shape;
+  // Later instances are allocated with room for this many fields.
+  if (shape->fieldCount > shape->klass->fieldCapacity)
+    shape->klass->fieldCapacity = shape->fieldCount;
+}
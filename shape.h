@@ -0,0 +1,19 @@
+#ifndef rotlang_shape_h
+#define rotlang_shape_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// The child of `shape` that adds the field `name`, made the first time an
+// instance of `shape` gets that field. Instances that get the same fields in
+// the same order end up sharing every shape on the way.
+Shape *shapeTransition(Shape *shape, Value name);
+// The index instances of `shape` store `name` at, or -1 if they don't have
+// it. Walks up the tree, so run() only asks on a cache miss.
+int shapeFieldIndex(Shape *shape, Value name);
+// Moves `instance` to `shape`, a child of its shape, and stores `value` in
+// the field that adds. Grows the fields when they're full.
+void instanceAddField(ObjInstance *instance, Shape *shape, Value value);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SNAPSHOT_MAGIC "rotimg01"
+#define SNAPSHOT_ALIGN 8
+
+// The image is the header, the strings laid out exactly as ObjStrings with
+// their chars, then the entry arrays of the two tables. A VAL_OBJ anywhere
+// in the tables holds the object's offset from the start of the image
+// instead of a pointer. Value and Entry are written raw, so an image only
+// loads into a build with the same layout.
+typedef struct {
+  char magic[8];
+  uint32_t valueSize;
+  uint32_t entrySize;
+  uint64_t globalsOffset;
+  uint32_t globalsCapacity;
+  uint32_t globalsCount;
+  uint64_t stringsOffset;
+  uint32_t stringsCapacity;
+  uint32_t stringsCount;
+} SnapshotHeader;
+
+typedef struct {
+  FILE *file;
+  uint64_t offset;
+  // Maps each string already written to its offset.
+  Table offsets;
+} Writer;
+
+static void writeBytes(Writer *writer, const void *data, size_t size) {
+  fwrite(data, 1, size, writer->file);
+  writer->offset += size;
+}
+
+static void align(Writer *writer) {
+  static const char zeros[SNAPSHOT_ALIGN];
+  size_t misalignment = writer->offset % SNAPSHOT_ALIGN;
+  if (misalignment != 0)
+    writeBytes(writer, zeros, SNAPSHOT_ALIGN - misalignment);
+}
+
+static uint64_t writeString(Writer *writer, ObjString *string) {
+  Value offset;
+  if (tableGet(&writer->offsets, OBJ_VAL(string), &offset))
+    return (uint64_t)AS_DOUBLE(offset);
+
+  align(writer);
+  uint64_t start = writer->offset;
+  // Built field by field so padding is zero and images are reproducible.
+  ObjString header;
+  memset(&header, 0, sizeof(header));
+  header.obj.type = string->obj.type;
+  header.length = string->length;
+  header.hash = string->hash;
+  writeBytes(writer, &header, sizeof(ObjString));
+  writeBytes(writer, string->chars, string->length + 1);
+  tableSet(&writer->offsets, OBJ_VAL(string), DOUBLE_VAL((double)start));
+  return start;
+}
+
+// Strings are the only objects an image holds, and every one of them is
+// interned; writeSnapshot() refuses globals holding anything else.
+static Value encodeValue(Writer *writer, Value value) {
+  Value encoded;
+  memset(&encoded, 0, sizeof(encoded));
+  encoded.type = value.type;
+  encoded.stringLength = value.stringLength;
+  encoded.as = value.as;
+  if (IS_OBJ(value))
+    encoded.as.obj = (Obj *)(uintptr_t)writeString(writer, AS_STRING(value));
+  return encoded;
+}
+
+// Natives are defined afresh by every VM, so images leave them out.
+static bool isNative(Entry *entry) { return IS_NATIVE(entry->value); }
+
+static uint64_t writeEntries(Writer *writer, Table *table) {
+  align(writer);
+  uint64_t start = writer->offset;
+  for (int i = 0; i < table->capacity; i++) {
+    Entry entry;
+    if (isNative(&table->entries[i])) {
+      // A tombstone keeps the probe sequences through this slot intact.
+      memset(&entry, 0, sizeof(entry));
+      entry.key = NIL_VAL;
+      entry.value = BOOL_VAL(true);
+    } else {
+      entry.key = encodeValue(writer, table->entries[i].key);
+      entry.value = encodeValue(writer, table->entries[i].value);
+    }
+    writeBytes(writer, &entry, sizeof(Entry));
+  }
+  return start;
+}
+
+// Names a global holding an object other than a string, if there is one.
+static bool findUnsupportedGlobal(Value *name) {
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Value value = vm.globals.entries[i].value;
+    if (IS_OBJ(value) && !IS_STRING(value) && !IS_NATIVE(value)) {
+      *name = vm.globals.entries[i].key;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool writeSnapshot(const char *path) {
+  Value name;
+  if (findUnsupportedGlobal(&name)) {
+    fprintf(stderr, "Can't snapshot '%.*s': images only hold strings.\n",
+            STRING_LENGTH(name), STRING_CHARS(name));
+    return false;
+  }
+
+  Writer writer;
+  writer.file = fopen(path, "wb");
+  if (writer.file == NULL) {
+    fprintf(stderr, "Could not open \"%s\" for writing.\n", path);
+    return false;
+  }
+  writer.offset = 0;
+  initTable(&writer.offsets);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  writeBytes(&writer, &header, sizeof(header));
+
+  // Objects first so the entry arrays, which refer to them, are contiguous.
+  for (int i = 0; i < vm.strings.capacity; i++) {
+    Value key = vm.strings.entries[i].key;
+    if (IS_STRING(key))
+      writeString(&writer, AS_STRING(key));
+  }
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    if (isNative(&vm.globals.entries[i]))
+      continue;
+    encodeValue(&writer, vm.globals.entries[i].key);
+    encodeValue(&writer, vm.globals.entries[i].value);
+  }
+
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.valueSize = sizeof(Value);
+  header.entrySize = sizeof(Entry);
+  header.globalsOffset = writeEntries(&writer, &vm.globals);
+  header.globalsCapacity = (uint32_t)vm.globals.capacity;
+  header.globalsCount = (uint32_t)vm.globals.count;
+  header.stringsOffset = writeEntries(&writer, &vm.strings);
+  header.stringsCapacity = (uint32_t)vm.strings.capacity;
+  header.stringsCount = (uint32_t)vm.strings.count;
+
+  rewind(writer.file);
+  fwrite(&header, sizeof(header), 1, writer.file);
+  bool ok = !ferror(writer.file);
+  ok = fclose(writer.file) == 0 && ok;
+  freeTable(&writer.offsets);
+  if (!ok)
+    fprintf(stderr, "Could not write \"%s\".\n", path);
+  return ok;
+}
+
+#if defined(__linux__)
+
+static char *image = NULL;
+static size_t imageSize = 0;
+
+static bool relocate(Value *value) {
+  if (!IS_OBJ(*value))
+    return true;
+  uintptr_t offset = (uintptr_t)value->as.obj;
+  if (offset < sizeof(SnapshotHeader) ||
+      offset + sizeof(ObjString) > imageSize)
+    return false;
+  value->as.obj = (Obj *)(image + offset);
+  return true;
+}
+
+// Tables are copied rather than used in place so they can keep growing;
+// the copy keeps every entry in its slot, so nothing is rehashed and no
+// string is touched until something looks it up.
+static bool copyTable(Table *table, uint64_t offset, uint32_t capacity,
+                      uint32_t count) {
+  if (offset > imageSize || capacity > (imageSize - offset) / sizeof(Entry))
+    return false;
+
+  Entry *source = (Entry *)(image + offset);
+  Entry *entries = ALLOCATE_AS(MEM_TABLE, Entry, capacity);
+  for (uint32_t i = 0; i < capacity; i++) {
+    entries[i] = source[i];
+    if (!relocate(&entries[i].key) || !relocate(&entries[i].value)) {
+      FREE_ARRAY_AS(MEM_TABLE, Entry, entries, capacity);
+      return false;
+    }
+  }
+  table->entries = entries;
+  table->capacity = (int)capacity;
+  table->count = (int)count;
+  return true;
+}
+
+static bool onlyNatives(Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (!IS_NIL(entry->key) && !isNative(entry))
+      return false;
+  }
+  return true;
+}
+
+bool restoreSnapshot(const char *path) {
+  if (vm.strings.count != 0 || !onlyNatives(&vm.globals) || image != NULL) {
+    fprintf(stderr, "A snapshot can only be restored into a fresh VM.\n");
+    return false;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) < 0) {
+    fprintf(stderr, "Could not open \"%s\".\n", path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  imageSize = (size_t)status.st_size;
+  if (imageSize < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "\"%s\" is not a snapshot this build can load.\n", path);
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(NULL, imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Could not map \"%s\".\n", path);
+    return false;
+  }
+  image = mapping;
+
+  // The natives initVM() defined go back in on top of the image's globals.
+  Table natives = vm.globals;
+  initTable(&vm.globals);
+  SnapshotHeader *header = (SnapshotHeader *)image;
+  bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, 8) == 0 &&
+               header->valueSize == sizeof(Value) &&
+               header->entrySize == sizeof(Entry) &&
+               copyTable(&vm.strings, header->stringsOffset,
+                         header->stringsCapacity, header->stringsCount) &&
+               copyTable(&vm.globals, header->globalsOffset,
+                         header->globalsCapacity, header->globalsCount);
+  if (!valid) {
+    fprintf(stderr, "\"%s\" is not a snapshot this build can load.\n", path);
+    freeTable(&vm.strings);
+    freeTable(&vm.globals);
+    releaseSnapshot();
+  }
+  tableAddAll(&natives, &vm.globals);
+  freeTable(&natives);
+  return valid;
+}
+
+void releaseSnapshot() {
+  if (image != NULL)
+    munmap(image, imageSize);
+  image = NULL;
+  imageSize = 0;
+}
+
+#else
+
+bool restoreSnapshot(const char *path) {
+  fprintf(stderr, "--restore needs mmap().\n");
+  return false;
+}
+
+void releaseSnapshot() {}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef rotlang_snapshot_h
+#define rotlang_snapshot_h
+
+#include "common.h"
+
+// Writes vm.globals, vm.strings and every string they reach to `path` in a
+// position-independent image: object references are offsets from the start
+// of the file. Natives are left out, since every VM defines its own.
+bool writeSnapshot(const char *path);
+
+// Maps an image written by writeSnapshot() into a VM that hasn't interned
+// anything yet. The strings stay in the read-only mapping, faulted in as
+// they're touched; only the two tables are copied, relocating their object
+// references as they go.
+bool restoreSnapshot(const char *path);
+
+// Unmaps the restored image. Call after freeVM(), once nothing can still
+// point into it.
+void releaseSnapshot();
+
+#endif
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "stream.h"
+#include "vm.h"
+
+// Input is read in blocks of this size; the buffer only grows if a single
+// line doesn't fit.
+#define STREAM_BUFFER (1 << 20)
+#define OUTPUT_BUFFER (1 << 16)
+
+static char outputBuffer[OUTPUT_BUFFER];
+
+// `line` is a view into the read buffer, so nothing is copied or allocated
+// for it unless the script stores it somewhere. chars[length] is always the
+// line's newline, so -p echoes the line with a single write.
+static InterpretResult processLine(Chunk *chunk, Value name, const char *chars,
+                                   size_t length, bool printLines) {
+  tableSet(&vm.globals, name, makeStringView(chars, (int)length));
+  InterpretResult result = loadChunk(chunk);
+  if (result == INTERPRET_OK)
+    result = runFor(INT64_MAX);
+  if (printLines)
+    fwrite(chars, 1, length + 1, stdout);
+  return result;
+}
+
+// Runs the chunk on each line of stdin. Returns the process exit code.
+static int streamLines(Chunk *chunk, bool printLines) {
+  Value name = makeString("line", 4);
+  size_t capacity = STREAM_BUFFER;
+  char *buffer = ALLOCATE(char, capacity);
+  // Unconsumed input is [start, end); [start, scanned) has no newline.
+  size_t start = 0;
+  size_t scanned = 0;
+  size_t end = 0;
+  int status = 0;
+
+  for (;;) {
+    char *newline = memchr(buffer + scanned, '\n', end - scanned);
+    if (newline != NULL) {
+      size_t length = (size_t)(newline - buffer) - start;
+      if (processLine(chunk, name, buffer + start, length, printLines) !=
+          INTERPRET_OK) {
+        status = 70;
+        break;
+      }
+      start = scanned = (size_t)(newline - buffer) + 1;
+      continue;
+    }
+
+    // Keep the partial line and refill behind it.
+    scanned = end;
+    if (start > 0) {
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      scanned -= start;
+      start = 0;
+    }
+    // Always leave room to terminate the last line.
+    if (end + 1 >= capacity) {
+      buffer = INCREASE_ARRAY(char, buffer, capacity, capacity * 2);
+      capacity *= 2;
+    }
+
+    ssize_t count = read(STDIN_FILENO, buffer + end, capacity - end);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0) {
+      perror("read");
+      status = 74;
+      break;
+    }
+    if (count == 0) {
+      if (end == start)
+        break;
+      // Terminate a last line that has no newline; the next read ends it.
+      buffer[end++] = '\n';
+      continue;
+    }
+    end += (size_t)count;
+  }
+
+  // Nothing may keep pointing into the buffer once it's gone, so the end
+  // script sees `line` as nil.
+  tableSet(&vm.globals, name, NIL_VAL);
+  FREE_ARRAY(char, buffer, capacity);
+  return status;
+}
+
+// Runs the begin or end script, if there is one. Returns the process exit
+// code.
+static int runOnce(Chunk *chunk, const char *source) {
+  if (source == NULL)
+    return 0;
+  InterpretResult result = loadChunk(chunk);
+  if (result == INTERPRET_OK)
+    result = runFor(INT64_MAX);
+  if (result == INTERPRET_COMPILE_ERROR)
+    return 65;
+  return result == INTERPRET_OK ? 0 : 70;
+}
+
+int runStream(const char *source, const char *beginSource,
+              const char *endSource, bool printLines) {
+  // Output goes out in large blocks even when stdout is a terminal.
+  setvbuf(stdout, outputBuffer, _IOFBF, OUTPUT_BUFFER);
+
+  // All three are compiled before anything runs, so a syntax error in the
+  // end script doesn't wait for the whole input.
+  Chunk chunk;
+  Chunk begin;
+  Chunk end;
+  initChunk(&chunk);
+  initChunk(&begin);
+  initChunk(&end);
+  int status = 65;
+  if (compile(source, &chunk) && loadChunk(&chunk) == INTERPRET_OK &&
+      (beginSource == NULL || compile(beginSource, &begin)) &&
+      (endSource == NULL || compile(endSource, &end)))
+    status = runOnce(&begin, beginSource);
+  if (status == 0)
+    status = streamLines(&chunk, printLines);
+  if (status == 0)
+    status = runOnce(&end, endSource);
+
+  freeChunk(&chunk);
+  freeChunk(&begin);
+  freeChunk(&end);
+  fflush(stdout);
+  return status;
+}
@@ -0,0 +1,16 @@
+#ifndef rotlang_stream_h
+#define rotlang_stream_h
+
+#include "common.h"
+
+// Compiles `source` once and runs it for every line of stdin, awk style,
+// with the line, minus its newline, in the global `line`. With
+// `printLines`, each line is also echoed after the script has run on it.
+// `beginSource` and `endSource`, when not NULL, run once before the first
+// line and once after the last, like awk's BEGIN and END; globals they
+// define are seen by every line. Returns the process exit code; a runtime
+// error stops the stream.
+int runStream(const char *source, const char *beginSource,
+              const char *endSource, bool printLines);
+
+#endif
@@ -15,7 +15,7 @@ void initTable(Table *table) {
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY_AS(MEM_TABLE, Entry, table->entries, table->capacity);
   initTable(table);
 }
 
@@ -32,7 +32,8 @@ uint32_t getHashValue(Value value) {
     return (uint32_t)(i ^ (i >> 32));
   }
   case VAL_DOUBLE: {
-    double d = AS_DOUBLE(value);
+    // -0.0 == 0.0, so the two must hash alike.
+    double d = AS_DOUBLE(value) == 0 ? 0 : AS_DOUBLE(value);
     uint64_t bits;
     memcpy(&bits, &d, sizeof(double));
     return (uint32_t)(bits ^ (bits >> 32));
@@ -42,8 +43,16 @@ uint32_t getHashValue(Value value) {
     if (obj->type == OBJ_STRING) {
       return ((ObjString *)obj)->hash;
     }
-    return 3;
+    // Other objects are equal only to themselves. The low bits of an
+    // address are always zero.
+    uintptr_t address = (uintptr_t)obj;
+    return (uint32_t)((address >> 4) ^ (address >> 32));
   }
+  case VAL_SHORT_STRING:
+    return hashString(value.as.shortChars, value.stringLength);
+  case VAL_STRING_VIEW:
+    // The same hash the ObjString with this content has.
+    return hashString(value.as.viewChars, value.stringLength);
 
   default:
     return 0;
@@ -76,7 +85,7 @@ static Entry *findEntry(Entry *entries, int capacity, Value key) {
 }
 
 static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
+  Entry *entries = ALLOCATE_AS(MEM_TABLE, Entry, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NIL_VAL;
     entries[i].value = NIL_VAL;
@@ -94,7 +103,7 @@ static void adjustCapacity(Table *table, int capacity) {
     table->count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY_AS(MEM_TABLE, Entry, table->entries, table->capacity);
 
   table->entries = entries;
   table->capacity = capacity;
@@ -142,13 +151,27 @@ bool tableDelete(Table *table, Value key) {
   return true;
 }
 
-void tableAddAll(Table *from, Table *to) {
+void tableReserve(Table *table, int count) {
+  int capacity = table->capacity;
+  while (count > capacity * TABLE_MAX_LOAD)
+    capacity = INCREASE_CAPACITY(capacity);
+  if (capacity != table->capacity)
+    adjustCapacity(table, capacity);
+}
+
+int tableAddAll(Table *from, Table *to) {
+  // from->count may include tombstones, so this can overshoot a little,
+  // but `to` grows at most once.
+  tableReserve(to, to->count + from->count);
+  int added = 0;
   for (int i = 0; i < from->capacity; i++) {
     Entry *entry = &from->entries[i];
     if (!valuesEqual(entry->key, NIL_VAL)) {
-      tableSet(to, entry->key, entry->value);
+      if (tableSet(to, entry->key, entry->value))
+        added++;
     }
   }
+  return added;
 }
 
 ObjString *tableFindString(Table *table, const char *chars, int length,
@@ -19,7 +19,11 @@ void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, Value key, Value *value);
 bool tableSet(Table *table, Value key, Value value);
-void tableAddAll(Table *from, Table *to);
+bool tableDelete(Table *table, Value key);
+// Grows the table up front so that `count` entries fit without a rehash.
+void tableReserve(Table *table, int count);
+// Returns how many of `from`'s keys weren't in `to` yet.
+int tableAddAll(Table *from, Table *to);
 uint32_t getHashValue(Value key);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
@@ -0,0 +1,20 @@
+pluh 1 + 2 * 3;
+pluh (1 + 2) * 3;
+pluh 10 / 4;
+pluh 10.0 / 4.0;
+pluh 7 - 10;
+pluh -(3 + 4);
+pluh 2.5 * 2.0 + 1.0;
+pluh 1 < 2;
+pluh 2 <= 1;
+pluh 3 > 3;
+pluh 3 >= 3;
+pluh 1 == 1;
+pluh 1 != 2;
+pluh !true;
+pluh !nil;
+pluh nil == false;
+pluh "a" == "a";
+sumn a = 6 * 7;
+sumn b = a - 2 + a - 2;
+pluh b;
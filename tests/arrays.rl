@@ -0,0 +1,21 @@
+sumn a = [1, 2, 3];
+pluh a;
+pluh a[1];
+a[0] = 10;
+pluh a;
+sumn b = [1.5, 2.5];
+b[1] = 4.0;
+pluh b;
+sumn c = [1, "two", 3.0, nil, [4, 5]];
+pluh c;
+pluh c[4][1];
+c[4][0] = 99;
+pluh c[4];
+pluh [];
+pluh [1, 2][0] + [3][0];
+a[2] = 2.5;
+pluh a;
+pluh a[1] = 7;
+pluh #a;
+push(a, "long enough to be a heap string");
+pluh a;
@@ -0,0 +1,39 @@
+typeshi Point {
+  init(x, y) { ts.x = x; ts.y = y; }
+  sum() { crashout ts.x + ts.y; }
+  scale(k) { crashout Point(ts.x * k, ts.y * k); }
+}
+sumn p = Point(1, 2);
+pluh p.sum();
+pluh p.scale(3).sum();
+pluh Point;
+sumn m = p.sum;
+pluh m();
+p.z = 10;
+pluh p.z;
+
+typeshi A {
+  hi() { crashout "A.hi"; }
+  who() { crashout "A"; }
+}
+typeshi B < A {
+  hi() { crashout "B.hi then " + super.hi(); }
+  sup() { sumn f = super.who; crashout f(); }
+}
+sumn b = B();
+pluh b.hi();
+pluh b.who();
+pluh b.sup();
+
+// Instances given fields in different orders get different shapes, so the
+// caches in total() see more than one.
+fn total(o) { crashout o.x + o.y; }
+sumn i = 0;
+sumn acc = 0;
+while (i < 20) {
+  sumn o = A();
+  if (i < 10) { o.x = i; o.y = 1; } else { o.y = 1; o.x = i; }
+  acc = acc + total(o);
+  i = i + 1;
+}
+pluh acc;
@@ -0,0 +1,35 @@
+sumn total = 0;
+{
+  sumn i = 0;
+  while (i < 10) {
+    if (i == 3) total = total + 100; else total = total + i;
+    i = i + 1;
+  }
+  pluh total;
+  sumn x = 1;
+  while (x <= 1000) x = x * 2;
+  pluh x;
+  sumn v = 1;
+  sumn k = 0;
+  while (k < 4) { if (k == 2) v = "str"; k = k + 1; }
+  pluh v;
+  pluh nil or 3;
+  pluh false and 1;
+  pluh 1 and 2;
+  pluh (k > 2 and k >= 4) or "no";
+  if (k != 4) pluh "bad"; else pluh "good";
+  if (1.5 > 1.0) pluh "dbl";
+  sumn d = 0.5;
+  while (d < 10.0) d = d * 3.0;
+  pluh d;
+}
+sumn g = 0;
+while (g < 5) g = g + 1;
+pluh g;
+if (g >= 5) { sumn q = g * 2; pluh q; }
+pluh !3;
+pluh !"yes";
+pluh !nil;
+sumn unset = nil;
+while (!unset) unset = 3;
+pluh unset;
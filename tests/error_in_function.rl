@@ -0,0 +1,9 @@
+fn inner(n) {
+  crashout n - "one";
+}
+fn outer(n) {
+  sumn r = inner(n);
+  crashout r;
+}
+pluh "before";
+pluh outer(1);
@@ -0,0 +1,5 @@
+sumn a = 2;
+sumn b = 2.5;
+pluh a * 3;
+pluh b * 2.0;
+pluh a + b;
@@ -0,0 +1,2 @@
+pluh "compiled but never run";
+pluh (1 + ;
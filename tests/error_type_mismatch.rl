@@ -0,0 +1,3 @@
+pluh 1 + 2;
+pluh 1 + "a";
+pluh "never printed";
@@ -0,0 +1,27 @@
+fn fib(n) {
+  if (n < 2) crashout n;
+  crashout fib(n - 1) + fib(n - 2);
+}
+pluh fib(20);
+
+fn ack(m, n) {
+  if (m == 0) crashout n + 1;
+  if (n == 0) crashout ack(m - 1, 1);
+  crashout ack(m - 1, ack(m, n - 1));
+}
+pluh ack(2, 3);
+
+// Deep enough to overflow the frame array unless tail calls reuse frames.
+fn count(n, acc) {
+  if (n == 0) crashout acc;
+  crashout count(n - 1, acc + 1);
+}
+pluh count(100000, 0);
+
+fn noResult() {}
+pluh noResult();
+
+fn apply(f, x) { crashout f(x); }
+fn twice(x) { crashout x * 2; }
+pluh apply(twice, 21);
+pluh twice;
@@ -0,0 +1,20 @@
+// Globals change type after the JIT has seen them, so its type guards fail
+// and the interpreter takes over from the instruction that failed.
+sumn x = 10;
+sumn y = 3;
+pluh x - y;
+pluh x * y + 1;
+pluh x < y;
+x = 1.5;
+pluh x - 1.0;
+pluh x * 2.0 < 4.0;
+x = "short";
+pluh x + "er";
+x = 7;
+y = 2;
+pluh x / y;
+pluh -x;
+y = 0.5;
+pluh 2.0 / y;
+pluh x == 7;
+pluh x == 7.0;
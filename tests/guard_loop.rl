@@ -0,0 +1,55 @@
+// Native code hands an instruction to the interpreter when a guard fails
+// and carries on after it, inside loops and calls as well.
+sumn step = 1;
+fn sum(xs) {
+  sumn t = xs[0];
+  sumn i = step;
+  while (i < #xs) {
+    t = t + xs[i];
+    i = i + step;
+  }
+  crashout t;
+}
+pluh sum([1, 2, 3, 4]);
+pluh sum([0.5, 1.5]);
+pluh sum(["a", "b", "c"]);
+step = 2;
+pluh sum([1, 2, 3, 4]);
+
+fn compare(x, y) {
+  if (x == y) crashout "eq";
+  if (x < y) crashout "lt";
+  crashout "ge";
+}
+pluh compare(1, 1);
+pluh compare(1.0, 2.0);
+pluh compare("a", "a");
+pluh compare(3, 2);
+pluh compare(nil, nil);
+pluh compare(0.0 / 0.0, 1.0);
+
+fn truthy(x) {
+  if (x) crashout "t";
+  crashout "f";
+}
+pluh truthy(nil);
+pluh truthy(false);
+pluh truthy(0);
+pluh truthy("");
+
+typeshi Counter {
+  init(n) { ts.n = n; }
+  get() { crashout ts.n; }
+}
+fn make(n) { crashout Counter(n); }
+fn root(x) { crashout sqrt(x); }
+fn countdown(n) {
+  if (n == 0) crashout "done";
+  crashout countdown(n - 1);
+}
+pluh make(3).get();
+pluh root(16.0);
+pluh countdown(100000);
+sumn m = {"k": [7, 8]};
+fn lookup(key, i) { crashout m[key][i]; }
+pluh lookup("k", 1);
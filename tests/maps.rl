@@ -0,0 +1,22 @@
+sumn m = {"a": 1, "b": 2};
+pluh m["a"];
+m["c"] = 3;
+pluh #m;
+pluh "b" in m;
+pluh "z" in m;
+pluh yeet m["b"];
+pluh yeet m["b"];
+pluh #m;
+sumn n = {...m, "d": 4, 5: "five", 2.5: nil, true: [1, 2]};
+pluh #n;
+pluh n[5];
+pluh n[true][1];
+pluh n[2.5];
+m["a"] = m["a"] + 10;
+pluh m["a"];
+sumn e = {};
+e["a rather long string key"] = 1;
+pluh e["a rather long string key"];
+e[m] = "by identity";
+pluh e[m];
+pluh n in e;
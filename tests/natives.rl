@@ -0,0 +1,23 @@
+pluh sqrt(16);
+pluh floor(2.7) + ceil(2.1);
+pluh abs(-5);
+pluh abs(-2.5);
+pluh pow(2, 10);
+pluh int(3.9);
+pluh int("-42") + 1;
+pluh double("2.5") * 2.0;
+pluh str(12) + str(true) + str(1.5) + str(nil);
+pluh upper("hello, world");
+pluh lower("ABC");
+pluh substr("hello world", 6, 5);
+sumn a = [5, 3, 9, 1];
+pluh sum(a);
+pluh min(a);
+pluh max(a);
+pluh min(3, 4);
+pluh max(2.5, 1.5);
+pluh dot(a, [1, 1, 1, 1]);
+pluh scale(a, 2);
+pluh sort(a);
+sumn t = clock();
+pluh clock() >= t;
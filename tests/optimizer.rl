@@ -0,0 +1,38 @@
+sumn a = 2 * 3;
+sumn b = a + 1;
+a = a + b;
+pluh a + b;
+pluh (a + b) * (a + b);
+{
+  sumn x = 4;
+  sumn y = x * x;
+  x = y - x;
+  pluh x + y;
+  if (1 < 2) pluh "folded"; else pluh "never";
+  sumn n = 0;
+  sumn s = 0;
+  while (n < 5) {
+    s = s + n * n;
+    n = n + 1;
+  }
+  pluh s;
+  pluh n > 3 and s or "no";
+}
+fn square(v) {
+  sumn r = v * v;
+  crashout r;
+}
+fn count(limit) {
+  sumn i = 0;
+  sumn hits = 0;
+  while (i < limit) {
+    if (i == 2 or i == 4) hits = hits + 1;
+    i = i + 1;
+  }
+  crashout hits;
+}
+pluh square(7);
+pluh count(6);
+sumn g = 1;
+g = g + square(3);
+pluh g;
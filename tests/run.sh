@@ -0,0 +1,62 @@
+#!/bin/sh
+# Runs a test script under every engine and compares each one's output with
+# the script's .expected file, which is the default engine's output.
+#
+#   tests/run.sh path/to/rotlangvm tests/script.rl
+#
+# Scripts that fail on purpose have a .status file with the exit status they
+# must end with and a .stderr file with what they must print to stderr.
+# Without them a script must exit with 0 and print nothing to stderr.
+#
+# A script with a .in file beside it is a stream test: it runs with -n over
+# that input, with the .begin.rl and .end.rl scripts beside it, if any, as
+# --begin and --end. Stream mode always runs on the stack VM, so only the
+# optimizer setting varies.
+
+vm="$1"
+script="$2"
+base="${script%.rl}"
+actual="${TMPDIR:-/tmp}/rotlang-test.$$"
+trap 'rm -f "$actual.out" "$actual.err" "$actual.none"' EXIT
+
+expectedStatus=0
+[ -f "$base.status" ] && expectedStatus=$(cat "$base.status")
+expectedErr="$base.stderr"
+if [ ! -f "$expectedErr" ]; then
+  expectedErr="$actual.none"
+  : > "$expectedErr"
+fi
+
+input=/dev/null
+engines='"" --jit --regvm -O2 "--slice 64"'
+if [ -f "$base.in" ]; then
+  input="$base.in"
+  engines='"" -O2'
+  stream=-n
+  [ -f "$base.begin.rl" ] && stream="$stream --begin $base.begin.rl"
+  [ -f "$base.end.rl" ] && stream="$stream --end $base.end.rl"
+fi
+
+status=0
+eval "set -- $engines"
+for engine in "$@"; do
+  run="$script${engine:+ $engine}"
+  # $engine and $stream are left unquoted so "--slice 64" and the stream
+  # options split into separate arguments.
+  "$vm" $engine $stream "$script" < "$input" > "$actual.out" 2> "$actual.err"
+  result=$?
+  if [ "$result" -ne "$expectedStatus" ]; then
+    echo "$run: exited with status $result, not $expectedStatus"
+    cat "$actual.err"
+    status=1
+  fi
+  if ! diff -u "$base.expected" "$actual.out"; then
+    echo "$run: output differs"
+    status=1
+  fi
+  if ! diff -u "$expectedErr" "$actual.err"; then
+    echo "$run: errors differ"
+    status=1
+  fi
+done
+exit $status
@@ -0,0 +1,5 @@
+sumn lines = 0;
+sumn errors = 0;
+sumn bytes = 0;
+sumn slowest = 0;
+sumn slowPath = "";
@@ -0,0 +1,3 @@
+pluh "${lines} lines, ${bytes} bytes, ${errors} errors";
+pluh "slowest: ${slowPath} in ${slowest} ms";
+pluh line;
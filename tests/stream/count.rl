@@ -0,0 +1,9 @@
+// Each line is "<status> <millis> <path>".
+lines = lines + 1;
+bytes = bytes + #line;
+if (substr(line, 0, 1) == "5") errors = errors + 1;
+sumn millis = int(substr(line, 4, 4));
+if (millis > slowest) {
+  slowest = millis;
+  slowPath = substr(line, 9, #line - 9);
+}
@@ -0,0 +1,19 @@
+sumn x = "world";
+sumn n = 42;
+pluh "hello " + x + "!";
+pluh "a" + "b" + "c" + "d";
+pluh x + ", " + x + " and more text to go past eight";
+sumn s = "s";
+pluh s + s + s;
+pluh "n=${n}, x=${x}!";
+pluh "${1.5} ${true} ${nil} ${n + 1} ${"nested ${x}"}";
+pluh "cost $5 and ${ {"k": 1}["k"] } map";
+pluh "pre" + "${n}" + "post";
+pluh "a" + "b" + "c" == "abc";
+fn g(a, b) { crashout "${a}-${b}"; }
+pluh g(1, 2.5);
+sumn i = 0;
+sumn acc = "";
+while (i < 3) { acc = acc + "[" + str(i) + "]"; i = i + 1; }
+pluh acc;
+pluh #"hello world";
@@ -15,8 +15,8 @@ void writeValueArray(ValueArray *array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = INCREASE_CAPACITY(oldCapacity);
-    array->values =
-        INCREASE_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    array->values = INCREASE_ARRAY_AS(MEM_CONSTANTS, Value, array->values,
+                                      oldCapacity, array->capacity);
   }
 
   array->values[array->count] = value;
@@ -24,7 +24,7 @@ void writeValueArray(ValueArray *array, Value value) {
 }
 
 void freeValueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  FREE_ARRAY_AS(MEM_CONSTANTS, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
@@ -45,12 +45,31 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_SHORT_STRING:
+    printf("%.*s", (int)value.stringLength, value.as.shortChars);
+    break;
+  case VAL_STRING_VIEW:
+    fwrite(value.as.viewChars, 1, value.stringLength, stdout);
+    break;
   }
 }
 
+static bool viewEquals(Value view, Value other) {
+  if (!IS_ANY_STRING(other))
+    return false;
+  int length = STRING_LENGTH(other);
+  return length == (int)view.stringLength &&
+         memcmp(view.as.viewChars, STRING_CHARS(other), length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type)
+  if (a.type != b.type) {
+    if (IS_STRING_VIEW(a))
+      return viewEquals(a, b);
+    if (IS_STRING_VIEW(b))
+      return viewEquals(b, a);
     return false;
+  }
   switch (a.type) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
@@ -62,6 +81,12 @@ bool valuesEqual(Value a, Value b) {
     return AS_INT(a) == AS_INT(b);
   case VAL_OBJ:
     return AS_OBJ(a) == AS_OBJ(b); // cuz of string interning
+  case VAL_SHORT_STRING:
+    // Unused bytes are zero, so the whole buffer can be compared.
+    return a.stringLength == b.stringLength &&
+           memcmp(a.as.shortChars, b.as.shortChars, SHORT_STRING_MAX) == 0;
+  case VAL_STRING_VIEW:
+    return viewEquals(a, b);
   default:
     return false; // Unreachable.
   }
@@ -5,16 +5,44 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct Shape Shape;
 
-typedef enum { VAL_BOOL, VAL_NIL, VAL_DOUBLE, VAL_INT, VAL_OBJ } ValueType;
+// The string tags stay last so the tags the JIT tests for keep their values
+// and every string tag is >= VAL_OBJ.
+typedef enum {
+  VAL_BOOL,
+  VAL_NIL,
+  VAL_DOUBLE,
+  VAL_INT,
+  VAL_OBJ,
+  VAL_SHORT_STRING,
+  VAL_STRING_VIEW
+} ValueType;
+
+// Strings of up to SHORT_STRING_MAX bytes live inside the Value itself and
+// never touch the heap; longer ones are interned ObjStrings. Every string has
+// exactly one representation, so equality never has to compare across them.
+//
+// The exception is VAL_STRING_VIEW: a borrowed pointer into a buffer someone
+// else owns, like the line buffer of the -n and -p streaming modes. A view
+// is only valid until its owner reuses the buffer, so anything that keeps a
+// value beyond the current instruction stores materialize(value) instead.
+// Views compare and hash by content, like the strings they stand in for.
+#define SHORT_STRING_MAX 8
 
 typedef struct {
   ValueType type;
+  // Length of a VAL_SHORT_STRING or VAL_STRING_VIEW, kept in what is
+  // otherwise padding.
+  uint32_t stringLength;
   union {
     bool boolean;
     double doubleNum;
     int intNum;
     Obj *obj;
+    // Not NUL-terminated; bytes past stringLength are zero.
+    char shortChars[SHORT_STRING_MAX];
+    const char *viewChars;
   } as;
 } Value;
 
@@ -23,17 +51,21 @@ typedef struct {
 #define IS_DOUBLE(value) ((value).type == VAL_DOUBLE)
 #define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_SHORT_STRING(value) ((value).type == VAL_SHORT_STRING)
+#define IS_STRING_VIEW(value) ((value).type == VAL_STRING_VIEW)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_DOUBLE(value) ((value).as.doubleNum)
 #define AS_INT(value) ((value).as.intNum)
 #define AS_OBJ(value) ((value).as.obj)
 
-#define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
-#define NIL_VAL ((Value){VAL_NIL, {.intNum = 0}})
-#define DOUBLE_VAL(value) ((Value){VAL_DOUBLE, {.doubleNum = value}})
-#define INT_VAL(value) ((Value){VAL_INT, {.intNum = value}})
-#define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
+#define BOOL_VAL(value) ((Value){.type = VAL_BOOL, .as = {.boolean = value}})
+#define NIL_VAL ((Value){.type = VAL_NIL, .as = {.intNum = 0}})
+#define DOUBLE_VAL(value)                                                      \
+  ((Value){.type = VAL_DOUBLE, .as = {.doubleNum = value}})
+#define INT_VAL(value) ((Value){.type = VAL_INT, .as = {.intNum = value}})
+#define OBJ_VAL(object)                                                        \
+  ((Value){.type = VAL_OBJ, .as = {.obj = (Obj *)object}})
 
 #define VAL_TYPE(value) ((value).type)
 
@@ -43,6 +75,14 @@ typedef struct {
   Value *values;
 } ValueArray;
 
+// Only nil and false are falsey. The flag is read as a byte: GCC loads it
+// before testing the type, and then takes whatever another type left in that
+// byte for a bool that is 0 or 1, which made `!3` true.
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) ||
+         (IS_BOOL(value) && *(const unsigned char *)&AS_BOOL(value) == 0);
+}
+
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
@@ -0,0 +1,579 @@
+#include <stdio.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "verifier.h"
+
+// Marks in Verifier.targets for offsets no jump goes to.
+#define NOT_INSTRUCTION -2
+#define NOT_TARGET -1
+
+typedef struct {
+  Chunk *chunk;
+  int offset;
+  // Static type of each value on the stack at `offset`.
+  StaticType *types;
+  int depth;
+  // For each offset: the index of its entry state if a jump goes there,
+  // NOT_TARGET for any other instruction, NOT_INSTRUCTION for operands.
+  int *targets;
+  int targetCount;
+  // The state each jump target is entered with, merged over every path
+  // into it seen so far: a depth, -1 until a path gets there, and
+  // maxStackDepth types.
+  int *targetDepths;
+  StaticType *targetTypes;
+  // Set when a back edge changes the state of a target already walked past.
+  bool changed;
+  bool quiet;
+} Verifier;
+
+static bool fail(Verifier *verifier, const char *message) {
+  if (!verifier->quiet) {
+    fprintf(stderr, "Invalid bytecode at offset %d (%s): %s\n",
+            verifier->offset,
+            opcodeName(verifier->chunk->code[verifier->offset]), message);
+  }
+  return false;
+}
+
+// Reads the constant operand `index` bytes past the opcode.
+static bool readConstant(Verifier *verifier, int index, Value *value) {
+  uint8_t constant = verifier->chunk->code[verifier->offset + index];
+  if (constant >= verifier->chunk->constants.count)
+    return fail(verifier, "constant index out of range");
+  *value = verifier->chunk->constants.values[constant];
+  return true;
+}
+
+// Reads the property name operand of a class or property instruction.
+static bool readName(Verifier *verifier) {
+  Value name;
+  if (!readConstant(verifier, 1, &name))
+    return false;
+  if (!IS_ANY_STRING(name))
+    return fail(verifier, "property name is not a string");
+  return true;
+}
+
+// Checks the cache index, the last operand of the instructions with one.
+static bool checkCache(Verifier *verifier) {
+  Chunk *chunk = verifier->chunk;
+  uint8_t op = chunk->code[verifier->offset];
+  int cache = chunk->code[verifier->offset + instructionLength(op) - 1];
+  if (cache >= chunk->cacheCount)
+    return fail(verifier, "cache index out of range");
+  return true;
+}
+
+static bool push(Verifier *verifier, StaticType type) {
+  if (verifier->depth == verifier->chunk->maxStackDepth)
+    return fail(verifier, "stack deeper than the chunk's maxStackDepth");
+  verifier->types[verifier->depth++] = type;
+  return true;
+}
+
+static bool need(Verifier *verifier, int count) {
+  if (verifier->depth < count)
+    return fail(verifier, "stack underflow");
+  return true;
+}
+
+static StaticType peekType(Verifier *verifier, int distance) {
+  return verifier->types[verifier->depth - 1 - distance];
+}
+
+// What a generic operator produces when it succeeds, given its operands.
+static StaticType binaryResult(uint8_t op, StaticType a, StaticType b) {
+  switch (op) {
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_NOT_GREATER:
+  case OP_NOT_LESS:
+    return TYPE_BOOL;
+  case OP_ADD:
+    if (a == TYPE_STRING && b == TYPE_STRING)
+      return TYPE_STRING;
+    // Fall through.
+  default:
+    return a == b && (a == TYPE_INT || a == TYPE_DOUBLE) ? a : TYPE_UNKNOWN;
+  }
+}
+
+static bool binary(Verifier *verifier, uint8_t op) {
+  if (!need(verifier, 2))
+    return false;
+  StaticType b = peekType(verifier, 0);
+  StaticType a = peekType(verifier, 1);
+  verifier->depth -= 2;
+  return push(verifier, binaryResult(op, a, b));
+}
+
+// Typed opcodes skip run()'s checks, so their operands must be proven.
+static bool typedBinary(Verifier *verifier, StaticType operand,
+                        StaticType result) {
+  if (!need(verifier, 2))
+    return false;
+  if (peekType(verifier, 0) != operand || peekType(verifier, 1) != operand)
+    return fail(verifier, "typed opcode on unproven operand types");
+  verifier->depth -= 2;
+  return push(verifier, result);
+}
+
+static bool typedUnary(Verifier *verifier, StaticType operand) {
+  if (!need(verifier, 1))
+    return false;
+  if (peekType(verifier, 0) != operand)
+    return fail(verifier, "typed opcode on an unproven operand type");
+  return true;
+}
+
+static StaticType *targetTypes(Verifier *verifier, int target) {
+  return verifier->targetTypes +
+         verifier->targets[target] * verifier->chunk->maxStackDepth;
+}
+
+// Merges the current state into the entry state of the jump target at
+// `target`. Values that can differ between paths lose their static type.
+static bool mergeInto(Verifier *verifier, int target, bool backward) {
+  int *depth = &verifier->targetDepths[verifier->targets[target]];
+  StaticType *types = targetTypes(verifier, target);
+  if (*depth == -1) {
+    *depth = verifier->depth;
+    for (int i = 0; i < verifier->depth; i++)
+      types[i] = verifier->types[i];
+    verifier->changed |= backward;
+    return true;
+  }
+  if (*depth != verifier->depth)
+    return fail(verifier, "stack depth differs between paths");
+  for (int i = 0; i < verifier->depth; i++) {
+    if (types[i] != verifier->types[i] && types[i] != TYPE_UNKNOWN) {
+      types[i] = TYPE_UNKNOWN;
+      verifier->changed |= backward;
+    }
+  }
+  return true;
+}
+
+static bool jump(Verifier *verifier) {
+  int target = jumpTarget(verifier->chunk, verifier->offset);
+  return mergeInto(verifier, target, target <= verifier->offset);
+}
+
+// Checks the instruction at verifier->offset and applies its stack effect.
+// Sets *ends if it never falls through to the next instruction.
+static bool verifyInstruction(Verifier *verifier, bool *ends) {
+  Chunk *chunk = verifier->chunk;
+  uint8_t op = chunk->code[verifier->offset];
+
+  Value value;
+  switch (op) {
+  case OP_CONSTANT:
+    return readConstant(verifier, 1, &value) &&
+           push(verifier, constantType(value));
+  case OP_NIL:
+    return push(verifier, TYPE_NIL);
+  case OP_TRUE:
+  case OP_FALSE:
+    return push(verifier, TYPE_BOOL);
+  case OP_POP:
+  case OP_PRINT:
+    if (!need(verifier, 1))
+      return false;
+    verifier->depth--;
+    return true;
+  case OP_POPN: {
+    int count = chunk->code[verifier->offset + 1];
+    if (!need(verifier, count))
+      return false;
+    verifier->depth -= count;
+    return true;
+  }
+  case OP_DUP:
+    return need(verifier, 1) && push(verifier, peekType(verifier, 0));
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL: {
+    // A local's type is whatever its slot holds at this point, so typed
+    // opcodes can use it.
+    int slot = chunk->code[verifier->offset + 1];
+    if (slot >= verifier->depth)
+      return fail(verifier, "local slot out of range");
+    if (op == OP_GET_LOCAL)
+      return push(verifier, verifier->types[slot]);
+    verifier->types[slot] = peekType(verifier, 0);
+    return true;
+  }
+  case OP_DEFINE_GLOBAL:
+    if (!readConstant(verifier, 1, &value) || !need(verifier, 1))
+      return false;
+    if (!IS_ANY_STRING(value))
+      return fail(verifier, "global name is not a string");
+    verifier->depth--;
+    return true;
+  case OP_GET_GLOBAL:
+    if (!readConstant(verifier, 1, &value))
+      return false;
+    if (!IS_ANY_STRING(value))
+      return fail(verifier, "global name is not a string");
+    return push(verifier, TYPE_UNKNOWN);
+  case OP_SET_GLOBAL:
+    if (!readConstant(verifier, 1, &value) || !need(verifier, 1))
+      return false;
+    if (!IS_ANY_STRING(value))
+      return fail(verifier, "global name is not a string");
+    return true;
+  case OP_ARRAY:
+    return push(verifier, TYPE_ARRAY);
+  case OP_ARRAY_APPEND:
+    // run() appends without checking that the target is an array.
+    if (!need(verifier, 2))
+      return false;
+    if (peekType(verifier, 1) != TYPE_ARRAY)
+      return fail(verifier, "append to an unproven array");
+    verifier->depth--;
+    return true;
+  case OP_GET_INDEX:
+    if (!need(verifier, 2))
+      return false;
+    verifier->depth -= 2;
+    return push(verifier, TYPE_UNKNOWN);
+  case OP_SET_INDEX: {
+    if (!need(verifier, 3))
+      return false;
+    StaticType type = peekType(verifier, 0);
+    verifier->depth -= 3;
+    return push(verifier, type);
+  }
+  case OP_MAP:
+    return push(verifier, TYPE_MAP);
+  case OP_MAP_INSERT:
+    // Like OP_ARRAY_APPEND, run() trusts the target to be a map.
+    if (!need(verifier, 3))
+      return false;
+    if (peekType(verifier, 2) != TYPE_MAP)
+      return fail(verifier, "insert into an unproven map");
+    verifier->depth -= 2;
+    return true;
+  case OP_MAP_MERGE:
+    if (!need(verifier, 2))
+      return false;
+    if (peekType(verifier, 1) != TYPE_MAP)
+      return fail(verifier, "merge into an unproven map");
+    verifier->depth--;
+    return true;
+  case OP_IN:
+  case OP_DELETE:
+    if (!need(verifier, 2))
+      return false;
+    verifier->depth -= 2;
+    return push(verifier, TYPE_BOOL);
+  case OP_SIZE:
+    // Fails at run time on anything without a size.
+    if (!need(verifier, 1))
+      return false;
+    verifier->types[verifier->depth - 1] = TYPE_INT;
+    return true;
+  case OP_CALL: {
+    int argCount = chunk->code[verifier->offset + 1];
+    if (!need(verifier, argCount + 1))
+      return false;
+    verifier->depth -= argCount + 1;
+    return push(verifier, TYPE_UNKNOWN);
+  }
+  case OP_TAIL_CALL:
+    if (chunk->arity < 0)
+      return fail(verifier, "tail call outside a function");
+    if (!need(verifier, chunk->code[verifier->offset + 1] + 1))
+      return false;
+    *ends = true;
+    return true;
+  case OP_CLASS:
+    return readName(verifier) && push(verifier, TYPE_UNKNOWN);
+  // run() checks that these operate on classes and functions itself.
+  case OP_INHERIT:
+    if (!need(verifier, 2))
+      return false;
+    verifier->depth -= 2;
+    return true;
+  case OP_METHOD:
+    if (!readName(verifier) || !need(verifier, 2))
+      return false;
+    verifier->depth--;
+    return true;
+  case OP_GET_PROPERTY:
+    if (!readName(verifier) || !checkCache(verifier) || !need(verifier, 1))
+      return false;
+    verifier->types[verifier->depth - 1] = TYPE_UNKNOWN;
+    return true;
+  case OP_SET_PROPERTY: {
+    if (!readName(verifier) || !checkCache(verifier) || !need(verifier, 2))
+      return false;
+    StaticType type = peekType(verifier, 0);
+    verifier->depth -= 2;
+    return push(verifier, type);
+  }
+  case OP_GET_SUPER:
+  case OP_SUPER_INVOKE:
+  case OP_INVOKE: {
+    // run() finds `super` through the frame's function.
+    if (op != OP_INVOKE && chunk->arity < 0)
+      return fail(verifier, "super outside a function");
+    if (!readName(verifier) || (op == OP_INVOKE && !checkCache(verifier)))
+      return false;
+    int argCount = op == OP_GET_SUPER ? 0 : chunk->code[verifier->offset + 2];
+    if (!need(verifier, argCount + 1))
+      return false;
+    verifier->depth -= argCount + 1;
+    return push(verifier, TYPE_UNKNOWN);
+  }
+  case OP_JUMP:
+    *ends = true;
+    return jump(verifier);
+  case OP_JUMP_IF_FALSE:
+    if (!need(verifier, 1))
+      return false;
+    verifier->depth--;
+    return jump(verifier);
+  case OP_LOOP:
+    if (chunk->code[verifier->offset + 1] >= chunk->loopCount)
+      return fail(verifier, "loop counter index out of range");
+    *ends = true;
+    return jump(verifier);
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_GREATER:
+  case OP_JUMP_IF_NOT_GREATER:
+    if (!need(verifier, 2))
+      return false;
+    verifier->depth -= 2;
+    return jump(verifier);
+  case OP_JUMP_IF_LESS_II:
+  case OP_JUMP_IF_NOT_LESS_II:
+  case OP_JUMP_IF_GREATER_II:
+  case OP_JUMP_IF_NOT_GREATER_II:
+    if (!need(verifier, 2))
+      return false;
+    if (peekType(verifier, 0) != TYPE_INT || peekType(verifier, 1) != TYPE_INT)
+      return fail(verifier, "typed opcode on unproven operand types");
+    verifier->depth -= 2;
+    return jump(verifier);
+  case OP_DEFINE_GLOBAL_CONSTANT:
+    if (!readConstant(verifier, 1, &value))
+      return false;
+    if (!IS_ANY_STRING(value))
+      return fail(verifier, "global name is not a string");
+    // The JIT pushes the value before storing it.
+    if (!readConstant(verifier, 2, &value) ||
+        !push(verifier, constantType(value)))
+      return false;
+    verifier->depth--;
+    return true;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_NOT_GREATER:
+  case OP_NOT_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+    return binary(verifier, op);
+  case OP_CONCAT_N:
+  case OP_INTERPOLATE: {
+    // run() reads the first two values of a failing OP_CONCAT_N to pick its
+    // error message.
+    int count = chunk->code[verifier->offset + 1];
+    if (count < (op == OP_CONCAT_N ? 2 : 1))
+      return fail(verifier, "too few values to concatenate");
+    if (!need(verifier, count))
+      return false;
+    verifier->depth -= count;
+    return push(verifier, TYPE_STRING);
+  }
+  case OP_CONSTANT_ADD:
+  case OP_CONSTANT_SUBTRACT:
+  case OP_CONSTANT_MULTIPLY:
+  case OP_CONSTANT_DIVIDE:
+  case OP_CONSTANT_LESS:
+  case OP_CONSTANT_GREATER:
+    return readConstant(verifier, 1, &value) &&
+           push(verifier, constantType(value)) &&
+           binary(verifier, (uint8_t)fusedConstantOperation(op));
+  case OP_NOT:
+    if (!need(verifier, 1))
+      return false;
+    verifier->types[verifier->depth - 1] = TYPE_BOOL;
+    return true;
+  case OP_NEGATE: {
+    if (!need(verifier, 1))
+      return false;
+    StaticType type = peekType(verifier, 0);
+    if (type != TYPE_INT && type != TYPE_DOUBLE)
+      verifier->types[verifier->depth - 1] = TYPE_UNKNOWN;
+    return true;
+  }
+  case OP_ADD_II:
+  case OP_SUBTRACT_II:
+  case OP_MULTIPLY_II:
+  case OP_DIVIDE_II:
+    return typedBinary(verifier, TYPE_INT, TYPE_INT);
+  case OP_LESS_II:
+  case OP_GREATER_II:
+    return typedBinary(verifier, TYPE_INT, TYPE_BOOL);
+  case OP_ADD_DD:
+  case OP_SUBTRACT_DD:
+  case OP_MULTIPLY_DD:
+  case OP_DIVIDE_DD:
+    return typedBinary(verifier, TYPE_DOUBLE, TYPE_DOUBLE);
+  case OP_LESS_DD:
+  case OP_GREATER_DD:
+    return typedBinary(verifier, TYPE_DOUBLE, TYPE_BOOL);
+  case OP_CONCAT_SS:
+    return typedBinary(verifier, TYPE_STRING, TYPE_STRING);
+  case OP_NEGATE_I:
+    return typedUnary(verifier, TYPE_INT);
+  case OP_NEGATE_D:
+    return typedUnary(verifier, TYPE_DOUBLE);
+  case OP_RETURN:
+    // A function's frame goes away with whatever is on it but the result.
+    if (chunk->arity >= 0 && !need(verifier, 1))
+      return false;
+    if (chunk->arity < 0 && verifier->depth != 0)
+      return fail(verifier, "values left on the stack at return");
+    *ends = true;
+    return true;
+  default:
+    return fail(verifier, "unknown opcode");
+  }
+}
+
+// Checks that every instruction fits in the code and every jump lands on an
+// instruction, and numbers the jump targets.
+static bool findTargets(Verifier *verifier) {
+  Chunk *chunk = verifier->chunk;
+  for (int offset = 0; offset < chunk->count; offset++)
+    verifier->targets[offset] = NOT_INSTRUCTION;
+  for (int offset = 0; offset < chunk->count;) {
+    verifier->offset = offset;
+    int length = instructionLength(chunk->code[offset]);
+    if (offset + length > chunk->count)
+      return fail(verifier, "operands run past the end of the code");
+    verifier->targets[offset] = NOT_TARGET;
+    offset += length;
+  }
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    verifier->offset = offset;
+    int target = jumpTarget(chunk, offset);
+    // A malformed OP_LOOP can jump back to -1 too.
+    if (target == -1 && chunk->code[offset] != OP_LOOP)
+      continue;
+    if (target < 0 || target >= chunk->count ||
+        verifier->targets[target] == NOT_INSTRUCTION)
+      return fail(verifier, "jump to the middle of an instruction");
+    if (verifier->targets[target] == NOT_TARGET)
+      verifier->targets[target] = verifier->targetCount++;
+  }
+  return true;
+}
+
+// Walks the code in order. At a jump target, the state falling through
+// merges with the paths jumping there and the walk goes on from the result;
+// code no path reaches is skipped, as no engine ever runs it.
+static bool walk(Verifier *verifier) {
+  Chunk *chunk = verifier->chunk;
+  // A function starts with itself or its receiver in slot 0 and its
+  // arguments, of any type, after it.
+  verifier->depth = chunk->arity >= 0 ? chunk->arity + 1 : 0;
+  if (verifier->depth > chunk->maxStackDepth)
+    return fail(verifier, "arguments deeper than the chunk's maxStackDepth");
+  for (int i = 0; i < verifier->depth; i++)
+    verifier->types[i] = TYPE_UNKNOWN;
+  bool reachable = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    verifier->offset = offset;
+    if (verifier->targets[offset] >= 0) {
+      if (reachable && !mergeInto(verifier, offset, false))
+        return false;
+      verifier->depth = verifier->targetDepths[verifier->targets[offset]];
+      reachable = verifier->depth != -1;
+      StaticType *types = targetTypes(verifier, offset);
+      for (int i = 0; i < verifier->depth; i++)
+        verifier->types[i] = types[i];
+    }
+    if (!reachable)
+      continue;
+
+    bool ends = false;
+    if (!verifyInstruction(verifier, &ends))
+      return false;
+    reachable = !ends;
+  }
+
+  if (reachable) {
+    if (!verifier->quiet)
+      fprintf(stderr, "Invalid bytecode: code ends without OP_RETURN\n");
+    return false;
+  }
+  return true;
+}
+
+static bool verify(Chunk *chunk, bool quiet) {
+  if (chunk->verified)
+    return true;
+
+  Verifier verifier;
+  verifier.chunk = chunk;
+  verifier.quiet = quiet;
+  verifier.offset = 0;
+  verifier.depth = 0;
+  verifier.types = ALLOCATE(StaticType, chunk->maxStackDepth);
+  verifier.targets = ALLOCATE(int, chunk->count);
+  verifier.targetCount = 0;
+  verifier.targetDepths = NULL;
+  verifier.targetTypes = NULL;
+
+  bool ok = findTargets(&verifier);
+  if (ok) {
+    verifier.targetDepths = ALLOCATE(int, verifier.targetCount);
+    for (int i = 0; i < verifier.targetCount; i++)
+      verifier.targetDepths[i] = -1;
+    verifier.targetTypes =
+        ALLOCATE(StaticType, verifier.targetCount * chunk->maxStackDepth);
+  }
+  // A back edge that changes a loop's entry state means walking again. Types
+  // only ever widen to TYPE_UNKNOWN, so this settles after a few walks.
+  do {
+    verifier.changed = false;
+    ok = ok && walk(&verifier);
+  } while (ok && verifier.changed);
+  // The functions declared in the chunk are checked along with it, so that
+  // calling one needs no check. Those still to be compiled are checked once
+  // they are.
+  for (int i = 0; ok && i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant) && AS_FUNCTION(constant)->source == NULL)
+      ok = verify(&AS_FUNCTION(constant)->chunk, quiet);
+  }
+
+  FREE_ARRAY(StaticType, verifier.types, chunk->maxStackDepth);
+  FREE_ARRAY(int, verifier.targets, chunk->count);
+  FREE_ARRAY(int, verifier.targetDepths, verifier.targetCount);
+  FREE_ARRAY(StaticType, verifier.targetTypes,
+             verifier.targetCount * chunk->maxStackDepth);
+  chunk->verified = ok;
+  return ok;
+}
+
+bool verifyChunk(Chunk *chunk) { return verify(chunk, false); }
+
+bool checkChunk(Chunk *chunk) { return verify(chunk, true); }
@@ -0,0 +1,19 @@
+#ifndef rotlang_verifier_h
+#define rotlang_verifier_h
+
+#include "chunk.h"
+
+// Checks, once, everything run() takes on trust: that every opcode exists
+// and its operands fit in the chunk, that constant indices are in range and
+// name strings where the VM reads a string, that no path underflows the
+// stack or outgrows maxStackDepth, and that typed opcodes only ever see the
+// operand types they skip checking for. The functions among the constants
+// that have been compiled are checked along with the chunk. On success the
+// chunk is flagged as verified; on failure the first problem is reported to
+// stderr.
+bool verifyChunk(Chunk *chunk);
+// The same checks without reporting anything, for code generators that
+// fall back to something simpler when their output is rejected.
+bool checkChunk(Chunk *chunk);
+
+#endif
@@ -3,17 +3,47 @@
 #include <string.h>
 #include <time.h>
 
+#include "array.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "map.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
+#include "regcode.h"
+#include "shape.h"
+#include "verifier.h"
 #include "vm.h"
 
 VM vm;
 
-static void resetStack() { vm.stackTop = vm.stack; }
+#define RUN_FOREVER INT64_MAX
+// How many instructions run() lets pass between reads of the clock when it
+// has a deadline.
+#define CLOCK_CHECK_INTERVAL 4096
+#define HEAP_LIMIT_MESSAGE "Heap limit of %zu bytes exceeded."
 
+static int64_t monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void resetStack() {
+  vm.stackTop = vm.stack;
+  vm.frameCount = 0;
+}
+
+static void reportRuntimeError(int line, const char *format, va_list args) {
+  vfprintf(stderr, format, args);
+  fputs("\n", stderr);
+  fprintf(stderr, "[line %d] in script\n", line);
+  resetStack();
+}
+
+// Reports the error with a line for each call in progress, innermost first.
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -21,20 +51,92 @@ static void runtimeError(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction].lineNumber;
-  fprintf(stderr, "[line %d] in script\n", line);
+  for (int i = vm.frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm.frames[i];
+    size_t instruction = frame->ip - frame->chunk->code - 1;
+    fprintf(stderr, "[line %d] in ", getLine(frame->chunk, (int)instruction));
+    if (frame->function == NULL) {
+      fprintf(stderr, "script\n");
+    } else {
+      Value name = frame->function->name;
+      fprintf(stderr, "%.*s()\n", STRING_LENGTH(name), STRING_CHARS(name));
+    }
+  }
   resetStack();
 }
 
+static void registerError(RegChunk *chunk, uint32_t *pc, const char *format,
+                          ...) {
+  va_list args;
+  va_start(args, format);
+  reportRuntimeError(chunk->lines[pc - chunk->code - 1], format, args);
+  va_end(args);
+}
+
+// Makes room for `slots` more values above the current stack top. The
+// array also keeps one slot below vm.stack: run() spills its cached top to
+// stackTop[-1] on every push, including the first one onto an empty stack.
+static void reserveStack(int slots) {
+  int used = (int)(vm.stackTop - vm.stack);
+  if (vm.stack != NULL && used + slots <= vm.stackCapacity)
+    return;
+
+  int oldCapacity = vm.stackCapacity;
+  while (vm.stackCapacity < used + slots)
+    vm.stackCapacity = INCREASE_CAPACITY(vm.stackCapacity);
+  Value *base = vm.stack == NULL ? NULL : vm.stack - 1;
+  base = INCREASE_ARRAY_AS(MEM_STACK, Value, base,
+                           oldCapacity == 0 ? 0 : oldCapacity + 1,
+                           vm.stackCapacity + 1);
+  vm.stack = base + 1;
+  vm.stackTop = vm.stack + used;
+}
+
+// Makes room for `slots` values from `base` up while run() is running, for
+// a call's frame. The stack may move, and every frame's slots move with it.
+// Returns where `base` is now.
+static Value *growStack(Value *base, int slots) {
+  int offsets[FRAMES_MAX];
+  for (int i = 0; i < vm.frameCount; i++)
+    offsets[i] = (int)(vm.frames[i].slots - vm.stack);
+  int offset = (int)(base - vm.stack);
+
+  vm.stackTop = base;
+  reserveStack(slots);
+  for (int i = 0; i < vm.frameCount; i++)
+    vm.frames[i].slots = vm.stack + offsets[i];
+  return vm.stack + offset;
+}
+
+// Compiles a function's body at its first call and, under --jit, its native
+// code with it.
+static bool compileBody(ObjFunction *function) {
+  if (!compileFunction(function) || !verifyChunk(&function->chunk))
+    return false;
+  if (vm.engine == ENGINE_JIT)
+    jitCompile(&function->chunk, &function->native);
+  return true;
+}
+
 void initVM() {
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
   resetStack();
+  vm.engine = ENGINE_STACK;
+  vm.profile = NULL;
   vm.objects = NULL;
+  vm.nativeError = NULL;
   initTable(&vm.globals);
   initTable(&vm.strings);
+  defineBuiltins();
 }
 
 void freeVM() {
+  if (vm.stack != NULL)
+    FREE_ARRAY_AS(MEM_STACK, Value, vm.stack - 1, vm.stackCapacity + 1);
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
+  resetStack();
   freeTable(&vm.globals);
   freeTable(&vm.strings);
   freeObjects();
@@ -45,83 +147,339 @@ void push(Value value) {
   vm.stackTop++;
 }
 
-void negate() {
-  vm.stackTop--;
-  *vm.stackTop = DOUBLE_VAL(-AS_DOUBLE(*vm.stackTop));
-  vm.stackTop++;
-}
-
 Value pop() {
   vm.stackTop--;
   return *vm.stackTop;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
-
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+void defineNative(const char *name, NativeFn function, int arity) {
+  tableSet(&vm.globals, makeString(name, (int)strlen(name)),
+           OBJ_VAL(newNative(function, name, arity)));
 }
 
-static void concatenate() {
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
+Value nativeError(const char *format, ...) {
+  static char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  vm.nativeError = message;
+  return NIL_VAL;
+}
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+// The inline cache misses of OP_GET_PROPERTY and OP_INVOKE: finds where
+// instances of `shape` keep `name` among the cache's other entries, or
+// looks it up and adds an entry while there's room. A full cache looks it
+// up every time, into `scratch`. Returns NULL if there's no such property.
+static CacheEntry *findProperty(PropertyCache *cache, Shape *shape, Value name,
+                                CacheEntry *scratch) {
+  for (int i = 1; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape)
+      return &cache->entries[i];
+  }
+  CacheEntry *entry = cache->count < PROPERTY_CACHE_ENTRIES
+                          ? &cache->entries[cache->count]
+                          : scratch;
+  entry->transition = NULL;
+  entry->method = NIL_VAL;
+  entry->field = shapeFieldIndex(shape, name);
+  // Methods never change once their class is made, so caching one is as
+  // safe as caching a field index.
+  if (entry->field < 0 &&
+      !tableGet(&shape->klass->methods, name, &entry->method))
+    return NULL;
+  entry->shape = shape;
+  if (entry != scratch)
+    cache->count++;
+  return entry;
+}
 
-  ObjString *result = takeString(chars, length);
-  push(OBJ_VAL(result));
+// The same for OP_SET_PROPERTY, where a field the instance doesn't have yet
+// is added: the entry records the shape it moves to.
+static CacheEntry *findField(PropertyCache *cache, Shape *shape, Value name,
+                             CacheEntry *scratch) {
+  for (int i = 1; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape)
+      return &cache->entries[i];
+  }
+  CacheEntry *entry = cache->count < PROPERTY_CACHE_ENTRIES
+                          ? &cache->entries[cache->count++]
+                          : scratch;
+  entry->shape = shape;
+  entry->method = NIL_VAL;
+  entry->transition = NULL;
+  entry->field = shapeFieldIndex(shape, name);
+  if (entry->field < 0) {
+    entry->transition = shapeTransition(shape, name);
+    entry->field = shape->fieldCount;
+  }
+  return entry;
 }
 
-static InterpretResult run() {
-#define READ_BYTE()                                                            \
-  ({                                                                           \
-    uint8_t byte = *vm.ip;                                                     \
-    *vm.ip++;                                                                  \
-    printf("read byte: %d \n", byte);                                          \
-    byte;                                                                      \
-  })
+// The dispatch loop keeps ip, the stack top pointer and the top-of-stack
+// value itself in locals so they can live in registers. Below the cached
+// top, sp[-1] is stale and sp[-2] down are the real values; frame->ip and
+// vm.stackTop are only brought up to date by SYNC(), which must run before
+// anything that reads them: runtime errors, tracing, and calls back into the
+// VM. The helpers run() calls (tableSet, concatenateStrings, printValue)
+// never look at the VM stack, so they need no sync; natives read their
+// arguments from it, so OP_CALL spills the cached top first.
+//
+// There are no bounds or operand checks on the bytecode itself: run() only
+// ever sees chunks verifyChunk() has accepted. A function's body is
+// compiled and verified by its first call.
+//
+// When `counted`, `budget` counts instructions down. Every dispatch
+// decrements it, but it is only tested at checkpoints: the instructions that
+// end a statement, loop back edges, and calls and returns, so the code run
+// between two of them is bounded by the length of a chunk. A nonzero
+// `deadline` is a CLOCK_MONOTONIC time in nanoseconds; the clock is read at
+// the first checkpoint after every CLOCK_CHECK_INTERVAL instructions, not at
+// each one.
+//
+// A `nested` run works for native code and hands control back to it once the
+// frame it starts in has returned or, with `step`, has run one instruction,
+// calls it makes included.
+//
+// run() is always inlined into runToEnd(), runSliced() and runNested(), so a
+// whole run compiles with no counting or checks at all.
+static inline __attribute__((always_inline)) InterpretResult
+run(int64_t budget, int64_t deadline, bool counted, bool nested, bool step) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  uint8_t *ip = frame->ip;
+  Value *sp = vm.stackTop;
+  Value tos = sp[-1];
+  Value *constants = frame->chunk->constants.values;
+  // The frame's locals, from slot 0 and the arguments on, are numbered
+  // from here.
+  Value *slots = frame->slots;
+  LoopCounter *loops = frame->chunk->loops;
+  PropertyCache *caches = frame->chunk->caches;
+  // The budget left when the clock is next read. Without a deadline it's 0,
+  // so only running out of budget gets past the first test in CHECK_BUDGET.
+  int64_t clockCheck =
+      deadline != 0 ? budget - CLOCK_CHECK_INTERVAL : 0;
+  CallFrame *base = frame;
+  uint8_t *start = ip;
 
-#define READ_CONSTANT()                                                        \
-  ({                                                                           \
-    uint8_t byte = READ_BYTE();                                                \
-    Value val = vm.chunk->constants.values[byte];                              \
-    if (IS_DOUBLE(val)) {                                                      \
-      printf("value: %g ", vm.chunk->constants.values[byte].as.doubleNum);     \
-    } else if (IS_INT(val)) {                                                  \
-      printf("value: %d ", vm.chunk->constants.values[byte].as.intNum);        \
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+// Spills the cached top to its slot and caches the new value.
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    sp[-1] = tos;                                                              \
+    tos = (value);                                                             \
+    sp++;                                                                      \
+  } while (false)
+#define DROP()                                                                 \
+  do {                                                                         \
+    sp--;                                                                      \
+    tos = sp[-1];                                                              \
+  } while (false)
+#define SYNC()                                                                 \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    sp[-1] = tos;                                                              \
+    vm.stackTop = sp;                                                          \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SYNC();                                                                    \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+// The compiler has reported whatever stopped the body compiling.
+#define COMPILE_BODY(function)                                                 \
+  do {                                                                         \
+    if (!compileBody(function)) {                                              \
+      SYNC();                                                                  \
+      resetStack();                                                            \
+      return INTERPRET_COMPILE_ERROR;                                          \
     }                                                                          \
-    vm.chunk->constants.values[byte];                                          \
-  })
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                                               \
+  } while (false)
+// Once the budget is spent or the deadline has passed, saves the state
+// runFor() resumes from.
+#define CHECK_BUDGET()                                                         \
   do {                                                                         \
-    Value num1 = peek(0);                                                      \
-    Value num2 = peek(1);                                                      \
-    if (IS_DOUBLE(num1)) {                                                     \
-      if (!IS_DOUBLE(num2)) {                                                  \
-        runtimeError("Operands type mismatch");                                \
-        return INTERPRET_RUNTIME_ERROR;                                        \
+    if (budget <= clockCheck) {                                                \
+      if (budget <= 0 || monotonicNanos() >= deadline) {                       \
+        SYNC();                                                                \
+        return INTERPRET_YIELD;                                                \
       }                                                                        \
-      double b = AS_DOUBLE(pop());                                             \
-      double a = AS_DOUBLE(pop());                                             \
-      push(valueType(a op b));                                                 \
-    } else if (IS_INT(num1)) {                                                 \
-      if (!IS_INT(num2)) {                                                     \
-        runtimeError("Operands must be numbers.");                             \
-        return INTERPRET_RUNTIME_ERROR;                                        \
+      clockCheck = budget - CLOCK_CHECK_INTERVAL;                              \
+    }                                                                          \
+  } while (false)
+// Follows every instruction that can allocate.
+#define CHECK_HEAP()                                                           \
+  do {                                                                         \
+    if (heapLimitExceeded())                                                   \
+      RUNTIME_ERROR(HEAP_LIMIT_MESSAGE, memoryStats.limit);                    \
+  } while (false)
+#define CHECK_INDEX(array, index)                                              \
+  do {                                                                         \
+    if (!IS_ARRAY(array))                                                      \
+      RUNTIME_ERROR("Only arrays and maps can be indexed.");                   \
+    if (!IS_INT(index))                                                        \
+      RUNTIME_ERROR("Array index must be an int.");                            \
+    if (AS_INT(index) < 0 || AS_INT(index) >= AS_ARRAY(array)->count)          \
+      RUNTIME_ERROR("Array index %d out of bounds.", AS_INT(index));           \
+  } while (false)
+// Operands are the value below the top (a) and the cached top (b); the
+// result replaces both.
+#define BINARY_OP(valueType, op)                                               \
+  do {                                                                         \
+    Value a = sp[-2];                                                          \
+    if (IS_DOUBLE(tos)) {                                                      \
+      if (!IS_DOUBLE(a))                                                       \
+        RUNTIME_ERROR("Operands type mismatch");                               \
+      tos = valueType(AS_DOUBLE(a) op AS_DOUBLE(tos));                         \
+    } else if (IS_INT(tos)) {                                                  \
+      if (!IS_INT(a))                                                          \
+        RUNTIME_ERROR("Operands must be numbers.");                            \
+      tos = valueType(AS_INT(a) op AS_INT(tos));                               \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    sp--;                                                                      \
+  } while (false)
+// Typed opcodes: the compiler has proven both operand types.
+#define TYPED_OP(valueType, as, op)                                            \
+  do {                                                                         \
+    tos = valueType(as(sp[-2]) op as(tos));                                    \
+    sp--;                                                                      \
+  } while (false)
+// Compare-and-branch: pops both operands and jumps if `a op b` is `when`,
+// after the same checks as BINARY_OP.
+#define COMPARE_JUMP(op, when)                                                 \
+  do {                                                                         \
+    BINARY_OP(BOOL_VAL, op);                                                   \
+    uint16_t offset = READ_SHORT();                                            \
+    if (AS_BOOL(tos) == (when))                                                \
+      ip += offset;                                                            \
+    DROP();                                                                    \
+  } while (false)
+#define TYPED_JUMP(op, when)                                                   \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    if ((AS_INT(sp[-2]) op AS_INT(tos)) == (when))                             \
+      ip += offset;                                                            \
+    sp -= 2;                                                                   \
+    tos = sp[-1];                                                              \
+  } while (false)
+// Calls the native at args[-1] right on the operand stack: no frame, and
+// the arguments aren't copied. The result replaces the native and its
+// arguments.
+#define CALL_NATIVE(args, argCount)                                            \
+  do {                                                                         \
+    ObjNative *native = AS_NATIVE(args[-1]);                                   \
+    if (native->arity >= 0 && argCount != native->arity)                       \
+      RUNTIME_ERROR("Expected %d arguments but got %d.", native->arity,        \
+                    argCount);                                                 \
+    Value result = native->function(argCount, args);                           \
+    if (vm.nativeError != NULL) {                                              \
+      const char *message = vm.nativeError;                                    \
+      vm.nativeError = NULL;                                                   \
+      RUNTIME_ERROR("%s", message);                                            \
+    }                                                                          \
+    sp = args;                                                                 \
+    tos = result;                                                              \
+    CHECK_HEAP();                                                              \
+  } while (false)
+// Points the loop's cached state at `frame`, continuing at `resume`.
+#define SWITCH_FRAME(resume)                                                   \
+  do {                                                                         \
+    ip = (resume);                                                             \
+    slots = frame->slots;                                                      \
+    constants = frame->chunk->constants.values;                                \
+    loops = frame->chunk->loops;                                               \
+    caches = frame->chunk->caches;                                             \
+  } while (false)
+// Works out what calling args[-1] runs. A function leaves `function` set
+// and args[-1] as its slot 0: the function itself, a bound method's
+// receiver, or a new instance for a class's initializer. A native or a
+// class without an initializer completes the call on the spot, leaving
+// `function` NULL and the result in place of the callee.
+#define FIND_CALLEE(args, argCount, function)                                  \
+  do {                                                                         \
+    Value callee = args[-1];                                                   \
+    if (IS_FUNCTION(callee)) {                                                 \
+      function = AS_FUNCTION(callee);                                          \
+    } else if (IS_NATIVE(callee)) {                                            \
+      CALL_NATIVE(args, argCount);                                             \
+    } else if (IS_BOUND_METHOD(callee)) {                                      \
+      args[-1] = AS_BOUND_METHOD(callee)->receiver;                            \
+      function = AS_BOUND_METHOD(callee)->method;                              \
+    } else if (IS_CLASS(callee)) {                                             \
+      ObjClass *klass = AS_CLASS(callee);                                      \
+      args[-1] = OBJ_VAL(newInstance(klass));                                  \
+      CHECK_HEAP();                                                            \
+      if (!IS_NIL(klass->initializer)) {                                       \
+        function = AS_FUNCTION(klass->initializer);                            \
+      } else if (argCount != 0) {                                              \
+        RUNTIME_ERROR("Expected 0 arguments but got %d.", argCount);           \
+      } else {                                                                 \
+        sp = args;                                                             \
+        tos = args[-1];                                                        \
       }                                                                        \
-      int b = AS_INT(pop());                                                   \
-      int a = AS_INT(pop());                                                   \
-      push(valueType(a op b));                                                 \
+    } else {                                                                   \
+      RUNTIME_ERROR("Can only call functions and classes.");                   \
+    }                                                                          \
+  } while (false)
+// Compiles the function if this is its first call and checks the argument
+// count.
+#define PREPARE_CALL(function, argCount)                                       \
+  do {                                                                         \
+    if ((function)->source != NULL)                                            \
+      COMPILE_BODY(function);                                                  \
+    if (argCount != (function)->chunk.arity)                                   \
+      RUNTIME_ERROR("Expected %d arguments but got %d.",                       \
+                    (function)->chunk.arity, argCount);                        \
+  } while (false)
+// Pushes a frame for `function` whose slot 0 is args[-1]. The arguments stay
+// where they are and become the slots after it.
+#define CALL_FUNCTION(function, args, argCount)                                \
+  do {                                                                         \
+    PREPARE_CALL(function, argCount);                                          \
+    if (vm.frameCount == FRAMES_MAX)                                           \
+      RUNTIME_ERROR("Stack overflow.");                                        \
+    Value *base = args - 1;                                                    \
+    int depth = (function)->chunk.maxStackDepth;                               \
+    if (base + depth > vm.stack + vm.stackCapacity)                            \
+      base = growStack(base, depth);                                           \
+    frame->ip = ip;                                                            \
+    frame = &vm.frames[vm.frameCount++];                                       \
+    frame->function = (function);                                              \
+    frame->chunk = &(function)->chunk;                                         \
+    frame->slots = base;                                                       \
+    sp = base + 1 + argCount;                                                  \
+    tos = sp[-1];                                                              \
+    SWITCH_FRAME((function)->chunk.code);                                      \
+    CHECK_BUDGET();                                                            \
+  } while (false)
+#define ARITHMETIC_OP(op)                                                      \
+  do {                                                                         \
+    if (IS_INT(tos)) {                                                         \
+      BINARY_OP(INT_VAL, op);                                                  \
+    } else if (IS_DOUBLE(tos)) {                                               \
+      BINARY_OP(DOUBLE_VAL, op);                                               \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands type mistmatch");                                \
     }                                                                          \
   } while (false)
 
+  // Held in a local so the per-dispatch check doesn't reload vm.profile.
+  OpProfile *profile = vm.profile;
+  if (profile != NULL)
+    resetProfileWindow(profile);
+
   for (;;) {
+    if (nested && (frame < base || (step && frame == base && ip != start))) {
+      SYNC();
+      return INTERPRET_OK;
+    }
 #ifdef DEBUG_TRACE_EXECUTION
+    SYNC();
     printf("          ");
     for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
       printf("[ ");
@@ -129,126 +487,911 @@ static InterpretResult run() {
       printf(" ]");
     }
     printf("\n");
-    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    disassembleInstruction(frame->chunk, (int)(ip - frame->chunk->code));
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      //   printValue(constant);
-      printf("\n");
+    uint8_t instruction = READ_BYTE();
+    if (counted)
+      budget--;
+    if (profile != NULL)
+      profileOpcode(profile, instruction);
+    switch (instruction) {
+    case OP_CONSTANT:
+      PUSH(READ_CONSTANT());
       break;
-    }
     case OP_NIL:
-      push(NIL_VAL);
+      PUSH(NIL_VAL);
       break;
     case OP_TRUE:
-      push(BOOL_VAL(true));
+      PUSH(BOOL_VAL(true));
       break;
     case OP_FALSE:
-      push(BOOL_VAL(false));
+      PUSH(BOOL_VAL(false));
       break;
     case OP_POP:
-      pop();
+      DROP();
+      CHECK_BUDGET();
+      break;
+    case OP_POPN:
+      sp -= READ_BYTE();
+      tos = sp[-1];
+      CHECK_BUDGET();
+      break;
+    case OP_DUP:
+      PUSH(tos);
+      break;
+    case OP_GET_LOCAL:
+      // PUSH spills the cached top before reading the slot, so this is
+      // right for the topmost local too.
+      PUSH(slots[READ_BYTE()]);
+      break;
+    case OP_SET_LOCAL:
+      // The assigned value stays on top, always above the local's slot.
+      slots[READ_BYTE()] = tos;
+      break;
+    case OP_DEFINE_GLOBAL:
+      tableSet(&vm.globals, READ_CONSTANT(), materialize(tos));
+      DROP();
+      CHECK_HEAP();
+      CHECK_BUDGET();
       break;
-    case OP_DEFINE_GLOBAL: {
-      ObjString *objString = READ_STRING();
-      Value value = OBJ_VAL(objString);
-      tableSet(&vm.globals, value, peek(0));
-      pop();
+    case OP_GET_GLOBAL: {
+      Value name = READ_CONSTANT();
+      Value value;
+      if (!tableGet(&vm.globals, name, &value))
+        RUNTIME_ERROR("Undefined variable '%.*s'.", STRING_LENGTH(name),
+                      STRING_CHARS(name));
+      PUSH(value);
       break;
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+    case OP_SET_GLOBAL: {
+      Value name = READ_CONSTANT();
+      if (tableSet(&vm.globals, name, materialize(tos))) {
+        tableDelete(&vm.globals, name);
+        RUNTIME_ERROR("Undefined variable '%.*s'.", STRING_LENGTH(name),
+                      STRING_CHARS(name));
+      }
+      CHECK_HEAP();
       break;
     }
+    case OP_ARRAY:
+      PUSH(OBJ_VAL(newArray(READ_BYTE())));
+      CHECK_HEAP();
+      break;
+    case OP_ARRAY_APPEND:
+      // The verifier has proven the target is an array. arraySet()
+      // materializes a string view.
+      arrayAppend(AS_ARRAY(sp[-2]), tos);
+      DROP();
+      CHECK_HEAP();
+      break;
+    case OP_GET_INDEX:
+      if (IS_MAP(sp[-2])) {
+        if (!tableGet(&AS_MAP(sp[-2])->table, tos, &tos))
+          RUNTIME_ERROR("Key not found.");
+      } else {
+        CHECK_INDEX(sp[-2], tos);
+        tos = arrayGet(AS_ARRAY(sp[-2]), AS_INT(tos));
+      }
+      sp--;
+      break;
+    case OP_SET_INDEX:
+      // Leaves the assigned value, which is already the cached top.
+      if (IS_MAP(sp[-3])) {
+        if (!mapSet(AS_MAP(sp[-3]), sp[-2], tos))
+          RUNTIME_ERROR("Map keys can't be nil.");
+      } else {
+        CHECK_INDEX(sp[-3], sp[-2]);
+        arraySet(AS_ARRAY(sp[-3]), AS_INT(sp[-2]), tos);
+      }
+      sp -= 2;
+      CHECK_HEAP();
+      break;
+    case OP_MAP:
+      PUSH(OBJ_VAL(newMap(READ_BYTE())));
+      CHECK_HEAP();
+      break;
+    case OP_MAP_INSERT:
+      // The verifier has proven the target is a map.
+      if (!mapSet(AS_MAP(sp[-3]), sp[-2], tos))
+        RUNTIME_ERROR("Map keys can't be nil.");
+      sp -= 2;
+      tos = sp[-1];
+      CHECK_HEAP();
+      break;
+    case OP_MAP_MERGE:
+      if (!IS_MAP(tos))
+        RUNTIME_ERROR("Only maps can be spread into a map.");
+      mapMerge(AS_MAP(sp[-2]), AS_MAP(tos));
+      DROP();
+      CHECK_HEAP();
+      break;
+    case OP_IN: {
+      if (!IS_MAP(tos))
+        RUNTIME_ERROR("Right operand of 'in' must be a map.");
+      Value value;
+      tos = BOOL_VAL(tableGet(&AS_MAP(tos)->table, sp[-2], &value));
+      sp--;
+      break;
+    }
+    case OP_DELETE:
+      if (!IS_MAP(sp[-2]))
+        RUNTIME_ERROR("Only map entries can be deleted.");
+      tos = BOOL_VAL(mapDelete(AS_MAP(sp[-2]), tos));
+      sp--;
+      break;
+    case OP_SIZE:
+      if (IS_ARRAY(tos)) {
+        tos = INT_VAL(AS_ARRAY(tos)->count);
+      } else if (IS_MAP(tos)) {
+        tos = INT_VAL(AS_MAP(tos)->size);
+      } else if (IS_ANY_STRING(tos)) {
+        tos = INT_VAL(STRING_LENGTH(tos));
+      } else {
+        RUNTIME_ERROR("Only arrays, maps and strings have a size.");
+      }
+      break;
+    case OP_CALL: {
+      // The callee and its arguments stay where they are and become the
+      // first slots of its frame. Only the cached top needs spilling.
+      int argCount = READ_BYTE();
+      sp[-1] = tos;
+      Value *args = sp - argCount;
+      ObjFunction *function = NULL;
+      FIND_CALLEE(args, argCount, function);
+      if (function != NULL)
+        CALL_FUNCTION(function, args, argCount);
+      break;
+    }
+    case OP_CLASS:
+      PUSH(OBJ_VAL(newClass(READ_CONSTANT())));
+      CHECK_HEAP();
+      break;
+    case OP_INHERIT: {
+      if (!IS_CLASS(sp[-2]))
+        RUNTIME_ERROR("Superclass must be a class.");
+      if (!IS_CLASS(tos))
+        RUNTIME_ERROR("Only classes can inherit.");
+      ObjClass *superclass = AS_CLASS(sp[-2]);
+      ObjClass *subclass = AS_CLASS(tos);
+      // Inherited methods are copied down, so looking one up never walks
+      // the superclasses.
+      tableAddAll(&superclass->methods, &subclass->methods);
+      subclass->superclass = superclass;
+      subclass->initializer = superclass->initializer;
+      sp -= 2;
+      tos = sp[-1];
+      CHECK_HEAP();
+      break;
+    }
+    case OP_METHOD: {
+      // The class is usually reloaded from a global, which the verifier
+      // can't type.
+      if (!IS_CLASS(sp[-2]) || !IS_FUNCTION(tos))
+        RUNTIME_ERROR("Only functions can be methods of classes.");
+      ObjClass *klass = AS_CLASS(sp[-2]);
+      ObjFunction *method = AS_FUNCTION(tos);
+      method->superclass = klass->superclass;
+      tableSet(&klass->methods, READ_CONSTANT(), tos);
+      if (method->kind == FUNCTION_INITIALIZER)
+        klass->initializer = tos;
+      DROP();
+      CHECK_HEAP();
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      uint8_t name = READ_BYTE();
+      PropertyCache *cache = &caches[READ_BYTE()];
+      if (!IS_INSTANCE(tos))
+        RUNTIME_ERROR("Only instances have properties.");
+      ObjInstance *instance = AS_INSTANCE(tos);
+      CacheEntry *entry = &cache->entries[0];
+      CacheEntry scratch;
+      if (entry->shape != instance->shape) {
+        entry = findProperty(cache, instance->shape, constants[name], &scratch);
+        if (entry == NULL)
+          RUNTIME_ERROR("Undefined property '%.*s'.",
+                        STRING_LENGTH(constants[name]),
+                        STRING_CHARS(constants[name]));
+      }
+      if (entry->field >= 0) {
+        tos = instance->fields[entry->field];
+        break;
+      }
+      tos = OBJ_VAL(newBoundMethod(tos, AS_FUNCTION(entry->method)));
+      CHECK_HEAP();
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      uint8_t name = READ_BYTE();
+      PropertyCache *cache = &caches[READ_BYTE()];
+      if (!IS_INSTANCE(sp[-2]))
+        RUNTIME_ERROR("Only instances have fields.");
+      ObjInstance *instance = AS_INSTANCE(sp[-2]);
+      Value value = materialize(tos);
+      CacheEntry *entry = &cache->entries[0];
+      CacheEntry scratch;
+      if (entry->shape != instance->shape)
+        entry = findField(cache, instance->shape, constants[name], &scratch);
+      if (entry->transition != NULL)
+        instanceAddField(instance, entry->transition, value);
+      else
+        instance->fields[entry->field] = value;
+      sp--;
+      tos = value;
+      CHECK_HEAP();
+      break;
+    }
+    case OP_INVOKE: {
+      uint8_t name = READ_BYTE();
+      int argCount = READ_BYTE();
+      PropertyCache *cache = &caches[READ_BYTE()];
+      sp[-1] = tos;
+      Value *args = sp - argCount;
+      if (!IS_INSTANCE(args[-1]))
+        RUNTIME_ERROR("Only instances have methods.");
+      ObjInstance *instance = AS_INSTANCE(args[-1]);
+      CacheEntry *entry = &cache->entries[0];
+      CacheEntry scratch;
+      if (entry->shape != instance->shape) {
+        entry = findProperty(cache, instance->shape, constants[name], &scratch);
+        if (entry == NULL)
+          RUNTIME_ERROR("Undefined property '%.*s'.",
+                        STRING_LENGTH(constants[name]),
+                        STRING_CHARS(constants[name]));
+      }
+      ObjFunction *function = NULL;
+      if (entry->field >= 0) {
+        // A field holding something callable is called like any value.
+        args[-1] = instance->fields[entry->field];
+        FIND_CALLEE(args, argCount, function);
+        if (function == NULL)
+          break;
+      } else {
+        function = AS_FUNCTION(entry->method);
+      }
+      CALL_FUNCTION(function, args, argCount);
+      break;
+    }
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE: {
+      Value name = READ_CONSTANT();
+      ObjClass *superclass = frame->function->superclass;
+      if (superclass == NULL)
+        RUNTIME_ERROR("Can't use 'super' in a class with no superclass.");
+      Value method;
+      if (!tableGet(&superclass->methods, name, &method))
+        RUNTIME_ERROR("Undefined property '%.*s'.", STRING_LENGTH(name),
+                      STRING_CHARS(name));
+      if (instruction == OP_GET_SUPER) {
+        tos = OBJ_VAL(newBoundMethod(tos, AS_FUNCTION(method)));
+        CHECK_HEAP();
+        break;
+      }
+      int argCount = READ_BYTE();
+      sp[-1] = tos;
+      Value *args = sp - argCount;
+      ObjFunction *function = AS_FUNCTION(method);
+      CALL_FUNCTION(function, args, argCount);
+      break;
+    }
+    case OP_JUMP: {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(tos))
+        ip += offset;
+      DROP();
+      break;
+    }
+    case OP_LOOP: {
+      loops[READ_BYTE()].iterations++;
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      CHECK_BUDGET();
+      break;
+    }
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      bool equal = valuesEqual(sp[-2], tos);
+      uint16_t offset = READ_SHORT();
+      if (equal == (instruction == OP_JUMP_IF_EQUAL))
+        ip += offset;
+      sp -= 2;
+      tos = sp[-1];
+      break;
+    }
+    case OP_JUMP_IF_LESS:
+      COMPARE_JUMP(<, true);
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      COMPARE_JUMP(<, false);
+      break;
+    case OP_JUMP_IF_GREATER:
+      COMPARE_JUMP(>, true);
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      COMPARE_JUMP(>, false);
+      break;
+    case OP_JUMP_IF_LESS_II:
+      TYPED_JUMP(<, true);
+      break;
+    case OP_JUMP_IF_NOT_LESS_II:
+      TYPED_JUMP(<, false);
+      break;
+    case OP_JUMP_IF_GREATER_II:
+      TYPED_JUMP(>, true);
+      break;
+    case OP_JUMP_IF_NOT_GREATER_II:
+      TYPED_JUMP(>, false);
+      break;
+    case OP_DEFINE_GLOBAL_CONSTANT: {
+      Value name = READ_CONSTANT();
+      tableSet(&vm.globals, name, READ_CONSTANT());
+      CHECK_HEAP();
+      CHECK_BUDGET();
+      break;
+    }
+    case OP_EQUAL:
+      tos = BOOL_VAL(valuesEqual(sp[-2], tos));
+      sp--;
+      break;
+    case OP_NOT_EQUAL:
+      tos = BOOL_VAL(!valuesEqual(sp[-2], tos));
+      sp--;
+      break;
+    // Each OP_CONSTANT_* superinstruction pushes its constant and falls
+    // through into the operation it was fused with.
+    case OP_CONSTANT_GREATER:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_GREATER:
       BINARY_OP(BOOL_VAL, >);
       break;
+    case OP_CONSTANT_LESS:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_LESS:
       BINARY_OP(BOOL_VAL, <);
       break;
+    case OP_NOT_GREATER:
+      BINARY_OP(BOOL_VAL, >);
+      tos = BOOL_VAL(!AS_BOOL(tos));
+      break;
+    case OP_NOT_LESS:
+      BINARY_OP(BOOL_VAL, <);
+      tos = BOOL_VAL(!AS_BOOL(tos));
+      break;
+    case OP_CONSTANT_ADD:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenate();
-      } else if (IS_INT(peek(0))) {
-        BINARY_OP(INT_VAL, +);
-      } else if (IS_DOUBLE(peek(0))) {
-        BINARY_OP(DOUBLE_VAL, +);
+      if (IS_ANY_STRING(tos) && IS_ANY_STRING(sp[-2])) {
+        tos = concatenateStrings(sp[-2], tos);
+        sp--;
+        CHECK_HEAP();
       } else {
-        runtimeError("Operands type mistmatch");
-        return INTERPRET_RUNTIME_ERROR;
+        ARITHMETIC_OP(+);
       }
       break;
+    case OP_CONCAT_N:
+    case OP_INTERPOLATE: {
+      int count = READ_BYTE();
+      sp[-1] = tos;
+      Value *values = sp - count;
+      Value result;
+      const char *error = concatenateValues(
+          values, count, instruction == OP_INTERPOLATE, &result);
+      if (error != NULL)
+        RUNTIME_ERROR("%s", error);
+      sp = values + 1;
+      tos = result;
+      CHECK_HEAP();
+      break;
+    }
+    case OP_CONSTANT_SUBTRACT:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_SUBTRACT:
-      if (IS_INT(peek(0))) {
-        BINARY_OP(INT_VAL, -);
-      } else if (IS_DOUBLE(peek(0))) {
-        BINARY_OP(DOUBLE_VAL, -);
-      } else {
-        runtimeError("Operands type mistmatch");
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      ARITHMETIC_OP(-);
       break;
+    case OP_CONSTANT_MULTIPLY:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_MULTIPLY:
-      if (IS_INT(peek(0))) {
-        BINARY_OP(INT_VAL, *);
-      } else if (IS_DOUBLE(peek(0))) {
-        BINARY_OP(DOUBLE_VAL, *);
-      } else {
-        runtimeError("Operands type mistmatch");
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      ARITHMETIC_OP(*);
       break;
+    case OP_CONSTANT_DIVIDE:
+      PUSH(READ_CONSTANT());
+      // Fall through.
     case OP_DIVIDE:
-      if (IS_INT(peek(0))) {
-        BINARY_OP(INT_VAL, /);
-      } else if (IS_DOUBLE(peek(0))) {
-        BINARY_OP(DOUBLE_VAL, /);
-      } else {
-        runtimeError("Operands type mistmatch");
-        return INTERPRET_RUNTIME_ERROR;
-      }
+      ARITHMETIC_OP(/);
       break;
     case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
+      tos = BOOL_VAL(isFalsey(tos));
       break;
     case OP_NEGATE:
-      if (!IS_DOUBLE(peek(0)) && !IS_INT(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+      if (IS_INT(tos)) {
+        tos = INT_VAL(-AS_INT(tos));
+      } else if (IS_DOUBLE(tos)) {
+        tos = DOUBLE_VAL(-AS_DOUBLE(tos));
+      } else {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      // push(NUMBER_VAL(-AS_NUMBER(pop())));
-      negate();
-      break;
-      //   clock_t t1 = clock();
-      //   // push(-pop());
-      //   negate();
-      //   clock_t t2 = clock();
-      //   double time_taken = t2 - t1;
-      //   printf("time taken: %f \n", time_taken / CLOCKS_PER_SEC);
-      //   break;
-    case OP_PRINT: {
-      printValue(pop());
+      break;
+    case OP_ADD_II:
+      TYPED_OP(INT_VAL, AS_INT, +);
+      break;
+    case OP_SUBTRACT_II:
+      TYPED_OP(INT_VAL, AS_INT, -);
+      break;
+    case OP_MULTIPLY_II:
+      TYPED_OP(INT_VAL, AS_INT, *);
+      break;
+    case OP_DIVIDE_II:
+      TYPED_OP(INT_VAL, AS_INT, /);
+      break;
+    case OP_LESS_II:
+      TYPED_OP(BOOL_VAL, AS_INT, <);
+      break;
+    case OP_GREATER_II:
+      TYPED_OP(BOOL_VAL, AS_INT, >);
+      break;
+    case OP_ADD_DD:
+      TYPED_OP(DOUBLE_VAL, AS_DOUBLE, +);
+      break;
+    case OP_SUBTRACT_DD:
+      TYPED_OP(DOUBLE_VAL, AS_DOUBLE, -);
+      break;
+    case OP_MULTIPLY_DD:
+      TYPED_OP(DOUBLE_VAL, AS_DOUBLE, *);
+      break;
+    case OP_DIVIDE_DD:
+      TYPED_OP(DOUBLE_VAL, AS_DOUBLE, /);
+      break;
+    case OP_LESS_DD:
+      TYPED_OP(BOOL_VAL, AS_DOUBLE, <);
+      break;
+    case OP_GREATER_DD:
+      TYPED_OP(BOOL_VAL, AS_DOUBLE, >);
+      break;
+    case OP_NEGATE_I:
+      tos = INT_VAL(-AS_INT(tos));
+      break;
+    case OP_NEGATE_D:
+      tos = DOUBLE_VAL(-AS_DOUBLE(tos));
+      break;
+    case OP_CONCAT_SS:
+      tos = concatenateStrings(sp[-2], tos);
+      sp--;
+      CHECK_HEAP();
+      break;
+    case OP_PRINT:
+      printValue(tos);
       printf("\n");
+      DROP();
+      CHECK_BUDGET();
       break;
+    case OP_TAIL_CALL: {
+      int argCount = READ_BYTE();
+      sp[-1] = tos;
+      Value *args = sp - argCount;
+      ObjFunction *function = NULL;
+      FIND_CALLEE(args, argCount, function);
+      if (function != NULL) {
+        PREPARE_CALL(function, argCount);
+        // The caller has nothing left to run, so the callee takes over its
+        // frame: slot 0 and the arguments move down over the caller's.
+        memmove(frame->slots, args - 1, sizeof(Value) * (argCount + 1));
+        int depth = function->chunk.maxStackDepth;
+        if (frame->slots + depth > vm.stack + vm.stackCapacity)
+          growStack(frame->slots, depth);
+        sp = frame->slots + 1 + argCount;
+        tos = sp[-1];
+        frame->function = function;
+        frame->chunk = &function->chunk;
+        SWITCH_FRAME(function->chunk.code);
+        CHECK_BUDGET();
+        break;
+      }
+      // Otherwise what the native returned, or the instance, is returned.
     }
-    case OP_RETURN: {
-      //   printValue(pop());
-      //   printf("\n");
-      return INTERPRET_OK;
-    }
+      // Fall through.
+    case OP_RETURN:
+      if (vm.frameCount == 1) {
+        SYNC();
+        return INTERPRET_OK;
+      }
+      // The result, the cached top, takes slot 0, where the callee was.
+      sp = frame->slots + 1;
+      vm.frameCount--;
+      frame = &vm.frames[vm.frameCount - 1];
+      SWITCH_FRAME(frame->ip);
+      CHECK_BUDGET();
+      break;
     }
   }
 
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef PUSH
+#undef DROP
+#undef SYNC
+#undef CHECK_HEAP
+#undef CHECK_BUDGET
+#undef CHECK_INDEX
+#undef RUNTIME_ERROR
+#undef COMPILE_BODY
+#undef FIND_CALLEE
+#undef PREPARE_CALL
+#undef CALL_FUNCTION
 #undef BINARY_OP
+#undef TYPED_OP
+#undef COMPARE_JUMP
+#undef TYPED_JUMP
+#undef CALL_NATIVE
+#undef SWITCH_FRAME
+#undef ARITHMETIC_OP
+}
+
+static InterpretResult runRegisters(RegChunk *chunk) {
+  Value *regs = vm.stack;
+  Value *constants = chunk->constants.values;
+  uint32_t *pc = chunk->code;
+  uint32_t instruction;
+
+#define R(n) (regs[(n)])
+#define K(n) (constants[(n)])
+#define REG_ERROR(...)                                                         \
+  do {                                                                         \
+    registerError(chunk, pc, __VA_ARGS__);                                     \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define CHECK_HEAP()                                                           \
+  do {                                                                         \
+    if (heapLimitExceeded())                                                   \
+      REG_ERROR(HEAP_LIMIT_MESSAGE, memoryStats.limit);                        \
+  } while (false)
+
+  // Same checks, in the same order and with the same messages, as run().
+#define NUMERIC_OP(intType, doubleType, op, message)                           \
+  do {                                                                         \
+    if (IS_INT(c)) {                                                           \
+      if (!IS_INT(b))                                                          \
+        REG_ERROR("Operands must be numbers.");                                \
+      R(REG_A(instruction)) = intType(AS_INT(b) op AS_INT(c));                 \
+    } else if (IS_DOUBLE(c)) {                                                 \
+      if (!IS_DOUBLE(b))                                                       \
+        REG_ERROR("Operands type mismatch");                                   \
+      R(REG_A(instruction)) = doubleType(AS_DOUBLE(b) op AS_DOUBLE(c));        \
+    } else {                                                                   \
+      REG_ERROR(message);                                                      \
+    }                                                                          \
+  } while (false)
+  // Takes the REG_JUMP after a branch's test if `test` is the branch's flag,
+  // and skips it otherwise.
+#define BRANCH(test)                                                           \
+  do {                                                                         \
+    if ((test) == (bool)REG_A(instruction))                                    \
+      pc = chunk->code + REG_BX(*pc);                                          \
+    else                                                                       \
+      pc++;                                                                    \
+  } while (false)
+  // Same checks, in the same order and with the same messages, as
+  // COMPARE_JUMP.
+#define COMPARE_BRANCH(op)                                                     \
+  do {                                                                         \
+    if (IS_DOUBLE(c)) {                                                        \
+      if (!IS_DOUBLE(b))                                                       \
+        REG_ERROR("Operands type mismatch");                                   \
+      BRANCH(AS_DOUBLE(b) op AS_DOUBLE(c));                                    \
+    } else if (IS_INT(c)) {                                                    \
+      if (!IS_INT(b))                                                          \
+        REG_ERROR("Operands must be numbers.");                                \
+      BRANCH(AS_INT(b) op AS_INT(c));                                          \
+    } else {                                                                   \
+      REG_ERROR("Operands must be numbers.");                                  \
+    }                                                                          \
+  } while (false)
+
+  // Each operand combination gets its own case so that picking a register
+  // or a constant costs no branch at run time.
+#define RK_CASES(regOp, body)                                                  \
+  case regOp: {                                                                \
+    Value b = R(REG_B(instruction)), c = R(REG_C(instruction));                \
+    body;                                                                      \
+    break;                                                                     \
+  }                                                                            \
+  case regOp | REG_KB: {                                                       \
+    Value b = K(REG_B(instruction)), c = R(REG_C(instruction));                \
+    body;                                                                      \
+    break;                                                                     \
+  }                                                                            \
+  case regOp | REG_KC: {                                                       \
+    Value b = R(REG_B(instruction)), c = K(REG_C(instruction));                \
+    body;                                                                      \
+    break;                                                                     \
+  }                                                                            \
+  case regOp | REG_KB | REG_KC: {                                              \
+    Value b = K(REG_B(instruction)), c = K(REG_C(instruction));                \
+    body;                                                                      \
+    break;                                                                     \
+  }
+#define RK_UNARY_CASES(regOp, body)                                            \
+  case regOp: {                                                                \
+    Value b = R(REG_B(instruction));                                           \
+    body;                                                                      \
+    break;                                                                     \
+  }                                                                            \
+  case regOp | REG_KB: {                                                       \
+    Value b = K(REG_B(instruction));                                           \
+    body;                                                                      \
+    break;                                                                     \
+  }
+
+  for (;;) {
+    instruction = *pc++;
+    switch (REG_OP(instruction)) {
+      RK_CASES(REG_EQUAL, R(REG_A(instruction)) = BOOL_VAL(valuesEqual(b, c)))
+      RK_CASES(REG_GREATER, NUMERIC_OP(BOOL_VAL, BOOL_VAL, >,
+                                       "Operands must be numbers."))
+      RK_CASES(REG_LESS, NUMERIC_OP(BOOL_VAL, BOOL_VAL, <,
+                                    "Operands must be numbers."))
+      RK_CASES(REG_ADD, {
+        if (IS_ANY_STRING(b) && IS_ANY_STRING(c)) {
+          R(REG_A(instruction)) = concatenateStrings(b, c);
+          CHECK_HEAP();
+        } else {
+          NUMERIC_OP(INT_VAL, DOUBLE_VAL, +, "Operands type mistmatch");
+        }
+      })
+      RK_CASES(REG_SUBTRACT,
+               NUMERIC_OP(INT_VAL, DOUBLE_VAL, -, "Operands type mistmatch"))
+      RK_CASES(REG_MULTIPLY,
+               NUMERIC_OP(INT_VAL, DOUBLE_VAL, *, "Operands type mistmatch"))
+      RK_CASES(REG_DIVIDE,
+               NUMERIC_OP(INT_VAL, DOUBLE_VAL, /, "Operands type mistmatch"))
+      RK_UNARY_CASES(REG_NOT, R(REG_A(instruction)) = BOOL_VAL(isFalsey(b)))
+      RK_UNARY_CASES(REG_NEGATE, {
+        if (IS_INT(b)) {
+          R(REG_A(instruction)) = INT_VAL(-AS_INT(b));
+        } else if (IS_DOUBLE(b)) {
+          R(REG_A(instruction)) = DOUBLE_VAL(-AS_DOUBLE(b));
+        } else {
+          REG_ERROR("Operand must be a number.");
+        }
+      })
+      RK_UNARY_CASES(REG_PRINT, {
+        printValue(b);
+        printf("\n");
+      })
+      RK_UNARY_CASES(REG_DEFINE_GLOBAL, {
+        tableSet(&vm.globals, K(REG_A(instruction)), materialize(b));
+        CHECK_HEAP();
+      })
+    case REG_GET_GLOBAL | REG_KB: {
+      Value name = K(REG_B(instruction));
+      if (!tableGet(&vm.globals, name, &R(REG_A(instruction))))
+        REG_ERROR("Undefined variable '%.*s'.", STRING_LENGTH(name),
+                  STRING_CHARS(name));
+      break;
+    }
+      RK_UNARY_CASES(REG_SET_GLOBAL, {
+        Value name = K(REG_A(instruction));
+        if (tableSet(&vm.globals, name, materialize(b))) {
+          tableDelete(&vm.globals, name);
+          REG_ERROR("Undefined variable '%.*s'.", STRING_LENGTH(name),
+                    STRING_CHARS(name));
+        }
+        CHECK_HEAP();
+      })
+      RK_UNARY_CASES(REG_MOVE, R(REG_A(instruction)) = b)
+    case REG_JUMP:
+      pc = chunk->code + REG_BX(instruction);
+      break;
+      RK_UNARY_CASES(REG_IF_FALSE, {
+        if (isFalsey(b))
+          pc = chunk->code + REG_BX(*pc);
+        else
+          pc++;
+      })
+      RK_CASES(REG_IF_EQUAL, BRANCH(valuesEqual(b, c)))
+      RK_CASES(REG_IF_LESS, COMPARE_BRANCH(<))
+      RK_CASES(REG_IF_GREATER, COMPARE_BRANCH(>))
+    case REG_RETURN:
+      return INTERPRET_OK;
+    }
+  }
+
+#undef R
+#undef K
+#undef REG_ERROR
+#undef CHECK_HEAP
+#undef NUMERIC_OP
+#undef BRANCH
+#undef COMPARE_BRANCH
+#undef RK_CASES
+#undef RK_UNARY_CASES
+}
+
+InterpretResult loadChunk(Chunk *chunk) {
+  // Every engine trusts its bytecode; this is the one place it's checked.
+  if (!chunk->verified && !verifyChunk(chunk))
+    return INTERPRET_COMPILE_ERROR;
+  reserveStack(chunk->maxStackDepth);
+  CallFrame *frame = &vm.frames[0];
+  frame->function = NULL;
+  frame->chunk = chunk;
+  frame->ip = chunk->code;
+  frame->slots = vm.stack;
+  vm.frameCount = 1;
+  return INTERPRET_OK;
+}
+
+static InterpretResult runToEnd() {
+  return run(RUN_FOREVER, 0, false, false, false);
+}
+
+static InterpretResult runSliced(int64_t budget, int64_t deadline) {
+  return run(budget, deadline, true, false, false);
+}
+
+static InterpretResult runNested(bool step) {
+  return run(RUN_FOREVER, 0, false, true, step);
+}
+
+// What the VM raised while native code had handed it an instruction; native
+// code then leaves with JIT_FAILED.
+static InterpretResult nativeFailure;
+
+int stepInstruction(int offset) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  frame->ip = frame->chunk->code + offset;
+  nativeFailure = runNested(true);
+  if (nativeFailure != INTERPRET_OK)
+    return -1;
+  return (int)(frame->ip - frame->chunk->code);
+}
+
+// Runs the innermost frame, a function's, until it returns, leaving its
+// result where the callee was: in native code while the function in the
+// frame has some, and on the stack VM otherwise.
+static InterpretResult runFunctionFrame() {
+  int depth = vm.frameCount;
+  while (vm.frameCount == depth) {
+    CallFrame *frame = &vm.frames[depth - 1];
+    JitCode *code = &frame->function->native;
+    if (code->entry == NULL)
+      return runNested(false);
+
+    int exit = jitRun(code, frame->chunk);
+    if (exit == JIT_FAILED)
+      return nativeFailure;
+    if (exit == JIT_FINISHED) {
+      *frame->slots = vm.stackTop[-1];
+      vm.stackTop = frame->slots + 1;
+      vm.frameCount--;
+    }
+    // Otherwise a tail call has put another function in the frame, or has
+    // already returned from it.
+  }
+  return INTERPRET_OK;
+}
+
+// The function at args[-1] if native code can run the call itself, compiling
+// it on its first call; NULL leaves the call to the stack VM. Returns false
+// if the function doesn't compile.
+static bool findNativeCallee(Value *args, int argCount,
+                             ObjFunction **function) {
+  *function = NULL;
+  if (!IS_FUNCTION(args[-1]))
+    return true;
+  ObjFunction *callee = AS_FUNCTION(args[-1]);
+  if (callee->source != NULL && !compileBody(callee)) {
+    resetStack();
+    nativeFailure = INTERPRET_COMPILE_ERROR;
+    return false;
+  }
+  if (callee->native.entry != NULL && argCount == callee->chunk.arity)
+    *function = callee;
+  return true;
+}
+
+bool callFromNative(int argCount, int offset) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // Where run() would have ip, for the stack trace of an error in the call.
+  frame->ip = frame->chunk->code + offset + 2;
+  Value *args = vm.stackTop - argCount;
+  ObjFunction *function;
+  if (!findNativeCallee(args, argCount, &function))
+    return false;
+  if (function == NULL || vm.frameCount == FRAMES_MAX)
+    return stepInstruction(offset) >= 0;
+
+  Value *base = args - 1;
+  int depth = function->chunk.maxStackDepth;
+  if (base + depth > vm.stack + vm.stackCapacity)
+    base = growStack(base, depth);
+  frame = &vm.frames[vm.frameCount++];
+  frame->function = function;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.code;
+  frame->slots = base;
+  vm.stackTop = base + 1 + argCount;
+  nativeFailure = runFunctionFrame();
+  return nativeFailure == INTERPRET_OK;
+}
+
+bool tailCallFromNative(int argCount, int offset) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  frame->ip = frame->chunk->code + offset + 2;
+  Value *args = vm.stackTop - argCount;
+  ObjFunction *function;
+  if (!findNativeCallee(args, argCount, &function))
+    return false;
+  if (function == NULL)
+    return stepInstruction(offset) >= 0;
+
+  // The callee takes over the frame, as in run().
+  memmove(frame->slots, args - 1, sizeof(Value) * (argCount + 1));
+  int depth = function->chunk.maxStackDepth;
+  if (frame->slots + depth > vm.stack + vm.stackCapacity)
+    growStack(frame->slots, depth);
+  vm.stackTop = frame->slots + 1 + argCount;
+  frame->function = function;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.code;
+  return true;
+}
+
+InterpretResult runFor(int64_t budget) {
+  return budget == INT64_MAX ? runToEnd() : runSliced(budget, 0);
+}
+
+InterpretResult runForTime(int64_t budget, int64_t nanoseconds) {
+  return runSliced(budget, monotonicNanos() + nanoseconds);
+}
+
+InterpretResult interpretChunk(Chunk *chunk) {
+  InterpretResult loaded = loadChunk(chunk);
+  if (loaded != INTERPRET_OK)
+    return loaded;
+
+  if (vm.engine == ENGINE_JIT) {
+    JitCode code;
+    if (jitCompile(chunk, &code)) {
+      int exit = jitRun(&code, chunk);
+      jitFree(&code);
+      return exit == JIT_FINISHED ? INTERPRET_OK : nativeFailure;
+    }
+  }
+
+  if (vm.engine == ENGINE_REGISTER) {
+    RegChunk regChunk;
+    initRegChunk(&regChunk);
+    if (translateChunk(chunk, &regChunk)) {
+#ifdef DEBUG_PRINT_CODE
+      disassembleRegChunk(&regChunk, "registers");
+#endif
+      InterpretResult result = interpretRegChunk(&regChunk);
+      freeRegChunk(&regChunk);
+      return result;
+    }
+    // No register form for something in the chunk; use the stack VM.
+    freeRegChunk(&regChunk);
+  }
+
+  return runToEnd();
+}
+
+InterpretResult interpretRegChunk(RegChunk *chunk) {
+  resetStack();
+  reserveStack(chunk->registerCount);
+  return runRegisters(chunk);
 }
 
 InterpretResult interpret(const char *source) {
@@ -259,12 +1402,17 @@ InterpretResult interpret(const char *source) {
     freeChunk(&chunk);
     return INTERPRET_COMPILE_ERROR;
   }
+  if (heapLimitExceeded()) {
+    fprintf(stderr, "Heap limit of %zu bytes exceeded while compiling.\n",
+            memoryStats.limit);
+    freeChunk(&chunk);
+    return INTERPRET_COMPILE_ERROR;
+  }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
-
-  InterpretResult result = run();
+  InterpretResult result = interpretChunk(&chunk);
 
+  if (vm.profile != NULL)
+    profileLoops(vm.profile, &chunk);
   freeChunk(&chunk);
   return result;
-}
\ No newline at end of file
+}
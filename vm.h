@@ -1,26 +1,58 @@
 #ifndef rotlang_vm_h
 #define rotlang_vm_h
 
-#define STACK_MAX 256
-
 #include "chunk.h"
+#include "object.h"
+#include "profile.h"
+#include "regcode.h"
 #include "table.h"
 #include "value.h"
 
+typedef enum {
+  ENGINE_STACK,
+  ENGINE_REGISTER,
+  ENGINE_JIT,
+} Engine;
+
+// Calls can nest this deep, counting the top-level chunk.
+#define FRAMES_MAX 256
+
+// A call in progress: the chunk running and its slots, the first of which
+// hold the arguments. While the innermost frame runs, run() keeps its ip in
+// a register and only stores it back to sync.
 typedef struct {
+  ObjFunction *function; // NULL for the top-level chunk.
   Chunk *chunk;
   uint8_t *ip;
-  Value stack[STACK_MAX];
+  Value *slots;
+} CallFrame;
+
+typedef struct {
+  // Frames are never allocated: calling a function takes the next one.
+  CallFrame frames[FRAMES_MAX];
+  int frameCount;
+  // Grown by reserveStack() before a chunk runs, and while it runs only by
+  // a call that needs more room than is left, which moves every frame's
+  // slots along. So push() and pop() need no bounds checks.
+  Value *stack;
   Value *stackTop;
+  int stackCapacity;
   Table globals;
   Table strings;
   Obj *objects;
+  Engine engine;
+  // Non-null while --profile-ops is recording opcode n-grams.
+  OpProfile *profile;
+  // Set by nativeError() for OP_CALL to raise once the native returns.
+  const char *nativeError;
 } VM;
 
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  // runFor() spent its budget; calling it again continues the chunk.
+  INTERPRET_YIELD,
 } InterpretResult;
 
 extern VM vm;
@@ -29,7 +61,43 @@ void initVM();
 void freeVM();
 
 InterpretResult interpret(const char *source);
+// Runs an already compiled chunk on vm.engine. The stack VM is the reference:
+// the other engines fall back to it for anything they can't handle.
+InterpretResult interpretChunk(Chunk *chunk);
+InterpretResult interpretRegChunk(RegChunk *chunk);
+// Time-sliced execution, always on the stack VM: loadChunk() verifies the
+// chunk and points the VM at its first instruction, then each runFor() call
+// executes about `budget` instructions and returns INTERPRET_YIELD, or
+// finishes the chunk with any other result. Yields only happen between
+// statements, at loop back edges and as calls start or return, so a slice
+// can overrun its budget by up to a statement. runFor(INT64_MAX) runs to the
+// end without counting. The chunk must outlive the run.
+InterpretResult loadChunk(Chunk *chunk);
+InterpretResult runFor(int64_t budget);
+// Like runFor(), but also yields once `nanoseconds` of wall-clock time have
+// passed, checked at the same points every few thousand instructions.
+InterpretResult runForTime(int64_t budget, int64_t nanoseconds);
 void push(Value value);
 Value pop();
 
+// How native code hands instructions to the stack VM. Each is called with
+// vm.stackTop in sync, for the instruction at `offset` in the innermost
+// frame, and fails once the VM has raised an error.
+//
+// Runs the instruction, calls it makes included, and returns the offset the
+// frame continues at, or -1.
+int stepInstruction(int offset);
+// OP_CALL and OP_TAIL_CALL. A function with native code runs in native code
+// too; any other callee is left to stepInstruction().
+bool callFromNative(int argCount, int offset);
+bool tailCallFromNative(int argCount, int offset);
+
+// Binds `name` in vm.globals to a native function. Names must fit in a
+// short string so that defining natives interns nothing: --restore needs
+// an empty intern table.
+void defineNative(const char *name, NativeFn function, int arity);
+// Fails the native being called with this message. Returns nil for the
+// native to return.
+Value nativeError(const char *format, ...);
+
 #endif
\ No newline at end of file